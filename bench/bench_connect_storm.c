@@ -0,0 +1,652 @@
+//
+// A reconnect storm: opens a large number of connections at once
+// and measures what it takes until all of them are connected.
+//
+// The echo server from the tests runs in a child process, so the
+// memory, file descriptors and CPU it uses are not counted. Every
+// listener gets at most 20000 connections, so the ephemeral ports
+// of 127.0.0.1 don't run out.
+//
+// Past a few thousand connections the listen queues of the kernel
+// fill up, and the SYN retransmits show up in phase_tcp. Raise
+// net.core.somaxconn and net.ipv4.tcp_max_syn_backlog to avoid it.
+//
+//   establish      - From the first ws_connect until the whole fleet
+//                    reached WS_STATE_CONNECTED.
+//   phase_tcp      - Per connection, from ws_connect until the TCP
+//                    connection was up.
+//   phase_tls      - Per connection, the TLS handshake (_ws_openssl_init
+//                    and the handshake itself), with --tls only.
+//   phase_upgrade  - Per connection, sending the HTTP upgrade request
+//                    and reading the reply (_ws_send_handshake and
+//                    _ws_read_server_handshake_reply).
+//   rate           - Handshakes completed in each --interval.
+//   rss, fds       - Resident memory and open file descriptors
+//                    added per connection.
+//   teardown       - ws_destroy on every connection.
+//
+
+#include <libws.h>
+#include <libws_log.h>
+#include <libws_private.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <signal.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <event2/event.h>
+#include <event2/bufferevent.h>
+#include "libws_bench_helpers.h"
+#include "libws_test_server.h"
+
+#define BENCH_CONNS_PER_LISTENER 20000
+#define BENCH_MAX_LISTENERS 16
+
+typedef struct bench_conn_s
+{
+	struct bench_state_s *state;
+	ws_t ws;
+	uint64_t start;         // When ws_connect was called.
+	uint64_t tcp;           // When the TCP connection was up.
+	uint64_t tls;           // When the TLS handshake completed.
+	uint64_t done;          // When the websocket handshake completed.
+	bufferevent_data_cb read_cb;
+	bufferevent_data_cb write_cb;
+	bufferevent_event_cb event_cb;
+	void *cb_arg;
+} bench_conn_t;
+
+typedef struct bench_state_s
+{
+	ws_base_t base;
+	bench_conn_t *conns;
+	size_t count;
+	size_t connected;
+	size_t failed;
+	int use_ssl;
+} bench_state_t;
+
+///
+/// Gets the resident memory of the process in bytes, 0 if unknown.
+///
+static size_t get_rss()
+{
+	FILE *f;
+	unsigned long size;
+	unsigned long resident = 0;
+
+	if (!(f = fopen("/proc/self/statm", "r")))
+		return 0;
+
+	if (fscanf(f, "%lu %lu", &size, &resident) != 2)
+		resident = 0;
+
+	fclose(f);
+
+	return (size_t)resident * (size_t)sysconf(_SC_PAGESIZE);
+}
+
+///
+/// Counts the open file descriptors of the process.
+///
+static size_t get_open_fds()
+{
+	DIR *d;
+	size_t count = 0;
+	int fd;
+	struct rlimit rl;
+
+	if ((d = opendir("/proc/self/fd")))
+	{
+		while (readdir(d))
+			count++;
+
+		closedir(d);
+
+		// ".", ".." and the one used by opendir.
+		return (count > 3) ? (count - 3) : 0;
+	}
+
+	if (getrlimit(RLIMIT_NOFILE, &rl))
+		return 0;
+
+	for (fd = 0; (rlim_t)fd < rl.rlim_cur; fd++)
+	{
+		if (fcntl(fd, F_GETFD) != -1)
+			count++;
+	}
+
+	return count;
+}
+
+///
+/// Makes sure we can open enough file descriptors for the fleet.
+///
+static int raise_fd_limit(size_t needed)
+{
+	struct rlimit rl;
+
+	if (getrlimit(RLIMIT_NOFILE, &rl))
+		return -1;
+
+	if (rl.rlim_cur < rl.rlim_max)
+	{
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+		getrlimit(RLIMIT_NOFILE, &rl);
+	}
+
+	if (rl.rlim_cur < (rlim_t)needed)
+	{
+		fprintf(stderr, "Need %u file descriptors but the limit is %u, "
+						"see ulimit -n.\n",
+				(unsigned)needed, (unsigned)rl.rlim_cur);
+		return -1;
+	}
+
+	return 0;
+}
+
+///
+/// Forks a child process that runs the echo servers.
+///
+/// @param[in]	use_ssl 	Use TLS.
+/// @param[in]	listeners 	Number of servers to start.
+/// @param[out]	ports 		The port of each server.
+///
+/// @returns 				The child or -1 on failure.
+///
+static pid_t start_servers(int use_ssl, int listeners, int *ports)
+{
+	int fds[2];
+	int i;
+	pid_t pid;
+	struct event_base *base;
+	libws_test_server_t *srv;
+
+	if (pipe(fds))
+		return -1;
+
+	if ((pid = fork()) < 0)
+	{
+		close(fds[0]);
+		close(fds[1]);
+		return -1;
+	}
+
+	if (pid == 0)
+	{
+		close(fds[0]);
+
+		if (!(base = event_base_new()))
+			_exit(1);
+
+		for (i = 0; i < listeners; i++)
+		{
+			if (!(srv = libws_test_server_new(base, use_ssl)))
+				_exit(1);
+
+			ports[i] = libws_test_server_get_port(srv);
+		}
+
+		if (write(fds[1], ports, listeners * sizeof(int))
+			!= (ssize_t)(listeners * sizeof(int)))
+			_exit(1);
+
+		close(fds[1]);
+		event_base_dispatch(base);
+		_exit(0);
+	}
+
+	close(fds[1]);
+
+	if (read(fds[0], ports, listeners * sizeof(int))
+		!= (ssize_t)(listeners * sizeof(int)))
+	{
+		close(fds[0]);
+		kill(pid, SIGKILL);
+		waitpid(pid, NULL, 0);
+		return -1;
+	}
+
+	close(fds[0]);
+	return pid;
+}
+
+static void stop_servers(pid_t pid)
+{
+	kill(pid, SIGKILL);
+	waitpid(pid, NULL, 0);
+}
+
+///
+/// Sits in front of the libws event callback, to see when the
+/// connection is up. For TLS that is when the handshake completed.
+///
+static void phase_event_cb(struct bufferevent *bev, short events, void *arg)
+{
+	bench_conn_t *conn = (bench_conn_t *)arg;
+	uint64_t now;
+
+	if (events & BEV_EVENT_CONNECTED)
+	{
+		now = libws_bench_now_ns();
+
+		if (conn->state->use_ssl)
+		{
+			conn->tls = now;
+		}
+		else
+		{
+			conn->tcp = now;
+		}
+	}
+
+	conn->event_cb(bev, events, conn->cb_arg);
+}
+
+// The callbacks share the argument, so these need to sit in front too.
+static void phase_read_cb(struct bufferevent *bev, void *arg)
+{
+	bench_conn_t *conn = (bench_conn_t *)arg;
+
+	if (conn->read_cb)
+		conn->read_cb(bev, conn->cb_arg);
+}
+
+static void phase_write_cb(struct bufferevent *bev, void *arg)
+{
+	bench_conn_t *conn = (bench_conn_t *)arg;
+
+	if (conn->write_cb)
+		conn->write_cb(bev, conn->cb_arg);
+}
+
+#ifdef LIBWS_WITH_OPENSSL
+///
+/// The TLS handshake starts as soon as the TCP connection is up.
+///
+static void phase_ssl_info_cb(const SSL *ssl, int where, int ret)
+{
+	ws_t ws = (ws_t)SSL_get_app_data(ssl);
+	bench_conn_t *conn;
+
+	if (!(where & SSL_CB_HANDSHAKE_START) || !ws)
+		return;
+
+	conn = (bench_conn_t *)ws_get_user_state(ws);
+
+	if (!conn->tcp)
+	{
+		conn->tcp = libws_bench_now_ns();
+	}
+}
+#endif
+
+static void watch_phases(bench_conn_t *conn)
+{
+	ws_t ws = conn->ws;
+
+	bufferevent_getcb(ws->bev, &conn->read_cb, &conn->write_cb,
+					&conn->event_cb, &conn->cb_arg);
+	bufferevent_setcb(ws->bev, phase_read_cb, phase_write_cb,
+					phase_event_cb, conn);
+
+	#ifdef LIBWS_WITH_OPENSSL
+	if (ws->ssl)
+	{
+		SSL_set_info_callback(ws->ssl, phase_ssl_info_cb);
+	}
+	#endif
+}
+
+static void check_done(bench_state_t *state)
+{
+	if ((state->connected + state->failed) == state->count)
+	{
+		ws_base_quit(state->base, 0);
+	}
+}
+
+static void onconnect(ws_t ws, void *arg)
+{
+	bench_conn_t *conn = (bench_conn_t *)arg;
+
+	conn->done = libws_bench_now_ns();
+	conn->state->connected++;
+	check_done(conn->state);
+}
+
+static void onclose(ws_t ws, ws_close_status_t status,
+					const char *reason, size_t reason_len, void *arg)
+{
+	bench_conn_t *conn = (bench_conn_t *)arg;
+
+	if (!conn->done)
+	{
+		conn->state->failed++;
+		check_done(conn->state);
+	}
+}
+
+static void onconnect_timeout(ws_t ws, struct timeval timeout, void *arg)
+{
+	bench_conn_t *conn = (bench_conn_t *)arg;
+
+	if (!conn->done)
+	{
+		conn->state->failed++;
+		check_done(conn->state);
+	}
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [--log] [--json] [--tls] [--interval ms] "
+					"[connections]\n"
+					"  --tls        Connect over TLS.\n"
+					"  --interval   Interval the handshake rate is reported "
+					"for (100 ms).\n"
+					"  connections  Number of connections (10000).\n",
+					prog);
+}
+
+int main(int argc, char **argv)
+{
+	int ret = 0;
+	int i;
+	int listeners;
+	int ports[BENCH_MAX_LISTENERS];
+	int json = 0;
+	pid_t server = -1;
+	size_t n;
+	size_t rss_before;
+	size_t fds_before;
+	size_t rss_after;
+	size_t fds_after;
+	size_t slots;
+	size_t *rate = NULL;
+	uint64_t interval_ns = 100 * 1000000ULL;
+	uint64_t start;
+	uint64_t end;
+	uint64_t last;
+	struct timeval timeout = { 120, 0 };
+	char name[64];
+	bench_conn_t *conn;
+	bench_state_t state;
+	libws_bench_hist_t *tcp_hist = NULL;
+	libws_bench_hist_t *tls_hist = NULL;
+	libws_bench_hist_t *upgrade_hist = NULL;
+	#ifdef LIBWS_WITH_MEMORY_ACCOUNTING
+	size_t mem;
+	size_t mem_peak;
+	#endif
+
+	memset(&state, 0, sizeof(state));
+	state.count = 10000;
+
+	for (i = 1; i < argc; i++)
+	{
+		if (!strcmp(argv[i], "--log"))
+		{
+			ws_set_log_cb(ws_default_log_cb);
+			ws_set_log_level(-1);
+		}
+		else if (!strcmp(argv[i], "--json"))
+		{
+			json = 1;
+		}
+		else if (!strcmp(argv[i], "--tls"))
+		{
+			state.use_ssl = 1;
+		}
+		else if ((i + 1 < argc) && !strcmp(argv[i], "--interval"))
+		{
+			interval_ns = (uint64_t)atoi(argv[++i]) * 1000000ULL;
+		}
+		else if ((argv[i][0] != '-') && (atoi(argv[i]) > 0))
+		{
+			state.count = (size_t)atoi(argv[i]);
+		}
+		else
+		{
+			usage(argv[0]);
+			return !strcmp(argv[i], "--help") ? 0 : -1;
+		}
+	}
+
+	#ifndef LIBWS_WITH_OPENSSL
+	if (state.use_ssl)
+	{
+		fprintf(stderr, "Not compiled with OpenSSL.\n");
+		return -1;
+	}
+	#endif
+
+	listeners = (int)((state.count + BENCH_CONNS_PER_LISTENER - 1)
+					/ BENCH_CONNS_PER_LISTENER);
+
+	if (!interval_ns || (listeners > BENCH_MAX_LISTENERS))
+	{
+		usage(argv[0]);
+		return -1;
+	}
+
+	// Both ends of each connection live in one of the processes,
+	// with some to spare for the rest.
+	if (raise_fd_limit(state.count + 64))
+		return -1;
+
+	// Include libevent and OpenSSL in the memory per connection,
+	// fails harmlessly without memory accounting.
+	ws_install_memory_hooks();
+
+	if (ws_global_init(&state.base))
+	{
+		fprintf(stderr, "Failed to init global state.\n");
+		return -1;
+	}
+
+	if ((server = start_servers(state.use_ssl, listeners, ports)) < 0)
+	{
+		fprintf(stderr, "Failed to start test servers.\n");
+		ret = -1;
+		goto fail;
+	}
+
+	if (!(state.conns = calloc(state.count, sizeof(bench_conn_t)))
+		|| !(tcp_hist = libws_bench_hist_new())
+		|| !(tls_hist = libws_bench_hist_new())
+		|| !(upgrade_hist = libws_bench_hist_new()))
+	{
+		fprintf(stderr, "Out of memory.\n");
+		ret = -1;
+		goto fail;
+	}
+
+	if (json)
+	{
+		libws_bench_set_json(stdout);
+	}
+
+	rss_before = get_rss();
+	fds_before = get_open_fds();
+	start = libws_bench_now_ns();
+
+	for (n = 0; n < state.count; n++)
+	{
+		conn = &state.conns[n];
+		conn->state = &state;
+
+		if (ws_init(&conn->ws, state.base))
+		{
+			fprintf(stderr, "Failed to init connection %u.\n", (unsigned)n);
+			ret = -1;
+			goto fail;
+		}
+
+		ws_set_user_state(conn->ws, conn);
+		ws_set_onconnect_cb(conn->ws, onconnect, conn);
+		ws_set_onclose_cb(conn->ws, onclose, conn);
+		ws_set_connect_timeout_cb(conn->ws, onconnect_timeout, timeout, conn);
+
+		if (state.use_ssl)
+		{
+			ws_set_ssl_state(conn->ws, LIBWS_SSL_SELFSIGNED);
+		}
+
+		conn->start = libws_bench_now_ns();
+
+		if (ws_connect(conn->ws, "127.0.0.1",
+						ports[n / BENCH_CONNS_PER_LISTENER], ""))
+		{
+			fprintf(stderr, "Failed to connect %u.\n", (unsigned)n);
+			ret = -1;
+			goto fail;
+		}
+
+		watch_phases(conn);
+	}
+
+	ws_base_service_blocking(state.base);
+	end = libws_bench_now_ns();
+
+	if (state.failed || (state.connected != state.count))
+	{
+		fprintf(stderr, "Only %u of %u connected.\n",
+				(unsigned)state.connected, (unsigned)state.count);
+		ret = -1;
+		goto fail;
+	}
+
+	rss_after = get_rss();
+	fds_after = get_open_fds();
+
+	snprintf(name, sizeof(name), "storm_%s_establish",
+			state.use_ssl ? "tls" : "plain");
+	libws_bench_report(name, state.count, end - start);
+
+	// Handshakes completed in each interval.
+	slots = (size_t)((end - start) / interval_ns) + 1;
+
+	if (!(rate = calloc(slots, sizeof(size_t))))
+	{
+		fprintf(stderr, "Out of memory.\n");
+		ret = -1;
+		goto fail;
+	}
+
+	for (n = 0; n < state.count; n++)
+	{
+		conn = &state.conns[n];
+
+		if (ws_get_state(conn->ws) != WS_STATE_CONNECTED)
+		{
+			fprintf(stderr, "Connection %u is not connected.\n", (unsigned)n);
+			ret = -1;
+		}
+
+		rate[(conn->done - start) / interval_ns]++;
+
+		libws_bench_hist_record(tcp_hist, conn->tcp - conn->start);
+
+		if (state.use_ssl)
+		{
+			libws_bench_hist_record(tls_hist, conn->tls - conn->tcp);
+			libws_bench_hist_record(upgrade_hist, conn->done - conn->tls);
+		}
+		else
+		{
+			libws_bench_hist_record(upgrade_hist, conn->done - conn->tcp);
+		}
+	}
+
+	snprintf(name, sizeof(name), "storm_%s_phase_tcp",
+			state.use_ssl ? "tls" : "plain");
+	libws_bench_report_hist(name, tcp_hist);
+
+	if (state.use_ssl)
+	{
+		libws_bench_report_hist("storm_tls_phase_tls", tls_hist);
+	}
+
+	snprintf(name, sizeof(name), "storm_%s_phase_upgrade",
+			state.use_ssl ? "tls" : "plain");
+	libws_bench_report_hist(name, upgrade_hist);
+
+	for (n = 0; n < slots; n++)
+	{
+		// The last interval ends with the last handshake.
+		last = ((n + 1) < slots) ? interval_ns
+				: ((end - start) - (n * interval_ns));
+
+		snprintf(name, sizeof(name), "storm_%s_rate_%ums",
+				state.use_ssl ? "tls" : "plain",
+				(unsigned)(((n + 1) * interval_ns) / 1000000));
+		libws_bench_report(name, rate[n], last ? last : 1);
+	}
+
+	snprintf(name, sizeof(name), "storm_%s_rss_per_conn",
+			state.use_ssl ? "tls" : "plain");
+	libws_bench_report_value(name, rss_before
+			? ((double)rss_after - (double)rss_before) / state.count : 0.0,
+			"bytes");
+
+	#ifdef LIBWS_WITH_MEMORY_ACCOUNTING
+	if (!ws_base_get_memory_usage(state.base, &mem, &mem_peak))
+	{
+		snprintf(name, sizeof(name), "storm_%s_libws_mem_per_conn",
+				state.use_ssl ? "tls" : "plain");
+		libws_bench_report_value(name, (double)mem / state.count, "bytes");
+	}
+	#endif
+
+	snprintf(name, sizeof(name), "storm_%s_fds_per_conn",
+			state.use_ssl ? "tls" : "plain");
+	libws_bench_report_value(name,
+			((double)fds_after - (double)fds_before) / state.count, "fds");
+
+	// Tear down while connected, the costly case.
+	start = libws_bench_now_ns();
+
+	for (n = 0; n < state.count; n++)
+	{
+		ws_destroy(&state.conns[n].ws);
+	}
+
+	snprintf(name, sizeof(name), "storm_%s_teardown",
+			state.use_ssl ? "tls" : "plain");
+	libws_bench_report(name, state.count, libws_bench_now_ns() - start);
+
+fail:
+	libws_bench_finish();
+
+	if (state.conns)
+	{
+		for (n = 0; n < state.count; n++)
+		{
+			if (state.conns[n].ws)
+				ws_destroy(&state.conns[n].ws);
+		}
+
+		free(state.conns);
+	}
+
+	if (server > 0)
+	{
+		stop_servers(server);
+	}
+
+	free(rate);
+	libws_bench_hist_free(tcp_hist);
+	libws_bench_hist_free(tls_hist);
+	libws_bench_hist_free(upgrade_hist);
+	ws_global_destroy(&state.base);
+
+	return ret;
+}
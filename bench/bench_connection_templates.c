@@ -0,0 +1,281 @@
+//
+// Measures connection setup with and without a connection template,
+// see ws_init_from_template. Batches of connections are configured
+// the same way (origin, subprotocols, max frame size and callbacks)
+// and connected to an in-process echo server:
+//
+//   setup     - Creating and configuring the connections.
+//   establish - From creating the connections until all of them
+//               completed the websocket handshake.
+//
+
+#include <libws.h>
+#include <libws_log.h>
+#include <libws_private.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <event2/event.h>
+#include "libws_bench_helpers.h"
+#include "libws_test_server.h"
+
+typedef struct bench_state_s
+{
+	ws_base_t base;
+	ws_template_t tmpl;
+	ws_t *conns;
+	size_t batch;
+	size_t connected;
+	int failed;
+	uint64_t setup_ns;
+	uint64_t establish_ns;
+} bench_state_t;
+
+static void onconnect(ws_t ws, void *arg)
+{
+	bench_state_t *state = (bench_state_t *)arg;
+
+	if (++state->connected == state->batch)
+	{
+		ws_base_quit(state->base, 0);
+	}
+}
+
+static void onclose(ws_t ws, ws_close_status_t status,
+					const char *reason, size_t reason_len, void *arg)
+{
+	bench_state_t *state = (bench_state_t *)arg;
+	state->failed = 1;
+	ws_base_quit(state->base, 0);
+}
+
+static void onmsg(ws_t ws, char *msg, uint64_t len, int binary, void *arg)
+{
+}
+
+static void onerr(ws_t ws, int errcode, const char *errmsg, void *arg)
+{
+}
+
+static int init_plain(bench_state_t *state, ws_t *ws)
+{
+	if (ws_init(ws, state->base))
+		return -1;
+
+	if (ws_set_origin(*ws, "bench.example.com")
+		|| ws_add_subprotocol(*ws, "chat")
+		|| ws_add_subprotocol(*ws, "echo")
+		|| ws_add_subprotocol(*ws, "superchat")
+		|| ws_set_max_frame_size(*ws, 16 * 1024))
+	{
+		return -1;
+	}
+
+	ws_set_onconnect_cb(*ws, onconnect, state);
+	ws_set_onclose_cb(*ws, onclose, state);
+	ws_set_onmsg_cb(*ws, onmsg, state);
+	ws_set_onerr_cb(*ws, onerr, state);
+	ws_set_onping_cb(*ws, onmsg, state);
+	ws_set_onpong_cb(*ws, onmsg, state);
+
+	return 0;
+}
+
+static int init_template(bench_state_t *state)
+{
+	ws_callbacks_t *cbs;
+
+	if (ws_template_new(&state->tmpl, state->base))
+		return -1;
+
+	if (!(cbs = ws_callbacks_new()))
+		return -1;
+
+	cbs->connect_cb = onconnect;
+	cbs->connect_arg = state;
+	cbs->close_cb = onclose;
+	cbs->close_arg = state;
+	cbs->msg_cb = onmsg;
+	cbs->msg_arg = state;
+	cbs->err_cb = onerr;
+	cbs->err_arg = state;
+	cbs->ping_cb = onmsg;
+	cbs->ping_arg = state;
+	cbs->pong_cb = onmsg;
+	cbs->pong_arg = state;
+
+	ws_template_set_callbacks(state->tmpl, cbs);
+	ws_callbacks_unref(cbs);
+
+	if (ws_template_set_origin(state->tmpl, "bench.example.com")
+		|| ws_template_add_subprotocol(state->tmpl, "chat")
+		|| ws_template_add_subprotocol(state->tmpl, "echo")
+		|| ws_template_add_subprotocol(state->tmpl, "superchat")
+		|| ws_template_set_max_frame_size(state->tmpl, 16 * 1024))
+	{
+		return -1;
+	}
+
+	return 0;
+}
+
+static int run(bench_state_t *state, libws_test_server_t *srv, int use_template)
+{
+	int ret = 0;
+	size_t i;
+	uint64_t start;
+	uint64_t setup_end;
+
+	state->connected = 0;
+	state->failed = 0;
+	memset(state->conns, 0, state->batch * sizeof(ws_t));
+
+	start = libws_bench_now_ns();
+
+	for (i = 0; i < state->batch; i++)
+	{
+		if (use_template
+			? ws_init_from_template(&state->conns[i], state->tmpl)
+			: init_plain(state, &state->conns[i]))
+		{
+			fprintf(stderr, "Failed to init connection.\n");
+			ret = -1;
+			goto fail;
+		}
+	}
+
+	setup_end = libws_bench_now_ns();
+
+	for (i = 0; i < state->batch; i++)
+	{
+		if (ws_connect(state->conns[i], "127.0.0.1",
+						libws_test_server_get_port(srv), "echo"))
+		{
+			fprintf(stderr, "Failed to connect.\n");
+			ret = -1;
+			goto fail;
+		}
+	}
+
+	ws_base_service_blocking(state->base);
+
+	if (state->failed || (state->connected != state->batch))
+	{
+		fprintf(stderr, "Only %u of %u connected.\n",
+				(unsigned)state->connected, (unsigned)state->batch);
+		ret = -1;
+		goto fail;
+	}
+
+	state->setup_ns += setup_end - start;
+	state->establish_ns += libws_bench_now_ns() - start;
+
+fail:
+	for (i = 0; i < state->batch; i++)
+	{
+		ws_destroy(&state->conns[i]);
+	}
+
+	// Let the server notice before the next batch.
+	while (libws_test_server_get_open_count(srv) > 0)
+	{
+		event_base_loop(state->base->ev_base, EVLOOP_ONCE);
+	}
+
+	return ret;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [--log] [rounds] [batch]\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+	int ret = 0;
+	int i;
+	int arg = 0;
+	int use_template;
+	int rounds = 20;
+	int round;
+	char name[64];
+	bench_state_t state;
+	libws_test_server_t *srv = NULL;
+
+	memset(&state, 0, sizeof(state));
+	state.batch = 400;
+
+	for (i = 1; i < argc; i++)
+	{
+		if (!strcmp(argv[i], "--log"))
+		{
+			ws_set_log_cb(ws_default_log_cb);
+			ws_set_log_level(-1);
+		}
+		else if (!strcmp(argv[i], "--help"))
+		{
+			usage(argv[0]);
+			return 0;
+		}
+		else
+		{
+			switch (arg++)
+			{
+				case 0: rounds = atoi(argv[i]); break;
+				case 1: state.batch = (size_t)atoi(argv[i]); break;
+				default: usage(argv[0]); return -1;
+			}
+		}
+	}
+
+	if (ws_global_init(&state.base))
+	{
+		fprintf(stderr, "Failed to init global state.\n");
+		return -1;
+	}
+
+	if (!(srv = libws_test_server_new(state.base->ev_base, 0)))
+	{
+		fprintf(stderr, "Failed to start test server.\n");
+		ret = -1;
+		goto fail;
+	}
+
+	if (!(state.conns = calloc(state.batch, sizeof(ws_t)))
+		|| init_template(&state))
+	{
+		fprintf(stderr, "Failed to create the template.\n");
+		ret = -1;
+		goto fail;
+	}
+
+	for (use_template = 0; use_template <= 1; use_template++)
+	{
+		state.setup_ns = 0;
+		state.establish_ns = 0;
+
+		for (round = 0; round < rounds; round++)
+		{
+			if ((ret = run(&state, srv, use_template)))
+				goto fail;
+		}
+
+		snprintf(name, sizeof(name), "conn_setup_%s",
+				use_template ? "template" : "plain");
+		libws_bench_report(name, (uint64_t)rounds * state.batch,
+							state.setup_ns);
+
+		snprintf(name, sizeof(name), "conn_establish_%s",
+				use_template ? "template" : "plain");
+		libws_bench_report(name, (uint64_t)rounds * state.batch,
+							state.establish_ns);
+	}
+
+fail:
+	ws_template_free(&state.tmpl);
+	if (state.conns) free(state.conns);
+	if (srv) libws_test_server_free(srv);
+	ws_global_destroy(&state.base);
+
+	return ret;
+}
@@ -0,0 +1,188 @@
+//
+// Measures the client side of handshake storms, once per SHA-1
+// backend the CPU supports:
+//
+//   accept_key  - Computing the expected Sec-WebSocket-Accept value.
+//   base64_key  - Base64 encoding a 16 byte Sec-WebSocket-Key.
+//   parse_reply - Parsing and validating a complete upgrade
+//                 response with _ws_read_server_handshake_reply.
+//
+
+#include <libws.h>
+#include <libws_log.h>
+#include <libws_private.h>
+#include <libws_handshake.h>
+#include <libws_crypto.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <event2/buffer.h>
+#include "libws_bench_helpers.h"
+
+static int bench_accept_key(const char *name, ws_t ws, int count)
+{
+	int i;
+	char key_hash[64];
+	char bench_name[64];
+	uint64_t start;
+
+	start = libws_bench_now_ns();
+
+	for (i = 0; i < count; i++)
+	{
+		if (_ws_calculate_key_hash(ws->handshake_key_base64,
+									key_hash, sizeof(key_hash)))
+		{
+			fprintf(stderr, "Failed to calculate the key hash.\n");
+			return -1;
+		}
+	}
+
+	snprintf(bench_name, sizeof(bench_name), "accept_key_%s", name);
+	libws_bench_report(bench_name, (uint64_t)count,
+						libws_bench_now_ns() - start);
+
+	return 0;
+}
+
+static void bench_base64_key(int count)
+{
+	int i;
+	char out[WS_BASE64_LEN(16) + 1];
+	unsigned char key[16];
+	uint64_t start;
+
+	memset(key, 0xa5, sizeof(key));
+	start = libws_bench_now_ns();
+
+	for (i = 0; i < count; i++)
+	{
+		key[i & 15] = (unsigned char)i;
+		_ws_base64_encode(key, sizeof(key), out);
+	}
+
+	libws_bench_report("base64_key", (uint64_t)count,
+						libws_bench_now_ns() - start);
+}
+
+static int bench_parse_reply(const char *name, ws_t ws,
+							struct evbuffer *in, int count)
+{
+	int i;
+	int len;
+	char key_hash[64];
+	char reply[256];
+	char bench_name[64];
+	uint64_t start;
+	ws_parse_state_t state;
+
+	if (_ws_calculate_key_hash(ws->handshake_key_base64,
+								key_hash, sizeof(key_hash)))
+	{
+		return -1;
+	}
+
+	len = snprintf(reply, sizeof(reply),
+					"HTTP/1.1 101 Switching Protocols\r\n"
+					"Upgrade: websocket\r\n"
+					"Connection: Upgrade\r\n"
+					"Sec-WebSocket-Accept: %s\r\n"
+					"Sec-WebSocket-Protocol: echo\r\n"
+					"\r\n", key_hash);
+
+	start = libws_bench_now_ns();
+
+	for (i = 0; i < count; i++)
+	{
+		ws->connect_state = WS_CONNECT_STATE_SENT_REQ;
+		evbuffer_add(in, reply, len);
+
+		if ((state = _ws_read_server_handshake_reply(ws, in))
+			!= WS_PARSE_STATE_SUCCESS)
+		{
+			fprintf(stderr, "Unexpected parse state %s.\n",
+					ws_parse_state_to_string(state));
+			return -1;
+		}
+	}
+
+	snprintf(bench_name, sizeof(bench_name), "parse_reply_%s", name);
+	libws_bench_report(bench_name, (uint64_t)count,
+						libws_bench_now_ns() - start);
+
+	return 0;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [--log] [replies]\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+	int ret = 0;
+	int i;
+	int count = 1000000;
+	size_t b;
+	size_t num_backends;
+	const ws_sha1_backend_t *backends;
+	ws_base_t base = NULL;
+	ws_t ws = NULL;
+	struct evbuffer *in = NULL;
+
+	for (i = 1; i < argc; i++)
+	{
+		if (!strcmp(argv[i], "--log"))
+		{
+			ws_set_log_cb(ws_default_log_cb);
+			ws_set_log_level(-1);
+		}
+		else if (!strcmp(argv[i], "--help"))
+		{
+			usage(argv[0]);
+			return 0;
+		}
+		else
+		{
+			count = atoi(argv[i]);
+		}
+	}
+
+	if (ws_global_init(&base))
+	{
+		fprintf(stderr, "Failed to init global state.\n");
+		return -1;
+	}
+
+	if (ws_init(&ws, base)
+		|| ws_add_subprotocol(ws, "echo")
+		|| _ws_generate_handshake_key(ws)
+		|| !(in = evbuffer_new()))
+	{
+		fprintf(stderr, "Failed to init websocket state.\n");
+		ret = -1;
+		goto fail;
+	}
+
+	bench_base64_key(count);
+
+	backends = _ws_sha1_backends(&num_backends);
+
+	for (b = 0; b < num_backends; b++)
+	{
+		_ws_sha1_set_backend(backends[b].name);
+
+		if ((ret = bench_accept_key(backends[b].name, ws, count))
+			|| (ret = bench_parse_reply(backends[b].name, ws, in, count)))
+		{
+			goto fail;
+		}
+	}
+
+fail:
+	if (in) evbuffer_free(in);
+	ws_destroy(&ws);
+	ws_global_destroy(&base);
+
+	return ret;
+}
@@ -0,0 +1,216 @@
+//
+// Measures debug logging on the event loop thread, with the default
+// log callback writing to stdout and with the log ring flushed by a
+// background thread. Output goes to /dev/null in both cases:
+//
+//   log_call_*     - A single LIBWS_LOG call with a few arguments.
+//   read_frames_*  - Parsing small frames with _ws_read_websocket,
+//                    with every priority enabled.
+//
+// The number of records the ring dropped is printed after each run.
+//
+
+#include <libws.h>
+#include <libws_log.h>
+#include <libws_private.h>
+#include <libws_header.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include "libws_bench_helpers.h"
+
+#define BENCH_FRAMES 1024
+
+typedef struct bench_state_s
+{
+	ws_t ws;
+	struct evbuffer *frames;
+	struct evbuffer *in;
+	FILE *devnull;
+	int stdout_fd;
+	int calls;
+	int rounds;
+	size_t slots;
+} bench_state_t;
+
+static void onmsg(ws_t ws, char *msg, uint64_t len, int binary, void *arg)
+{
+}
+
+static uint64_t log_calls(bench_state_t *state)
+{
+	int i;
+	uint64_t start = libws_bench_now_ns();
+
+	for (i = 0; i < state->calls; i++)
+	{
+		LIBWS_LOG(LIBWS_DEBUG, "Frame %d of %s, %u bytes", i, "bench", 125);
+	}
+
+	return libws_bench_now_ns() - start;
+}
+
+static uint64_t read_frames(bench_state_t *state)
+{
+	int i;
+	uint64_t start = libws_bench_now_ns();
+
+	for (i = 0; i < state->rounds; i++)
+	{
+		evbuffer_add(state->in, evbuffer_pullup(state->frames, -1),
+					evbuffer_get_length(state->frames));
+		_ws_read_websocket(state->ws, state->in);
+	}
+
+	return libws_bench_now_ns() - start;
+}
+
+///
+/// Runs a benchmark with the default log callback, with stdout
+/// pointed at /dev/null.
+///
+static void run_default(const char *name, bench_state_t *state,
+						uint64_t (*run)(bench_state_t *), uint64_t ops)
+{
+	uint64_t elapsed;
+
+	fflush(stdout);
+	dup2(fileno(state->devnull), STDOUT_FILENO);
+
+	ws_set_log_cb(ws_default_log_cb);
+	elapsed = run(state);
+	ws_set_log_cb(NULL);
+
+	fflush(stdout);
+	dup2(state->stdout_fd, STDOUT_FILENO);
+
+	libws_bench_report(name, ops, elapsed);
+}
+
+static int run_ring(const char *name, bench_state_t *state,
+					uint64_t (*run)(bench_state_t *), uint64_t ops)
+{
+	uint64_t elapsed;
+
+	if (ws_log_ring_start(state->slots, 1, state->devnull))
+	{
+		fprintf(stderr, "Failed to start the log ring.\n");
+		return -1;
+	}
+
+	elapsed = run(state);
+	libws_bench_report(name, ops, elapsed);
+	printf("  dropped %llu records\n",
+			(unsigned long long)ws_log_ring_get_dropped());
+
+	ws_log_ring_stop();
+
+	return 0;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [calls] [rounds] [slots]\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+	int ret = 0;
+	int i;
+	int arg = 0;
+	size_t header_len;
+	uint8_t header_buf[WS_HDR_MAX_SIZE];
+	char payload[16];
+	ws_header_t h;
+	ws_base_t base = NULL;
+	bench_state_t state;
+
+	memset(&state, 0, sizeof(state));
+	state.calls = 1000000;
+	state.rounds = 200;
+	state.slots = 64 * 1024;
+
+	for (i = 1; i < argc; i++)
+	{
+		if (!strcmp(argv[i], "--help"))
+		{
+			usage(argv[0]);
+			return 0;
+		}
+
+		switch (arg++)
+		{
+			case 0: state.calls = atoi(argv[i]); break;
+			case 1: state.rounds = atoi(argv[i]); break;
+			case 2: state.slots = (size_t)atoi(argv[i]); break;
+			default: usage(argv[0]); return -1;
+		}
+	}
+
+	if (!(state.devnull = fopen("/dev/null", "w"))
+		|| ((state.stdout_fd = dup(STDOUT_FILENO)) < 0))
+	{
+		fprintf(stderr, "Failed to open /dev/null.\n");
+		return -1;
+	}
+
+	if (ws_global_init(&base))
+	{
+		fprintf(stderr, "Failed to init global state.\n");
+		return -1;
+	}
+
+	if (ws_init(&state.ws, base)
+		|| !(state.ws->bev = bufferevent_socket_new(base->ev_base, -1, 0))
+		|| !(state.frames = evbuffer_new())
+		|| !(state.in = evbuffer_new()))
+	{
+		fprintf(stderr, "Failed to init websocket state.\n");
+		ret = -1;
+		goto fail;
+	}
+
+	ws_set_onmsg_cb(state.ws, onmsg, NULL);
+
+	memset(&h, 0, sizeof(h));
+	h.fin = 1;
+	h.opcode = WS_OPCODE_BINARY_0X2;
+	h.payload_len = sizeof(payload);
+	ws_pack_header(&h, header_buf, sizeof(header_buf), &header_len);
+	memset(payload, 'x', sizeof(payload));
+
+	for (i = 0; i < BENCH_FRAMES; i++)
+	{
+		evbuffer_add(state.frames, header_buf, header_len);
+		evbuffer_add(state.frames, payload, sizeof(payload));
+	}
+
+	ws_set_log_level(-1);
+
+	run_default("log_call_default", &state, log_calls, state.calls);
+
+	if ((ret = run_ring("log_call_ring", &state, log_calls, state.calls)))
+		goto fail;
+
+	run_default("read_frames_default", &state, read_frames,
+				(uint64_t)state.rounds * BENCH_FRAMES);
+
+	if ((ret = run_ring("read_frames_ring", &state, read_frames,
+						(uint64_t)state.rounds * BENCH_FRAMES)))
+		goto fail;
+
+fail:
+	ws_set_log_level(0);
+	if (state.frames) evbuffer_free(state.frames);
+	if (state.in) evbuffer_free(state.in);
+	ws_destroy(&state.ws);
+	ws_global_destroy(&base);
+	fclose(state.devnull);
+	close(state.stdout_fd);
+
+	return ret;
+}
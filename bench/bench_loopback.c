@@ -0,0 +1,368 @@
+//
+// End to end throughput and latency over loopback, against the
+// in-process echo server used by the tests, so no external server
+// is needed.
+//
+// A number of connections each keep --depth messages in flight,
+// sending a new message for every echo received, until --count
+// messages have been echoed on each. The round trip of every
+// message is recorded in a histogram.
+//
+// Run it plain and with --tls, with --frame-size to fragment the
+// messages using ws_set_max_frame_size.
+//
+
+#include <libws.h>
+#include <libws_log.h>
+#include <libws_private.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "libws_bench_helpers.h"
+#include "libws_test_server.h"
+
+typedef struct bench_conn_s
+{
+	struct bench_state_s *state;
+	ws_t ws;
+	uint64_t sent;
+	uint64_t received;
+	uint64_t *send_times;   // Ring of --depth send times, echoes
+	                        // come back in the order they were sent.
+} bench_conn_t;
+
+typedef struct bench_state_s
+{
+	ws_base_t base;
+	bench_conn_t *conns;
+	int conn_count;
+	int connected;
+	int closed;
+	uint64_t count;
+	uint64_t depth;
+	uint64_t frame_size;
+	char *msg;
+	size_t msg_size;
+	libws_bench_hist_t *hist;
+	uint64_t start;
+	uint64_t elapsed;
+	int failed;
+} bench_state_t;
+
+static void send_next(bench_conn_t *conn)
+{
+	bench_state_t *state = conn->state;
+
+	conn->send_times[conn->sent % state->depth] = libws_bench_now_ns();
+	conn->sent++;
+
+	if (ws_send_msg_ex(conn->ws, state->msg, state->msg_size, 1))
+	{
+		fprintf(stderr, "Failed to send message.\n");
+		state->failed = 1;
+		ws_close(conn->ws);
+	}
+}
+
+static void onmsg(ws_t ws, char *msg, uint64_t len, int binary, void *arg)
+{
+	bench_conn_t *conn = (bench_conn_t *)arg;
+	bench_state_t *state = conn->state;
+	uint64_t now = libws_bench_now_ns();
+
+	if (len != state->msg_size)
+	{
+		fprintf(stderr, "Got %llu bytes, expected %u.\n",
+				(unsigned long long)len, (unsigned)state->msg_size);
+		state->failed = 1;
+		ws_close(ws);
+		return;
+	}
+
+	libws_bench_hist_record(state->hist,
+				now - conn->send_times[conn->received % state->depth]);
+	conn->received++;
+
+	if (conn->sent < state->count)
+	{
+		send_next(conn);
+	}
+	else if (conn->received == state->count)
+	{
+		ws_close(ws);
+	}
+}
+
+static void onconnect(ws_t ws, void *arg)
+{
+	int i;
+	uint64_t j;
+	bench_conn_t *conn = (bench_conn_t *)arg;
+	bench_state_t *state = conn->state;
+
+	if (ws_set_max_frame_size(ws, state->frame_size))
+	{
+		fprintf(stderr, "Failed to set max frame size.\n");
+		state->failed = 1;
+	}
+
+	// Start sending when all connections are up, so the
+	// handshakes aren't part of the measurement.
+	if (++state->connected < state->conn_count)
+		return;
+
+	state->start = libws_bench_now_ns();
+
+	for (i = 0; i < state->conn_count; i++)
+	{
+		for (j = 0; (j < state->depth) && (j < state->count); j++)
+		{
+			send_next(&state->conns[i]);
+		}
+	}
+}
+
+static void onclose(ws_t ws, ws_close_status_t status,
+			const char *reason, size_t reason_len, void *arg)
+{
+	bench_conn_t *conn = (bench_conn_t *)arg;
+	bench_state_t *state = conn->state;
+
+	if (conn->received != state->count)
+	{
+		fprintf(stderr, "Connection closed early: %d %s\n", status, reason);
+		state->failed = 1;
+	}
+
+	if (++state->closed == state->conn_count)
+	{
+		state->elapsed = libws_bench_now_ns() - state->start;
+		ws_base_quit(state->base, 1);
+	}
+}
+
+static int run(bench_state_t *state, int port, int use_ssl)
+{
+	int ret = 0;
+	int i;
+	bench_conn_t *conn;
+
+	state->connected = 0;
+	state->closed = 0;
+	state->failed = 0;
+
+	if (!(state->conns = calloc(state->conn_count, sizeof(bench_conn_t))))
+	{
+		fprintf(stderr, "Out of memory.\n");
+		return -1;
+	}
+
+	for (i = 0; i < state->conn_count; i++)
+	{
+		conn = &state->conns[i];
+		conn->state = state;
+
+		if (!(conn->send_times = calloc(state->depth, sizeof(uint64_t)))
+			|| ws_init(&conn->ws, state->base))
+		{
+			fprintf(stderr, "Failed to init websocket state.\n");
+			ret = -1;
+			goto fail;
+		}
+
+		ws_set_onconnect_cb(conn->ws, onconnect, conn);
+		ws_set_onmsg_cb(conn->ws, onmsg, conn);
+		ws_set_onclose_cb(conn->ws, onclose, conn);
+
+		if (use_ssl)
+		{
+			ws_set_ssl_state(conn->ws, LIBWS_SSL_SELFSIGNED);
+		}
+
+		if (ws_connect(conn->ws, "localhost", port, ""))
+		{
+			fprintf(stderr, "Failed to connect to localhost:%d\n", port);
+			ret = -1;
+			goto fail;
+		}
+	}
+
+	ws_base_service_blocking(state->base);
+
+	if (state->failed)
+	{
+		ret = -1;
+	}
+
+fail:
+	for (i = 0; i < state->conn_count; i++)
+	{
+		conn = &state->conns[i];
+		free(conn->send_times);
+
+		if (conn->ws)
+		{
+			ws_destroy(&conn->ws);
+		}
+	}
+
+	free(state->conns);
+	state->conns = NULL;
+
+	return ret;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [--log] [--json] [--tls] [--connections n]\n"
+					"       [--count n] [--size bytes] [--frame-size bytes]\n"
+					"       [--depth n]\n"
+					"  --tls            Connect over TLS.\n"
+					"  --connections    Number of connections (8).\n"
+					"  --count          Messages echoed on each connection (10000).\n"
+					"  --size           Size of each message (1024).\n"
+					"  --frame-size     Fragment messages into frames of this size,\n"
+					"                   0 to not fragment (0).\n"
+					"  --depth          Messages in flight on each connection (1).\n",
+					prog);
+}
+
+int main(int argc, char **argv)
+{
+	int ret = 0;
+	int i;
+	int use_ssl = 0;
+	int json = 0;
+	int port;
+	char name[128];
+	bench_state_t state;
+	libws_test_server_t *srv = NULL;
+	double secs;
+	uint64_t msgs;
+
+	memset(&state, 0, sizeof(state));
+	state.conn_count = 8;
+	state.count = 10000;
+	state.msg_size = 1024;
+	state.depth = 1;
+
+	for (i = 1; i < argc; i++)
+	{
+		if (!strcmp(argv[i], "--log"))
+		{
+			ws_set_log_cb(ws_default_log_cb);
+			ws_set_log_level(-1);
+		}
+		else if (!strcmp(argv[i], "--json"))
+		{
+			json = 1;
+		}
+		else if (!strcmp(argv[i], "--tls"))
+		{
+			use_ssl = 1;
+		}
+		else if ((i + 1 < argc) && !strcmp(argv[i], "--connections"))
+		{
+			state.conn_count = atoi(argv[++i]);
+		}
+		else if ((i + 1 < argc) && !strcmp(argv[i], "--count"))
+		{
+			state.count = (uint64_t)atoi(argv[++i]);
+		}
+		else if ((i + 1 < argc) && !strcmp(argv[i], "--size"))
+		{
+			state.msg_size = (size_t)atoi(argv[++i]);
+		}
+		else if ((i + 1 < argc) && !strcmp(argv[i], "--frame-size"))
+		{
+			state.frame_size = (uint64_t)atoi(argv[++i]);
+		}
+		else if ((i + 1 < argc) && !strcmp(argv[i], "--depth"))
+		{
+			state.depth = (uint64_t)atoi(argv[++i]);
+		}
+		else
+		{
+			usage(argv[0]);
+			return !strcmp(argv[i], "--help") ? 0 : -1;
+		}
+	}
+
+	if ((state.conn_count <= 0) || !state.count || !state.depth)
+	{
+		usage(argv[0]);
+		return -1;
+	}
+
+	#ifndef LIBWS_WITH_OPENSSL
+	if (use_ssl)
+	{
+		fprintf(stderr, "Not compiled with OpenSSL.\n");
+		return -1;
+	}
+	#endif
+
+	if (ws_global_init(&state.base))
+	{
+		fprintf(stderr, "Failed to init global state.\n");
+		return -1;
+	}
+
+	if (!(srv = libws_test_server_new(state.base->ev_base, use_ssl)))
+	{
+		fprintf(stderr, "Failed to start test server.\n");
+		ret = -1;
+		goto fail;
+	}
+
+	port = libws_test_server_get_port(srv);
+
+	// Not empty, so the echo can't be mistaken for a control frame.
+	if (!(state.msg = malloc(state.msg_size ? state.msg_size : 1))
+		|| !(state.hist = libws_bench_hist_new()))
+	{
+		fprintf(stderr, "Out of memory.\n");
+		ret = -1;
+		goto fail;
+	}
+
+	memset(state.msg, 'x', state.msg_size);
+
+	if ((ret = run(&state, port, use_ssl)))
+		goto fail;
+
+	snprintf(name, sizeof(name), "loopback_%s_c%d_s%u_f%u_d%u",
+			use_ssl ? "tls" : "plain", state.conn_count,
+			(unsigned)state.msg_size, (unsigned)state.frame_size,
+			(unsigned)state.depth);
+
+	msgs = state.count * state.conn_count;
+	secs = (double)state.elapsed / 1e9;
+
+	if (json)
+	{
+		libws_bench_set_json(stdout);
+		libws_bench_report_bytes(name, msgs, msgs * state.msg_size,
+								state.elapsed);
+	}
+	else
+	{
+		printf("%-32s %10llu msgs %10.1f msgs/s %10.1f MB/s\n", name,
+				(unsigned long long)msgs, (double)msgs / secs,
+				((double)msgs * state.msg_size / (1024 * 1024)) / secs);
+	}
+
+	libws_bench_report_hist(name, state.hist);
+	libws_bench_finish();
+
+fail:
+	if (srv)
+	{
+		libws_test_server_free(srv);
+	}
+
+	libws_bench_hist_free(state.hist);
+	free(state.msg);
+	ws_global_destroy(&state.base);
+	return ret;
+}
@@ -0,0 +1,164 @@
+//
+// Measures how many frames per second _ws_read_websocket parses,
+// with logging compiled in but disabled. Every frame is a small
+// complete binary message, so per frame overhead dominates:
+//
+//   read_frames       - Logging disabled at runtime.
+//   read_frames_nocb  - All priorities enabled but no log callback set,
+//                       so the log arguments are evaluated.
+//
+
+#include <libws.h>
+#include <libws_log.h>
+#include <libws_private.h>
+#include <libws_header.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include "libws_bench_helpers.h"
+
+#define BENCH_BATCH 1024
+
+static void onmsg(ws_t ws, char *msg, uint64_t len, int binary, void *arg)
+{
+	(*(uint64_t *)arg)++;
+}
+
+static int run(const char *name, ws_t ws, struct evbuffer *frames, int rounds)
+{
+	int i;
+	uint64_t msgs = 0;
+	uint64_t start;
+	struct evbuffer *in = evbuffer_new();
+
+	if (!in)
+		return -1;
+
+	ws_set_onmsg_cb(ws, onmsg, &msgs);
+
+	start = libws_bench_now_ns();
+
+	for (i = 0; i < rounds; i++)
+	{
+		evbuffer_add(in, evbuffer_pullup(frames, -1),
+					evbuffer_get_length(frames));
+		_ws_read_websocket(ws, in);
+	}
+
+	libws_bench_report(name, (uint64_t)rounds * BENCH_BATCH,
+						libws_bench_now_ns() - start);
+
+	evbuffer_free(in);
+
+	if (msgs != (uint64_t)rounds * BENCH_BATCH)
+	{
+		fprintf(stderr, "Got %u of %u messages.\n",
+				(unsigned)msgs, (unsigned)(rounds * BENCH_BATCH));
+		return -1;
+	}
+
+	return 0;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [--log] [rounds] [payload size]\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+	int ret = 0;
+	int i;
+	int arg = 0;
+	int rounds = 2000;
+	size_t payload_len = 16;
+	size_t header_len;
+	uint8_t header_buf[WS_HDR_MAX_SIZE];
+	char payload[125];
+	ws_header_t h;
+	ws_base_t base = NULL;
+	ws_t ws = NULL;
+	struct evbuffer *frames = NULL;
+
+	for (i = 1; i < argc; i++)
+	{
+		if (!strcmp(argv[i], "--log"))
+		{
+			ws_set_log_cb(ws_default_log_cb);
+			ws_set_log_level(-1);
+		}
+		else if (!strcmp(argv[i], "--help"))
+		{
+			usage(argv[0]);
+			return 0;
+		}
+		else
+		{
+			switch (arg++)
+			{
+				case 0: rounds = atoi(argv[i]); break;
+				case 1: payload_len = (size_t)atoi(argv[i]); break;
+				default: usage(argv[0]); return -1;
+			}
+		}
+	}
+
+	if (payload_len > sizeof(payload))
+	{
+		fprintf(stderr, "Payload size must be at most %u.\n",
+				(unsigned)sizeof(payload));
+		return -1;
+	}
+
+	if (ws_global_init(&base))
+	{
+		fprintf(stderr, "Failed to init global state.\n");
+		return -1;
+	}
+
+	if (ws_init(&ws, base)
+		|| !(ws->bev = bufferevent_socket_new(base->ev_base, -1, 0))
+		|| !(frames = evbuffer_new()))
+	{
+		fprintf(stderr, "Failed to init websocket state.\n");
+		ret = -1;
+		goto fail;
+	}
+
+	// Unmasked frames, as sent by a server.
+	memset(&h, 0, sizeof(h));
+	h.fin = 1;
+	h.opcode = WS_OPCODE_BINARY_0X2;
+	h.payload_len = payload_len;
+	ws_pack_header(&h, header_buf, sizeof(header_buf), &header_len);
+	memset(payload, 'x', sizeof(payload));
+
+	for (i = 0; i < BENCH_BATCH; i++)
+	{
+		evbuffer_add(frames, header_buf, header_len);
+		evbuffer_add(frames, payload, payload_len);
+	}
+
+	if (ws_get_log_level())
+	{
+		// Logging to the console was asked for.
+		ret = run("read_frames_log", ws, frames, rounds);
+		goto fail;
+	}
+
+	if ((ret = run("read_frames", ws, frames, rounds)))
+		goto fail;
+
+	ws_set_log_level(-1);
+	ret = run("read_frames_nocb", ws, frames, rounds);
+	ws_set_log_level(0);
+
+fail:
+	if (frames) evbuffer_free(frames);
+	ws_destroy(&ws);
+	ws_global_destroy(&base);
+
+	return ret;
+}
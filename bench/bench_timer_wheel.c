@@ -0,0 +1,271 @@
+//
+// Measures the cost of arming, re-arming and cancelling one timeout per
+// connection, as done for the connect, pong, close and keepalive timeouts:
+//
+//   wheel    - The per base timer wheel libws uses.
+//   heap     - A libevent timer per connection (its min-heap).
+//   common   - A libevent timer per connection using a common timeout.
+//
+// The wheel and heap get timeouts spread over 1 - 60 seconds, the common
+// timeout only supports a single duration so all get 30 seconds.
+//
+// For the wheel the timeouts are then armed again, and the wheel is
+// moved forward without waiting, to measure:
+//
+//   tick     - A tick with all of them armed, including cascading
+//              them to lower levels of the wheel.
+//   expire   - Running each of them when it expires.
+//
+
+#include <libws.h>
+#include <libws_private.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <event2/event.h>
+#include "libws_bench_helpers.h"
+
+typedef enum bench_backend_e
+{
+	BENCH_WHEEL,
+	BENCH_HEAP,
+	BENCH_COMMON
+} bench_backend_t;
+
+static const char *backend_names[] = { "wheel", "heap", "common" };
+
+static void bench_cb(void *arg)
+{
+}
+
+static void bench_event_cb(evutil_socket_t fd, short what, void *arg)
+{
+}
+
+static void bench_timeouts(struct timeval *tvs, size_t count, unsigned int seed)
+{
+	size_t i;
+	uint32_t ms;
+
+	for (i = 0; i < count; i++)
+	{
+		seed = (seed * 1103515245u) + 12345u;
+		ms = 1000 + ((seed >> 8) % 59000);
+		tvs[i].tv_sec = (long)(ms / 1000);
+		tvs[i].tv_usec = (long)((ms % 1000) * 1000);
+	}
+}
+
+static void bench_report(bench_backend_t backend, const char *op,
+						size_t count, uint64_t start)
+{
+	char name[64];
+	snprintf(name, sizeof(name), "timer_%s_%s", backend_names[backend], op);
+	libws_bench_report(name, count, libws_bench_now_ns() - start);
+}
+
+static int run(ws_base_t base, bench_backend_t backend, size_t count)
+{
+	int ret = 0;
+	size_t i;
+	uint64_t start;
+	ws_timer_t *timers = NULL;
+	struct event **events = NULL;
+	struct timeval *tvs = NULL;
+	struct timeval *tvs2 = NULL;
+	struct timeval common = {30, 0};
+	const struct timeval *common_tv = NULL;
+
+	tvs = calloc(count, sizeof(struct timeval));
+	tvs2 = calloc(count, sizeof(struct timeval));
+
+	if (!tvs || !tvs2)
+	{
+		fprintf(stderr, "Out of memory.\n");
+		ret = -1;
+		goto fail;
+	}
+
+	if (backend == BENCH_COMMON)
+	{
+		common_tv = event_base_init_common_timeout(base->ev_base, &common);
+
+		for (i = 0; i < count; i++)
+		{
+			tvs[i] = *common_tv;
+			tvs2[i] = *common_tv;
+		}
+	}
+	else
+	{
+		bench_timeouts(tvs, count, 1);
+		bench_timeouts(tvs2, count, 2);
+	}
+
+	start = libws_bench_now_ns();
+
+	if (backend == BENCH_WHEEL)
+	{
+		if (!(timers = calloc(count, sizeof(ws_timer_t))))
+		{
+			fprintf(stderr, "Out of memory.\n");
+			ret = -1;
+			goto fail;
+		}
+
+		for (i = 0; i < count; i++)
+			_ws_timer_init(&timers[i], bench_cb, NULL);
+	}
+	else
+	{
+		if (!(events = calloc(count, sizeof(struct event *))))
+		{
+			fprintf(stderr, "Out of memory.\n");
+			ret = -1;
+			goto fail;
+		}
+
+		for (i = 0; i < count; i++)
+		{
+			if (!(events[i] = evtimer_new(base->ev_base, bench_event_cb, NULL)))
+			{
+				fprintf(stderr, "Out of memory.\n");
+				ret = -1;
+				goto fail;
+			}
+		}
+	}
+
+	bench_report(backend, "create", count, start);
+
+	start = libws_bench_now_ns();
+
+	for (i = 0; i < count; i++)
+	{
+		if (timers)
+			_ws_timer_add(&base->timers, &timers[i], &tvs[i]);
+		else
+			evtimer_add(events[i], &tvs[i]);
+	}
+
+	bench_report(backend, "arm", count, start);
+
+	// Like a keepalive being pushed back by traffic.
+	start = libws_bench_now_ns();
+
+	for (i = 0; i < count; i++)
+	{
+		if (timers)
+			_ws_timer_add(&base->timers, &timers[i], &tvs2[i]);
+		else
+			evtimer_add(events[i], &tvs2[i]);
+	}
+
+	bench_report(backend, "rearm", count, start);
+
+	start = libws_bench_now_ns();
+
+	for (i = 0; i < count; i++)
+	{
+		if (timers)
+			_ws_timer_del(&base->timers, &timers[i]);
+		else
+			evtimer_del(events[i]);
+	}
+
+	bench_report(backend, "cancel", count, start);
+
+	if (timers)
+	{
+		uint64_t now;
+
+		for (i = 0; i < count; i++)
+			_ws_timer_add(&base->timers, &timers[i], &tvs[i]);
+
+		// Up to the shortest timeout, 1 second.
+		now = base->timers.now;
+		start = libws_bench_now_ns();
+		_ws_timer_wheel_run(&base->timers, now + 1000);
+		bench_report(backend, "tick", 1000, start);
+
+		// Well past the longest, arming them took some time too.
+		start = libws_bench_now_ns();
+		_ws_timer_wheel_run(&base->timers, now + 120000);
+		bench_report(backend, "expire", count, start);
+
+		if (base->timers.count)
+		{
+			fprintf(stderr, "%u timers didn't expire.\n",
+					(unsigned)base->timers.count);
+			ret = -1;
+		}
+	}
+
+	printf("%-32s %10llu bytes per timer\n", "",
+		(unsigned long long)(timers ? sizeof(ws_timer_t)
+									: event_get_struct_event_size()));
+
+fail:
+	if (events)
+	{
+		for (i = 0; i < count; i++)
+		{
+			if (events[i])
+				event_free(events[i]);
+		}
+
+		free(events);
+	}
+
+	free(timers);
+	free(tvs);
+	free(tvs2);
+
+	return ret;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [count]\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+	int ret = 0;
+	int backend;
+	size_t count = 1000000;
+	ws_base_t base = NULL;
+
+	if (argc > 2)
+	{
+		usage(argv[0]);
+		return -1;
+	}
+
+	if (argc == 2)
+	{
+		if (!strcmp(argv[1], "--help"))
+		{
+			usage(argv[0]);
+			return 0;
+		}
+
+		count = (size_t)atoi(argv[1]);
+	}
+
+	if (ws_global_init(&base))
+	{
+		fprintf(stderr, "Failed to init global state.\n");
+		return -1;
+	}
+
+	for (backend = BENCH_WHEEL; backend <= BENCH_COMMON; backend++)
+	{
+		if ((ret = run(base, (bench_backend_t)backend, count)))
+			break;
+	}
+
+	ws_global_destroy(&base);
+
+	return ret;
+}
@@ -0,0 +1,398 @@
+//
+// Measures time-to-first-message when reconnecting over TLS 1.3,
+// with and without sending the websocket handshake as early data.
+//
+// Runs an in-process stand-in for "openssl s_server -early_data" that
+// reads the early data, replies to the websocket upgrade and then sends
+// one message followed by a close frame.
+//
+
+#include <libws.h>
+#include <libws_log.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/rsa.h>
+#include <openssl/sha.h>
+#include <openssl/x509.h>
+#include "libws_bench_helpers.h"
+
+#define BENCH_WS_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+
+typedef struct bench_server_s
+{
+	SSL_CTX *ctx;
+	int listen_fd;
+	int port;
+	int count;				///< Number of connections to serve.
+	int reject;				///< Never read early data, rejecting it.
+	int early_data_count;	///< Number of handshakes received as early data.
+} bench_server_t;
+
+typedef struct bench_client_s
+{
+	ws_base_t base;
+	uint64_t start;
+	uint64_t first_msg;
+} bench_client_t;
+
+static int bench_create_server_ctx(bench_server_t *srv)
+{
+	EVP_PKEY *pkey = NULL;
+	EVP_PKEY_CTX *pctx = NULL;
+	X509 *x509 = NULL;
+	int ret = -1;
+
+	if (!(srv->ctx = SSL_CTX_new(TLS_server_method())))
+		goto fail;
+
+	// Self-signed certificate.
+	if (!(pctx = EVP_PKEY_CTX_new_id(EVP_PKEY_RSA, NULL))
+	 || (EVP_PKEY_keygen_init(pctx) <= 0)
+	 || (EVP_PKEY_CTX_set_rsa_keygen_bits(pctx, 2048) <= 0)
+	 || (EVP_PKEY_keygen(pctx, &pkey) <= 0))
+		goto fail;
+
+	if (!(x509 = X509_new()))
+		goto fail;
+
+	ASN1_INTEGER_set(X509_get_serialNumber(x509), 1);
+	X509_gmtime_adj(X509_getm_notBefore(x509), 0);
+	X509_gmtime_adj(X509_getm_notAfter(x509), 3600);
+	X509_set_pubkey(x509, pkey);
+	X509_NAME_add_entry_by_txt(X509_get_subject_name(x509), "CN",
+		MBSTRING_ASC, (const unsigned char *)"localhost", -1, -1, 0);
+	X509_set_issuer_name(x509, X509_get_subject_name(x509));
+
+	if (!X509_sign(x509, pkey, EVP_sha256())
+	 || !SSL_CTX_use_certificate(srv->ctx, x509)
+	 || !SSL_CTX_use_PrivateKey(srv->ctx, pkey))
+		goto fail;
+
+	SSL_CTX_set_min_proto_version(srv->ctx, TLS1_3_VERSION);
+	SSL_CTX_set_max_early_data(srv->ctx, 16384);
+
+	ret = 0;
+fail:
+	EVP_PKEY_CTX_free(pctx);
+	EVP_PKEY_free(pkey);
+	X509_free(x509);
+	return ret;
+}
+
+static int bench_listen(bench_server_t *srv)
+{
+	struct sockaddr_in sin;
+	socklen_t len = sizeof(sin);
+	int one = 1;
+
+	if ((srv->listen_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+		return -1;
+
+	setsockopt(srv->listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	sin.sin_port = 0;
+
+	if (bind(srv->listen_fd, (struct sockaddr *)&sin, sizeof(sin))
+	 || listen(srv->listen_fd, 16)
+	 || getsockname(srv->listen_fd, (struct sockaddr *)&sin, &len))
+		return -1;
+
+	srv->port = ntohs(sin.sin_port);
+
+	return 0;
+}
+
+static int bench_write(SSL *ssl, const void *buf, size_t len, int early)
+{
+	size_t written;
+
+	if (early)
+		return SSL_write_early_data(ssl, buf, len, &written) ? 0 : -1;
+
+	return (SSL_write(ssl, buf, len) > 0) ? 0 : -1;
+}
+
+static int bench_reply_upgrade(SSL *ssl, const char *request, int early)
+{
+	char key[128];
+	char accept_key[64];
+	char reply[512];
+	unsigned char hash[SHA_DIGEST_LENGTH];
+	const char *k;
+	size_t i = 0;
+	static const unsigned char msg_and_close[] =
+		"\x81\x05hello"
+		"\x88\x02\x03\xe8";
+
+	if (!(k = strstr(request, "Sec-WebSocket-Key:")))
+		return -1;
+
+	k += strlen("Sec-WebSocket-Key:");
+	while (*k == ' ') k++;
+
+	while ((*k != '\r') && *k && (i < sizeof(key) - sizeof(BENCH_WS_GUID)))
+		key[i++] = *k++;
+
+	key[i] = '\0';
+	strcat(key, BENCH_WS_GUID);
+
+	SHA1((unsigned char *)key, strlen(key), hash);
+	EVP_EncodeBlock((unsigned char *)accept_key, hash, sizeof(hash));
+
+	snprintf(reply, sizeof(reply),
+		"HTTP/1.1 101 Switching Protocols\r\n"
+		"Upgrade: websocket\r\n"
+		"Connection: Upgrade\r\n"
+		"Sec-WebSocket-Accept: %s\r\n"
+		"\r\n", accept_key);
+
+	if (bench_write(ssl, reply, strlen(reply), early)
+	 || bench_write(ssl, msg_and_close, sizeof(msg_and_close) - 1, early))
+		return -1;
+
+	return 0;
+}
+
+static void bench_serve_one(bench_server_t *srv, int fd)
+{
+	SSL *ssl;
+	char request[4096];
+	size_t len = 0;
+	size_t n = 0;
+	int one = 1;
+	int replied = 0;
+	int r;
+
+	if (!(ssl = SSL_new(srv->ctx)))
+		return;
+
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	SSL_set_fd(ssl, fd);
+
+	if (!srv->reject)
+	{
+		// Read the upgrade request sent as early data, and reply
+		// right away before the handshake is complete (0.5-RTT data).
+		do
+		{
+			r = SSL_read_early_data(ssl, request + len,
+								sizeof(request) - 1 - len, &n);
+			len += n;
+			request[len] = '\0';
+
+			if (!replied && strstr(request, "\r\n\r\n"))
+			{
+				if (bench_reply_upgrade(ssl, request, 1))
+					goto done;
+
+				srv->early_data_count++;
+				replied = 1;
+			}
+		}
+		while (r == SSL_READ_EARLY_DATA_SUCCESS);
+
+		if (r == SSL_READ_EARLY_DATA_ERROR)
+			goto done;
+	}
+
+	if (SSL_accept(ssl) <= 0)
+		goto done;
+
+	request[len] = '\0';
+
+	// Otherwise read it the normal way.
+	if (!replied)
+	{
+		while (!strstr(request, "\r\n\r\n"))
+		{
+			if ((r = SSL_read(ssl, request + len, sizeof(request) - 1 - len)) <= 0)
+				goto done;
+
+			len += r;
+			request[len] = '\0';
+		}
+
+		if (bench_reply_upgrade(ssl, request, 0))
+			goto done;
+	}
+
+	// Wait for the client to echo the close frame, and then close.
+	SSL_read(ssl, request, sizeof(request));
+	SSL_shutdown(ssl);
+	shutdown(fd, SHUT_WR);
+	while (read(fd, request, sizeof(request)) > 0);
+
+done:
+	SSL_free(ssl);
+	close(fd);
+}
+
+static void *bench_server_thread(void *arg)
+{
+	bench_server_t *srv = (bench_server_t *)arg;
+	int fd;
+	int i;
+
+	for (i = 0; i < srv->count; i++)
+	{
+		if ((fd = accept(srv->listen_fd, NULL, NULL)) < 0)
+			break;
+
+		bench_serve_one(srv, fd);
+	}
+
+	return NULL;
+}
+
+static void onmsg(ws_t ws, char *msg, uint64_t len, int binary, void *arg)
+{
+	bench_client_t *client = (bench_client_t *)arg;
+
+	if (!client->first_msg)
+		client->first_msg = libws_bench_now_ns();
+}
+
+static void onclose(ws_t ws, ws_close_status_t status,
+			const char *reason, size_t reason_len, void *arg)
+{
+	bench_client_t *client = (bench_client_t *)arg;
+	ws_base_quit(client->base, 1);
+}
+
+static int bench_run(const char *name, int count, int early_data, int reject)
+{
+	int ret = 0;
+	int i;
+	int accepted = 0;
+	int resumed = 0;
+	size_t samples = 0;
+	uint64_t *ttfm = NULL;
+	ws_t ws = NULL;
+	bench_server_t srv;
+	bench_client_t client;
+	pthread_t thread;
+
+	memset(&srv, 0, sizeof(srv));
+	memset(&client, 0, sizeof(client));
+
+	// The first connection is a full handshake to get a session ticket.
+	srv.count = count + 1;
+	srv.reject = reject;
+
+	if (bench_create_server_ctx(&srv) || bench_listen(&srv))
+	{
+		fprintf(stderr, "Failed to setup server\n");
+		return -1;
+	}
+
+	if (!(ttfm = (uint64_t *)calloc(count, sizeof(uint64_t))))
+		return -1;
+
+	pthread_create(&thread, NULL, bench_server_thread, &srv);
+
+	if (ws_global_init(&client.base))
+	{
+		fprintf(stderr, "Failed to init global state.\n");
+		ret = -1;
+		goto fail;
+	}
+
+	if (ws_init(&ws, client.base))
+	{
+		fprintf(stderr, "Failed to init websocket state.\n");
+		ret = -1;
+		goto fail;
+	}
+
+	ws_set_onmsg_cb(ws, onmsg, &client);
+	ws_set_onclose_cb(ws, onclose, &client);
+	ws_set_ssl_state(ws, LIBWS_SSL_SELFSIGNED);
+	ws_set_ssl_early_data(ws, early_data);
+
+	for (i = 0; i <= count; i++)
+	{
+		client.first_msg = 0;
+		client.start = libws_bench_now_ns();
+
+		if (ws_connect(ws, "127.0.0.1", srv.port, ""))
+		{
+			fprintf(stderr, "Failed to connect\n");
+			ret = -1;
+			goto fail;
+		}
+
+		ws_base_service_blocking(client.base);
+
+		if (!client.first_msg)
+		{
+			fprintf(stderr, "Connection %d got no message\n", i);
+			ret = -1;
+			goto fail;
+		}
+
+		if (i == 0)
+			continue;
+
+		ttfm[samples++] = client.first_msg - client.start;
+		resumed += ws_is_ssl_session_reused(ws);
+		accepted += ws_is_ssl_early_data_accepted(ws);
+	}
+
+	libws_bench_report_latency(name, ttfm, samples);
+	printf("%*s resumed %d, early data accepted %d (server got %d)\n",
+			32, "", resumed, accepted, srv.early_data_count);
+
+fail:
+	ws_destroy(&ws);
+
+	if (client.base)
+		ws_global_destroy(&client.base);
+
+	pthread_join(thread, NULL);
+	close(srv.listen_fd);
+	SSL_CTX_free(srv.ctx);
+	free(ttfm);
+
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	int i;
+	int count = 1000;
+
+	for (i = 1; i < argc; i++)
+	{
+		if (!strcmp(argv[i], "--log"))
+		{
+			ws_set_log_cb(ws_default_log_cb);
+			ws_set_log_level(-1);
+		}
+		else
+		{
+			count = atoi(argv[i]);
+		}
+	}
+
+	if (bench_run("ttfm_tls13_resume", count, 0, 0)
+	 || bench_run("ttfm_tls13_early_data", count, 1, 0)
+	 || bench_run("ttfm_tls13_early_data_rejected", count, 1, 1))
+	{
+		return -1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,315 @@
+//
+// Measures the effect of the TLS record sizing policy, see
+// ws_set_tls_record_policy. Runs against an in-process TLS echo server:
+//
+//   idle   - Latency of small messages sent after an idle period.
+//   mixed  - Latency of a small message queued right after a bulk message.
+//   bulk   - Throughput of back to back large messages.
+//
+// Each is run with the policy disabled and enabled.
+//
+
+#include <libws.h>
+#include <libws_log.h>
+#include <libws_private.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <event2/event.h>
+#include "libws_bench_helpers.h"
+#include "libws_test_server.h"
+
+typedef enum bench_mode_e
+{
+	BENCH_IDLE,
+	BENCH_MIXED,
+	BENCH_BULK
+} bench_mode_t;
+
+typedef struct bench_state_s
+{
+	ws_base_t base;
+	ws_t ws;
+	bench_mode_t mode;
+	struct event *timer;
+	struct timeval gap;
+	char *small_msg;
+	size_t small_size;
+	char *bulk_msg;
+	size_t bulk_size;
+	uint64_t *samples;
+	size_t count;
+	size_t done;
+	size_t received;
+	uint64_t start;
+	uint64_t elapsed;
+	int failed;
+} bench_state_t;
+
+static void send_next(ws_t ws, bench_state_t *state)
+{
+	state->start = libws_bench_now_ns();
+
+	if (state->mode == BENCH_MIXED)
+	{
+		ws_send_msg_ex(ws, state->bulk_msg, state->bulk_size, 1);
+	}
+
+	ws_send_msg_ex(ws, state->small_msg, state->small_size, 1);
+}
+
+static void ontimer(evutil_socket_t fd, short what, void *arg)
+{
+	bench_state_t *state = (bench_state_t *)arg;
+	send_next(state->ws, state);
+}
+
+static void onmsg(ws_t ws, char *msg, uint64_t len, int binary, void *arg)
+{
+	bench_state_t *state = (bench_state_t *)arg;
+
+	if (state->mode == BENCH_BULK)
+	{
+		if (++state->received == state->count)
+		{
+			state->elapsed = libws_bench_now_ns() - state->start;
+			ws_close(ws);
+		}
+
+		return;
+	}
+
+	// Only time the small message.
+	if (len != state->small_size)
+		return;
+
+	state->samples[state->done++] = libws_bench_now_ns() - state->start;
+
+	if (state->done == state->count)
+	{
+		ws_close(ws);
+		return;
+	}
+
+	evtimer_add(state->timer, &state->gap);
+}
+
+static void onconnect(ws_t ws, void *arg)
+{
+	size_t i;
+	bench_state_t *state = (bench_state_t *)arg;
+
+	if (state->mode == BENCH_BULK)
+	{
+		state->start = libws_bench_now_ns();
+
+		for (i = 0; i < state->count; i++)
+		{
+			ws_send_msg_ex(ws, state->bulk_msg, state->bulk_size, 1);
+		}
+
+		return;
+	}
+
+	send_next(ws, state);
+}
+
+static void onclose(ws_t ws, ws_close_status_t status,
+			const char *reason, size_t reason_len, void *arg)
+{
+	bench_state_t *state = (bench_state_t *)arg;
+
+	if ((state->mode == BENCH_BULK)
+		? (state->received != state->count)
+		: (state->done != state->count))
+	{
+		fprintf(stderr, "Connection closed early: %d %s\n", status, reason);
+		state->failed = 1;
+	}
+
+	ws_base_quit(state->base, 1);
+}
+
+static int run(bench_state_t *state, int port, int policy)
+{
+	int ret = 0;
+	ws_t ws = NULL;
+	struct timeval idle = { 0, 0 };
+
+	state->done = 0;
+	state->received = 0;
+	state->failed = 0;
+
+	if (ws_init(&ws, state->base))
+	{
+		fprintf(stderr, "Failed to init websocket state.\n");
+		return -1;
+	}
+
+	ws_set_onconnect_cb(ws, onconnect, state);
+	ws_set_onmsg_cb(ws, onmsg, state);
+	ws_set_onclose_cb(ws, onclose, state);
+	ws_set_ssl_state(ws, LIBWS_SSL_SELFSIGNED);
+
+	if (policy)
+	{
+		// Consider anything longer than half the gap between
+		// messages as idle.
+		idle.tv_usec = (state->gap.tv_sec * 1000000 + state->gap.tv_usec) / 2;
+
+		if (ws_set_tls_record_policy(ws, WS_DEFAULT_TLS_RECORD_SMALL,
+			WS_DEFAULT_TLS_RECORD_LARGE, WS_DEFAULT_TLS_RECORD_RAMP, idle))
+		{
+			fprintf(stderr, "Failed to set TLS record policy.\n");
+			ret = -1;
+			goto fail;
+		}
+	}
+
+	state->ws = ws;
+	state->timer = evtimer_new(state->base->ev_base, ontimer, state);
+
+	if (ws_connect(ws, "localhost", port, ""))
+	{
+		fprintf(stderr, "Failed to connect to localhost:%d\n", port);
+		ret = -1;
+		goto fail;
+	}
+
+	ws_base_service_blocking(state->base);
+
+	if (state->failed)
+	{
+		ret = -1;
+	}
+
+fail:
+	if (state->timer)
+	{
+		event_free(state->timer);
+		state->timer = NULL;
+	}
+
+	ws_destroy(&ws);
+	return ret;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [--log] [count] [small size] [bulk size]\n",
+			prog);
+}
+
+int main(int argc, char **argv)
+{
+	int ret = 0;
+	int i;
+	int arg = 0;
+	int policy;
+	char name[64];
+	bench_state_t state;
+	libws_test_server_t *srv = NULL;
+	size_t count = 500;
+	size_t bulk_count;
+
+	memset(&state, 0, sizeof(state));
+	state.small_size = 1000;
+	state.bulk_size = 64 * 1024;
+	state.gap.tv_usec = 20000;
+
+	for (i = 1; i < argc; i++)
+	{
+		if (!strcmp(argv[i], "--log"))
+		{
+			ws_set_log_cb(ws_default_log_cb);
+			ws_set_log_level(-1);
+		}
+		else if (!strcmp(argv[i], "--help"))
+		{
+			usage(argv[0]);
+			return 0;
+		}
+		else
+		{
+			switch (arg++)
+			{
+				case 0: count = (size_t)atoi(argv[i]); break;
+				case 1: state.small_size = (size_t)atoi(argv[i]); break;
+				case 2: state.bulk_size = (size_t)atoi(argv[i]); break;
+				default: usage(argv[0]); return -1;
+			}
+		}
+	}
+
+	if (ws_global_init(&state.base))
+	{
+		fprintf(stderr, "Failed to init global state.\n");
+		return -1;
+	}
+
+	if (!(srv = libws_test_server_new(state.base->ev_base, 1)))
+	{
+		fprintf(stderr, "Failed to start test server.\n");
+		ret = -1;
+		goto fail;
+	}
+
+	state.small_msg = calloc(1, state.small_size);
+	state.bulk_msg = calloc(1, state.bulk_size);
+	state.samples = calloc(count, sizeof(uint64_t));
+
+	if (!state.small_msg || !state.bulk_msg || !state.samples)
+	{
+		fprintf(stderr, "Out of memory.\n");
+		ret = -1;
+		goto fail;
+	}
+
+	// Transfer about 256 MB in the bulk test.
+	bulk_count = (256 * 1024 * 1024) / state.bulk_size;
+
+	for (policy = 0; policy <= 1; policy++)
+	{
+		state.mode = BENCH_IDLE;
+		state.count = count;
+
+		if ((ret = run(&state, libws_test_server_get_port(srv), policy)))
+			goto fail;
+
+		snprintf(name, sizeof(name), "tls_record_idle_%s",
+				policy ? "policy" : "default");
+		libws_bench_report_latency(name, state.samples, state.count);
+
+		state.mode = BENCH_MIXED;
+
+		if ((ret = run(&state, libws_test_server_get_port(srv), policy)))
+			goto fail;
+
+		snprintf(name, sizeof(name), "tls_record_mixed_%s",
+				policy ? "policy" : "default");
+		libws_bench_report_latency(name, state.samples, state.count);
+
+		state.mode = BENCH_BULK;
+		state.count = bulk_count;
+
+		if ((ret = run(&state, libws_test_server_get_port(srv), policy)))
+			goto fail;
+
+		printf("tls_record_bulk_%s: %.1f MB/s\n",
+				policy ? "policy" : "default",
+				((double)bulk_count * state.bulk_size / (1024 * 1024))
+				/ ((double)state.elapsed / 1e9));
+	}
+
+fail:
+	if (srv)
+	{
+		libws_test_server_free(srv);
+	}
+
+	free(state.small_msg);
+	free(state.bulk_msg);
+	free(state.samples);
+	ws_global_destroy(&state.base);
+	return ret;
+}
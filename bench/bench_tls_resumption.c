@@ -0,0 +1,157 @@
+//
+// Measures how many TLS connections per second we can open against
+// a server, with and without TLS session resumption.
+//
+// The server does not need to speak websocket, any TLS server replying
+// to a HTTP request will do, for instance:
+//
+//   openssl s_server -accept 9443 -cert cert.pem -key key.pem -www
+//
+// See tls_resumption.sh.
+//
+
+#include <libws.h>
+#include <libws_log.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "libws_bench_helpers.h"
+
+typedef struct bench_state_s
+{
+	ws_base_t base;
+	int done;
+} bench_state_t;
+
+static void onclose(ws_t ws, ws_close_status_t status,
+			const char *reason, size_t reason_len, void *arg)
+{
+	bench_state_t *state = (bench_state_t *)arg;
+	state->done = 1;
+	ws_base_quit(state->base, 1);
+}
+
+static void onconnect(ws_t ws, void *arg)
+{
+	ws_close(ws);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [--no-resume] [--early-data] [--log] "
+					"[host] [port] [count]\n",
+			prog);
+}
+
+int main(int argc, char **argv)
+{
+	int ret = 0;
+	int i;
+	int arg = 0;
+	ws_t ws = NULL;
+	bench_state_t state;
+	char *server = "localhost";
+	int port = 9443;
+	int count = 1000;
+	int resume = 1;
+	int resumed = 0;
+	int early_data = 0;
+	int accepted = 0;
+	uint64_t start;
+	uint64_t elapsed;
+
+	memset(&state, 0, sizeof(state));
+
+	for (i = 1; i < argc; i++)
+	{
+		if (!strcmp(argv[i], "--no-resume"))
+		{
+			resume = 0;
+		}
+		else if (!strcmp(argv[i], "--early-data"))
+		{
+			early_data = 1;
+		}
+		else if (!strcmp(argv[i], "--log"))
+		{
+			ws_set_log_cb(ws_default_log_cb);
+			ws_set_log_level(-1);
+		}
+		else if (!strcmp(argv[i], "--help"))
+		{
+			usage(argv[0]);
+			return 0;
+		}
+		else
+		{
+			switch (arg++)
+			{
+				case 0: server = argv[i]; break;
+				case 1: port = atoi(argv[i]); break;
+				case 2: count = atoi(argv[i]); break;
+				default: usage(argv[0]); return -1;
+			}
+		}
+	}
+
+	if (ws_global_init(&state.base))
+	{
+		fprintf(stderr, "Failed to init global state.\n");
+		return -1;
+	}
+
+	if (!resume)
+	{
+		ws_base_set_ssl_session_cache(state.base, 0);
+	}
+
+	if (ws_init(&ws, state.base))
+	{
+		fprintf(stderr, "Failed to init websocket state.\n");
+		ret = -1;
+		goto fail;
+	}
+
+	ws_set_onconnect_cb(ws, onconnect, NULL);
+	ws_set_onclose_cb(ws, onclose, &state);
+	ws_set_ssl_state(ws, LIBWS_SSL_SELFSIGNED);
+	ws_set_ssl_early_data(ws, early_data);
+
+	start = libws_bench_now_ns();
+
+	for (i = 0; i < count; i++)
+	{
+		state.done = 0;
+
+		if (ws_connect(ws, server, port, ""))
+		{
+			fprintf(stderr, "Failed to connect to %s:%d\n", server, port);
+			ret = -1;
+			goto fail;
+		}
+
+		ws_base_service_blocking(state.base);
+
+		if (!state.done)
+		{
+			fprintf(stderr, "Connection %d never closed\n", i);
+			ret = -1;
+			goto fail;
+		}
+
+		resumed += ws_is_ssl_session_reused(ws);
+		accepted += ws_is_ssl_early_data_accepted(ws);
+	}
+
+	elapsed = libws_bench_now_ns() - start;
+
+	libws_bench_report(resume ? "tls_connect_resume" : "tls_connect_full",
+						count, elapsed);
+	printf("%d of %d sessions resumed, %d early data accepted\n",
+			resumed, count, accepted);
+
+fail:
+	ws_destroy(&ws);
+	ws_global_destroy(&state.base);
+	return ret;
+}
@@ -0,0 +1,517 @@
+//
+// Microbenchmarks for the protocol hot paths, run each release and
+// compared with --json:
+//
+//   mask_payload/<size>/align<n>   - ws_mask_payload on a buffer that
+//                                    starts n bytes past an alignment.
+//   utf8_validate/<text>           - ws_utf8_validate on 64kb of ASCII,
+//                                    mixed latin and CJK text.
+//   pack_header/<len>              - ws_pack_header for the 7, 16 and
+//   unpack_header/<len>              64 bit payload lengths, masked.
+//   handshake_reply                - _ws_read_server_handshake_reply on
+//                                    a complete upgrade response.
+//   read_websocket/<frames>        - _ws_read_websocket on many small or
+//                                    a few huge frames, per frame.
+//   read_websocket_provided/<frames> - The same, into a buffer from
+//                                    ws_set_recv_buffer_provider.
+//
+// Every benchmark runs until it took at least --min-time milliseconds.
+//
+
+#include <libws.h>
+#include <libws_log.h>
+#include <libws_private.h>
+#include <libws_header.h>
+#include <libws_handshake.h>
+#include <libws_utf8.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include "libws_bench_helpers.h"
+
+typedef void (*bench_f)(void *arg, uint64_t iterations);
+
+static const char *filter;
+static uint64_t min_time_ns = 200 * 1000000ULL;
+
+// Results that are otherwise unused, so they're not optimized away.
+static volatile uint64_t sink;
+
+///
+/// Runs a benchmark enough times to take at least #min_time_ns.
+///
+/// @param[in] name             Name of the benchmark.
+/// @param[in] run              Runs a number of iterations.
+/// @param[in] arg              Passed to run.
+/// @param[in] ops_per_iter     Operations in each iteration.
+/// @param[in] bytes_per_iter   Bytes processed by each iteration.
+///
+static void bench_run(const char *name, bench_f run, void *arg,
+					uint64_t ops_per_iter, uint64_t bytes_per_iter)
+{
+	uint64_t n = 1;
+	uint64_t start;
+	uint64_t elapsed;
+	uint64_t scale;
+
+	if (filter && !strstr(name, filter))
+		return;
+
+	for (;;)
+	{
+		start = libws_bench_now_ns();
+		run(arg, n);
+		elapsed = libws_bench_now_ns() - start;
+
+		if (elapsed >= min_time_ns)
+			break;
+
+		// Aim a bit past the minimum time, at most 100 times more.
+		scale = elapsed ? (min_time_ns + min_time_ns / 5) / elapsed : 100;
+		n *= (scale < 2) ? 2 : (scale > 100) ? 100 : scale;
+	}
+
+	libws_bench_report_bytes(name, n * ops_per_iter,
+							n * bytes_per_iter, elapsed);
+}
+
+//
+// ws_mask_payload
+//
+
+typedef struct mask_arg_s
+{
+	char *buf;
+	size_t len;
+} mask_arg_t;
+
+static void run_mask(void *arg, uint64_t n)
+{
+	mask_arg_t *m = (mask_arg_t *)arg;
+	uint64_t i;
+
+	for (i = 0; i < n; i++)
+	{
+		ws_mask_payload(0x37fa213d, m->buf, m->len);
+	}
+
+	sink += (unsigned char)m->buf[0];
+}
+
+static int bench_mask()
+{
+	size_t sizes[] = { 16, 125, 1024, 64 * 1024, 1024 * 1024 };
+	size_t aligns[] = { 0, 1, 3 };
+	size_t s;
+	size_t a;
+	char name[64];
+	char *mem;
+	mask_arg_t m;
+
+	if (!(mem = malloc(1024 * 1024 + 64)))
+		return -1;
+
+	memset(mem, 'x', 1024 * 1024 + 64);
+
+	for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+	{
+		for (a = 0; a < sizeof(aligns) / sizeof(aligns[0]); a++)
+		{
+			// Malloc returns at least 8 byte aligned memory.
+			m.buf = mem + aligns[a];
+			m.len = sizes[s];
+
+			snprintf(name, sizeof(name), "mask_payload/%u/align%u",
+					(unsigned)sizes[s], (unsigned)aligns[a]);
+			bench_run(name, run_mask, &m, 1, sizes[s]);
+		}
+	}
+
+	free(mem);
+	return 0;
+}
+
+//
+// ws_utf8_validate
+//
+
+typedef struct utf8_arg_s
+{
+	char *buf;
+	size_t len;
+} utf8_arg_t;
+
+static void run_utf8(void *arg, uint64_t n)
+{
+	utf8_arg_t *u = (utf8_arg_t *)arg;
+	ws_utf8_state_t state;
+	uint64_t i;
+
+	for (i = 0; i < n; i++)
+	{
+		state = WS_UTF8_ACCEPT;
+		sink += ws_utf8_validate(&state, u->buf, u->len);
+	}
+}
+
+static int bench_utf8()
+{
+	const char *texts[][2] =
+	{
+		{ "ascii", "The quick brown fox jumps over the lazy dog. " },
+		{ "mixed", "Gr\xc3\xb6\xc3\x9f" "e, \xc3\xa5ngstr\xc3\xb6m och "
+					"caf\xc3\xa9 \xe2\x82\xac" "5 - na\xc3\xafve. " },
+		{ "cjk", "\xe6\x97\xa5\xe6\x9c\xac\xe8\xaa\x9e\xe3\x81\xae"
+				"\xe3\x83\x86\xe3\x82\xad\xe3\x82\xb9\xe3\x83\x88\xe3\x80\x82"
+				"\xe4\xb8\xad\xe6\x96\x87\xe6\x96\x87\xe6\x9c\xac\xe3\x80\x82" }
+	};
+	size_t t;
+	size_t len;
+	size_t text_len;
+	char name[64];
+	utf8_arg_t u;
+
+	if (!(u.buf = malloc(64 * 1024)))
+		return -1;
+
+	for (t = 0; t < sizeof(texts) / sizeof(texts[0]); t++)
+	{
+		// Whole copies of the text only, so it's all valid.
+		text_len = strlen(texts[t][1]);
+
+		for (len = 0; (len + text_len) <= 64 * 1024; len += text_len)
+		{
+			memcpy(&u.buf[len], texts[t][1], text_len);
+		}
+
+		u.len = len;
+
+		snprintf(name, sizeof(name), "utf8_validate/%s", texts[t][0]);
+		bench_run(name, run_utf8, &u, 1, u.len);
+	}
+
+	free(u.buf);
+	return 0;
+}
+
+//
+// ws_pack_header and ws_unpack_header
+//
+
+typedef struct header_arg_s
+{
+	ws_header_t h;
+	uint8_t buf[WS_HDR_MAX_SIZE];
+	size_t len;
+} header_arg_t;
+
+static void run_pack_header(void *arg, uint64_t n)
+{
+	header_arg_t *h = (header_arg_t *)arg;
+	uint64_t i;
+	size_t len = 0;
+
+	for (i = 0; i < n; i++)
+	{
+		h->h.mask = (uint32_t)i;
+		ws_pack_header(&h->h, h->buf, sizeof(h->buf), &len);
+	}
+
+	sink += len + h->buf[0];
+}
+
+static void run_unpack_header(void *arg, uint64_t n)
+{
+	header_arg_t *h = (header_arg_t *)arg;
+	ws_header_t out;
+	uint64_t i;
+	size_t len = 0;
+
+	for (i = 0; i < n; i++)
+	{
+		sink += ws_unpack_header(&out, &len, h->buf, h->len);
+	}
+
+	sink += len + out.payload_len;
+}
+
+static int bench_header()
+{
+	uint64_t lens[] = { 125, 16 * 1024, 1024 * 1024 };
+	size_t l;
+	char name[64];
+	header_arg_t h;
+
+	for (l = 0; l < sizeof(lens) / sizeof(lens[0]); l++)
+	{
+		memset(&h, 0, sizeof(h));
+		h.h.fin = 1;
+		h.h.opcode = WS_OPCODE_BINARY_0X2;
+		h.h.mask_bit = 1;
+		h.h.mask = 0x37fa213d;
+		h.h.payload_len = lens[l];
+
+		snprintf(name, sizeof(name), "pack_header/%llu",
+				(unsigned long long)lens[l]);
+		bench_run(name, run_pack_header, &h, 1, 0);
+
+		h.h.mask = 0x37fa213d;
+		ws_pack_header(&h.h, h.buf, sizeof(h.buf), &h.len);
+
+		snprintf(name, sizeof(name), "unpack_header/%llu",
+				(unsigned long long)lens[l]);
+		bench_run(name, run_unpack_header, &h, 1, 0);
+	}
+
+	return 0;
+}
+
+//
+// _ws_read_server_handshake_reply
+//
+
+typedef struct reply_arg_s
+{
+	ws_t ws;
+	struct evbuffer *in;
+	char reply[256];
+	size_t len;
+	int failed;
+} reply_arg_t;
+
+static void run_reply(void *arg, uint64_t n)
+{
+	reply_arg_t *r = (reply_arg_t *)arg;
+	uint64_t i;
+
+	for (i = 0; i < n; i++)
+	{
+		r->ws->connect_state = WS_CONNECT_STATE_SENT_REQ;
+		evbuffer_add(r->in, r->reply, r->len);
+
+		if (_ws_read_server_handshake_reply(r->ws, r->in)
+			!= WS_PARSE_STATE_SUCCESS)
+		{
+			r->failed = 1;
+			evbuffer_drain(r->in, evbuffer_get_length(r->in));
+		}
+	}
+}
+
+static int bench_handshake_reply(ws_base_t base)
+{
+	int ret = 0;
+	char key_hash[64];
+	reply_arg_t r;
+
+	memset(&r, 0, sizeof(r));
+
+	if (ws_init(&r.ws, base)
+		|| ws_add_subprotocol(r.ws, "echo")
+		|| _ws_generate_handshake_key(r.ws)
+		|| _ws_calculate_key_hash(r.ws->handshake_key_base64,
+								key_hash, sizeof(key_hash))
+		|| !(r.in = evbuffer_new()))
+	{
+		ret = -1;
+		goto fail;
+	}
+
+	r.len = (size_t)snprintf(r.reply, sizeof(r.reply),
+					"HTTP/1.1 101 Switching Protocols\r\n"
+					"Upgrade: websocket\r\n"
+					"Connection: Upgrade\r\n"
+					"Sec-WebSocket-Accept: %s\r\n"
+					"Sec-WebSocket-Protocol: echo\r\n"
+					"\r\n", key_hash);
+
+	bench_run("handshake_reply", run_reply, &r, 1, r.len);
+
+	if (r.failed)
+	{
+		fprintf(stderr, "Failed to parse the handshake reply.\n");
+		ret = -1;
+	}
+
+fail:
+	if (r.in) evbuffer_free(r.in);
+	ws_destroy(&r.ws);
+
+	return ret;
+}
+
+//
+// _ws_read_websocket
+//
+
+typedef struct frames_arg_s
+{
+	ws_t ws;
+	struct evbuffer *in;
+	char *data;
+	size_t len;
+	uint64_t msgs;
+	char *dst;				///< Handed out for every frame when provided.
+} frames_arg_t;
+
+static void onmsg(ws_t ws, char *msg, uint64_t len, int binary, void *arg)
+{
+	((frames_arg_t *)arg)->msgs++;
+}
+
+static char *onalloc(ws_t ws, uint64_t *len, int binary, void *arg)
+{
+	return ((frames_arg_t *)arg)->dst;
+}
+
+static void oncommit(ws_t ws, char *buf, uint64_t len, int binary,
+					int msg_end, void *arg)
+{
+	((frames_arg_t *)arg)->msgs += msg_end;
+}
+
+static void run_frames(void *arg, uint64_t n)
+{
+	frames_arg_t *f = (frames_arg_t *)arg;
+	uint64_t i;
+
+	for (i = 0; i < n; i++)
+	{
+		// As if it was all read from the socket at once.
+		evbuffer_add_reference(f->in, f->data, f->len, NULL, NULL);
+		_ws_read_websocket(f->ws, f->in);
+	}
+}
+
+static int bench_frames(ws_base_t base, const char *name,
+						size_t count, size_t payload_len, int provided)
+{
+	int ret = 0;
+	size_t i;
+	size_t header_len;
+	uint8_t header[WS_HDR_MAX_SIZE];
+	ws_header_t h;
+	frames_arg_t f;
+
+	memset(&f, 0, sizeof(f));
+
+	memset(&h, 0, sizeof(h));
+	h.fin = 1;
+	h.opcode = WS_OPCODE_BINARY_0X2;
+	h.payload_len = payload_len;
+	ws_pack_header(&h, header, sizeof(header), &header_len);
+
+	f.len = count * (header_len + payload_len);
+
+	if (!(f.data = malloc(f.len))
+		|| !(f.dst = malloc(payload_len))
+		|| ws_init(&f.ws, base)
+		|| !(f.ws->bev = bufferevent_socket_new(base->ev_base, -1, 0))
+		|| !(f.in = evbuffer_new()))
+	{
+		ret = -1;
+		goto fail;
+	}
+
+	for (i = 0; i < count; i++)
+	{
+		memcpy(&f.data[i * (header_len + payload_len)], header, header_len);
+		memset(&f.data[i * (header_len + payload_len) + header_len],
+				'x', payload_len);
+	}
+
+	ws_set_onmsg_cb(f.ws, onmsg, &f);
+
+	if (provided)
+	{
+		ws_set_recv_buffer_provider(f.ws, onalloc, oncommit, &f);
+	}
+
+	bench_run(name, run_frames, &f, count, f.len);
+
+	if (f.msgs % count)
+	{
+		fprintf(stderr, "Got %llu messages, not a multiple of %u.\n",
+				(unsigned long long)f.msgs, (unsigned)count);
+		ret = -1;
+	}
+
+fail:
+	if (f.in) evbuffer_free(f.in);
+	if (f.data) free(f.data);
+	if (f.dst) free(f.dst);
+	ws_destroy(&f.ws);
+
+	return ret;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [--log] [--json] [--min-time ms] [filter]\n"
+					"  --json       Write the results as JSON.\n"
+					"  --min-time   Least time to run each benchmark (%u ms).\n"
+					"  filter       Only run benchmarks with this in the name.\n",
+					prog, (unsigned)(min_time_ns / 1000000));
+}
+
+int main(int argc, char **argv)
+{
+	int ret = 0;
+	int i;
+	ws_base_t base = NULL;
+
+	for (i = 1; i < argc; i++)
+	{
+		if (!strcmp(argv[i], "--log"))
+		{
+			ws_set_log_cb(ws_default_log_cb);
+			ws_set_log_level(-1);
+		}
+		else if (!strcmp(argv[i], "--json"))
+		{
+			libws_bench_set_json(stdout);
+		}
+		else if (!strcmp(argv[i], "--min-time") && (i + 1 < argc))
+		{
+			min_time_ns = (uint64_t)atoi(argv[++i]) * 1000000ULL;
+		}
+		else if (!strcmp(argv[i], "--help") || (argv[i][0] == '-'))
+		{
+			usage(argv[0]);
+			return 0;
+		}
+		else
+		{
+			filter = argv[i];
+		}
+	}
+
+	if (ws_global_init(&base))
+	{
+		fprintf(stderr, "Failed to init global state.\n");
+		return -1;
+	}
+
+	if (bench_mask()
+		|| bench_utf8()
+		|| bench_header()
+		|| bench_handshake_reply(base)
+		|| bench_frames(base, "read_websocket/1024x16b", 1024, 16, 0)
+		|| bench_frames(base, "read_websocket/1024x125b", 1024, 125, 0)
+		|| bench_frames(base, "read_websocket/4x1mb", 4, 1024 * 1024, 0)
+		|| bench_frames(base, "read_websocket_provided/1024x125b",
+						1024, 125, 1)
+		|| bench_frames(base, "read_websocket_provided/4x1mb",
+						4, 1024 * 1024, 1))
+	{
+		fprintf(stderr, "Benchmark failed.\n");
+		ret = -1;
+	}
+
+	libws_bench_finish();
+	ws_global_destroy(&base);
+
+	return ret;
+}
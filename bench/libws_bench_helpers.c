@@ -0,0 +1,308 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+#else
+#include <time.h>
+#endif
+#include "libws_bench_helpers.h"
+
+uint64_t libws_bench_now_ns()
+{
+	#ifdef _WIN32
+	LARGE_INTEGER freq;
+	LARGE_INTEGER now;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&now);
+	return (uint64_t)((double)now.QuadPart * 1e9 / (double)freq.QuadPart);
+	#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL) + (uint64_t)ts.tv_nsec;
+	#endif
+}
+
+static FILE *_libws_bench_json;
+static int _libws_bench_json_count;
+
+void libws_bench_set_json(FILE *out)
+{
+	_libws_bench_json = out;
+	_libws_bench_json_count = 0;
+
+	if (out)
+	{
+		fprintf(out, "{\n  \"benchmarks\": [");
+	}
+}
+
+void libws_bench_finish()
+{
+	if (_libws_bench_json)
+	{
+		fprintf(_libws_bench_json, "\n  ]\n}\n");
+		fflush(_libws_bench_json);
+		_libws_bench_json = NULL;
+	}
+}
+
+///
+/// Starts a JSON object for a result, the names are
+/// ours so nothing needs to be escaped.
+///
+static FILE *_libws_bench_json_begin(const char *name)
+{
+	FILE *out = _libws_bench_json;
+
+	fprintf(out, "%s\n    {\"name\": \"%s\"",
+			_libws_bench_json_count++ ? "," : "", name);
+
+	return out;
+}
+
+void libws_bench_report(const char *name, uint64_t ops, uint64_t elapsed_ns)
+{
+	libws_bench_report_bytes(name, ops, 0, elapsed_ns);
+}
+
+void libws_bench_report_bytes(const char *name, uint64_t ops,
+							uint64_t bytes, uint64_t elapsed_ns)
+{
+	FILE *out;
+	double secs = (double)elapsed_ns / 1e9;
+	double ns_per_op = ops ? ((double)elapsed_ns / (double)ops) : 0.0;
+	double ops_per_sec = (secs > 0.0) ? ((double)ops / secs) : 0.0;
+	double gb_per_sec = (secs > 0.0) ? ((double)bytes / secs / 1e9) : 0.0;
+
+	if (_libws_bench_json)
+	{
+		out = _libws_bench_json_begin(name);
+		fprintf(out, ", \"ops\": %llu, \"elapsed_ns\": %llu, "
+					"\"ns_per_op\": %.3f, \"ops_per_sec\": %.1f",
+				(unsigned long long)ops, (unsigned long long)elapsed_ns,
+				ns_per_op, ops_per_sec);
+
+		if (bytes)
+		{
+			fprintf(out, ", \"bytes\": %llu, \"gb_per_sec\": %.4f",
+					(unsigned long long)bytes, gb_per_sec);
+		}
+
+		fprintf(out, "}");
+		return;
+	}
+
+	printf("%-32s %10llu ops %10.3f ms %12.1f ns/op %12.1f ops/s",
+		name,
+		(unsigned long long)ops,
+		(double)elapsed_ns / 1e6,
+		ns_per_op,
+		ops_per_sec);
+
+	if (bytes)
+	{
+		printf(" %8.3f GB/s", gb_per_sec);
+	}
+
+	printf("\n");
+}
+
+void libws_bench_report_value(const char *name, double value,
+							const char *unit)
+{
+	if (_libws_bench_json)
+	{
+		fprintf(_libws_bench_json_begin(name),
+				", \"value\": %.1f, \"unit\": \"%s\"}", value, unit);
+		return;
+	}
+
+	printf("%-32s %14.1f %s\n", name, value, unit);
+}
+
+static int _libws_bench_cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+	return (x < y) ? -1 : (x > y);
+}
+
+void libws_bench_report_latency(const char *name,
+								uint64_t *samples, size_t count)
+{
+	if (!count)
+	{
+		if (_libws_bench_json)
+			fprintf(_libws_bench_json_begin(name), ", \"samples\": 0}");
+		else
+			printf("%-32s no samples\n", name);
+		return;
+	}
+
+	qsort(samples, count, sizeof(uint64_t), _libws_bench_cmp_u64);
+
+	if (_libws_bench_json)
+	{
+		fprintf(_libws_bench_json_begin(name),
+				", \"samples\": %llu, \"min_us\": %.1f, \"p50_us\": %.1f, "
+				"\"p99_us\": %.1f, \"max_us\": %.1f}",
+				(unsigned long long)count,
+				samples[0] / 1e3,
+				samples[count / 2] / 1e3,
+				samples[(count * 99) / 100] / 1e3,
+				samples[count - 1] / 1e3);
+		return;
+	}
+
+	printf("%-32s %10llu samples  min %9.1f us  p50 %9.1f us  "
+			"p99 %9.1f us  max %9.1f us\n",
+		name,
+		(unsigned long long)count,
+		samples[0] / 1e3,
+		samples[count / 2] / 1e3,
+		samples[(count * 99) / 100] / 1e3,
+		samples[count - 1] / 1e3);
+}
+
+//
+// The histogram has buckets for each power of two, each split into
+// half as many sub buckets as the first bucket. The first bucket covers
+// 0 to 2047 exactly, and every value is recorded within 1 / 1024 of it.
+//
+#define LIBWS_BENCH_HIST_SUB_BITS 11
+#define LIBWS_BENCH_HIST_SUB_COUNT (1 << LIBWS_BENCH_HIST_SUB_BITS)
+#define LIBWS_BENCH_HIST_SUB_HALF (LIBWS_BENCH_HIST_SUB_COUNT / 2)
+#define LIBWS_BENCH_HIST_MAX_BITS 41
+#define LIBWS_BENCH_HIST_COUNTS \
+	((LIBWS_BENCH_HIST_MAX_BITS - LIBWS_BENCH_HIST_SUB_BITS + 2) \
+		* LIBWS_BENCH_HIST_SUB_HALF)
+
+struct libws_bench_hist_s
+{
+	uint64_t total;
+	uint64_t min;
+	uint64_t max;
+	uint64_t counts[LIBWS_BENCH_HIST_COUNTS];
+};
+
+libws_bench_hist_t *libws_bench_hist_new()
+{
+	libws_bench_hist_t *hist;
+
+	if (!(hist = (libws_bench_hist_t *)calloc(1, sizeof(*hist))))
+		return NULL;
+
+	hist->min = (uint64_t)-1;
+
+	return hist;
+}
+
+void libws_bench_hist_free(libws_bench_hist_t *hist)
+{
+	free(hist);
+}
+
+static size_t _libws_bench_hist_index(uint64_t value)
+{
+	unsigned int shift = 0;
+
+	if (value >= ((uint64_t)1 << LIBWS_BENCH_HIST_MAX_BITS))
+		value = ((uint64_t)1 << LIBWS_BENCH_HIST_MAX_BITS) - 1;
+
+	// Shift the value into the upper half of the sub buckets.
+	while ((value >> shift) >= LIBWS_BENCH_HIST_SUB_COUNT)
+		shift++;
+
+	return ((size_t)shift * LIBWS_BENCH_HIST_SUB_HALF)
+			+ (size_t)(value >> shift);
+}
+
+static uint64_t _libws_bench_hist_highest(size_t index)
+{
+	unsigned int shift;
+
+	if (index < LIBWS_BENCH_HIST_SUB_COUNT)
+		return index;
+
+	shift = (unsigned int)(index / LIBWS_BENCH_HIST_SUB_HALF) - 1;
+
+	return (((uint64_t)index - ((uint64_t)shift * LIBWS_BENCH_HIST_SUB_HALF))
+			<< shift) + (((uint64_t)1 << shift) - 1);
+}
+
+void libws_bench_hist_record(libws_bench_hist_t *hist, uint64_t value)
+{
+	hist->counts[_libws_bench_hist_index(value)]++;
+	hist->total++;
+
+	if (value < hist->min) hist->min = value;
+	if (value > hist->max) hist->max = value;
+}
+
+uint64_t libws_bench_hist_percentile(libws_bench_hist_t *hist,
+									double percentile)
+{
+	size_t i;
+	uint64_t seen = 0;
+	uint64_t wanted;
+
+	if (!hist->total)
+		return 0;
+
+	wanted = (uint64_t)(((percentile / 100.0) * (double)hist->total) + 0.5);
+
+	if (wanted < 1)
+		wanted = 1;
+
+	for (i = 0; i < LIBWS_BENCH_HIST_COUNTS; i++)
+	{
+		seen += hist->counts[i];
+
+		if (seen >= wanted)
+		{
+			// Don't claim more than was actually seen.
+			return (_libws_bench_hist_highest(i) < hist->max)
+					? _libws_bench_hist_highest(i) : hist->max;
+		}
+	}
+
+	return hist->max;
+}
+
+void libws_bench_report_hist(const char *name, libws_bench_hist_t *hist)
+{
+	if (!hist->total)
+	{
+		if (_libws_bench_json)
+			fprintf(_libws_bench_json_begin(name), ", \"samples\": 0}");
+		else
+			printf("%-32s no samples\n", name);
+		return;
+	}
+
+	if (_libws_bench_json)
+	{
+		fprintf(_libws_bench_json_begin(name),
+				", \"samples\": %llu, \"min_us\": %.1f, \"p50_us\": %.1f, "
+				"\"p99_us\": %.1f, \"p99_9_us\": %.1f, \"max_us\": %.1f}",
+				(unsigned long long)hist->total,
+				hist->min / 1e3,
+				libws_bench_hist_percentile(hist, 50.0) / 1e3,
+				libws_bench_hist_percentile(hist, 99.0) / 1e3,
+				libws_bench_hist_percentile(hist, 99.9) / 1e3,
+				hist->max / 1e3);
+		return;
+	}
+
+	printf("%-32s %10llu samples  min %9.1f us  p50 %9.1f us  "
+			"p99 %9.1f us  p99.9 %9.1f us  max %9.1f us\n",
+		name,
+		(unsigned long long)hist->total,
+		hist->min / 1e3,
+		libws_bench_hist_percentile(hist, 50.0) / 1e3,
+		libws_bench_hist_percentile(hist, 99.0) / 1e3,
+		libws_bench_hist_percentile(hist, 99.9) / 1e3,
+		hist->max / 1e3);
+}
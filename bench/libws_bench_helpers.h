@@ -0,0 +1,110 @@
+
+#ifndef __LIBWS_BENCH_HELPERS_H__
+#define __LIBWS_BENCH_HELPERS_H__
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stddef.h>
+
+///
+/// Gets a monotonic timestamp in nanoseconds.
+///
+uint64_t libws_bench_now_ns();
+
+///
+/// Prints the result of a benchmark run.
+///
+/// @param[in]	name 		Name of the benchmark.
+/// @param[in]	ops 		Number of operations performed.
+/// @param[in]	elapsed_ns 	Time it took to perform them.
+///
+void libws_bench_report(const char *name, uint64_t ops, uint64_t elapsed_ns);
+
+///
+/// Prints the result of a benchmark run that processed data,
+/// including the throughput.
+///
+/// @param[in]	name 		Name of the benchmark.
+/// @param[in]	ops 		Number of operations performed.
+/// @param[in]	bytes 		Number of bytes processed by all of them.
+/// @param[in]	elapsed_ns 	Time it took to perform them.
+///
+void libws_bench_report_bytes(const char *name, uint64_t ops,
+							uint64_t bytes, uint64_t elapsed_ns);
+
+///
+/// Prints min, median, p99 and max of a set of latency samples.
+///
+/// @param[in]	name 		Name of the benchmark.
+/// @param[in]	samples 	Latencies in nanoseconds, will be sorted.
+/// @param[in]	count 		Number of samples.
+///
+void libws_bench_report_latency(const char *name,
+								uint64_t *samples, size_t count);
+
+///
+/// Prints a single measured value, such as memory per connection.
+///
+/// @param[in]	name 		Name of the benchmark.
+/// @param[in]	value 		The value.
+/// @param[in]	unit 		Unit of the value, such as "bytes".
+///
+void libws_bench_report_value(const char *name, double value,
+							const char *unit);
+
+///
+/// A latency histogram in the style of HdrHistogram, values are
+/// recorded with 3 significant digits up to about 36 minutes, in
+/// constant memory no matter how many samples.
+///
+typedef struct libws_bench_hist_s libws_bench_hist_t;
+
+///
+/// Creates an empty histogram.
+///
+/// @returns 	The histogram, or NULL if out of memory.
+///
+libws_bench_hist_t *libws_bench_hist_new();
+
+void libws_bench_hist_free(libws_bench_hist_t *hist);
+
+///
+/// Records a value, usually a latency in nanoseconds.
+///
+void libws_bench_hist_record(libws_bench_hist_t *hist, uint64_t value);
+
+///
+/// Gets the value at a percentile, rounded up to the
+/// highest value equivalent to it.
+///
+/// @param[in]	hist 		The histogram.
+/// @param[in]	percentile 	The percentile, 0 to 100.
+///
+/// @returns 				The value, or 0 if the histogram is empty.
+///
+uint64_t libws_bench_hist_percentile(libws_bench_hist_t *hist,
+									double percentile);
+
+///
+/// Prints min, p50, p99, p99.9 and max of the latencies
+/// recorded in a histogram.
+///
+/// @param[in]	name 		Name of the benchmark.
+/// @param[in]	hist 		Latencies in nanoseconds.
+///
+void libws_bench_report_hist(const char *name, libws_bench_hist_t *hist);
+
+///
+/// Makes the reports write a JSON document instead of text,
+/// finished by #libws_bench_finish.
+///
+/// @param[in]	out 		Where to write it.
+///
+void libws_bench_set_json(FILE *out);
+
+///
+/// Finishes the JSON document, if any.
+///
+void libws_bench_finish();
+
+#endif // __LIBWS_BENCH_HELPERS_H__
@@ -0,0 +1,39 @@
+#!/bin/sh
+#
+# Runs bench_tls_resumption against a local "openssl s_server",
+# first with full handshakes and then with session resumption.
+#
+# Usage: tls_resumption.sh <path to bench_tls_resumption> [count] [port]
+#
+
+BENCH=${1:-./bench_tls_resumption}
+COUNT=${2:-1000}
+PORT=${3:-9443}
+OPENSSL=${OPENSSL:-openssl}
+TMPDIR=$(mktemp -d)
+
+cleanup()
+{
+	[ -n "$SERVER_PID" ] && kill $SERVER_PID 2>/dev/null
+	rm -rf "$TMPDIR"
+}
+
+trap cleanup EXIT
+
+$OPENSSL req -x509 -newkey rsa:2048 -nodes -days 1 -subj "/CN=localhost" \
+	-keyout "$TMPDIR/key.pem" -out "$TMPDIR/cert.pem" >/dev/null 2>&1 || exit 1
+
+$OPENSSL s_server -quiet -accept $PORT -cert "$TMPDIR/cert.pem" \
+	-key "$TMPDIR/key.pem" -www >/dev/null 2>&1 &
+SERVER_PID=$!
+
+# Give the server some time to start listening.
+sleep 1
+
+if ! kill -0 $SERVER_PID 2>/dev/null; then
+	echo "Failed to start openssl s_server on port $PORT"
+	exit 1
+fi
+
+"$BENCH" --no-resume 127.0.0.1 $PORT $COUNT || exit 1
+"$BENCH" 127.0.0.1 $PORT $COUNT || exit 1
@@ -44,6 +44,9 @@
 #include "libws.h"
 #include "libws_handshake.h"
 #include "libws_utf8.h"
+#include "libws_template.h"
+#include "libws_msg.h"
+#include "libws_crypto.h"
 
 void ws_set_memory_functions(ws_malloc_replacement_f malloc_replace,
 							 ws_free_replacement_f free_replace,
@@ -52,6 +55,28 @@ void ws_set_memory_functions(ws_malloc_replacement_f malloc_replace,
 	_ws_set_memory_functions(malloc_replace, free_replace, realloc_replace);
 }
 
+int ws_install_memory_hooks()
+{
+	#ifdef LIBWS_WITH_MEMORY_ACCOUNTING
+	return _ws_install_memory_hooks();
+	#else
+	LIBWS_LOG(LIBWS_ERR, "Compiled without memory accounting");
+	return -1;
+	#endif
+}
+
+static void _ws_base_destroy_slabs(ws_base_t base)
+{
+	// Before the arena blocks, handles give theirs back.
+	_ws_msg_base_destroy(base);
+	_ws_slab_destroy(&base->conn_slab);
+	_ws_slab_destroy(&base->cold_slab);
+	_ws_slab_destroy(&base->arena_blocks);
+	#ifdef LIBWS_WITH_MEMORY_ACCOUNTING
+	_ws_slab_destroy(&base->mem_slab);
+	#endif
+}
+
 int ws_global_init(ws_base_t *base)
 {
 	#ifdef _WIN32
@@ -66,6 +91,13 @@ int ws_global_init(ws_base_t *base)
 
 	LIBWS_LOG(LIBWS_INFO, "Libevent version %s", event_get_version());
 
+	#ifdef LIBWS_WITH_MEMORY_ACCOUNTING
+	_ws_freeze_memory_hooks();
+	#endif
+
+	_ws_crypto_init();
+	LIBWS_LOG(LIBWS_INFO, "SHA-1 backend %s", _ws_sha1_backend_name());
+
 	if (!(*base = (ws_base_s *)_ws_calloc(1, sizeof(ws_base_s))))
 	{
 		LIBWS_LOG(LIBWS_CRIT, "Out of memory!");
@@ -74,6 +106,21 @@ int ws_global_init(ws_base_t *base)
 
 	b = *base;
 
+	_WS_STATS(_ws_metrics_init(&b->metrics));
+	_ws_callbacks_init(&b->default_cbs);
+
+	// Nothing is allocated until the first object is.
+	_ws_slab_init(&b->conn_slab, &b->allocator, sizeof(struct ws_s), 32);
+	_ws_slab_init(&b->cold_slab, &b->allocator, sizeof(ws_cold_t), 32);
+	_ws_slab_init(&b->arena_blocks, &b->allocator, WS_ARENA_BLOCK_SIZE, 16);
+	_ws_msg_base_init(b);
+
+	#ifdef LIBWS_WITH_MEMORY_ACCOUNTING
+	_ws_mem_account_init(&b->mem, NULL);
+	_ws_slab_init(&b->mem_slab, &b->allocator, sizeof(ws_mem_account_t), 64);
+	b->allocator.account = &b->mem;
+	#endif
+
 	#ifdef _WIN32
 	// Initialize Winsock.
 
@@ -121,6 +168,12 @@ int ws_global_init(ws_base_t *base)
 		}
 	}
 
+	if (_ws_timer_wheel_init(&b->timers, b->ev_base))
+	{
+		LIBWS_LOG(LIBWS_CRIT, "Failed to init timers");
+		goto fail;
+	}
+
 	#ifdef LIBWS_WITH_OPENSSL
 	if (_ws_global_openssl_init(b))
 	{
@@ -131,6 +184,8 @@ int ws_global_init(ws_base_t *base)
 
 	return 0;
 fail:
+	_ws_timer_wheel_destroy(&b->timers);
+
 	if (b->ev_base)
 	{
 		event_base_free(b->ev_base);
@@ -139,6 +194,8 @@ fail:
 
 	if (*base)
 	{
+		_ws_base_destroy_slabs(b);
+		_WS_STATS(_ws_metrics_destroy(&b->metrics));
 		_ws_free(*base);
 		*base = NULL;
 	}
@@ -179,6 +236,8 @@ void ws_global_destroy(ws_base_t *base)
 		b->dns_base = NULL;
 	}	
 
+	_ws_timer_wheel_destroy(&b->timers);
+
 	if (b->ev_base)
 	{
 		event_base_free(b->ev_base);
@@ -189,12 +248,50 @@ void ws_global_destroy(ws_base_t *base)
 	_ws_global_openssl_destroy(b);
 	#endif
 
+	_ws_base_destroy_slabs(b);
+	_WS_STATS(_ws_metrics_destroy(&b->metrics));
+
 	_ws_free(*base);
 	*base = NULL;
 
+	#ifdef LIBWS_WITH_MEMORY_ACCOUNTING
+	_ws_free_cached_memory();
+	#endif
+
 	// TODO: Should we destroy all connections here as well?
 }
 
+int ws_base_set_allocator(ws_base_t base, ws_base_malloc_f malloc_fn,
+						ws_base_free_f free_fn, ws_base_realloc_f realloc_fn,
+						void *ctx)
+{
+	assert(base);
+
+	if ((!malloc_fn || !free_fn || !realloc_fn)
+		&& (malloc_fn || free_fn || realloc_fn))
+	{
+		LIBWS_LOG(LIBWS_ERR, "Either set all allocator functions or none");
+		return -1;
+	}
+
+	if (base->conn_slab.in_use)
+	{
+		LIBWS_LOG(LIBWS_ERR, "Cannot change the allocator while "
+							"there are connections");
+		return -1;
+	}
+
+	// Give back what was cached using the old allocator.
+	_ws_base_destroy_slabs(base);
+
+	base->allocator.malloc_fn = malloc_fn;
+	base->allocator.free_fn = free_fn;
+	base->allocator.realloc_fn = realloc_fn;
+	base->allocator.ctx = ctx;
+
+	return 0;
+}
+
 int ws_init(ws_t *ws, ws_base_t ws_base)
 {
 	struct ws_s *w = NULL;
@@ -202,7 +299,7 @@ int ws_init(ws_t *ws, ws_base_t ws_base)
 	assert(ws);
 	assert(ws_base);
 
-	if (!(*ws = (struct ws_s *)_ws_calloc(1, sizeof(struct ws_s))))
+	if (!(*ws = (struct ws_s *)_ws_slab_alloc(&ws_base->conn_slab)))
 	{
 		LIBWS_LOG(LIBWS_CRIT, "Out of memory!");
 		return -1;
@@ -210,29 +307,27 @@ int ws_init(ws_t *ws, ws_base_t ws_base)
 
 	// Just for convenience.
 	w = *ws;
+	memset(w, 0, sizeof(struct ws_s));
 
-	w->ping_cb = ws_default_onping_cb;
-	w->pong_cb = ws_default_onpong_cb;
-	w->msg_begin_cb = ws_default_msg_begin_cb;
-	w->msg_frame_cb = ws_default_msg_frame_cb;
-	w->msg_end_cb = ws_default_msg_end_cb;
-	w->msg_frame_begin_cb = ws_default_msg_frame_begin_cb;
-	w->msg_frame_data_cb = ws_default_msg_frame_data_cb;
-	w->msg_frame_end_cb = ws_default_msg_frame_end_cb;
-
-	w->ws_base = ws_base;
-
-	#ifdef LIBWS_WITH_OPENSSL
-	if (_ws_openssl_init(w, ws_base))
+	#ifdef LIBWS_WITH_MEMORY_ACCOUNTING
+	if (!(w->mem = _ws_mem_account_new(&ws_base->mem_slab, &ws_base->mem)))
 	{
-		LIBWS_LOG(LIBWS_ERR, "Failed to init OpenSSL");
-		_ws_free(*ws);
+		LIBWS_LOG(LIBWS_CRIT, "Out of memory!");
+		_ws_slab_free(&ws_base->conn_slab, w);
 		*ws = NULL;
 		return -1;
 	}
-	#endif // LIBWS_WITH_OPENSSL
+	#endif
+
+	// Share the default callbacks until one is set.
+	w->cbs = ws_callbacks_ref(&ws_base->default_cbs);
+
+	w->ws_base = ws_base;
+	w->max_handshake_size = WS_DEFAULT_MAX_HANDSHAKE_SIZE;
+	_ws_init_timers(w);
 
 	w->state = WS_STATE_CLOSED_CLEANLY;
+	_WS_STATS(_WS_METRICS(ws_base)->connections[w->state]++);
 
 	return 0;
 }
@@ -246,20 +341,23 @@ void ws_destroy(ws_t *ws)
 
 	w = *ws;
 
+	_WS_STATS(_WS_METRICS(w->ws_base)->connections[w->state]--);
+
+	#ifdef LIBWS_WITH_OPENSSL
+	// Must be done before the bufferevent is freed, since it owns the
+	// SSL session.
+	_ws_openssl_close(w);
+	#endif
+
 	if (w->bev)
 	{
 		bufferevent_free(w->bev);
 		w->bev = NULL;
 	}
 
-	if (w->origin)
-	{
-		_ws_free(w->origin);
-	}
+	_ws_destroy_timers(w);
 
-	_ws_destroy_event(&w->connect_timeout_event);
-	_ws_destroy_event(&w->close_timeout_event);
-	_ws_destroy_event(&w->pong_timeout_event);
+	if (w->rtt) _ws_allocator_free(_WS_ALLOCATOR(w->ws_base), w->rtt);
 
 	// Must be done after the bufferevent is freed.
 	if (w->rate_limits)
@@ -268,18 +366,22 @@ void ws_destroy(ws_t *ws)
 		w->rate_limits = NULL;
 	}
 
-	ws_clear_subprotocols(w);
+	_ws_free_cold(w);
+	ws_callbacks_unref(w->cbs);
+	_ws_template_unref(w->tmpl);
 
 	if (w->handshake_key_base64) _ws_free(w->handshake_key_base64);
-	if (w->server) _ws_free(w->server);
-	if (w->uri) _ws_free(w->uri);
+	if (w->server) _ws_allocator_free(_WS_ALLOCATOR(w->ws_base), w->server);
+	if (w->uri) _ws_allocator_free(_WS_ALLOCATOR(w->ws_base), w->uri);
 
+	_ws_arena_reset(&w->arena, &w->ws_base->arena_blocks);
 
-	#ifdef LIBWS_WITH_OPENSSL
-	_ws_openssl_destroy(w);
+	#ifdef LIBWS_WITH_MEMORY_ACCOUNTING
+	// Anything libevent hasn't freed yet keeps the account alive.
+	_ws_mem_account_unref(w->mem);
 	#endif
 
-	_ws_free(w);
+	_ws_slab_free(&w->ws_base->conn_slab, w);
 	*ws = NULL;
 }
 
@@ -289,10 +391,114 @@ ws_base_t ws_get_base(ws_t ws)
 	return ws->ws_base;
 }
 
+static ws_callbacks_t *_ws_callbacks_alloc()
+{
+	ws_callbacks_t *cbs;
+	#ifdef LIBWS_WITH_MEMORY_ACCOUNTING
+	// Tables can be shared and outlive a connection,
+	// so don't charge them to the current one.
+	ws_mem_account_t *prev = _ws_mem_enter(NULL);
+	#endif
+
+	cbs = (ws_callbacks_t *)_ws_malloc(sizeof(ws_callbacks_t));
+
+	#ifdef LIBWS_WITH_MEMORY_ACCOUNTING
+	_ws_mem_leave(prev);
+	#endif
+
+	return cbs;
+}
+
+ws_callbacks_t *ws_callbacks_new()
+{
+	ws_callbacks_t *cbs;
+
+	if (!(cbs = _ws_callbacks_alloc()))
+	{
+		LIBWS_LOG(LIBWS_CRIT, "Out of memory!");
+		return NULL;
+	}
+
+	_ws_callbacks_init(cbs);
+
+	return cbs;
+}
+
+ws_callbacks_t *ws_callbacks_ref(ws_callbacks_t *cbs)
+{
+	assert(cbs);
+	cbs->refcount++;
+	return cbs;
+}
+
+void ws_callbacks_unref(ws_callbacks_t *cbs)
+{
+	if (!cbs)
+		return;
+
+	assert(cbs->refcount > 0);
+
+	if (--cbs->refcount == 0)
+	{
+		_ws_free(cbs);
+	}
+}
+
+void ws_set_callbacks(ws_t ws, ws_callbacks_t *cbs)
+{
+	assert(ws);
+	assert(cbs);
+
+	// Ref first in case it's the same table.
+	ws_callbacks_ref(cbs);
+	ws_callbacks_unref(ws->cbs);
+	ws->cbs = cbs;
+}
+
+ws_callbacks_t *ws_get_callbacks(ws_t ws)
+{
+	assert(ws);
+	return ws->cbs;
+}
+
+///
+/// Gets a callback table that only this connection uses,
+/// so that a single callback can be changed.
+///
+/// @param[in] ws       The websocket session context.
+/// @param[in] setter   Name of the calling setter, logged if
+///                     the callback can't be set.
+///
+static ws_callbacks_t *_ws_callbacks_writable(ws_t ws, const char *setter)
+{
+	ws_callbacks_t *cbs;
+
+	if (ws->cbs->refcount == 1)
+	{
+		return ws->cbs;
+	}
+
+	if (!(cbs = _ws_callbacks_alloc()))
+	{
+		LIBWS_LOG(LIBWS_ERR, "Out of memory! %s: the callback was not set",
+				setter);
+		return NULL;
+	}
+
+	*cbs = *ws->cbs;
+	cbs->refcount = 1;
+
+	ws_callbacks_unref(ws->cbs);
+	ws->cbs = cbs;
+
+	return cbs;
+}
+
 int ws_connect(ws_t ws, const char *server, int port, const char *uri)
 {
-	int ret = 0;
-	struct evbuffer *out = NULL;
+	#ifdef LIBWS_WITH_MEMORY_ACCOUNTING
+	ws_mem_account_t *prev_mem;
+	#endif
 	assert(ws);
 
 	LIBWS_LOG(LIBWS_DEBUG, "Connect start");
@@ -310,48 +516,68 @@ int ws_connect(ws_t ws, const char *server, int port, const char *uri)
 		return -1;
 	}
 
-	if (ws->server) _ws_free(ws->server);
-	ws->server = _ws_strdup(server);
+	#ifdef LIBWS_WITH_MEMORY_ACCOUNTING
+	// The strings, socket, SSL state and DNS lookup belong to the connection.
+	prev_mem = _ws_mem_enter(ws->mem);
+	#endif
+
+	if (ws->server) _ws_allocator_free(_WS_ALLOCATOR(ws->ws_base), ws->server);
+	ws->server = _ws_allocator_strdup(_WS_ALLOCATOR(ws->ws_base), server);
 
-	if (ws->uri) _ws_free(ws->uri);
-	ws->uri = _ws_strdup(uri);
+	if (ws->uri) _ws_allocator_free(_WS_ALLOCATOR(ws->ws_base), ws->uri);
+	ws->uri = _ws_allocator_strdup(_WS_ALLOCATOR(ws->ws_base), uri);
 
 	ws->port = port;
 	ws->received_close = 0;
 	ws->sent_close = 0;
 	ws->in_msg = 0;
+	ws->has_header = 0;
+	ws->recv_msg_len = 0;
+	ws->recv_too_big = 0;
+	ws->connect_state = WS_CONNECT_STATE_NONE;
+
+	#ifdef LIBWS_WITH_MEMORY_ACCOUNTING
+	// Going over the limit only closes the connection it happened on.
+	ws->mem->over_limit = 0;
+	#endif
 
 	if (_ws_create_bufferevent_socket(ws))
 	{
 		LIBWS_LOG(LIBWS_ERR, "Failed to create bufferevent socket");
-		ret = -1;
 		goto fail;
 	}
 
-	out = bufferevent_get_output(ws->bev);
-	
 	if (bufferevent_socket_connect_hostname(ws->bev, 
 				ws->ws_base->dns_base, AF_UNSPEC, ws->server, ws->port))
 	{
 		LIBWS_LOG(LIBWS_ERR, "Failed to create connect event");
-		ret = -1;
 		goto fail;
 	}
 
-	ws->state = WS_STATE_CONNECTING;
+	_ws_set_state(ws, WS_STATE_CONNECTING);
+	_WS_STATS(_WS_METRICS(ws->ws_base)->connects++);
 
 	// Setup a timeout event for the connection attempt.
 	if (_ws_setup_connection_timeout(ws))
 	{
 		LIBWS_LOG(LIBWS_ERR, "Failed to setup connection timeout event");
-		ret = -1;
 		goto fail;
 	}
 
+	#ifdef LIBWS_WITH_MEMORY_ACCOUNTING
+	_ws_mem_leave(prev_mem);
+	#endif
+
 	return 0;
 fail:
-	if (ws->server) _ws_free(ws->server);
-	if (ws->uri) _ws_free(ws->uri);
+	#ifdef LIBWS_WITH_MEMORY_ACCOUNTING
+	_ws_mem_leave(prev_mem);
+	#endif
+
+	if (ws->server) _ws_allocator_free(_WS_ALLOCATOR(ws->ws_base), ws->server);
+	if (ws->uri) _ws_allocator_free(_WS_ALLOCATOR(ws->ws_base), ws->uri);
+	ws->server = NULL;
+	ws->uri = NULL;
 
 	return -1;
 }
@@ -365,7 +591,7 @@ int ws_close_with_status_reason(ws_t ws, ws_close_status_t status,
 	LIBWS_LOG(LIBWS_TRACE, "Sending close frame %d, %*s", 
 			status, reason_len, reason);
 
-	ws->state = WS_STATE_CLOSING;
+	_ws_set_state(ws, WS_STATE_CLOSING);
 
 	// The underlying TCP connection, in most normal cases, SHOULD be closed
 	// first by the server, so that it holds the TIME_WAIT state and not the
@@ -394,21 +620,12 @@ int ws_close_with_status_reason(ws_t ws, ws_close_status_t status,
 	// Give the server time to initiate the closing of the
 	// TCP session. Otherwise we'll force an unclean shutdown
 	// ourselves.
-	if (ws->close_timeout_event) event_free(ws->close_timeout_event);
-
-	if (!(ws->close_timeout_event = evtimer_new(ws->ws_base->ev_base, 
-									_ws_close_timeout_cb, (void *)ws)))
-	{
-		LIBWS_LOG(LIBWS_ERR, "Failed to create close timeout event");
-		goto fail;
-	}
-
 	tv.tv_sec = 3; // TODO: Let the user set this.
 	tv.tv_usec = 0;
 
-	if (evtimer_add(ws->close_timeout_event, &tv))
+	if (_ws_timer_add(&ws->ws_base->timers, &ws->close_timeout_timer, &tv))
 	{
-		LIBWS_LOG(LIBWS_ERR, "Failed to add close timeout event");
+		LIBWS_LOG(LIBWS_ERR, "Failed to add close timeout");
 		goto fail;
 	}
 
@@ -419,22 +636,21 @@ fail:
 	// If we fail to send the close frame, we do a TCP close
 	// right away (unclean websocket close).
 
-	if (ws->close_timeout_event)
-	{
-		event_free(ws->close_timeout_event);
-		ws->close_timeout_event = NULL;
-	}
+	_ws_timer_del(&ws->ws_base->timers, &ws->close_timeout_timer);
 
 	LIBWS_LOG(LIBWS_ERR, "Failed to send close frame, "
 						 "forcing unclean close");
 
 	_ws_shutdown(ws);
+	_ws_set_state(ws, WS_STATE_CLOSED_UNCLEANLY);
+	_WS_STATS(_WS_METRICS(ws->ws_base)->closes[
+				_ws_metrics_close_index(WS_CLOSE_STATUS_ABNORMAL_1006)]++);
 
-	if (ws->close_cb)
+	if (ws->cbs->close_cb)
 	{
 		char reason[] = "Problem sending close frame";
-		ws->close_cb(ws, WS_CLOSE_STATUS_ABNORMAL_1006, 
-					reason, sizeof(reason), ws->close_arg);
+		ws->cbs->close_cb(ws, WS_CLOSE_STATUS_ABNORMAL_1006, 
+					reason, sizeof(reason), ws->cbs->close_arg);
 	}
 
 	return -1;
@@ -562,6 +778,12 @@ void *ws_get_user_state(ws_t ws)
 	return ws->user_state;
 }
 
+ws_state_t ws_get_state(ws_t ws)
+{
+	assert(ws);
+	return ws->state;
+}
+
 #define _WS_MUST_BE_CONNECTED(__ws__, err_msg) \
 	if (__ws__->state != WS_STATE_CONNECTED) \
 	{ \
@@ -589,6 +811,7 @@ int ws_msg_begin(ws_t ws, int binary)
 						WS_OPCODE_BINARY_0X2 : WS_OPCODE_TEXT_0X1;
 
 	ws->send_state = WS_SEND_STATE_MESSAGE_BEGIN;
+	_WS_STATS(ws->stats_msg_out_len = 0);
 	
 	return 0;
 }
@@ -650,6 +873,9 @@ int ws_msg_frame_data_begin(ws_t ws, uint64_t datalen)
 		return -1;
 	}
 
+	_WS_STATS(ws->stats.frames_out++);
+	_WS_STATS(ws->stats_msg_out_len += datalen);
+
 	return 0;
 }
 
@@ -733,12 +959,18 @@ int ws_msg_end(ws_t ws)
 
 	ws->send_state = WS_SEND_STATE_NONE;
 
+	_WS_STATS(_ws_stats_count_msg(ws, ws->binary_mode
+				? WS_OPCODE_BINARY_0X2 : WS_OPCODE_TEXT_0X1,
+				ws->stats_msg_out_len, 1));
+
+	// Streamed messages are only checked once they are complete.
+	_ws_check_memory_limit(ws, WS_CLOSE_STATUS_POLICY_VIOLATION_1008);
+
 	return 0;
 }
 
 int ws_send_msg_ex(ws_t ws, char *msg, uint64_t len, int binary)
 {
-	int saved_binary_mode;
 	uint64_t curlen;
 	uint64_t remaining;
 	assert(ws);
@@ -823,100 +1055,273 @@ uint64_t ws_get_max_frame_size(ws_t ws)
 	return ws->max_frame_size;
 }
 
+int ws_set_max_message_size(ws_t ws, uint64_t max_message_size)
+{
+	assert(ws);
+
+	if (max_message_size > WS_MAX_PAYLOAD_LEN)
+	{
+		LIBWS_LOG(LIBWS_ERR, "Max message size cannot exceed max payload length");
+		return -1;
+	}
+
+	ws->max_message_size = max_message_size;
+
+	return 0;
+}
+
+uint64_t ws_get_max_message_size(ws_t ws)
+{
+	assert(ws);
+	return ws->max_message_size;
+}
+
+int ws_set_max_frame_size_recv(ws_t ws, uint64_t max_frame_size_recv)
+{
+	assert(ws);
+
+	if (max_frame_size_recv > WS_MAX_PAYLOAD_LEN)
+	{
+		LIBWS_LOG(LIBWS_ERR, "Max frame size cannot exceed max payload length");
+		return -1;
+	}
+
+	ws->max_frame_size_recv = max_frame_size_recv;
+
+	return 0;
+}
+
+uint64_t ws_get_max_frame_size_recv(ws_t ws)
+{
+	assert(ws);
+	return ws->max_frame_size_recv;
+}
+
+int ws_set_max_handshake_size(ws_t ws, size_t max_handshake_size)
+{
+	assert(ws);
+
+	if (max_handshake_size == 0)
+	{
+		LIBWS_LOG(LIBWS_ERR, "Max handshake size cannot be 0");
+		return -1;
+	}
+
+	ws->max_handshake_size = max_handshake_size;
+
+	return 0;
+}
+
+size_t ws_get_max_handshake_size(ws_t ws)
+{
+	assert(ws);
+	return ws->max_handshake_size;
+}
+
 void ws_set_onconnect_cb(ws_t ws, ws_connect_callback_f func, void *arg)
 {
+	ws_callbacks_t *cbs;
 	assert(ws);
 
-	ws->connect_cb = func;
-	ws->connect_arg = arg;
+	if (!(cbs = _ws_callbacks_writable(ws, "ws_set_onconnect_cb")))
+	{
+		return;
+	}
+
+	cbs->connect_cb = func;
+	cbs->connect_arg = arg;
 }
 
 void ws_set_onmsg_cb(ws_t ws, ws_msg_callback_f func, void *arg)
 {
+	ws_callbacks_t *cbs;
+	assert(ws);
+
+	if (!(cbs = _ws_callbacks_writable(ws, "ws_set_onmsg_cb")))
+	{
+		return;
+	}
+
+	cbs->msg_cb = func;
+	cbs->msg_arg = arg;
+}
+
+void ws_set_recv_buffer_provider(ws_t ws, ws_recv_alloc_callback_f alloc_cb,
+						ws_recv_commit_callback_f commit_cb, void *arg)
+{
+	ws_callbacks_t *cbs;
 	assert(ws);
 
-	ws->msg_cb = func;
-	ws->msg_arg = arg;
+	if (!(cbs = _ws_callbacks_writable(ws, "ws_set_recv_buffer_provider")))
+	{
+		return;
+	}
+
+	cbs->recv_alloc_cb = alloc_cb;
+	cbs->recv_commit_cb = commit_cb;
+	cbs->recv_buffer_arg = arg;
 }
 
 void ws_set_onmsg_begin_cb(ws_t ws, ws_msg_begin_callback_f func, void *arg)
 {
+	ws_callbacks_t *cbs;
 	assert(ws);
 
-	ws->msg_begin_cb = func ? func : ws_default_msg_begin_cb;
-	ws->msg_begin_arg = arg;
+	if (!(cbs = _ws_callbacks_writable(ws, "ws_set_onmsg_begin_cb")))
+	{
+		return;
+	}
+
+	cbs->msg_begin_cb = func ? func : ws_default_msg_begin_cb;
+	cbs->msg_begin_arg = arg;
 }
 
 void ws_set_onmsg_frame_cb(ws_t ws, ws_msg_frame_callback_f func, void *arg)
 {
+	ws_callbacks_t *cbs;
 	assert(ws);
 
-	ws->msg_frame_cb = func ? func : ws_default_msg_frame_cb;
-	ws->msg_frame_arg = arg;
+	if (!(cbs = _ws_callbacks_writable(ws, "ws_set_onmsg_frame_cb")))
+	{
+		return;
+	}
+
+	cbs->msg_frame_cb = func ? func : ws_default_msg_frame_cb;
+	cbs->msg_frame_arg = arg;
 }
 
 void ws_set_onmsg_end_cb(ws_t ws, ws_msg_end_callback_f func, void *arg)
 {
+	ws_callbacks_t *cbs;
+	assert(ws);
+
+	if (!(cbs = _ws_callbacks_writable(ws, "ws_set_onmsg_end_cb")))
+	{
+		return;
+	}
+
+	cbs->msg_end_cb = func ? func : ws_default_msg_end_cb;
+	cbs->msg_end_arg = arg;
+}
+
+void ws_set_onmsg_abort_cb(ws_t ws, ws_msg_abort_callback_f func, void *arg)
+{
+	ws_callbacks_t *cbs;
 	assert(ws);
 
-	ws->msg_end_cb = func ? func : ws_default_msg_end_cb;
-	ws->msg_end_arg = arg;
+	if (!(cbs = _ws_callbacks_writable(ws, "ws_set_onmsg_abort_cb")))
+	{
+		return;
+	}
+
+	cbs->msg_abort_cb = func;
+	cbs->msg_abort_arg = arg;
 }
 
 void ws_set_onmsg_frame_begin_cb(ws_t ws, ws_msg_frame_begin_callback_f func, 
 								void *arg)
 {
+	ws_callbacks_t *cbs;
 	assert(ws);
 
-	ws->msg_frame_begin_cb = func ? func : ws_default_msg_frame_begin_cb;
-	ws->msg_frame_begin_arg = arg;
+	if (!(cbs = _ws_callbacks_writable(ws, "ws_set_onmsg_frame_begin_cb")))
+	{
+		return;
+	}
+
+	cbs->msg_frame_begin_cb = func ? func : ws_default_msg_frame_begin_cb;
+	cbs->msg_frame_begin_arg = arg;
 }
 
 void ws_set_onmsg_frame_data_cb(ws_t ws, ws_msg_frame_data_callback_f func, 
 								void *arg)
 {
+	ws_callbacks_t *cbs;
 	assert(ws);
 
-	ws->msg_frame_data_cb = func ? func : ws_default_msg_frame_data_cb;
-	ws->msg_frame_data_arg = arg;
+	if (!(cbs = _ws_callbacks_writable(ws, "ws_set_onmsg_frame_data_cb")))
+	{
+		return;
+	}
+
+	cbs->msg_frame_data_cb = func ? func : ws_default_msg_frame_data_cb;
+	cbs->msg_frame_data_arg = arg;
 }
 
 void ws_set_onmsg_frame_end_cb(ws_t ws, ws_msg_frame_end_callback_f func, 
 								void *arg)
 {
+	ws_callbacks_t *cbs;
 	assert(ws);
 
-	ws->msg_frame_end_cb = func ? func : ws_default_msg_frame_end_cb;
-	ws->msg_frame_end_arg = arg;
+	if (!(cbs = _ws_callbacks_writable(ws, "ws_set_onmsg_frame_end_cb")))
+	{
+		return;
+	}
+
+	cbs->msg_frame_end_cb = func ? func : ws_default_msg_frame_end_cb;
+	cbs->msg_frame_end_arg = arg;
 }
 
 void ws_set_onerr_cb(ws_t ws, ws_err_callback_f func, void *arg)
 {
+	ws_callbacks_t *cbs;
 	assert(ws);
 
-	ws->err_cb = func;
-	ws->err_arg = arg;
+	if (!(cbs = _ws_callbacks_writable(ws, "ws_set_onerr_cb")))
+	{
+		return;
+	}
+
+	cbs->err_cb = func;
+	cbs->err_arg = arg;
+}
+
+void ws_set_header_cb(ws_t ws, ws_header_callback_f func, void *arg)
+{
+	ws_callbacks_t *cbs;
+	assert(ws);
+
+	if (!(cbs = _ws_callbacks_writable(ws, "ws_set_header_cb")))
+	{
+		return;
+	}
+
+	cbs->header_cb = func;
+	cbs->header_arg = arg;
 }
 
 void ws_set_onclose_cb(ws_t ws, ws_close_callback_f func, void *arg)
 {
+	ws_callbacks_t *cbs;
 	assert(ws);
 
-	ws->close_cb = func;
-	ws->close_arg = arg;
+	if (!(cbs = _ws_callbacks_writable(ws, "ws_set_onclose_cb")))
+	{
+		return;
+	}
+
+	cbs->close_cb = func;
+	cbs->close_arg = arg;
 }
 
 int ws_set_origin(ws_t ws, const char *origin)
 {
+	ws_cold_t *cold;
 	assert(ws);
 
+	if (!(cold = _ws_get_cold(ws)))
+	{
+		return -1;
+	}
+
 	// TODO: Verify that origin is a valid value.
-	if (ws->origin)
+	if (cold->origin)
 	{
-		_ws_free(ws->origin);
+		_ws_allocator_free(_WS_ALLOCATOR(ws->ws_base), cold->origin);
 	}
 
-	if (!(ws->origin = _ws_strdup(origin)))
+	if (!(cold->origin = _ws_allocator_strdup(_WS_ALLOCATOR(ws->ws_base), origin)))
 	{
 		LIBWS_LOG(LIBWS_ERR, "Could not copy origin string. Out of memory!");
 		return -1;
@@ -930,6 +1335,13 @@ void ws_default_onping_cb(ws_t ws, char *msg, uint64_t len,
 {
 	assert(ws);
 
+	// Sent when the read is done, see ws_set_pong_coalescing.
+	if (ws->pong_coalesce)
+	{
+		_ws_queue_pong(ws, msg, (size_t)len);
+		return;
+	}
+
 	if (ws_send_pong(ws, msg, (size_t)len))
 	{
 		LIBWS_LOG(LIBWS_ERR, "Failed to send pong");
@@ -938,10 +1350,16 @@ void ws_default_onping_cb(ws_t ws, char *msg, uint64_t len,
 
 void ws_set_onping_cb(ws_t ws, ws_msg_callback_f func, void *arg)
 {
+	ws_callbacks_t *cbs;
 	assert(ws);
 
-	ws->ping_cb = func ? func : ws_default_onping_cb;
-	ws->ping_arg = arg;
+	if (!(cbs = _ws_callbacks_writable(ws, "ws_set_onping_cb")))
+	{
+		return;
+	}
+
+	cbs->ping_cb = func ? func : ws_default_onping_cb;
+	cbs->ping_arg = arg;
 }
 
 void ws_default_onpong_cb(ws_t ws, char *msg, uint64_t len, 
@@ -955,19 +1373,103 @@ void ws_default_onpong_cb(ws_t ws, char *msg, uint64_t len,
 
 void ws_set_onpong_cb(ws_t ws, ws_msg_callback_f func, void *arg)
 {
+	ws_callbacks_t *cbs;
 	assert(ws);
 
-	ws->pong_cb = func ? func : ws_default_onpong_cb;
-	ws->pong_arg = arg;
+	if (!(cbs = _ws_callbacks_writable(ws, "ws_set_onpong_cb")))
+	{
+		return;
+	}
+
+	cbs->pong_cb = func ? func : ws_default_onpong_cb;
+	cbs->pong_arg = arg;
 }
 
 void ws_set_pong_timeout_cb(ws_t ws, ws_timeout_callback_f func, 
 							struct timeval timeout, void *arg)
 {
+	ws_callbacks_t *cbs;
 	assert(ws);
 
-	ws->pong_timeout_cb = func;
-	ws->pong_timeout_arg = arg;
+	if (!(cbs = _ws_callbacks_writable(ws, "ws_set_pong_timeout_cb")))
+	{
+		return;
+	}
+
+	cbs->pong_timeout_cb = func;
+	ws->pong_timeout = timeout;
+	cbs->pong_timeout_arg = arg;
+}
+
+int ws_set_keepalive(ws_t ws, struct timeval interval, 
+					struct timeval timeout, int skip_if_active)
+{
+	assert(ws);
+
+	_ws_keepalive_stop(ws);
+
+	if (evutil_timerisset(&interval) && !ws->rtt)
+	{
+		if (!(ws->rtt = (ws_histogram_t *)_ws_allocator_calloc(
+						_WS_ALLOCATOR(ws->ws_base), 1, sizeof(ws_histogram_t))))
+		{
+			LIBWS_LOG(LIBWS_CRIT, "Out of memory!");
+			return -1;
+		}
+	}
+
+	ws->keepalive_interval = interval;
+	ws->keepalive_timeout = evutil_timerisset(&timeout) ? timeout : interval;
+	ws->keepalive_skip_active = skip_if_active;
+
+	if (ws->state == WS_STATE_CONNECTED)
+	{
+		return _ws_keepalive_start(ws);
+	}
+
+	return 0;
+}
+
+void ws_set_pong_coalescing(ws_t ws, int enabled, struct timeval min_interval)
+{
+	assert(ws);
+
+	ws->pong_coalesce = enabled;
+
+	if (enabled)
+	{
+		ws->pong_interval = min_interval;
+		return;
+	}
+
+	// Answer any ping that is still waiting right away.
+	evutil_timerclear(&ws->pong_interval);
+	_ws_timer_del(&ws->ws_base->timers, &ws->pong_reply_timer);
+	_ws_flush_pong(ws);
+}
+
+int ws_get_rtt_stats(ws_t ws, ws_rtt_stats_t *stats)
+{
+	assert(ws);
+	assert(stats);
+
+	memset(stats, 0, sizeof(ws_rtt_stats_t));
+
+	if (!ws->rtt || (ws->rtt->count == 0))
+	{
+		return -1;
+	}
+
+	stats->count = ws->rtt->count;
+	stats->min = ws->rtt->min;
+	stats->max = ws->rtt->max;
+	stats->mean = ws->rtt->sum / ws->rtt->count;
+	stats->p50 = _ws_histogram_percentile(ws->rtt, 50.0);
+	stats->p90 = _ws_histogram_percentile(ws->rtt, 90.0);
+	stats->p99 = _ws_histogram_percentile(ws->rtt, 99.0);
+	stats->last = ws->last_rtt;
+
+	return 0;
 }
 
 int ws_add_header(ws_t ws, const char *header, const char *value)
@@ -1002,11 +1504,17 @@ int ws_is_connected(ws_t ws)
 void ws_set_recv_timeout_cb(ws_t ws, ws_timeout_callback_f func, 
 						struct timeval recv_timeout, void *arg)
 {
+	ws_callbacks_t *cbs;
 	assert(ws);
+
+	if (!(cbs = _ws_callbacks_writable(ws, "ws_set_recv_timeout_cb")))
+	{
+		return;
+	}
 	
-	ws->recv_timeout_cb = func;
+	cbs->recv_timeout_cb = func;
 	ws->recv_timeout = recv_timeout;
-	ws->recv_timeout_arg = arg;
+	cbs->recv_timeout_arg = arg;
 
 	_ws_set_timeouts(ws);
 }
@@ -1014,11 +1522,17 @@ void ws_set_recv_timeout_cb(ws_t ws, ws_timeout_callback_f func,
 void ws_set_send_timeout_cb(ws_t ws, ws_timeout_callback_f func, 
 						struct timeval send_timeout, void *arg)
 {
+	ws_callbacks_t *cbs;
 	assert(ws);
 
-	ws->send_timeout_cb = func;
+	if (!(cbs = _ws_callbacks_writable(ws, "ws_set_send_timeout_cb")))
+	{
+		return;
+	}
+
+	cbs->send_timeout_cb = func;
 	ws->send_timeout = send_timeout;
-	ws->send_timeout_arg = arg;
+	cbs->send_timeout_arg = arg;
 
 	_ws_set_timeouts(ws);
 }
@@ -1026,11 +1540,17 @@ void ws_set_send_timeout_cb(ws_t ws, ws_timeout_callback_f func,
 void ws_set_connect_timeout_cb(ws_t ws, ws_timeout_callback_f func,
 						struct timeval connect_timeout, void *arg)
 {
+	ws_callbacks_t *cbs;
 	assert(ws);
 
-	ws->connect_timeout_cb = func;
+	if (!(cbs = _ws_callbacks_writable(ws, "ws_set_connect_timeout_cb")))
+	{
+		return;
+	}
+
+	cbs->connect_timeout_cb = func;
 	ws->connect_timeout = connect_timeout;
-	ws->connect_timeout_arg = arg;
+	cbs->connect_timeout_arg = arg;
 }
 
 int ws_send_ping_ex(ws_t ws, char *msg, size_t len)
@@ -1042,7 +1562,7 @@ int ws_send_ping_ex(ws_t ws, char *msg, size_t len)
 		return -1;
 	}
 
-	if (ws->pong_timeout_cb && _ws_setup_pong_timeout(ws))
+	if (ws->cbs->pong_timeout_cb && _ws_setup_pong_timeout(ws))
 	{
 		LIBWS_LOG(LIBWS_ERR, "Failed to setup pong timeout callback");
 	}
@@ -1072,52 +1592,73 @@ int ws_send_pong(ws_t ws, char *msg, size_t len)
 
 int ws_add_subprotocol(ws_t ws, const char *subprotocol)
 {
+	ws_cold_t *cold;
+	char **subprotocols;
 	assert(ws);
 
-	if (!(ws->subprotocols = (char **)_ws_realloc(ws->subprotocols, 
-								(ws->num_subprotocols + 1) * sizeof(char *))))
+	if (!(cold = _ws_get_cold(ws)))
+	{
+		return -1;
+	}
+
+	if (!(subprotocols = (char **)_ws_allocator_realloc(
+								_WS_ALLOCATOR(ws->ws_base), cold->subprotocols, 
+								(cold->num_subprotocols + 1) * sizeof(char *))))
+	{
+		LIBWS_LOG(LIBWS_ERR, "Out of memory!");
+		return -1;
+	}
+
+	cold->subprotocols = subprotocols;
+
+	if (!(subprotocols[cold->num_subprotocols] = 
+			_ws_allocator_strdup(_WS_ALLOCATOR(ws->ws_base), subprotocol)))
 	{
 		LIBWS_LOG(LIBWS_ERR, "Out of memory!");
 		return -1;
 	}
 
-	ws->subprotocols[ws->num_subprotocols] = strdup(subprotocol);
-	ws->num_subprotocols++;
+	cold->num_subprotocols++;
 
 	return 0;
 }
 
 size_t ws_get_subprotocol_count(ws_t ws)
 {
+	size_t count;
 	assert(ws);
-	return ws->num_subprotocols;
+	_ws_get_subprotocol_list(ws, &count);
+	return count;
 }
 
 char **ws_get_subprotocols(ws_t ws, size_t *count)
 {
-	assert(ws);
 	size_t i;
+	size_t num_subprotocols;
+	char **subprotocols;
 	char **ret = NULL;
-	size_t lengths = 0;
+	assert(ws);
+
+	subprotocols = _ws_get_subprotocol_list(ws, &num_subprotocols);
 
-	if (!ws->subprotocols)
+	if (!subprotocols)
 		return NULL;
 
-	if (!(ret = (char **)_ws_malloc(ws->num_subprotocols * sizeof(char *))))
+	if (!(ret = (char **)_ws_malloc(num_subprotocols * sizeof(char *))))
 	{
 		LIBWS_LOG(LIBWS_ERR, "Out of memory!"); 
 		return NULL;
 	}
 
-	for (i = 0; i < ws->num_subprotocols; i++)
+	for (i = 0; i < num_subprotocols; i++)
 	{
-		if (!(ret[i] = _ws_strdup(ws->subprotocols[i])))
+		if (!(ret[i] = _ws_strdup(subprotocols[i])))
 		{
 			goto fail;
 		}
 	}
 
-	*count = ws->num_subprotocols;
+	*count = num_subprotocols;
 
 	return ret;
 fail:
@@ -1146,18 +1687,54 @@ int ws_clear_subprotocols(ws_t ws)
 	size_t i;
 	assert(ws);
 
-	if (!ws->subprotocols)
+	if (!ws->cold || !ws->cold->subprotocols)
+		return 0;
+
+	for (i = 0; i < ws->cold->num_subprotocols; i++)
+	{
+		if (ws->cold->subprotocols[i])
+			_ws_allocator_free(_WS_ALLOCATOR(ws->ws_base), 
+								ws->cold->subprotocols[i]);
+	}
+
+	_ws_allocator_free(_WS_ALLOCATOR(ws->ws_base), ws->cold->subprotocols);
+	ws->cold->subprotocols = NULL;
+	ws->cold->num_subprotocols = 0;
+
+	return 0;
+}
+
+int _ws_msg_reserve(ws_t ws, size_t extra)
+{
+	size_t need;
+	size_t cap;
+	char *data;
+
+	// +1 for the null char added at the end of the message.
+	need = ws->msg_len + ws->msg_frame_len + extra + 1;
+
+	if (ws->msg_data && (need <= ws->msg_cap))
+	{
 		return 0;
+	}
+
+	cap = ws->msg_cap * 2;
 
-	for (i = 0; i < ws->num_subprotocols; i++)
+	if (cap < need)
+		cap = need;
+
+	if (cap < 256)
+		cap = 256;
+
+	if (!(data = (char *)_ws_arena_grow(&ws->arena, &ws->ws_base->arena_blocks,
+						ws->msg_data, ws->msg_len + ws->msg_frame_len, cap)))
 	{
-		if (ws->subprotocols[i])
-			_ws_free(ws->subprotocols[i]);
+		LIBWS_LOG(LIBWS_CRIT, "Out of memory!");
+		return -1;
 	}
 
-	_ws_free(ws->subprotocols);
-	ws->subprotocols = NULL;
-	ws->num_subprotocols = 0;
+	ws->msg_data = data;
+	ws->msg_cap = cap;
 
 	return 0;
 }
@@ -1169,18 +1746,15 @@ void ws_default_msg_begin_cb(ws_t ws, void *arg)
 	LIBWS_LOG(LIBWS_TRACE, "Default message begin callback "
 							"(setup message buffer)");
 
-	if (ws->msg)
+	if (ws->msg_len != 0)
 	{
-		if (evbuffer_get_length(ws->msg) != 0)
-		{
-			LIBWS_LOG(LIBWS_WARN, "Non-empty message buffer on new message");
-		}
-	
-		evbuffer_free(ws->msg);
-		ws->msg = NULL;
+		LIBWS_LOG(LIBWS_WARN, "Non-empty message buffer on new message");
 	}
 
-	if (!(ws->msg = evbuffer_new()))
+	ws->msg_len = 0;
+	ws->msg_frame_len = 0;
+
+	if (_ws_msg_reserve(ws, 0))
 	{
 		// TODO: Close connection. Internal error error code.
 		return;
@@ -1195,41 +1769,57 @@ void ws_default_msg_frame_cb(ws_t ws, char *payload,
 	LIBWS_LOG(LIBWS_TRACE, "Default message frame callback "
 							"(append data to message)");
 
-	// Finally we append the frame payload to the message payload.
-	evbuffer_add_buffer(ws->msg, ws->frame_data);
+	// The frame payload is already placed right after the
+	// message payload, so simply make it part of the message.
+	ws->msg_len += ws->msg_frame_len;
+	ws->msg_frame_len = 0;
 }
 
 void ws_default_msg_end_cb(ws_t ws, void *arg)
 {
 	size_t len;
-	unsigned char *payload;
+	char *payload;
 	assert(ws);
 
 	LIBWS_LOG(LIBWS_TRACE, "Default message end callback "
 							"(Calls the on message callback)");
+
+	if (!ws->msg_data)
+	{
+		return;
+	}
 	
 	// Finalize the message by adding a null char.
 	// TODO: No null for binary?
-	evbuffer_add_printf(ws->msg, "");
+	// (There's always room for it, see _ws_msg_reserve).
+	ws->msg_data[ws->msg_len] = '\0';
 
-	len = evbuffer_get_length(ws->msg);
-	payload = evbuffer_pullup(ws->msg, len);
+	len = ws->msg_len;
+	payload = ws->msg_data;
 
 	LIBWS_LOG(LIBWS_DEBUG2, "Message received of length %lu:\n%s", len, payload);
 
-	if (ws->msg_cb)
+	if (ws->cbs->msg_cb)
 	{
 		LIBWS_LOG(LIBWS_DEBUG, "Calling message callback");
-		ws->msg_cb(ws, (char *)payload, len,
-			ws->msg_isbinary, ws->msg_arg);
+		ws->msg_delivering = 1;
+		ws->cbs->msg_cb(ws, payload, len,
+			ws->msg_isbinary, ws->cbs->msg_arg);
+		ws->msg_delivering = 0;
 	}
 	else
 	{
 		LIBWS_LOG(LIBWS_DEBUG, "No message callback set, drop message");
 	}
 
-	evbuffer_free(ws->msg);
-	ws->msg = NULL;
+	// The message was retained, it owns the memory now.
+	if (ws->msg_handle)
+	{
+		_ws_msg_delivered(ws);
+	}
+
+	// The memory itself is given back when the frame ends.
+	ws->msg_len = 0;
 }
 
 void ws_default_msg_frame_begin_cb(ws_t ws, void *arg)
@@ -1239,25 +1829,14 @@ void ws_default_msg_frame_begin_cb(ws_t ws, void *arg)
 	LIBWS_LOG(LIBWS_TRACE, "Default message frame begin callback "
 							"(Sets up the frame data buffer)");
 
-	// Setup the frame payload buffer.
-	if (ws->frame_data)
+	if (ws->msg_frame_len != 0)
 	{
-		if (evbuffer_get_length(ws->frame_data) != 0)
-		{
-			LIBWS_LOG(LIBWS_WARN, "Non-empty message buffer on new frame");
-			// TODO: This should probably fail somehow...
-		}
-
-		// TODO: Should we really free it? Not just do evbuffer_remove with a NULL dest?
-		evbuffer_free(ws->frame_data);
-		ws->frame_data = NULL;
+		LIBWS_LOG(LIBWS_WARN, "Non-empty message buffer on new frame");
+		// TODO: This should probably fail somehow...
 	}
 
-	if (!(ws->frame_data = evbuffer_new()))
-	{
-		// TODO: Close connection. Internal error reason.
-		return;
-	}
+	// The frame data is appended after the message so far.
+	ws->msg_frame_len = 0;
 }
 
 void ws_default_msg_frame_data_cb(ws_t ws, char *payload, 
@@ -1268,9 +1847,14 @@ void ws_default_msg_frame_data_cb(ws_t ws, char *payload,
 	LIBWS_LOG(LIBWS_TRACE, "Default message frame data callback "
 							"(Append data to frame data buffer)");
 
-	// TODO: Instead of using a copied payload buf here, we should 
-	// instead use evbuffer_add_buffer()
-	evbuffer_add(ws->frame_data, payload, (size_t)len);
+	if (_ws_msg_reserve(ws, (size_t)len))
+	{
+		// TODO: Close connection. Internal error reason.
+		return;
+	}
+
+	memcpy(ws->msg_data + ws->msg_len + ws->msg_frame_len, payload, (size_t)len);
+	ws->msg_frame_len += (size_t)len;
 }
 
 void ws_default_msg_frame_end_cb(ws_t ws, void *arg)
@@ -1280,13 +1864,11 @@ void ws_default_msg_frame_end_cb(ws_t ws, void *arg)
 	LIBWS_LOG(LIBWS_TRACE, "Default message frame end callback "
 							"(Calls the message frame callback)");
 
-	if (ws->msg_frame_cb)
+	if (ws->cbs->msg_frame_cb)
 	{
-		size_t frame_len = evbuffer_get_length(ws->frame_data);
-		const unsigned char *payload = evbuffer_pullup(ws->frame_data, frame_len);
-		
 		LIBWS_LOG(LIBWS_DEBUG, "Calling message frame callback");
-		ws->msg_frame_cb(ws, (char *)payload, frame_len, arg);
+		ws->cbs->msg_frame_cb(ws, ws->msg_data ? ws->msg_data + ws->msg_len : NULL,
+							ws->msg_frame_len, arg);
 	}
 	else
 	{
@@ -1296,8 +1878,95 @@ void ws_default_msg_frame_end_cb(ws_t ws, void *arg)
 		ws_default_msg_frame_cb(ws, NULL, 0, arg);
 	}
 
-	evbuffer_free(ws->frame_data);
-	ws->frame_data = NULL;
+	ws->msg_frame_len = 0;
+}
+
+int ws_get_stats(ws_t ws, ws_stats_t *stats)
+{
+	assert(ws);
+	assert(stats);
+
+	#ifdef LIBWS_WITH_STATS
+	*stats = ws->stats;
+
+	// The queue depths are only looked at when asked for.
+	if (ws->bev)
+	{
+		stats->in_queue_bytes = evbuffer_get_length(
+									bufferevent_get_input(ws->bev));
+		stats->out_queue_bytes = evbuffer_get_length(
+									bufferevent_get_output(ws->bev));
+
+		_WS_STATS_MAX(stats->peak_in_queue_bytes, stats->in_queue_bytes);
+		_WS_STATS_MAX(stats->peak_out_queue_bytes, stats->out_queue_bytes);
+	}
+
+	return 0;
+	#else
+	memset(stats, 0, sizeof(ws_stats_t));
+	LIBWS_LOG(LIBWS_ERR, "Compiled without statistics support");
+	return -1;
+	#endif // LIBWS_WITH_STATS
+}
+
+int ws_get_memory_usage(ws_t ws, size_t *bytes, size_t *peak)
+{
+	assert(ws);
+	assert(bytes);
+
+	#ifdef LIBWS_WITH_MEMORY_ACCOUNTING
+	*bytes = ws->mem->bytes;
+	if (peak) *peak = ws->mem->peak;
+	return 0;
+	#else
+	*bytes = 0;
+	if (peak) *peak = 0;
+	LIBWS_LOG(LIBWS_ERR, "Compiled without memory accounting support");
+	return -1;
+	#endif // LIBWS_WITH_MEMORY_ACCOUNTING
+}
+
+int ws_set_memory_limit(ws_t ws, size_t limit)
+{
+	assert(ws);
+
+	#ifdef LIBWS_WITH_MEMORY_ACCOUNTING
+	ws->mem->limit = limit;
+	return 0;
+	#else
+	LIBWS_LOG(LIBWS_ERR, "Compiled without memory accounting support");
+	return -1;
+	#endif // LIBWS_WITH_MEMORY_ACCOUNTING
+}
+
+int ws_base_get_memory_usage(ws_base_t base, size_t *bytes, size_t *peak)
+{
+	assert(base);
+	assert(bytes);
+
+	#ifdef LIBWS_WITH_MEMORY_ACCOUNTING
+	*bytes = base->mem.bytes;
+	if (peak) *peak = base->mem.peak;
+	return 0;
+	#else
+	*bytes = 0;
+	if (peak) *peak = 0;
+	LIBWS_LOG(LIBWS_ERR, "Compiled without memory accounting support");
+	return -1;
+	#endif // LIBWS_WITH_MEMORY_ACCOUNTING
+}
+
+int ws_base_set_memory_limit(ws_base_t base, size_t limit)
+{
+	assert(base);
+
+	#ifdef LIBWS_WITH_MEMORY_ACCOUNTING
+	base->mem.limit = limit;
+	return 0;
+	#else
+	LIBWS_LOG(LIBWS_ERR, "Compiled without memory accounting support");
+	return -1;
+	#endif // LIBWS_WITH_MEMORY_ACCOUNTING
 }
 
 #ifdef LIBWS_WITH_OPENSSL
@@ -1356,3 +2025,57 @@ void ws_set_rate_limits(ws_t ws, size_t read_rate, size_t read_burst,
 
 }
 
+void ws_pause_read(ws_t ws)
+{
+	assert(ws);
+
+	ws->read_paused = 1;
+
+	if (ws->bev)
+	{
+		bufferevent_disable(ws->bev, EV_READ);
+	}
+}
+
+void ws_resume_read(ws_t ws)
+{
+	assert(ws);
+
+	if (!ws->read_paused)
+		return;
+
+	ws->read_paused = 0;
+
+	// Before the connection is up, connecting enables reading.
+	if (!ws->bev || (ws->connect_state == WS_CONNECT_STATE_NONE))
+		return;
+
+	bufferevent_enable(ws->bev, EV_READ);
+
+	// Parse what was left in the input when pausing. Deferred so
+	// calling this from a callback doesn't re-enter the parser.
+	if (evbuffer_get_length(bufferevent_get_input(ws->bev)))
+	{
+		bufferevent_trigger(ws->bev, EV_READ,
+			BEV_TRIG_IGNORE_WATERMARKS | BEV_TRIG_DEFER_CALLBACKS);
+	}
+}
+
+int ws_is_read_paused(ws_t ws)
+{
+	assert(ws);
+	return ws->read_paused;
+}
+
+void ws_set_read_watermark(ws_t ws, size_t high_watermark)
+{
+	assert(ws);
+
+	ws->read_watermark = high_watermark;
+
+	if (ws->bev)
+	{
+		bufferevent_setwatermark(ws->bev, EV_READ, 0, high_watermark);
+	}
+}
+
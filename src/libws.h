@@ -29,6 +29,28 @@ int ws_global_init(ws_base_t *base);
 ///
 void ws_global_destroy(ws_base_t *base);
 
+///
+/// Makes libevent and OpenSSL allocate through libws, so that the memory
+/// they use for a connection is included in #ws_get_memory_usage and
+/// the memory limits. Without this only the memory libws allocates
+/// itself is accounted for.
+///
+/// This replaces the memory functions of libevent and OpenSSL for the
+/// whole process, including any use of them outside of libws. Every block
+/// libevent allocates afterwards has a header that libws expects when it
+/// is freed. So this must be called before anything in the process
+/// has used libevent, and before the first #ws_global_init. Blocks
+/// allocated before would corrupt the heap when freed. OpenSSL refuses
+/// the change if it has already allocated memory, its memory is then
+/// not accounted for.
+///
+/// #ws_set_memory_functions also does this.
+///
+/// @returns 	0 on success, -1 if called after #ws_global_init or if
+///				compiled with -DLIBWS_WITH_MEMORY_ACCOUNTING=OFF.
+///
+int ws_install_memory_hooks();
+
 ///
 /// Replaces the libraries memory handling functions.
 /// If any of the values are set to NULL, the default will be used.
@@ -38,6 +60,17 @@ void ws_global_destroy(ws_base_t *base);
 ///		  realloc(NULL, size) is the same as malloc(size).
 ///		  realloc(ptr, 0) is the same as free(ptr).
 ///		  They must be threadsafe if you're using them from several threads.
+///		  Set them before #ws_global_init and don't change them later,
+///		  libevent and OpenSSL might free memory as late as at exit.
+///		  With LIBWS_WITH_MEMORY_ACCOUNTING this also calls
+///		  #ws_install_memory_hooks, with the same ordering requirements.
+///
+/// Freed blocks of up to 64kb are kept per thread and reused, so
+/// sending and receiving messages of a bounded size doesn't call
+/// these once a connection is set up. A thread gives its blocks back
+/// when it exits, and after #ws_global_destroy the next time it
+/// allocates or frees memory (requires LIBWS_WITH_MEMORY_ACCOUNTING
+/// and thread local storage).
 ///
 /// @param[in]	malloc_replace 	The malloc replacement function.
 /// @param[in]	free_replace 	The free replacement function.
@@ -47,6 +80,33 @@ void ws_set_memory_functions(ws_malloc_replacement_f malloc_replace,
 							 ws_free_replacement_f free_replace,
 							 ws_realloc_replacement_f realloc_replace);
 
+///
+/// Sets the allocator used for the connections of a base.
+///
+/// Connection contexts are carved out of larger chunks that are
+/// kept by the base, and incoming messages are assembled in
+/// scratch memory that is recycled after each message callback.
+/// So once a base has warmed up, new connections and messages don't
+/// allocate anything. The chunks come from these functions.
+///
+/// Set all functions to NULL to go back to the functions
+/// set with #ws_set_memory_functions (the default).
+///
+/// @note Can only be changed while the base has no connections.
+///		  The functions are only called from the thread running the base.
+///
+/// @param[in]	base 		The base.
+/// @param[in]	malloc_fn 	The malloc function.
+/// @param[in]	free_fn 	The free function.
+/// @param[in]	realloc_fn 	The realloc function.
+/// @param[in]	ctx 		Passed as the first argument to the functions.
+///
+/// @returns 0 on success. -1 on failure.
+///
+int ws_base_set_allocator(ws_base_t base, ws_base_malloc_f malloc_fn,
+						ws_base_free_f free_fn, ws_base_realloc_f realloc_fn,
+						void *ctx);
+
 ///
 /// Initializes a new Websocket connection context and ties
 /// it to a global context.
@@ -66,7 +126,110 @@ int ws_init(ws_t *ws, ws_base_t base);
 void ws_destroy(ws_t *ws);
 
 ///
-/// Gets the websocket base context that the given websocket 
+/// Creates a connection template. A template holds the configuration
+/// that many connections have in common, so that setting up each one
+/// only costs a reference. See #ws_init_from_template.
+///
+/// The handshake request is rendered once per server, port and uri,
+/// only the key is filled in for each connection.
+///
+/// @param[out]	tmpl 	The template.
+/// @param[in]	base 	The global websocket context.
+///
+/// @returns			0 on success.
+///
+int ws_template_new(ws_template_t *tmpl, ws_base_t base);
+
+///
+/// Releases a connection template. Connections created from it
+/// keep their own reference, so it is freed with the last one.
+///
+/// @param[in]	tmpl 	The template.
+///
+void ws_template_free(ws_template_t *tmpl);
+
+///
+/// Sets the callback table connections created from
+/// the template will use. See #ws_set_callbacks.
+///
+/// @param[in]	tmpl 	The template.
+/// @param[in]	cbs		The callback table.
+///
+void ws_template_set_callbacks(ws_template_t tmpl, ws_callbacks_t *cbs);
+
+///
+/// Gets the callback table of a template.
+///
+/// @param[in]	tmpl 	The template.
+///
+/// @returns The callback table, owned by the template.
+///
+ws_callbacks_t *ws_template_get_callbacks(ws_template_t tmpl);
+
+///
+/// Sets the origin for connections created from the template.
+/// See #ws_set_origin.
+///
+/// Like the subprotocols, this is shared by reference, don't change
+/// it while connections are using the template unless the change is
+/// meant for all of them.
+///
+/// @param[in]	tmpl 	The template.
+/// @param[in]	origin 	The origin.
+///
+/// @returns			0 on success.
+///
+int ws_template_set_origin(ws_template_t tmpl, const char *origin);
+
+///
+/// Adds a subprotocol for connections created from the template.
+/// Subprotocols added to a connection replace the ones of its template.
+/// See #ws_add_subprotocol.
+///
+/// @param[in]	tmpl 		The template.
+/// @param[in]	subprotocol The subprotocol.
+///
+/// @returns				0 on success.
+///
+int ws_template_add_subprotocol(ws_template_t tmpl, const char *subprotocol);
+
+///
+/// Sets the max frame size for connections created from
+/// the template. See #ws_set_max_frame_size.
+///
+/// @param[in]	tmpl 			The template.
+/// @param[in]	max_frame_size 	The max frame size.
+///
+/// @returns					0 on success.
+///
+int ws_template_set_max_frame_size(ws_template_t tmpl, uint64_t max_frame_size);
+
+#ifdef LIBWS_WITH_OPENSSL
+///
+/// Sets the SSL state for connections created from
+/// the template. See #ws_set_ssl_state.
+///
+/// @param[in]	tmpl 	The template.
+/// @param[in]	ssl 	The SSL state.
+///
+void ws_template_set_ssl_state(ws_template_t tmpl, libws_ssl_state_t ssl);
+#endif // LIBWS_WITH_OPENSSL
+
+///
+/// Initializes a new Websocket connection context using
+/// the configuration of a template, see #ws_init.
+///
+/// The connection can still be configured as usual afterwards.
+///
+/// @param[out]	ws 		Websocket context.
+/// @param[in]	tmpl 	The template.
+///
+/// @returns			0 on success.
+///
+int ws_init_from_template(ws_t *ws, ws_template_t tmpl);
+
+///
+/// Gets the websocket base context that the given websocket
 /// session belongs to.
 ///
 /// @param[in]	ws 	The websocket context.
@@ -312,6 +475,78 @@ int ws_set_max_frame_size(ws_t ws, uint64_t max_frame_size);
 ///
 uint64_t ws_get_max_frame_size(ws_t ws);
 
+///
+/// Sets the max size of a received message. The size of a fragmented
+/// message is checked as each frame header arrives, so the connection
+/// is closed with #WS_CLOSE_STATUS_MESSAGE_TOO_BIG_1009 before the
+/// payload that goes over the limit is buffered.
+///
+/// @param[in]	ws 					The websocket session context.
+/// @param[in]	max_message_size 	The max size in bytes. 0 means no limit.
+///
+/// @returns						0 on success.
+///
+int ws_set_max_message_size(ws_t ws, uint64_t max_message_size);
+
+///
+/// Gets the max size of a received message.
+/// See #ws_set_max_message_size.
+///
+/// @param[in]	ws 	The websocket session context.
+///
+/// @returns		The max message size, 0 if there is no limit.
+///
+uint64_t ws_get_max_message_size(ws_t ws);
+
+///
+/// Sets the max size of a received frame. Frames that declare a larger
+/// payload length close the connection with
+/// #WS_CLOSE_STATUS_MESSAGE_TOO_BIG_1009 without reading the payload.
+/// Unlike #ws_set_max_frame_size this only applies to received frames.
+///
+/// @param[in]	ws 						The websocket session context.
+/// @param[in]	max_frame_size_recv 	The max size in bytes. 0 means no limit.
+///
+/// @returns							0 on success.
+///
+int ws_set_max_frame_size_recv(ws_t ws, uint64_t max_frame_size_recv);
+
+///
+/// Gets the max size of a received frame.
+/// See #ws_set_max_frame_size_recv.
+///
+/// @param[in]	ws 	The websocket session context.
+///
+/// @returns		The max frame size, 0 if there is no limit.
+///
+uint64_t ws_get_max_frame_size_recv(ws_t ws);
+
+///
+/// Sets the max size of the HTTP upgrade response from the server,
+/// including the status line and headers. Larger responses fail
+/// the connection. Defaults to #WS_DEFAULT_MAX_HANDSHAKE_SIZE.
+///
+/// The response is parsed in place, so the header callback gets
+/// the headers without them being copied. They are only valid
+/// during the callback.
+///
+/// @param[in]	ws 					The websocket session context.
+/// @param[in]	max_handshake_size 	The max size in bytes.
+///
+/// @returns						0 on success.
+///
+int ws_set_max_handshake_size(ws_t ws, size_t max_handshake_size);
+
+///
+/// Gets the max size of the HTTP upgrade response.
+/// See #ws_set_max_handshake_size.
+///
+/// @param[in]	ws 	The websocket session context.
+///
+/// @returns		The max size in bytes.
+///
+size_t ws_get_max_handshake_size(ws_t ws);
+
 ///
 /// Get the header for the current websocket frame being read.
 ///
@@ -323,6 +558,57 @@ uint64_t ws_get_max_frame_size(ws_t ws);
 ///
 ws_header_t *ws_get_header(ws_t ws);
 
+///
+/// Creates a callback table with the default callbacks set.
+/// It can be shared by many connections using #ws_set_callbacks.
+///
+/// @returns A callback table with a reference count of 1,
+///          or NULL if out of memory.
+///
+ws_callbacks_t *ws_callbacks_new();
+
+///
+/// Takes a reference to a callback table.
+///
+/// @param[in]	cbs		The callback table.
+///
+/// @returns The callback table.
+///
+ws_callbacks_t *ws_callbacks_ref(ws_callbacks_t *cbs);
+
+///
+/// Releases a reference to a callback table,
+/// it is freed when the last one is released.
+///
+/// @param[in]	cbs		The callback table.
+///
+void ws_callbacks_unref(ws_callbacks_t *cbs);
+
+///
+/// Makes a connection use a callback table. The connection takes its
+/// own reference, so the caller can release theirs right away.
+///
+/// Don't change a table while connections are using it, unless
+/// the change is meant for all of them.
+///
+/// The ws_set_*_cb functions give a connection that shares its table
+/// its own copy before changing it. If that copy can't be allocated
+/// the callback is not changed, and an error is logged.
+///
+/// @param[in]	ws 		The websocket session context.
+/// @param[in]	cbs		The callback table.
+///
+void ws_set_callbacks(ws_t ws, ws_callbacks_t *cbs);
+
+///
+/// Gets the callback table a connection uses.
+///
+/// @param[in]	ws 		The websocket session context.
+///
+/// @returns The callback table, owned by the connection.
+///
+ws_callbacks_t *ws_get_callbacks(ws_t ws);
+
 ///
 /// Sets the on connect callback function.
 ///
@@ -350,6 +636,72 @@ void ws_set_onconnect_cb(ws_t ws, ws_connect_callback_f func, void *arg);
 /// 
 void ws_set_onmsg_cb(ws_t ws, ws_msg_callback_f func, void *arg);
 
+///
+/// Gets a handle to the message being delivered, so it can be kept
+/// after the message callback returns without copying it. Only valid
+/// from within a callback set using #ws_set_onmsg_cb.
+///
+/// The handle is released by the library when the callback returns,
+/// take a reference with #ws_msg_retain to keep it.
+///
+/// @ingroup MessageAPI Message based API
+///
+/// @param[in]	ws 	The websocket session context.
+///
+/// @returns		The handle, or NULL if no message is being
+///					delivered or out of memory.
+///
+ws_msg_t *ws_get_msg(ws_t ws);
+
+///
+/// Gets the payload of a message, it is NUL terminated.
+///
+/// @param[in]	msg 	The message handle.
+///
+/// @returns			The payload.
+///
+const char *ws_msg_data(const ws_msg_t *msg);
+
+///
+/// Gets the length of a message payload.
+///
+/// @param[in]	msg 	The message handle.
+///
+/// @returns			The payload length.
+///
+uint64_t ws_msg_len(const ws_msg_t *msg);
+
+///
+/// Returns if a message is binary.
+///
+/// @param[in]	msg 	The message handle.
+///
+/// @returns			1 if binary, 0 if text.
+///
+int ws_msg_is_binary(const ws_msg_t *msg);
+
+///
+/// Takes a reference to a message, see #ws_get_msg.
+///
+/// The references are counted atomically, so a message can be handed
+/// to another thread and released there. Its memory is given back by
+/// the thread that created the base, the next time it gets a handle.
+/// All handles must be released before #ws_global_destroy.
+///
+/// @param[in]	msg 	The message handle.
+///
+/// @returns			The message handle.
+///
+ws_msg_t *ws_msg_retain(ws_msg_t *msg);
+
+///
+/// Releases a reference to a message, it is freed when
+/// the last one is released. See #ws_msg_retain.
+///
+/// @param[in]	msg 	The message handle.
+///
+void ws_msg_release(ws_msg_t *msg);
+
 /// @defgroup FrameAPI Frame based API
 /// @{
 
@@ -429,6 +781,20 @@ void ws_set_onmsg_frame_cb(ws_t ws, ws_msg_frame_callback_f func, void *arg);
 /// 
 void ws_set_onmsg_end_cb(ws_t ws, ws_msg_end_callback_f func, void *arg);
 
+///
+/// Sets the message abort callback function. It is called instead of
+/// the message end callback when a message that has begun is dropped,
+/// because it went over #ws_set_max_message_size, #ws_set_max_frame_size_recv
+/// or the memory limit. The connection is closed right after.
+///
+/// @see ws_set_onmsg_begin_cb, ws_set_onmsg_end_cb
+///
+/// @param[in]	ws 		The websocket session context.
+/// @param[in]	func 	The callback function, NULL for none.
+/// @param[in]	arg		User context passed to the callback.
+///
+void ws_set_onmsg_abort_cb(ws_t ws, ws_msg_abort_callback_f func, void *arg);
+
 // TODO: Add a note about how overriding these functions will result in message not being assembled unless the default handlers are called from within the overriden versions.
 /// @defgroup StreamAPI Stream based API
 /// @{
@@ -515,6 +881,36 @@ void ws_set_onmsg_frame_end_cb(ws_t ws, ws_msg_frame_end_callback_f func,
 /// @}
 /// @}
 
+///
+/// Makes received messages land in buffers owned by the application,
+/// such as a ring buffer or a pool of pinned memory, instead of being
+/// assembled by the library. The payload is unmasked and validated
+/// in place. None of the message or frame callbacks are called.
+///
+/// When payload for a data frame arrives, @p alloc_cb is asked for a
+/// buffer. On input its length is what is left of the frame, and it
+/// may lower it to hand out a smaller chunk. Returning NULL closes the
+/// connection with #WS_CLOSE_STATUS_UNEXPECTED_CONDITION_1011.
+///
+/// Once a buffer has been filled it is passed to @p commit_cb, with
+/// msg_end set for the last one of the message. An empty final frame
+/// is committed as a NULL buffer. A buffer that is not full when the
+/// connection closes is never committed.
+///
+/// If a message goes over the receive limits after it has begun, the
+/// buffer being filled is committed with what it holds so far (NULL if
+/// there is none) and msg_end set to #WS_RECV_MSG_ABORTED, before the
+/// connection is closed. Everything committed for the message can then
+/// be thrown away.
+///
+/// @param[in]	ws 			The websocket session context.
+/// @param[in]	alloc_cb 	Hands out buffers, NULL to turn this off.
+/// @param[in]	commit_cb 	Gets the filled buffers, NULL to turn this off.
+/// @param[in]	arg			User context passed to both callbacks.
+///
+void ws_set_recv_buffer_provider(ws_t ws, ws_recv_alloc_callback_f alloc_cb,
+						ws_recv_commit_callback_f commit_cb, void *arg);
+
 ///
 /// Sets the on error callback function.
 ///
@@ -526,6 +922,19 @@ void ws_set_onmsg_frame_end_cb(ws_t ws, ws_msg_frame_end_callback_f func,
 /// 
 void ws_set_onerr_cb(ws_t ws, ws_err_callback_f func, void *arg);
 
+///
+/// Sets a callback that gets each header of the HTTP upgrade
+/// response from the server. Returning non-zero fails the connection.
+///
+/// The name and value point into the received response and
+/// are only valid during the callback.
+///
+/// @param[in]	ws 		The websocket session context.
+/// @param[in]	func 	The callback function.
+/// @param[in]	arg		User context passed to the callback.
+///
+void ws_set_header_cb(ws_t ws, ws_header_callback_f func, void *arg);
+
 ///
 /// Sets the on close callback function.
 ///
@@ -595,6 +1004,28 @@ void ws_default_onpong_cb(ws_t ws, char *msg, uint64_t len,
 ///
 void ws_set_onping_cb(ws_t ws, ws_msg_callback_f func, void *arg);
 
+///
+/// Makes the default ping callback answer only the latest ping of
+/// each read, instead of sending a pong for every ping. The pong is
+/// sent once all the input read from the socket has been handled.
+/// RFC 6455 allows answering only the most recent ping, so a peer
+/// flooding us with pings gets one pong per read.
+///
+/// If a minimum interval is given, pongs are also sent at most
+/// that often. The latest ping received in between is answered
+/// when the interval is up.
+///
+/// Pings that are never answered are counted in
+/// ws_stats_t#pongs_suppressed. Has no effect if a ping callback is
+/// set, unless it calls #ws_default_onping_cb.
+///
+/// @param[in]	ws 				The websocket session context.
+/// @param[in]	enabled 		Non-zero to coalesce pongs, 0 to answer
+///								every ping right away.
+/// @param[in]	min_interval	Min time between pongs, 0 for no limit.
+///
+void ws_set_pong_coalescing(ws_t ws, int enabled, struct timeval min_interval);
+
 ///
 /// Sets the on pong callback function for when a ping websocket
 /// frame is received. 
@@ -616,6 +1047,44 @@ void ws_set_onpong_cb(ws_t ws, ws_msg_callback_f func, void *arg);
 void ws_set_pong_timeout_cb(ws_t ws, ws_timeout_callback_f func, 
 							struct timeval timeout, void *arg);
 
+///
+/// Makes the library send pings on its own to keep the connection
+/// alive and to detect dead peers. The round trip time of each ping
+/// is measured, see ws_get_rtt_stats.
+///
+/// If no pong is received within the timeout the connection is
+/// closed uncleanly, and the close callback is called with
+/// #WS_CLOSE_STATUS_ABNORMAL_1006. The pongs to these pings are not
+/// passed to the pong callback.
+///
+/// The first ping of each connection in a base is staggered over
+/// the interval, so that connections opened at the same time don't
+/// all ping at once.
+///
+/// @param[in]	ws 				The websocket session context.
+/// @param[in]	interval 		Time between pings, 0 disables keepalive.
+/// @param[in]	timeout 		Time to wait for a pong reply, if 0 the
+///								interval is used.
+/// @param[in]	skip_if_active	Skip the ping if data was received within
+///								the last interval.
+///
+/// @returns 					0 on success.
+///
+int ws_set_keepalive(ws_t ws, struct timeval interval, 
+					struct timeval timeout, int skip_if_active);
+
+///
+/// Gets the round trip times measured by the keepalive pings
+/// of the current (or last) connection.
+///
+/// @param[in]	ws 		The websocket session context.
+/// @param[out]	stats 	Set to the round trip times.
+///
+/// @returns 			0 on success, -1 if no round trip
+///						has been measured yet.
+///
+int ws_get_rtt_stats(ws_t ws, ws_rtt_stats_t *stats);
+
 ///
 /// Adds a HTTP header to the initial connection handshake.
 ///
@@ -808,8 +1277,258 @@ int ws_clear_subprotocols(ws_t ws);
 ///
 void ws_set_ssl_state(ws_t ws, libws_ssl_state_t ssl);
 
+///
+/// Loads trusted CA certificates into the SSL context shared by all
+/// connections of the base, and enables verification of the server
+/// certificate and hostname for connections not allowing self-signed
+/// certificates.
+///
+/// @param[in]	base 	The global websocket context.
+/// @param[in]	ca_file A PEM file with CA certificates, or NULL.
+/// @param[in]	ca_path A directory with hashed CA certificates, or NULL.
+///						If both are NULL the OpenSSL defaults are used.
+///
+/// @returns 			0 on success.
+///
+int ws_base_set_ssl_ca_paths(ws_base_t base, const char *ca_file,
+							const char *ca_path);
+
+///
+/// Sets the allowed ciphers for all connections of the base.
+///
+/// @param[in]	base 	The global websocket context.
+/// @param[in]	ciphers An OpenSSL cipher list string.
+///
+/// @returns 			0 on success.
+///
+int ws_base_set_ssl_ciphers(ws_base_t base, const char *ciphers);
+
+///
+/// Sets the minimum TLS version allowed for all connections of the base.
+///
+/// @param[in]	base 	The global websocket context.
+/// @param[in]	version The minimum TLS version.
+///
+/// @returns 			0 on success.
+///
+int ws_base_set_ssl_min_version(ws_base_t base, libws_tls_version_t version);
+
+///
+/// Sets the ALPN protocols offered by all connections of the base.
+///
+/// @param[in]	base 		The global websocket context.
+/// @param[in]	protos 		Protocol list in wire format, each name
+///							prefixed by its length. E.g. "\x08http/1.1"
+/// @param[in]	protos_len 	Length of the protocol list.
+///
+/// @returns 				0 on success.
+///
+int ws_base_set_ssl_alpn(ws_base_t base, const unsigned char *protos,
+						unsigned int protos_len);
+
+///
+/// Sets the max number of client TLS sessions cached by the base.
+/// Sessions are cached per server "host:port" and used to resume
+/// the TLS session on the next connection, skipping a full handshake.
+///
+/// Default is #WS_DEFAULT_SSL_SESSION_CACHE_SIZE.
+///
+/// @param[in]	base 			The global websocket context.
+/// @param[in]	max_sessions 	Max number of sessions, 0 disables resumption.
+///
+void ws_base_set_ssl_session_cache(ws_base_t base, size_t max_sessions);
+
+///
+/// Gets the number of TLS sessions currently cached by the base.
+///
+/// @param[in]	base 	The global websocket context.
+///
+/// @returns 			The number of cached sessions.
+///
+size_t ws_base_get_ssl_session_count(ws_base_t base);
+
+///
+/// Checks if the last TLS connection resumed a cached session.
+///
+/// @param[in]	ws 	The websocket session context.
+///
+/// @returns 		1 if the session was resumed, otherwise 0.
+///
+int ws_is_ssl_session_reused(ws_t ws);
+
+///
+/// Sends the websocket handshake as TLS 1.3 early data (0-RTT) when
+/// resuming a cached session that allows it, saving a round trip
+/// on reconnect. If the server rejects the early data, the handshake
+/// is sent again once the TLS handshake is complete.
+///
+/// Disabled by default.
+///
+/// @warning Early data is not protected against replay. An attacker
+///			 can resend the upgrade request to the server, so only enable
+///			 this if opening a websocket has no side effects on the server
+///			 that would be harmful if repeated. Messages are never sent
+///			 as early data, only the HTTP upgrade request.
+///
+/// @param[in]	ws 		The websocket session context.
+/// @param[in]	enabled Set to 1 to enable early data.
+///
+void ws_set_ssl_early_data(ws_t ws, int enabled);
+
+///
+/// Checks if the server accepted the handshake sent as early data
+/// for the last connection.
+///
+/// @param[in]	ws 	The websocket session context.
+///
+/// @returns 		1 if the early data was accepted, otherwise 0.
+///
+int ws_is_ssl_early_data_accepted(ws_t ws);
+
+///
+/// Sets the TLS record sizing policy for the connection.
+///
+/// After being idle, data is sent in small records that fit in a single
+/// TCP segment, so the receiver can decrypt the first message as soon as
+/// the first packet arrives. Once ramp_bytes have been sent without being
+/// idle, large records are used to reduce the per record overhead for
+/// sustained transfers. Bytes count as sent once they have been written
+/// to the socket, not when they are queued, and the connection is idle
+/// once everything queued has been written.
+///
+/// The defaults are #WS_DEFAULT_TLS_RECORD_SMALL,
+/// #WS_DEFAULT_TLS_RECORD_LARGE, #WS_DEFAULT_TLS_RECORD_RAMP and
+/// #WS_DEFAULT_TLS_RECORD_IDLE_MS. The policy is disabled by default,
+/// in which case OpenSSL uses records of up to 16 KB.
+///
+/// Since small records only help if they are sent right away,
+/// Nagle's algorithm is turned off for connections using the policy.
+///
+/// @param[in]	ws 			The websocket session context.
+/// @param[in]	small_size 	Record size after being idle, at least 512 bytes.
+///							Set to 0 to disable the policy.
+/// @param[in]	large_size 	Record size for sustained transfers,
+///							at most 16384 bytes.
+/// @param[in]	ramp_bytes 	Bytes to send in small records before
+///							switching to large records.
+/// @param[in]	idle 		Time without sending before the connection
+///							is considered idle.
+///
+/// @returns 				0 on success.
+///
+int ws_set_tls_record_policy(ws_t ws, size_t small_size, size_t large_size,
+							size_t ramp_bytes, struct timeval idle);
+
 #endif // LIBWS_WITH_OPENSSL
 
+///
+/// Gets the traffic statistics for the connection. The counters
+/// keep counting across reconnects of the same websocket context.
+///
+/// The counters are removed when compiling
+/// with -DLIBWS_WITH_STATS=OFF.
+///
+/// @param[in]	ws 		The websocket session context.
+/// @param[out]	stats 	Set to the current statistics.
+///
+/// @returns 			0 on success, -1 if compiled
+///						without statistics support.
+///
+int ws_get_stats(ws_t ws, ws_stats_t *stats);
+
+///
+/// Gets the metrics for all connections of a base.
+///
+/// Each thread counts into its own set of counters, these are
+/// summed up here. While other threads are running the result is
+/// not an exact snapshot, but no locks are taken when counting.
+///
+/// @param[in]	base 	 The base to get the metrics for.
+/// @param[out]	metrics Set to the current metrics.
+///
+/// @returns 			 0 on success, -1 if compiled
+///						 without statistics support.
+///
+int ws_base_get_metrics(ws_base_t base, ws_base_metrics_t *metrics);
+
+///
+/// Writes the metrics for a base as text, ready to be served
+/// to a Prometheus scraper or as JSON.
+///
+/// @param[in]	base 	The base to get the metrics for.
+/// @param[out]	buf 	The buffer to write to, NUL terminated.
+/// @param[in]	len 	Size of the buffer, 4096 bytes is plenty.
+/// @param[in]	format 	#WS_METRICS_PROMETHEUS or #WS_METRICS_JSON.
+///
+/// @returns 			The length of the text written, or -1 if the
+///						buffer is too small.
+///
+int ws_base_write_metrics(ws_base_t base, char *buf, size_t len,
+						ws_metrics_format_t format);
+
+///
+/// Gets the memory used by a connection. This includes what libevent
+/// and OpenSSL allocate while working on the connection, such as its
+/// socket, send buffer and TLS state, as well as the message being
+/// received. Memory libevent allocates on its own, such as the
+/// buffers it reads the socket into, isn't tied to a connection.
+///
+/// Memory from an allocator set with #ws_base_set_allocator
+/// is not counted.
+///
+/// The accounting is removed when compiling
+/// with -DLIBWS_WITH_MEMORY_ACCOUNTING=OFF.
+///
+/// @param[in]	ws 		The websocket context.
+/// @param[out]	bytes 	Set to the bytes currently in use.
+/// @param[out]	peak 	Set to the most bytes in use at once. Can be NULL.
+///
+/// @returns 			0 on success, -1 if compiled
+///						without memory accounting.
+///
+int ws_get_memory_usage(ws_t ws, size_t *bytes, size_t *peak);
+
+///
+/// Sets a limit for the memory a connection may use, see
+/// #ws_get_memory_usage. A connection that goes over it is closed
+/// with #WS_CLOSE_STATUS_MESSAGE_TOO_BIG_1009 if it was receiving a
+/// message, or #WS_CLOSE_STATUS_POLICY_VIOLATION_1008 otherwise.
+///
+/// @param[in]	ws 		The websocket context.
+/// @param[in]	limit 	The limit in bytes, 0 for no limit (the default).
+///
+/// @returns 			0 on success, -1 if compiled
+///						without memory accounting.
+///
+int ws_set_memory_limit(ws_t ws, size_t limit);
+
+///
+/// Gets the memory used by a base and all of its connections.
+///
+/// @see ws_get_memory_usage
+///
+/// @param[in]	base 	The base.
+/// @param[out]	bytes 	Set to the bytes currently in use.
+/// @param[out]	peak 	Set to the most bytes in use at once. Can be NULL.
+///
+/// @returns 			0 on success, -1 if compiled
+///						without memory accounting.
+///
+int ws_base_get_memory_usage(ws_base_t base, size_t *bytes, size_t *peak);
+
+///
+/// Sets a limit for the memory a base and all of its connections may
+/// use. When it is reached, the connection that allocated the last
+/// byte is closed the same way as with #ws_set_memory_limit.
+///
+/// @param[in]	base 	The base.
+/// @param[in]	limit 	The limit in bytes, 0 for no limit (the default).
+///
+/// @returns 			0 on success, -1 if compiled
+///						without memory accounting.
+///
+int ws_base_set_memory_limit(ws_base_t base, size_t limit);
+
 ///
 /// Convert a parse state enum value into a readable string.
 ///
@@ -826,5 +1545,44 @@ const char *ws_parse_state_to_string(ws_parse_state_t state);
 void ws_set_rate_limits(ws_t ws, size_t read_rate, size_t read_burst, 
 						size_t write_rate, size_t write_burst);
 
+///
+/// Stops reading from the connection, so the peer is slowed down by
+/// TCP flow control when the application can't keep up.
+///
+/// When called from a message callback, the rest of the already
+/// received input is not parsed until #ws_resume_read is called.
+/// Control frames are not answered while paused either.
+///
+/// @param[in]	ws 	The websocket session context.
+///
+void ws_pause_read(ws_t ws);
+
+///
+/// Resumes reading after #ws_pause_read. Input that was received
+/// before pausing is parsed from the event loop, not from this call.
+///
+/// @param[in]	ws 	The websocket session context.
+///
+void ws_resume_read(ws_t ws);
+
+///
+/// Returns if reading is paused. See #ws_pause_read.
+///
+/// @param[in]	ws 	The websocket session context.
+///
+/// @returns		1 if paused, 0 otherwise.
+///
+int ws_is_read_paused(ws_t ws);
+
+///
+/// Sets the max amount of received data to buffer before the
+/// library stops reading from the socket. Reading continues once
+/// the buffered input has been parsed.
+///
+/// @param[in]	ws 				The websocket session context.
+/// @param[in]	high_watermark 	The max in bytes, 0 means no limit.
+///
+void ws_set_read_watermark(ws_t ws, size_t high_watermark);
+
 #endif // __LIBWS_H__
 
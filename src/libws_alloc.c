@@ -0,0 +1,702 @@
+#include "libws_config.h"
+#include <assert.h>
+#include <string.h>
+#include <stdint.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+#include "libws_log.h"
+#include "libws_private.h"
+#include "libws_alloc.h"
+
+#define WS_ALIGN_UP(n, a) (((n) + ((a) - 1)) & ~((size_t)(a) - 1))
+#define WS_ARENA_ALIGN 16
+#define WS_ARENA_BLOCK_DATA(b) ((char *)((b) + 1))
+#define WS_ARENA_SMALL_SIZE (WS_ARENA_BLOCK_SIZE - sizeof(ws_arena_block_t))
+
+#ifdef LIBWS_WITH_MEMORY_ACCOUNTING
+LIBWS_THREAD_LOCAL ws_mem_account_t *_ws_mem_current;
+#endif
+
+void *_ws_allocator_malloc(ws_allocator_t *alloc, size_t size)
+{
+	assert(alloc);
+
+	if (!alloc->malloc_fn)
+	{
+		return _ws_malloc(size);
+	}
+
+	if (size == 0)
+		return NULL;
+
+	_WS_STATS(_ws_metrics_alloc_shard()->allocs++);
+
+	return alloc->malloc_fn(alloc->ctx, size);
+}
+
+void *_ws_allocator_calloc(ws_allocator_t *alloc, size_t count, size_t size)
+{
+	void *p;
+	assert(alloc);
+
+	if (!alloc->malloc_fn)
+	{
+		return _ws_calloc(count, size);
+	}
+
+	if (!count || !size)
+		return NULL;
+
+	if ((p = _ws_allocator_malloc(alloc, count * size)))
+	{
+		memset(p, 0, count * size);
+	}
+
+	return p;
+}
+
+void *_ws_allocator_realloc(ws_allocator_t *alloc, void *ptr, size_t size)
+{
+	assert(alloc);
+
+	if (!alloc->realloc_fn)
+	{
+		return _ws_realloc(ptr, size);
+	}
+
+	_WS_STATS(if (!ptr) _ws_metrics_alloc_shard()->allocs++);
+
+	return alloc->realloc_fn(alloc->ctx, ptr, size);
+}
+
+void _ws_allocator_free(ws_allocator_t *alloc, void *ptr)
+{
+	assert(alloc);
+
+	if (!alloc->free_fn)
+	{
+		_ws_free(ptr);
+		return;
+	}
+
+	if (!ptr)
+		return;
+
+	_WS_STATS(_ws_metrics_alloc_shard()->frees++);
+
+	alloc->free_fn(alloc->ctx, ptr);
+}
+
+char *_ws_allocator_strdup(ws_allocator_t *alloc, const char *str)
+{
+	size_t len;
+	char *p;
+	assert(alloc);
+
+	if (!alloc->malloc_fn)
+	{
+		return _ws_strdup(str);
+	}
+
+	if (!str)
+		return NULL;
+
+	len = strlen(str);
+
+	if ((p = (char *)_ws_allocator_malloc(alloc, len + 1)))
+	{
+		memcpy(p, str, len + 1);
+	}
+
+	return p;
+}
+
+void _ws_slab_init(ws_slab_t *slab, ws_allocator_t *alloc,
+					size_t obj_size, size_t per_chunk)
+{
+	assert(slab);
+	assert(alloc);
+	assert(obj_size >= sizeof(void *));
+	assert(per_chunk > 0);
+
+	memset(slab, 0, sizeof(ws_slab_t));
+	slab->alloc = alloc;
+	slab->obj_size = WS_ALIGN_UP(obj_size, WS_SLAB_ALIGN);
+	slab->per_chunk = per_chunk;
+}
+
+void _ws_slab_destroy(ws_slab_t *slab)
+{
+	ws_slab_chunk_t *chunk;
+	ws_slab_chunk_t *next;
+	assert(slab);
+
+	if (slab->in_use)
+	{
+		LIBWS_LOG(LIBWS_WARN, "Freeing slab with %lu objects in use",
+				(unsigned long)slab->in_use);
+	}
+
+	for (chunk = slab->chunks; chunk; chunk = next)
+	{
+		next = chunk->next;
+		_ws_allocator_free(slab->alloc, chunk);
+	}
+
+	slab->chunks = NULL;
+	slab->free_list = NULL;
+	slab->in_use = 0;
+}
+
+static int _ws_slab_grow(ws_slab_t *slab)
+{
+	size_t i;
+	char *first;
+	ws_slab_chunk_t *chunk;
+	#ifdef LIBWS_WITH_MEMORY_ACCOUNTING
+	ws_mem_account_t *prev = _ws_mem_enter(slab->alloc->account);
+	#endif
+
+	chunk = (ws_slab_chunk_t *)_ws_allocator_malloc(slab->alloc,
+					sizeof(ws_slab_chunk_t) + (WS_SLAB_ALIGN - 1)
+					+ (slab->obj_size * slab->per_chunk));
+
+	#ifdef LIBWS_WITH_MEMORY_ACCOUNTING
+	_ws_mem_leave(prev);
+	#endif
+
+	if (!chunk)
+	{
+		LIBWS_LOG(LIBWS_CRIT, "Out of memory!");
+		return -1;
+	}
+
+	chunk->next = slab->chunks;
+	slab->chunks = chunk;
+
+	first = (char *)WS_ALIGN_UP((uintptr_t)(chunk + 1), WS_SLAB_ALIGN);
+
+	// Backwards, so the objects are handed out in address order.
+	for (i = slab->per_chunk; i > 0; i--)
+	{
+		void *obj = first + ((i - 1) * slab->obj_size);
+		*((void **)obj) = slab->free_list;
+		slab->free_list = obj;
+	}
+
+	return 0;
+}
+
+void *_ws_slab_alloc(ws_slab_t *slab)
+{
+	void *obj;
+	assert(slab);
+
+	if (!slab->free_list && _ws_slab_grow(slab))
+	{
+		return NULL;
+	}
+
+	obj = slab->free_list;
+	slab->free_list = *((void **)obj);
+	slab->in_use++;
+
+	return obj;
+}
+
+void _ws_slab_free(ws_slab_t *slab, void *obj)
+{
+	assert(slab);
+	assert(slab->in_use > 0);
+
+	if (!obj)
+		return;
+
+	*((void **)obj) = slab->free_list;
+	slab->free_list = obj;
+	slab->in_use--;
+}
+
+static void _ws_arena_block_free(ws_slab_t *blocks, ws_arena_block_t *b)
+{
+	if (b->size == WS_ARENA_SMALL_SIZE)
+	{
+		_ws_slab_free(blocks, b);
+	}
+	else
+	{
+		_ws_allocator_free(blocks->alloc, b);
+	}
+}
+
+void *_ws_arena_alloc(ws_arena_t *arena, ws_slab_t *blocks, size_t size)
+{
+	ws_arena_block_t *b;
+	assert(arena);
+	assert(blocks);
+
+	b = arena->blocks;
+	size = WS_ALIGN_UP(size, WS_ARENA_ALIGN);
+
+	if (!b || ((b->size - b->used) < size))
+	{
+		if (size <= WS_ARENA_SMALL_SIZE)
+		{
+			if (!(b = (ws_arena_block_t *)_ws_slab_alloc(blocks)))
+			{
+				return NULL;
+			}
+
+			b->size = WS_ARENA_SMALL_SIZE;
+		}
+		else
+		{
+			if (!(b = (ws_arena_block_t *)_ws_allocator_malloc(blocks->alloc,
+								sizeof(ws_arena_block_t) + size)))
+			{
+				LIBWS_LOG(LIBWS_CRIT, "Out of memory!");
+				return NULL;
+			}
+
+			b->size = size;
+		}
+
+		b->used = 0;
+		b->next = arena->blocks;
+		arena->blocks = b;
+	}
+
+	b->last = b->used;
+	b->used += size;
+
+	return WS_ARENA_BLOCK_DATA(b) + b->last;
+}
+
+void *_ws_arena_grow(ws_arena_t *arena, ws_slab_t *blocks,
+					void *ptr, size_t old_size, size_t new_size)
+{
+	ws_arena_block_t *b;
+	int sole = 0;
+	void *p;
+	assert(arena);
+	assert(blocks);
+
+	b = arena->blocks;
+
+	if (!ptr)
+	{
+		return _ws_arena_alloc(arena, blocks, new_size);
+	}
+
+	assert(b);
+	new_size = WS_ALIGN_UP(new_size, WS_ARENA_ALIGN);
+
+	if ((char *)ptr == (WS_ARENA_BLOCK_DATA(b) + b->last))
+	{
+		if ((b->last + new_size) <= b->size)
+		{
+			b->used = b->last + new_size;
+			return ptr;
+		}
+
+		// Nothing else lives in the block, so it
+		// can be released once the data is moved.
+		sole = (b->last == 0);
+	}
+
+	if (!(p = _ws_arena_alloc(arena, blocks, new_size)))
+	{
+		return NULL;
+	}
+
+	memcpy(p, ptr, old_size);
+
+	if (sole && (arena->blocks->next == b))
+	{
+		arena->blocks->next = b->next;
+		_ws_arena_block_free(blocks, b);
+	}
+
+	return p;
+}
+
+void _ws_arena_reset(ws_arena_t *arena, ws_slab_t *blocks)
+{
+	ws_arena_block_t *b;
+	ws_arena_block_t *next;
+	assert(arena);
+	assert(blocks);
+
+	for (b = arena->blocks; b; b = next)
+	{
+		next = b->next;
+		_ws_arena_block_free(blocks, b);
+	}
+
+	arena->blocks = NULL;
+}
+
+#ifdef LIBWS_WITH_MEMORY_ACCOUNTING
+
+void _ws_mem_account_init(ws_mem_account_t *account, ws_mem_account_t *parent)
+{
+	assert(account);
+
+	memset(account, 0, sizeof(ws_mem_account_t));
+	account->refs = 1;
+	account->parent = parent;
+}
+
+ws_mem_account_t *_ws_mem_account_new(ws_slab_t *slab, ws_mem_account_t *parent)
+{
+	ws_mem_account_t *account;
+	assert(slab);
+
+	if (!(account = (ws_mem_account_t *)_ws_slab_alloc(slab)))
+	{
+		return NULL;
+	}
+
+	_ws_mem_account_init(account, parent);
+	account->slab = slab;
+
+	return account;
+}
+
+void _ws_mem_account_unref(ws_mem_account_t *account)
+{
+	assert(account);
+	assert(account->refs > 0);
+
+	if ((--account->refs == 0) && account->slab)
+	{
+		assert(account->bytes == 0);
+		_ws_slab_free(account->slab, account);
+	}
+}
+
+static void _ws_mem_charge(ws_mem_account_t *account, size_t size)
+{
+	ws_mem_account_t *a;
+
+	for (a = account; a; a = a->parent)
+	{
+		a->bytes += size;
+
+		if (a->bytes > a->peak)
+			a->peak = a->bytes;
+
+		// Whoever allocated the byte that went over the
+		// limit of the base is the one that gets closed.
+		if (a->limit && (a->bytes > a->limit) && !account->over_limit)
+			account->over_limit = 1;
+	}
+}
+
+static void _ws_mem_discharge(ws_mem_account_t *account, size_t size)
+{
+	ws_mem_account_t *a;
+
+	for (a = account; a; a = a->parent)
+	{
+		assert(a->bytes >= size);
+		a->bytes -= size;
+	}
+}
+
+void *_ws_mem_track(void *block, size_t size)
+{
+	ws_mem_header_t *h = (ws_mem_header_t *)block;
+
+	if (!block)
+		return NULL;
+
+	h->account = _ws_mem_current;
+	h->size = size;
+
+	if (h->account)
+	{
+		h->account->refs++;
+		_ws_mem_charge(h->account, size);
+	}
+
+	return (char *)block + WS_MEM_HEADER_SIZE;
+}
+
+void *_ws_mem_untrack(void *ptr)
+{
+	ws_mem_header_t *h = WS_MEM_HEADER(ptr);
+
+	if (h->account)
+	{
+		_ws_mem_discharge(h->account, h->size);
+		_ws_mem_account_unref(h->account);
+	}
+
+	return h;
+}
+
+void *_ws_mem_retrack(void *block, size_t size)
+{
+	ws_mem_header_t *h = (ws_mem_header_t *)block;
+	assert(block);
+
+	if (h->account)
+	{
+		if (size > h->size)
+			_ws_mem_charge(h->account, size - h->size);
+		else
+			_ws_mem_discharge(h->account, h->size - size);
+	}
+
+	h->size = size;
+
+	return (char *)block + WS_MEM_HEADER_SIZE;
+}
+
+#ifdef LIBWS_HAVE_THREAD_LOCAL
+
+#if defined(__GNUC__)
+#define _WS_LOAD_RELAXED(ptr) __atomic_load_n((ptr), __ATOMIC_RELAXED)
+#define _WS_ATOMIC_INC(ptr) __sync_add_and_fetch((ptr), 1)
+#elif defined(_WIN32)
+#define _WS_LOAD_RELAXED(ptr) (*(volatile unsigned int *)(ptr))
+#define _WS_ATOMIC_INC(ptr) InterlockedIncrement((volatile LONG *)(ptr))
+#else
+#define _WS_LOAD_RELAXED(ptr) (*(volatile unsigned int *)(ptr))
+#define _WS_ATOMIC_INC(ptr) (++(*(ptr)))
+#endif
+
+typedef enum ws_mem_cache_state_e
+{
+	WS_MEM_CACHE_UNREGISTERED,
+	WS_MEM_CACHE_REGISTERED,	///< Flushed when the thread exits.
+	WS_MEM_CACHE_EXITED			///< The thread is exiting, keep nothing.
+} ws_mem_cache_state_t;
+
+typedef struct ws_mem_cache_s
+{
+	void *blocks[WS_MEM_CACHE_CLASSES];	///< Linked through the header.
+	size_t count[WS_MEM_CACHE_CLASSES];
+	unsigned int gen;					///< #_ws_mem_cache_gen when filled.
+	ws_mem_cache_state_t state;
+	void (*free_fn)(void *ptr);			///< Frees the blocks on thread exit.
+} ws_mem_cache_t;
+
+static LIBWS_THREAD_LOCAL ws_mem_cache_t _ws_mem_cache;
+
+// Bumped by #_ws_mem_cache_flush_all, the other threads flush their
+// cache the next time they use it.
+static unsigned int _ws_mem_cache_gen;
+
+#ifdef _WIN32
+static DWORD _ws_mem_cache_key = FLS_OUT_OF_INDEXES;
+static INIT_ONCE _ws_mem_cache_key_once = INIT_ONCE_STATIC_INIT;
+#else
+static pthread_key_t _ws_mem_cache_key;
+static int _ws_mem_cache_key_ok;
+static pthread_once_t _ws_mem_cache_key_once = PTHREAD_ONCE_INIT;
+#endif
+
+static void _ws_mem_cache_free_blocks(ws_mem_cache_t *cache,
+									void (*free_fn)(void *ptr))
+{
+	int c;
+	void *block;
+
+	for (c = 0; c < WS_MEM_CACHE_CLASSES; c++)
+	{
+		while ((block = cache->blocks[c]))
+		{
+			cache->blocks[c] = *((void **)block);
+			free_fn(block);
+		}
+
+		cache->count[c] = 0;
+	}
+}
+
+///
+/// Thread exit destructor, the key value is the exiting
+/// thread's #_ws_mem_cache.
+///
+#ifdef _WIN32
+static void WINAPI _ws_mem_cache_exit(void *arg)
+#else
+static void _ws_mem_cache_exit(void *arg)
+#endif
+{
+	ws_mem_cache_t *cache = (ws_mem_cache_t *)arg;
+
+	if (!cache)
+		return;
+
+	_ws_mem_cache_free_blocks(cache, cache->free_fn);
+
+	// Destructors run after this one might still free memory.
+	cache->state = WS_MEM_CACHE_EXITED;
+}
+
+#ifdef _WIN32
+static BOOL CALLBACK _ws_mem_cache_key_create(PINIT_ONCE once,
+											PVOID param, PVOID *ctx)
+{
+	_ws_mem_cache_key = FlsAlloc(_ws_mem_cache_exit);
+	return TRUE;
+}
+#else
+static void _ws_mem_cache_key_create()
+{
+	_ws_mem_cache_key_ok = !pthread_key_create(&_ws_mem_cache_key,
+												_ws_mem_cache_exit);
+}
+#endif
+
+///
+/// Makes sure the cache of this thread is freed when it exits.
+///
+/// @returns 0 on success, -1 if the blocks can't be kept.
+///
+static int _ws_mem_cache_register(void (*free_fn)(void *ptr))
+{
+	ws_mem_cache_t *cache = &_ws_mem_cache;
+
+	if (cache->state == WS_MEM_CACHE_REGISTERED)
+		return 0;
+
+	if (cache->state == WS_MEM_CACHE_EXITED)
+		return -1;
+
+	#ifdef _WIN32
+	InitOnceExecuteOnce(&_ws_mem_cache_key_once,
+						_ws_mem_cache_key_create, NULL, NULL);
+
+	if ((_ws_mem_cache_key == FLS_OUT_OF_INDEXES)
+		|| !FlsSetValue(_ws_mem_cache_key, cache))
+	{
+		return -1;
+	}
+	#else
+	pthread_once(&_ws_mem_cache_key_once, _ws_mem_cache_key_create);
+
+	if (!_ws_mem_cache_key_ok
+		|| pthread_setspecific(_ws_mem_cache_key, cache))
+	{
+		return -1;
+	}
+	#endif
+
+	cache->free_fn = free_fn;
+	cache->gen = _WS_LOAD_RELAXED(&_ws_mem_cache_gen);
+	cache->state = WS_MEM_CACHE_REGISTERED;
+
+	return 0;
+}
+
+///
+/// Frees the blocks of this thread if another thread
+/// flushed all caches since they were kept.
+///
+static void _ws_mem_cache_check_gen()
+{
+	ws_mem_cache_t *cache = &_ws_mem_cache;
+	unsigned int gen = _WS_LOAD_RELAXED(&_ws_mem_cache_gen);
+
+	if (cache->gen != gen)
+	{
+		_ws_mem_cache_free_blocks(cache, cache->free_fn);
+		cache->gen = gen;
+	}
+}
+
+#endif // LIBWS_HAVE_THREAD_LOCAL
+
+int _ws_mem_cache_class(size_t size)
+{
+	int c = 0;
+	size_t class_size = ((size_t)1 << WS_MEM_CACHE_MIN_SHIFT);
+
+	while (class_size < size)
+	{
+		if (++c == WS_MEM_CACHE_CLASSES)
+			return -1;
+
+		class_size <<= 1;
+	}
+
+	return c;
+}
+
+size_t _ws_mem_block_size(size_t size)
+{
+	int c = _ws_mem_cache_class(size);
+
+	if (c < 0)
+		return size + WS_MEM_HEADER_SIZE;
+
+	return ((size_t)1 << (WS_MEM_CACHE_MIN_SHIFT + c)) + WS_MEM_HEADER_SIZE;
+}
+
+void *_ws_mem_cache_get(size_t size)
+{
+	#ifdef LIBWS_HAVE_THREAD_LOCAL
+	void *block;
+	int c = _ws_mem_cache_class(size);
+
+	if (c < 0)
+		return NULL;
+
+	_ws_mem_cache_check_gen();
+
+	if (!(block = _ws_mem_cache.blocks[c]))
+		return NULL;
+
+	_ws_mem_cache.blocks[c] = *((void **)block);
+	_ws_mem_cache.count[c]--;
+
+	return block;
+	#else
+	return NULL;
+	#endif
+}
+
+int _ws_mem_cache_put(void *block, size_t size, void (*free_fn)(void *ptr))
+{
+	#ifdef LIBWS_HAVE_THREAD_LOCAL
+	int c = _ws_mem_cache_class(size);
+	assert(block);
+	assert(free_fn);
+
+	if ((c < 0) || _ws_mem_cache_register(free_fn))
+		return -1;
+
+	_ws_mem_cache_check_gen();
+
+	if (_ws_mem_cache.count[c] >=
+		(WS_MEM_CACHE_CLASS_BYTES >> (WS_MEM_CACHE_MIN_SHIFT + c)))
+	{
+		return -1;
+	}
+
+	*((void **)block) = _ws_mem_cache.blocks[c];
+	_ws_mem_cache.blocks[c] = block;
+	_ws_mem_cache.count[c]++;
+
+	return 0;
+	#else
+	return -1;
+	#endif
+}
+
+void _ws_mem_cache_flush_all()
+{
+	#ifdef LIBWS_HAVE_THREAD_LOCAL
+	_WS_ATOMIC_INC(&_ws_mem_cache_gen);
+	_ws_mem_cache_check_gen();
+	#endif
+}
+
+#endif // LIBWS_WITH_MEMORY_ACCOUNTING
@@ -0,0 +1,308 @@
+#ifndef __LIBWS_ALLOC_H__
+#define __LIBWS_ALLOC_H__
+
+///
+/// @internal
+/// @file libws_alloc.h
+///
+/// Allocators owned by a base:
+///
+/// - #ws_allocator_t, the user supplied functions (with a context)
+///   that everything else here gets its memory from. Falls back to
+///   the global functions set with ws_set_memory_functions.
+/// - #ws_slab_t, fixed size objects carved out of larger chunks and
+///   kept on a free list, such as the connection contexts.
+/// - #ws_arena_t, a bump allocator for scratch memory that is all
+///   released at once, such as an incoming message.
+///
+/// - #ws_mem_account_t, the bytes used by a connection or a base,
+///   including what libevent and OpenSSL allocate on their behalf.
+/// - A per thread cache of freed blocks behind _ws_malloc, so that the
+///   evbuffer chains libevent allocates for each read and write don't
+///   hit the system allocator once a connection is up and running.
+///   Each thread gives its blocks back when it exits. Compiled out
+///   without thread local storage.
+///
+/// None of these are thread safe, just like the rest of a base.
+///
+
+#include "libws_config.h"
+#include "libws_private_config.h"
+#include "libws_types.h"
+#include <stddef.h>
+
+#define WS_SLAB_ALIGN 64           ///< Objects start on a cache line.
+#define WS_ARENA_BLOCK_SIZE 4096   ///< Size of the arena blocks that
+                                   /// are pooled in a slab.
+#define WS_MEM_HEADER_SIZE 16      ///< Room in front of each tracked
+                                   /// allocation, keeps the alignment.
+#define WS_MEM_CACHE_MIN_SHIFT 5   ///< Smallest cached block is 32 bytes.
+#define WS_MEM_CACHE_CLASSES 12    ///< Power of two size classes, so the
+                                   /// biggest cached block is 64kb.
+#define WS_MEM_CACHE_CLASS_BYTES ((size_t)128 * 1024) ///< Most bytes kept
+                                   /// per class and thread.
+
+#ifdef LIBWS_WITH_MEMORY_ACCOUNTING
+
+///
+/// Bytes allocated for a connection or a base. Each tracked allocation
+/// points to the account it was charged to, so the same account gets
+/// the bytes back when it is freed, whoever frees it.
+///
+typedef struct ws_mem_account_s
+{
+    size_t bytes;               ///< Bytes currently allocated.
+    size_t peak;                ///< Most bytes allocated at once.
+    size_t limit;               ///< 0 for no limit.
+    size_t refs;                ///< The owner plus each live allocation.
+    int over_limit;             ///< 1 when this or the parent went over
+                                /// its limit, 2 once that's been acted on.
+    struct ws_mem_account_s *parent; ///< Also charged, NULL for a base.
+    struct ws_slab_s *slab;     ///< Slab to return the account to when
+                                /// unused, NULL if embedded.
+} ws_mem_account_t;
+
+///
+/// Put in front of each tracked allocation.
+///
+typedef struct ws_mem_header_s
+{
+    ws_mem_account_t *account;  ///< NULL if not charged to anyone.
+    size_t size;
+} ws_mem_header_t;
+
+#define WS_MEM_HEADER(ptr) \
+    ((ws_mem_header_t *)((char *)(ptr) - WS_MEM_HEADER_SIZE))
+
+///
+/// The account new allocations on this thread are charged to.
+///
+extern LIBWS_THREAD_LOCAL ws_mem_account_t *_ws_mem_current;
+
+///
+/// Charges allocations to an account until #_ws_mem_leave.
+///
+/// @returns The previous account, to pass to #_ws_mem_leave.
+///
+static LIBWS_INLINE ws_mem_account_t *_ws_mem_enter(ws_mem_account_t *account)
+{
+    ws_mem_account_t *prev = _ws_mem_current;
+    _ws_mem_current = account;
+    return prev;
+}
+
+static LIBWS_INLINE void _ws_mem_leave(ws_mem_account_t *prev)
+{
+    _ws_mem_current = prev;
+}
+
+#endif // LIBWS_WITH_MEMORY_ACCOUNTING
+
+typedef struct ws_allocator_s
+{
+    ws_base_malloc_f malloc_fn;     ///< NULL to use the global functions.
+    ws_base_realloc_f realloc_fn;
+    ws_base_free_f free_fn;
+    void *ctx;
+    #ifdef LIBWS_WITH_MEMORY_ACCOUNTING
+    ws_mem_account_t *account;      ///< Charged for slab chunks, since
+                                    /// they are shared by connections.
+    #endif
+} ws_allocator_t;
+
+typedef struct ws_slab_chunk_s
+{
+    struct ws_slab_chunk_s *next;
+} ws_slab_chunk_t;
+
+typedef struct ws_slab_s
+{
+    ws_allocator_t *alloc;      ///< Where the chunks come from.
+    size_t obj_size;            ///< Rounded up to #WS_SLAB_ALIGN.
+    size_t per_chunk;           ///< Objects per chunk.
+    void *free_list;            ///< Free objects, linked through
+                                /// their first bytes.
+    ws_slab_chunk_t *chunks;
+    size_t in_use;              ///< Objects handed out.
+} ws_slab_t;
+
+typedef struct ws_arena_block_s
+{
+    struct ws_arena_block_s *next;
+    size_t size;                ///< Usable bytes after the header.
+    size_t used;
+    size_t last;                ///< Offset of the latest allocation.
+} ws_arena_block_t;
+
+typedef struct ws_arena_s
+{
+    ws_arena_block_t *blocks;   ///< Newest first, NULL when reset.
+} ws_arena_t;
+
+void *_ws_allocator_malloc(ws_allocator_t *alloc, size_t size);
+
+void *_ws_allocator_calloc(ws_allocator_t *alloc, size_t count, size_t size);
+
+void *_ws_allocator_realloc(ws_allocator_t *alloc, void *ptr, size_t size);
+
+void _ws_allocator_free(ws_allocator_t *alloc, void *ptr);
+
+char *_ws_allocator_strdup(ws_allocator_t *alloc, const char *str);
+
+///
+/// Sets up a slab, no memory is allocated until the first object is.
+///
+/// @param[in] slab         The slab.
+/// @param[in] alloc        The allocator to get chunks from.
+/// @param[in] obj_size     Size of each object.
+/// @param[in] per_chunk    The number of objects to allocate at a time.
+///
+void _ws_slab_init(ws_slab_t *slab, ws_allocator_t *alloc,
+                   size_t obj_size, size_t per_chunk);
+
+///
+/// Frees all chunks of a slab. All objects must have been freed.
+///
+void _ws_slab_destroy(ws_slab_t *slab);
+
+///
+/// Gets an object from a slab, the memory is not cleared.
+///
+/// @returns An object aligned to #WS_SLAB_ALIGN or NULL if out of memory.
+///
+void *_ws_slab_alloc(ws_slab_t *slab);
+
+///
+/// Puts an object back on the free list of its slab.
+///
+void _ws_slab_free(ws_slab_t *slab, void *obj);
+
+///
+/// Allocates from an arena. Blocks of #WS_ARENA_BLOCK_SIZE come from
+/// the given slab, larger ones straight from its allocator.
+///
+/// @param[in] arena    The arena.
+/// @param[in] blocks   Slab of #WS_ARENA_BLOCK_SIZE sized blocks.
+/// @param[in] size     Bytes to allocate.
+///
+/// @returns Memory aligned to 16 bytes, or NULL if out of memory.
+///
+void *_ws_arena_alloc(ws_arena_t *arena, ws_slab_t *blocks, size_t size);
+
+///
+/// Grows an allocation, in place if it is the latest one and there
+/// is room left in its block. Otherwise it is copied, and the old
+/// space is not reused until the arena is reset.
+///
+/// @param[in] ptr      The allocation to grow, or NULL.
+/// @param[in] old_size Its current size.
+/// @param[in] new_size The size wanted.
+///
+void *_ws_arena_grow(ws_arena_t *arena, ws_slab_t *blocks,
+                     void *ptr, size_t old_size, size_t new_size);
+
+///
+/// Releases everything allocated from an arena, giving
+/// the blocks back to the slab or the allocator.
+///
+void _ws_arena_reset(ws_arena_t *arena, ws_slab_t *blocks);
+
+#ifdef LIBWS_WITH_MEMORY_ACCOUNTING
+
+///
+/// Sets up an embedded account that is never freed.
+///
+void _ws_mem_account_init(ws_mem_account_t *account, ws_mem_account_t *parent);
+
+///
+/// Gets a new account from a slab, owned by the caller.
+///
+/// @param[in] slab     Slab of #ws_mem_account_t.
+/// @param[in] parent   Account also charged for everything, or NULL.
+///
+/// @returns The account or NULL if out of memory.
+///
+ws_mem_account_t *_ws_mem_account_new(ws_slab_t *slab, ws_mem_account_t *parent);
+
+///
+/// Drops a reference to an account. It is returned to its slab
+/// once the owner and all allocations charged to it are gone.
+///
+void _ws_mem_account_unref(ws_mem_account_t *account);
+
+///
+/// Sets up the header of a new allocation and charges
+/// it to the current account.
+///
+/// @param[in] block    The allocation, including the header. Can be NULL.
+/// @param[in] size     Bytes requested, excluding the header.
+///
+/// @returns The memory after the header, or NULL if block is NULL.
+///
+void *_ws_mem_track(void *block, size_t size);
+
+///
+/// Gives back the bytes of an allocation to its account.
+///
+/// @param[in] ptr  Pointer returned by #_ws_mem_track.
+///
+/// @returns The start of the allocation, including the header.
+///
+void *_ws_mem_untrack(void *ptr);
+
+///
+/// Updates the account of an allocation that was resized.
+///
+/// @param[in] block    The reallocated block, including the header.
+/// @param[in] size     The new size, excluding the header.
+///
+/// @returns The memory after the header.
+///
+void *_ws_mem_retrack(void *block, size_t size);
+
+///
+/// Gets the size class of an allocation.
+///
+/// @param[in] size     Bytes requested, excluding the header.
+///
+/// @returns The class, or -1 if too big to be cached.
+///
+int _ws_mem_cache_class(size_t size);
+
+///
+/// Gets the number of bytes to allocate for a block, including
+/// the header. Cached sizes are rounded up to their class.
+///
+size_t _ws_mem_block_size(size_t size);
+
+///
+/// Gets a previously freed block on this thread.
+///
+/// @param[in] size     Bytes requested, excluding the header.
+///
+/// @returns A block of #_ws_mem_block_size bytes, or NULL if
+///          there is none, or the size isn't cached.
+///
+void *_ws_mem_cache_get(size_t size);
+
+///
+/// Keeps a freed block for reuse on this thread.
+///
+/// @param[in] block    The block, including the header.
+/// @param[in] size     The size it was allocated for, excluding the header.
+/// @param[in] free_fn  Frees the cached blocks when the thread exits.
+///
+/// @returns 0 if it was kept, -1 if it should be freed.
+///
+int _ws_mem_cache_put(void *block, size_t size, void (*free_fn)(void *ptr));
+
+///
+/// Gives the blocks cached on this thread back to the system right
+/// away, other threads give theirs back the next time they allocate
+/// or free memory, or when they exit.
+///
+void _ws_mem_cache_flush_all();
+
+#endif // LIBWS_WITH_MEMORY_ACCOUNTING
+
+#endif // __LIBWS_ALLOC_H__
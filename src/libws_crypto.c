@@ -0,0 +1,461 @@
+
+#include "libws_config.h"
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+#include "libws_log.h"
+#include "libws_crypto.h"
+
+#ifdef LIBWS_WITH_OPENSSL
+#include <openssl/evp.h>
+#else
+#include "libws_sha1.h"
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define LIBWS_HAVE_SHA1_X86
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+#if defined(__aarch64__) \
+	&& (defined(__ARM_FEATURE_CRYPTO) || defined(__ARM_FEATURE_SHA2))
+#define LIBWS_HAVE_SHA1_ARMV8
+#include <arm_neon.h>
+#if defined(__linux__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+#endif
+
+//
+// Hardware backends, these only process whole blocks.
+//
+
+#if defined(LIBWS_HAVE_SHA1_X86) || defined(LIBWS_HAVE_SHA1_ARMV8)
+
+#define WS_SHA1_BLOCK_LEN 64
+
+typedef void (*ws_sha1_blocks_f)(uint32_t state[5],
+								const unsigned char *data, size_t blocks);
+
+///
+/// Pads the message and runs it through a block function.
+///
+static void _ws_sha1_pad_blocks(ws_sha1_blocks_f blocks_fn,
+								const void *data, size_t len,
+								unsigned char *md)
+{
+	int i;
+	size_t full = len / WS_SHA1_BLOCK_LEN;
+	size_t rest = len % WS_SHA1_BLOCK_LEN;
+	size_t tail_len = (rest < 56) ? WS_SHA1_BLOCK_LEN : (2 * WS_SHA1_BLOCK_LEN);
+	uint64_t bits = (uint64_t)len * 8;
+	unsigned char tail[2 * WS_SHA1_BLOCK_LEN];
+	uint32_t state[5] =
+	{
+		0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0
+	};
+
+	if (full)
+	{
+		blocks_fn(state, (const unsigned char *)data, full);
+	}
+
+	memset(tail, 0, tail_len);
+	memcpy(tail, (const unsigned char *)data + (full * WS_SHA1_BLOCK_LEN), rest);
+	tail[rest] = 0x80;
+
+	for (i = 0; i < 8; i++)
+	{
+		tail[tail_len - 1 - i] = (unsigned char)(bits >> (8 * i));
+	}
+
+	blocks_fn(state, tail, tail_len / WS_SHA1_BLOCK_LEN);
+
+	for (i = 0; i < 5; i++)
+	{
+		md[(i * 4) + 0] = (unsigned char)(state[i] >> 24);
+		md[(i * 4) + 1] = (unsigned char)(state[i] >> 16);
+		md[(i * 4) + 2] = (unsigned char)(state[i] >> 8);
+		md[(i * 4) + 3] = (unsigned char)(state[i]);
+	}
+}
+
+#endif
+
+#ifdef LIBWS_HAVE_SHA1_X86
+
+//
+// Four rounds using the SHA extensions. The message schedule for
+// the following groups is computed while the rounds run, MSG holds
+// the words for the next four groups and E alternates between them.
+//
+#define _WS_SHA1_X86_ROUNDS4(g) \
+	do \
+	{ \
+		__m128i *e_in = &E[(g) & 1]; \
+		__m128i *e_out = &E[((g) + 1) & 1]; \
+		__m128i cur = MSG[(g) & 3]; \
+		if ((g) == 0) \
+			*e_in = _mm_add_epi32(*e_in, cur); \
+		else \
+			*e_in = _mm_sha1nexte_epu32(*e_in, cur); \
+		*e_out = ABCD; \
+		if (((g) >= 3) && ((g) <= 18)) \
+			MSG[((g) + 1) & 3] = _mm_sha1msg2_epu32(MSG[((g) + 1) & 3], cur); \
+		ABCD = _mm_sha1rnds4_epu32(ABCD, *e_in, (g) / 5); \
+		if (((g) >= 1) && ((g) <= 16)) \
+			MSG[((g) + 3) & 3] = _mm_sha1msg1_epu32(MSG[((g) + 3) & 3], cur); \
+		if (((g) >= 2) && ((g) <= 17)) \
+			MSG[((g) + 2) & 3] = _mm_xor_si128(MSG[((g) + 2) & 3], cur); \
+	} while (0)
+
+__attribute__((target("sha,sse4.1,ssse3")))
+static void _ws_sha1_blocks_x86(uint32_t state[5],
+								const unsigned char *data, size_t blocks)
+{
+	int i;
+	__m128i ABCD;
+	__m128i ABCD_SAVE;
+	__m128i E0_SAVE;
+	__m128i E[2];
+	__m128i MSG[4];
+	const __m128i MASK = _mm_set_epi64x(0x0001020304050607ULL,
+										0x08090a0b0c0d0e0fULL);
+
+	ABCD = _mm_loadu_si128((const __m128i *)state);
+	ABCD = _mm_shuffle_epi32(ABCD, 0x1B);
+	E[0] = _mm_set_epi32((int)state[4], 0, 0, 0);
+	E[1] = _mm_setzero_si128();
+
+	while (blocks--)
+	{
+		ABCD_SAVE = ABCD;
+		E0_SAVE = E[0];
+
+		for (i = 0; i < 4; i++)
+		{
+			MSG[i] = _mm_shuffle_epi8(
+				_mm_loadu_si128((const __m128i *)(data + (i * 16))), MASK);
+		}
+
+		_WS_SHA1_X86_ROUNDS4(0);
+		_WS_SHA1_X86_ROUNDS4(1);
+		_WS_SHA1_X86_ROUNDS4(2);
+		_WS_SHA1_X86_ROUNDS4(3);
+		_WS_SHA1_X86_ROUNDS4(4);
+		_WS_SHA1_X86_ROUNDS4(5);
+		_WS_SHA1_X86_ROUNDS4(6);
+		_WS_SHA1_X86_ROUNDS4(7);
+		_WS_SHA1_X86_ROUNDS4(8);
+		_WS_SHA1_X86_ROUNDS4(9);
+		_WS_SHA1_X86_ROUNDS4(10);
+		_WS_SHA1_X86_ROUNDS4(11);
+		_WS_SHA1_X86_ROUNDS4(12);
+		_WS_SHA1_X86_ROUNDS4(13);
+		_WS_SHA1_X86_ROUNDS4(14);
+		_WS_SHA1_X86_ROUNDS4(15);
+		_WS_SHA1_X86_ROUNDS4(16);
+		_WS_SHA1_X86_ROUNDS4(17);
+		_WS_SHA1_X86_ROUNDS4(18);
+		_WS_SHA1_X86_ROUNDS4(19);
+
+		E[0] = _mm_sha1nexte_epu32(E[0], E0_SAVE);
+		ABCD = _mm_add_epi32(ABCD, ABCD_SAVE);
+
+		data += WS_SHA1_BLOCK_LEN;
+	}
+
+	ABCD = _mm_shuffle_epi32(ABCD, 0x1B);
+	_mm_storeu_si128((__m128i *)state, ABCD);
+	state[4] = (uint32_t)_mm_extract_epi32(E[0], 3);
+}
+
+static void _ws_sha1_x86(const void *data, size_t len, unsigned char *md)
+{
+	_ws_sha1_pad_blocks(_ws_sha1_blocks_x86, data, len, md);
+}
+
+static int _ws_sha1_x86_supported()
+{
+	unsigned int eax, ebx, ecx, edx;
+
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)
+		|| !(ecx & bit_SSSE3) || !(ecx & bit_SSE4_1))
+	{
+		return 0;
+	}
+
+	if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+	{
+		return 0;
+	}
+
+	return (ebx & (1 << 29)) != 0;
+}
+
+#endif // LIBWS_HAVE_SHA1_X86
+
+#ifdef LIBWS_HAVE_SHA1_ARMV8
+
+static void _ws_sha1_blocks_armv8(uint32_t state[5],
+								const unsigned char *data, size_t blocks)
+{
+	int g;
+	uint32_t e;
+	uint32_t e_next;
+	uint32_t e_save;
+	uint32x4_t abcd;
+	uint32x4_t abcd_save;
+	uint32x4_t tmp;
+	uint32x4_t msg[4];
+	const uint32x4_t k[4] =
+	{
+		vdupq_n_u32(0x5A827999), vdupq_n_u32(0x6ED9EBA1),
+		vdupq_n_u32(0x8F1BBCDC), vdupq_n_u32(0xCA62C1D6)
+	};
+
+	abcd = vld1q_u32(state);
+	e = state[4];
+
+	while (blocks--)
+	{
+		abcd_save = abcd;
+		e_save = e;
+
+		for (g = 0; g < 4; g++)
+		{
+			msg[g] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + (g * 16))));
+		}
+
+		for (g = 0; g < 20; g++)
+		{
+			if (g >= 4)
+			{
+				msg[g & 3] = vsha1su1q_u32(
+					vsha1su0q_u32(msg[g & 3], msg[(g + 1) & 3], msg[(g + 2) & 3]),
+					msg[(g + 3) & 3]);
+			}
+
+			tmp = vaddq_u32(msg[g & 3], k[g / 5]);
+			e_next = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+
+			switch (g / 5)
+			{
+				case 0: abcd = vsha1cq_u32(abcd, e, tmp); break;
+				case 2: abcd = vsha1mq_u32(abcd, e, tmp); break;
+				default: abcd = vsha1pq_u32(abcd, e, tmp); break;
+			}
+
+			e = e_next;
+		}
+
+		abcd = vaddq_u32(abcd, abcd_save);
+		e += e_save;
+
+		data += WS_SHA1_BLOCK_LEN;
+	}
+
+	vst1q_u32(state, abcd);
+	state[4] = e;
+}
+
+static void _ws_sha1_armv8(const void *data, size_t len, unsigned char *md)
+{
+	_ws_sha1_pad_blocks(_ws_sha1_blocks_armv8, data, len, md);
+}
+
+static int _ws_sha1_armv8_supported()
+{
+	#if defined(__linux__)
+	return (getauxval(AT_HWCAP) & HWCAP_SHA1) != 0;
+	#else
+	// Built with the crypto extensions enabled.
+	return 1;
+	#endif
+}
+
+#endif // LIBWS_HAVE_SHA1_ARMV8
+
+#ifdef LIBWS_WITH_OPENSSL
+
+static void _ws_sha1_openssl(const void *data, size_t len, unsigned char *md)
+{
+	EVP_Digest(data, len, md, NULL, EVP_sha1(), NULL);
+}
+
+#else
+
+static void _ws_sha1_portable(const void *data, size_t len, unsigned char *md)
+{
+	SHA1((const unsigned char *)data, len, md);
+}
+
+#endif // LIBWS_WITH_OPENSSL
+
+//
+// All backends compiled in, fastest first. The last one
+// is always supported and is used until _ws_crypto_init.
+//
+static ws_sha1_backend_t _ws_sha1_all[] =
+{
+	#ifdef LIBWS_HAVE_SHA1_X86
+	{ "x86-sha", _ws_sha1_x86 },
+	#endif
+	#ifdef LIBWS_HAVE_SHA1_ARMV8
+	{ "armv8-crypto", _ws_sha1_armv8 },
+	#endif
+	#ifdef LIBWS_WITH_OPENSSL
+	{ "openssl", _ws_sha1_openssl }
+	#else
+	{ "portable", _ws_sha1_portable }
+	#endif
+};
+
+#define WS_SHA1_BACKEND_COUNT (sizeof(_ws_sha1_all) / sizeof(_ws_sha1_all[0]))
+
+static ws_sha1_backend_t _ws_sha1_supported[WS_SHA1_BACKEND_COUNT];
+static size_t _ws_sha1_supported_count;
+static const ws_sha1_backend_t *_ws_sha1_current =
+	&_ws_sha1_all[WS_SHA1_BACKEND_COUNT - 1];
+
+static int _ws_sha1_backend_supported(const ws_sha1_backend_t *b)
+{
+	#ifdef LIBWS_HAVE_SHA1_X86
+	if (b->sha1 == _ws_sha1_x86)
+		return _ws_sha1_x86_supported();
+	#endif
+
+	#ifdef LIBWS_HAVE_SHA1_ARMV8
+	if (b->sha1 == _ws_sha1_armv8)
+		return _ws_sha1_armv8_supported();
+	#endif
+
+	return 1;
+}
+
+void _ws_crypto_init()
+{
+	size_t i;
+	size_t count = 0;
+
+	if (_ws_sha1_supported_count)
+		return;
+
+	for (i = 0; i < WS_SHA1_BACKEND_COUNT; i++)
+	{
+		if (_ws_sha1_backend_supported(&_ws_sha1_all[i]))
+		{
+			_ws_sha1_supported[count++] = _ws_sha1_all[i];
+		}
+	}
+
+	_ws_sha1_current = &_ws_sha1_supported[0];
+	_ws_sha1_supported_count = count;
+
+	LIBWS_LOG(LIBWS_DEBUG, "Using the %s SHA-1 backend",
+							_ws_sha1_current->name);
+}
+
+void _ws_sha1(const void *data, size_t len, unsigned char *md)
+{
+	_ws_sha1_current->sha1(data, len, md);
+}
+
+const ws_sha1_backend_t *_ws_sha1_backends(size_t *count)
+{
+	assert(count);
+	_ws_crypto_init();
+	*count = _ws_sha1_supported_count;
+	return _ws_sha1_supported;
+}
+
+const char *_ws_sha1_backend_name()
+{
+	return _ws_sha1_current->name;
+}
+
+int _ws_sha1_set_backend(const char *name)
+{
+	size_t i;
+	assert(name);
+
+	_ws_crypto_init();
+
+	for (i = 0; i < _ws_sha1_supported_count; i++)
+	{
+		if (!strcmp(_ws_sha1_supported[i].name, name))
+		{
+			_ws_sha1_current = &_ws_sha1_supported[i];
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+//
+// Base64 is encoded 12 bits at a time using a table of all
+// character pairs, built at compile time.
+//
+#define _WS_B64_CHAR(v) \
+	(char)(((v) < 26) ? ('A' + (v)) \
+		: ((v) < 52) ? ('a' + (v) - 26) \
+		: ((v) < 62) ? ('0' + (v) - 52) \
+		: ((v) == 62) ? '+' : '/')
+
+#define _WS_B64_PAIR(i) _WS_B64_CHAR((i) >> 6), _WS_B64_CHAR((i) & 63)
+#define _WS_B64_PAIRS4(i) \
+	_WS_B64_PAIR(i), _WS_B64_PAIR((i) + 1), \
+	_WS_B64_PAIR((i) + 2), _WS_B64_PAIR((i) + 3)
+#define _WS_B64_PAIRS16(i) \
+	_WS_B64_PAIRS4(i), _WS_B64_PAIRS4((i) + 4), \
+	_WS_B64_PAIRS4((i) + 8), _WS_B64_PAIRS4((i) + 12)
+#define _WS_B64_PAIRS64(i) \
+	_WS_B64_PAIRS16(i), _WS_B64_PAIRS16((i) + 16), \
+	_WS_B64_PAIRS16((i) + 32), _WS_B64_PAIRS16((i) + 48)
+#define _WS_B64_PAIRS256(i) \
+	_WS_B64_PAIRS64(i), _WS_B64_PAIRS64((i) + 64), \
+	_WS_B64_PAIRS64((i) + 128), _WS_B64_PAIRS64((i) + 192)
+#define _WS_B64_PAIRS1024(i) \
+	_WS_B64_PAIRS256(i), _WS_B64_PAIRS256((i) + 256), \
+	_WS_B64_PAIRS256((i) + 512), _WS_B64_PAIRS256((i) + 768)
+
+static const char _ws_b64_pairs[4096 * 2] =
+{
+	_WS_B64_PAIRS1024(0), _WS_B64_PAIRS1024(1024),
+	_WS_B64_PAIRS1024(2048), _WS_B64_PAIRS1024(3072)
+};
+
+static const char _ws_b64_chars[] =
+	"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+size_t _ws_base64_encode(const void *data, size_t len, char *out)
+{
+	const unsigned char *in = (const unsigned char *)data;
+	char *o = out;
+	uint32_t v;
+
+	for (; len >= 3; len -= 3, in += 3, o += 4)
+	{
+		v = ((uint32_t)in[0] << 16) | ((uint32_t)in[1] << 8) | in[2];
+		memcpy(o, &_ws_b64_pairs[(v >> 12) * 2], 2);
+		memcpy(o + 2, &_ws_b64_pairs[(v & 0xfff) * 2], 2);
+	}
+
+	if (len)
+	{
+		v = (uint32_t)in[0] << 16;
+		if (len == 2) v |= (uint32_t)in[1] << 8;
+
+		memcpy(o, &_ws_b64_pairs[(v >> 12) * 2], 2);
+		o[2] = (len == 2) ? _ws_b64_chars[(v >> 6) & 63] : '=';
+		o[3] = '=';
+		o += 4;
+	}
+
+	*o = '\0';
+
+	return (size_t)(o - out);
+}
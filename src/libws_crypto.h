@@ -0,0 +1,84 @@
+
+#ifndef __LIBWS_CRYPTO_H__
+#define __LIBWS_CRYPTO_H__
+
+///
+/// @internal
+/// @file libws_crypto.h
+///
+/// SHA-1 and Base64 for the opening handshake.
+///
+/// SHA-1 has several backends, the fastest one the CPU supports is
+/// selected by #_ws_crypto_init: the x86 SHA extensions, the ARMv8
+/// crypto extensions, OpenSSL or the portable implementation.
+///
+
+#include "libws_config.h"
+#include <stddef.h>
+
+#define WS_SHA1_DIGEST_LEN 20
+
+///
+/// Length of the Base64 encoding of len bytes, excluding the NUL.
+///
+#define WS_BASE64_LEN(len) ((((len) + 2) / 3) * 4)
+
+typedef void (*ws_sha1_f)(const void *data, size_t len, unsigned char *md);
+
+typedef struct ws_sha1_backend_s
+{
+    const char *name;           ///< Name of the backend.
+    ws_sha1_f sha1;             ///< Computes a digest.
+} ws_sha1_backend_t;
+
+///
+/// Selects the fastest SHA-1 backend the CPU supports.
+/// Safe to call more than once.
+///
+void _ws_crypto_init();
+
+///
+/// Computes the SHA-1 digest of data, using the selected backend.
+///
+/// @param[in]  data    The data.
+/// @param[in]  len     Length of the data.
+/// @param[out] md      The #WS_SHA1_DIGEST_LEN byte digest.
+///
+void _ws_sha1(const void *data, size_t len, unsigned char *md);
+
+///
+/// Gets the SHA-1 backends supported by the CPU, fastest first.
+///
+/// @param[out] count   The number of backends.
+///
+/// @returns            The backends.
+///
+const ws_sha1_backend_t *_ws_sha1_backends(size_t *count);
+
+///
+/// Gets the name of the selected SHA-1 backend.
+///
+const char *_ws_sha1_backend_name();
+
+///
+/// Selects a SHA-1 backend by name, for tests and benchmarks.
+///
+/// @param[in] name     Name of a backend from #_ws_sha1_backends.
+///
+/// @returns            0 on success, -1 if it's not supported.
+///
+int _ws_sha1_set_backend(const char *name);
+
+///
+/// Base64 encodes data.
+///
+/// @param[in]  data    The data.
+/// @param[in]  len     Length of the data.
+/// @param[out] out     Room for WS_BASE64_LEN(len) + 1 bytes,
+///                     the result is NUL terminated.
+///
+/// @returns            Length of the result.
+///
+size_t _ws_base64_encode(const void *data, size_t len, char *out);
+
+#endif // __LIBWS_CRYPTO_H__
@@ -5,7 +5,8 @@
 #include "libws_log.h"
 #include "libws_handshake.h"
 #include "libws_private.h"
-#include "libws_base64.h"
+#include "libws_crypto.h"
+#include "libws_template.h"
 #include <event2/event.h>
 #include <event2/bufferevent.h>
 #include <event2/buffer.h>
@@ -14,15 +15,8 @@
 int _ws_generate_handshake_key(ws_t ws)
 {
 	char rand_key[16];
-	int key_len;
 	assert(ws);
 
-	if (ws->handshake_key_base64)
-	{
-		_ws_free(ws->handshake_key_base64);
-		ws->handshake_key_base64 = NULL;
-	}
-
 	// Randomize 16 bytes and base64 encode them for the
 	// Sec-WebSocket-Key field.
 	if (_ws_get_random_mask(ws, rand_key, sizeof(rand_key)) < 0)
@@ -32,12 +26,89 @@ int _ws_generate_handshake_key(ws_t ws)
 		return -1;
 	}
 
-	ws->handshake_key_base64 = libws_base64((const void *)rand_key, 
-											sizeof(rand_key), &key_len);
+	if (!ws->handshake_key_base64
+		&& !(ws->handshake_key_base64 = 
+			(char *)_ws_malloc(WS_BASE64_LEN(sizeof(rand_key)) + 1)))
+	{
+		LIBWS_LOG(LIBWS_CRIT, "Out of memory!");
+		return -1;
+	}
+
+	_ws_base64_encode(rand_key, sizeof(rand_key), ws->handshake_key_base64);
+
+	return 0;
+}
+
+int _ws_render_handshake(struct evbuffer *out, const char *server, int port,
+						const char *uri, const char *origin,
+						char **subprotocols, size_t num_subprotocols,
+						const char *key, size_t *key_offset)
+{
+	size_t i;
+	size_t start_len;
+	assert(out);
+	assert(server);
+	assert(key);
+
+	start_len = evbuffer_get_length(out);
+
+	if (evbuffer_add_printf(out,
+		"GET /%s HTTP/1.1\r\n"
+		"Host: %s:%d\r\n"
+		"Connection: Upgrade\r\n"
+		"Upgrade: websocket\r\n"
+		"Sec-Websocket-Version: 13\r\n"
+		"Sec-WebSocket-Key: ",
+		(uri ? uri : ""),
+		server,
+		port) < 0)
+	{
+		return -1;
+	}
+
+	if (key_offset)
+	{
+		*key_offset = evbuffer_get_length(out) - start_len;
+	}
+
+	if (evbuffer_add_printf(out, "%s\r\n", key) < 0)
+	{
+		return -1;
+	}
+
+	if (origin && (evbuffer_add_printf(out, "Origin: %s\r\n", origin) < 0))
+	{
+		return -1;
+	}
+
+	if (num_subprotocols > 0)
+	{
+		if (evbuffer_add_printf(out, "Sec-WebSocket-Protocol: %s",
+			subprotocols[0]) < 0)
+		{
+			return -1;
+		}
+
+		for (i = 1; i < num_subprotocols; i++)
+		{
+			if (evbuffer_add_printf(out, ", %s", subprotocols[i]) < 0)
+			{
+				return -1;
+			}
+		}
+
+		if (evbuffer_add(out, "\r\n", 2))
+		{
+			return -1;
+		}
+	}
+
+	// TODO: Sec-WebSocket-Extensions
+
+	// TODO: Add custom headers.
 
-	if (!ws->handshake_key_base64)
+	if (evbuffer_add(out, "\r\n", 2))
 	{
-		LIBWS_LOG(LIBWS_ERR, "Failed to base64 encode websocket key");
 		return -1;
 	}
 
@@ -46,8 +117,8 @@ int _ws_generate_handshake_key(ws_t ws)
 
 int _ws_send_handshake(ws_t ws, struct evbuffer *out)
 {
-	size_t key_len = 0;
-	size_t i;
+	char **subprotocols;
+	size_t num_subprotocols;
 	assert(ws);
 	assert(out);
 
@@ -66,43 +137,34 @@ int _ws_send_handshake(ws_t ws, struct evbuffer *out)
 		return -1;
 	}
 
-	evbuffer_add_printf(out,
-		"GET /%s HTTP/1.1\r\n"
-		"Host: %s:%d\r\n"
-		"Connection: Upgrade\r\n"
-		"Upgrade: websocket\r\n"
-		"Sec-Websocket-Version: 13\r\n"
-		"Sec-WebSocket-Key: %s\r\n",
-		(ws->uri ? ws->uri : ""),
-		ws->server,
-		ws->port,
-		ws->handshake_key_base64);
-
-	if (ws->origin)
+	// Unless the connection has its own origin or subprotocols,
+	// the template already has the request rendered.
+	if (ws->tmpl && (!ws->cold 
+		|| (!ws->cold->origin && !ws->cold->num_subprotocols)))
 	{
-		evbuffer_add_printf(out, "Origin: %s\r\n", ws->origin);
+		if (_ws_template_send_handshake(ws->tmpl, ws, out))
+		{
+			LIBWS_LOG(LIBWS_ERR, "Failed to send template handshake");
+			return -1;
+		}
 	}
-
-	if (ws->num_subprotocols > 0)
+	else
 	{
-		evbuffer_add_printf(out, "Sec-WebSocket-Protocol: %s", 
-			ws->subprotocols[0]);
+		subprotocols = _ws_get_subprotocol_list(ws, &num_subprotocols);
 
-		for (i = 1; i < ws->num_subprotocols; i++)
+		if (_ws_render_handshake(out, ws->server, ws->port, ws->uri,
+								_ws_get_origin(ws), subprotocols,
+								num_subprotocols, ws->handshake_key_base64,
+								NULL))
 		{
-			evbuffer_add_printf(out, ", %s", ws->subprotocols[i]);
+			LIBWS_LOG(LIBWS_ERR, "Failed to render handshake");
+			return -1;
 		}
 	}
-	
-	evbuffer_add_printf(out, "\r\n");
 
 	ws->connect_state = WS_CONNECT_STATE_SENT_REQ;
 
-	LIBWS_LOG(LIBWS_DEBUG, "%s", evbuffer_pullup(out, evbuffer_get_length(out)));
-
-	// TODO: Sec-WebSocket-Extensions
-
-	// TODO: Add custom headers.
+	LIBWS_LOG(LIBWS_DEBUG, "Sent handshake request");
 
 	return 0;
 }
@@ -110,10 +172,7 @@ int _ws_send_handshake(ws_t ws, struct evbuffer *out)
 int _ws_parse_http_header(char *line, char **header_name, 
 						char **header_val)
 {
-	int ret = 0;
- 	char *start = line;
  	char *end;
- 	size_t len;
 
 	assert(header_name);
 	assert(header_val);
@@ -127,42 +186,18 @@ int _ws_parse_http_header(char *line, char **header_name,
 	if (!(end = strchr(line, ':')))
 		return -1;
 
-	len = (end - start) * sizeof(char);
-	*header_name = (char *)_ws_malloc(len + 1);
-
-	if (!(*header_name))
-		return -1;
-
-	memcpy(*header_name, line, len);
-	(*header_name)[len] = '\0';
+	// Split the line in place, no copies.
+	*end++ = '\0';
+	*header_name = line;
+	*header_val = ws_rtrim(end + strspn(end, " \t"));
 
-	end++;
-	*header_val = _ws_strdup(end + strspn(end, " \t"));
-
-	if (!(*header_val))
-	{
-		ret = -1;
-		goto fail;
-	}
-
-	ws_rtrim(*header_val);
-
-	return ret;
-fail:
-	if (*header_name)
-	{
-		_ws_free(*header_name);
-		*header_name = NULL;
-	}
-
-	return ret;
+	return 0;
 }
 
 int _ws_parse_http_status(const char *line, 
 						int *http_major_version, int *http_minor_version,
 						int *status_code)
 {
-	const char *s = line;
 	int n;
 
 	*status_code = -1;
@@ -181,33 +216,6 @@ int _ws_parse_http_status(const char *line,
 	return 0;
 }
 
-ws_parse_state_t _ws_read_http_status(ws_t ws, 
-				struct evbuffer *in, 
-				int *http_major_version, 
-				int *http_minor_version,
-				int *status_code)
-{
-	char *line = NULL;
-	size_t len;
-	assert(ws);
-	assert(in);
-
-	line = evbuffer_readln(in, &len, EVBUFFER_EOL_CRLF);
-
-	if (!line)
-		return WS_PARSE_STATE_NEED_MORE;
-
-	if (_ws_parse_http_status(line, 
-		http_major_version, http_minor_version, status_code))
-	{
-		_ws_free(line);
-		return WS_PARSE_STATE_ERROR;
-	}
-
-	_ws_free(line);
-	return WS_PARSE_STATE_SUCCESS;
-}
-
 static int _ws_validate_http_header(ws_t ws, ws_http_header_flags_t flag,
 				const char *name, const char *val, 
 				const char *expected_name, const char *expected_val,
@@ -239,67 +247,78 @@ static int _ws_validate_http_header(ws_t ws, ws_http_header_flags_t flag,
 
 int _ws_check_server_protocol_list(ws_t ws, const char *val)
 {
-	int ret = 0;
 	size_t i;
-	char *s = _ws_strdup(val);
-	char *v = s;
-	char *prot = NULL;
-	char *end = NULL;
+	size_t len;
+	const char *prot = val;
+	const char *end;
+	const char *next;
 	int found = 0;
+	char **subprotocols;
+	size_t num_subprotocols;
+	assert(val);
+
+	subprotocols = _ws_get_subprotocol_list(ws, &num_subprotocols);
 	
-	while ((prot = libws_strsep(&v, ",")) != NULL)
+	while (1)
 	{
+		if (!(next = strchr(prot, ',')))
+		{
+			next = prot + strlen(prot);
+		}
+
 		// Trim start.
 		prot += strspn(prot, " ");
-		
+
 		// Trim end.
-		ws_rtrim(prot);
+		end = next;
+		while ((end > prot) && (*(end - 1) == ' ')) end--;
+		len = (size_t)(end - prot);
 
 		found = 0;
 
-		for (i = 0; i < ws->num_subprotocols; i++)
+		for (i = 0; i < num_subprotocols; i++)
 		{
-			if (!strcasecmp(ws->subprotocols[i], prot))
+			if ((strlen(subprotocols[i]) == len)
+				&& !strncasecmp(subprotocols[i], prot, len))
 			{
 				// TODO: Add subprotocol to negotiated list of sub protocols.
 				// TODO: Maybe give the user a list of these in the connection callback?
 				found = 1;
+				break;
 			}
 		}
 
 		if (!found)
-		{
-			ret = -1;
+			return -1;
+
+		if (*next == '\0')
 			break;
-		}
-	}
 
-	_ws_free(s);
+		prot = next + 1;
+	}
 
-	return ret;
+	return 0;
 }
 
 int _ws_calculate_key_hash(const char *handshake_key_base64, 
 							char *key_hash, size_t len)
 {
-	char key_hash_sha1[20]; // SHA1, 160 bits = 20 bytes.
-	char *key_hash_sha1_base64;
-	int base64_len;
-	char accept_key[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
-	strcpy(key_hash, handshake_key_base64);
-	strcat(key_hash, accept_key);
-	
-	SHA1((unsigned char *)key_hash, 
-		strlen(key_hash), (unsigned char *)key_hash_sha1);
+	static const char accept_key[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+	char buf[128 + sizeof(accept_key)];
+	unsigned char key_hash_sha1[WS_SHA1_DIGEST_LEN];
+	size_t key_len = strlen(handshake_key_base64);
 
-	key_hash_sha1_base64 = libws_base64((const void *)key_hash_sha1, 
-									sizeof(key_hash_sha1), &base64_len);
-
-	if (!key_hash_sha1_base64)
+	if ((key_len > (sizeof(buf) - sizeof(accept_key)))
+		|| (len < (WS_BASE64_LEN(WS_SHA1_DIGEST_LEN) + 1)))
+	{
 		return -1;
+	}
+
+	memcpy(buf, handshake_key_base64, key_len);
+	memcpy(buf + key_len, accept_key, sizeof(accept_key) - 1);
 
-	strcpy(key_hash, key_hash_sha1_base64);
-	free(key_hash_sha1_base64);
+	_ws_sha1(buf, key_len + sizeof(accept_key) - 1, key_hash_sha1);
+	_ws_base64_encode(key_hash_sha1, sizeof(key_hash_sha1), key_hash);
 
 	return 0;
 }
@@ -352,6 +371,7 @@ int _ws_validate_http_headers(ws_t ws, const char *name, const char *val)
 	//    E914-47DA-95CA-C5AB0DC85B11" but ignoring any leading and
 	//    trailing whitespace, the client MUST _Fail the WebSocket
 	//    Connection_.
+	if (!strcasecmp("Sec-WebSocket-Accept", name))
 	{
 		char key_hash[256];
 
@@ -455,93 +475,179 @@ int _ws_validate_http_headers(ws_t ws, const char *name, const char *val)
 	return 0;	
 }
 
-ws_parse_state_t _ws_read_http_headers(ws_t ws, struct evbuffer *in)
+///
+/// Finds the end of a line in the response region, the region
+/// always ends with an empty line so this can't run past it.
+///
+static char *_ws_find_crlf(char *s)
 {
-	char *line = NULL;
+	while ((s[0] != '\r') || (s[1] != '\n'))
+		s++;
+
+	return s;
+}
+
+static ws_parse_state_t _ws_check_http_status(ws_t ws, const char *line)
+{
+	int major_version;
+	int minor_version;
+	int status_code;
+
+	if (_ws_parse_http_status(line,
+		&major_version, &minor_version, &status_code))
+	{
+		LIBWS_LOG(LIBWS_ERR, "Failed to parse HTTP status line");
+		return WS_PARSE_STATE_ERROR;
+	}
+
+	LIBWS_LOG(LIBWS_DEBUG, "HTTP/%d.%d %d", 
+			major_version, minor_version, status_code);
+
+	if ((major_version != 1) || (minor_version != 1))
+	{
+		LIBWS_LOG(LIBWS_ERR, "Server using unsupported HTTP "
+							 "version %d.%d",
+								major_version, minor_version);
+		return WS_PARSE_STATE_ERROR;
+	}
+
+	if (status_code != HTTP_STATUS_SWITCHING_PROTOCOLS_101)
+	{
+		// TODO: This must not be invalid. Could be a redirect for instance (add callback for this, so the user can decide to follow it... and also add auto follow support).
+
+		LIBWS_LOG(LIBWS_ERR, "Invalid HTTP status code (%d)", 
+							status_code);
+		return WS_PARSE_STATE_ERROR;
+	}
+
+	return WS_PARSE_STATE_SUCCESS;
+}
+
+ws_parse_state_t _ws_read_http_response(ws_t ws, struct evbuffer *in)
+{
+	struct evbuffer_ptr end;
+	char *data;
+	char *line;
+	char *eol;
 	char *header_name = NULL;
 	char *header_val = NULL;
-	ws_parse_state_t state = WS_PARSE_STATE_NEED_MORE;
+	char status_line[64];
 	size_t len;
+	ws_parse_state_t state;
 	assert(ws);
 	assert(in);
 
-	// TODO: Set a max header size to allow.
+	end = evbuffer_search(in, "\r\n\r\n", 4, NULL);
 
-	while ((line = evbuffer_readln(in, &len, EVBUFFER_EOL_CRLF)) != NULL)
+	if (end.pos < 0)
 	{
-		// Check for end of HTTP response (empty line).
-		if (*line == '\0')
+		if (evbuffer_get_length(in) > ws->max_handshake_size)
 		{
-			LIBWS_LOG(LIBWS_DEBUG2, "End of HTTP request");
-			state = WS_PARSE_STATE_SUCCESS;
-			break;	
+			LIBWS_LOG(LIBWS_ERR, "HTTP upgrade response larger than "
+								 "%u bytes", (unsigned)ws->max_handshake_size);
+			return WS_PARSE_STATE_ERROR;
 		}
 
+		// Don't wait for the rest if the status is already wrong.
+		end = evbuffer_search(in, "\r\n", 2, NULL);
+
+		if ((end.pos >= 0) && ((size_t)end.pos < sizeof(status_line)))
+		{
+			evbuffer_copyout(in, status_line, (size_t)end.pos);
+			status_line[end.pos] = '\0';
+
+			if ((state = _ws_check_http_status(ws, status_line))
+				!= WS_PARSE_STATE_SUCCESS)
+			{
+				return state;
+			}
+		}
+
+		return WS_PARSE_STATE_NEED_MORE;
+	}
+
+	len = (size_t)end.pos + 4;
+
+	if (len > ws->max_handshake_size)
+	{
+		LIBWS_LOG(LIBWS_ERR, "HTTP upgrade response of %u bytes is larger "
+							 "than %u bytes", (unsigned)len,
+							 (unsigned)ws->max_handshake_size);
+		return WS_PARSE_STATE_ERROR;
+	}
+
+	// The whole response is parsed in place. Every line is NUL terminated
+	// where it ends, and the headers are split into name and value
+	// pointing into it, the region is only drained when done.
+	if (!(data = (char *)evbuffer_pullup(in, len)))
+	{
+		LIBWS_LOG(LIBWS_ERR, "Out of memory!");
+		return WS_PARSE_STATE_ERROR;
+	}
+
+	if (memchr(data, '\0', len))
+	{
+		LIBWS_LOG(LIBWS_ERR, "NUL byte in HTTP upgrade response");
+		return WS_PARSE_STATE_ERROR;
+	}
+
+	line = data;
+	eol = _ws_find_crlf(line);
+	*eol = '\0';
+
+	if ((state = _ws_check_http_status(ws, line)) != WS_PARSE_STATE_SUCCESS)
+	{
+		return state;
+	}
+
+	LIBWS_LOG(LIBWS_DEBUG, "Reading headers");
+
+	// Check for end of HTTP response (empty line).
+	for (line = eol + 2; (line[0] != '\r') || (line[1] != '\n'); line = eol + 2)
+	{
+		eol = _ws_find_crlf(line);
+		*eol = '\0';
+
 		if (_ws_parse_http_header(line, &header_name, &header_val))
 		{
 			LIBWS_LOG(LIBWS_ERR, "Failed to parse HTTP upgrade "
-								 "repsonse line: %s", line);
-			
-			state = WS_PARSE_STATE_ERROR;
-			break;
+								 "response line: %s", line);
+			return WS_PARSE_STATE_ERROR;
 		}
 
 		LIBWS_LOG(LIBWS_DEBUG2, "%s: %s", header_name, header_val);
 		
 		// Let the user get the header.
-		if (ws->header_cb)
+		if (ws->cbs->header_cb)
 		{
 			LIBWS_LOG(LIBWS_DEBUG2, "	Call header callback");
 
-			if (ws->header_cb(ws, header_name, header_val, ws->header_arg))
+			if (ws->cbs->header_cb(ws, header_name, header_val, ws->cbs->header_arg))
 			{
 				LIBWS_LOG(LIBWS_DEBUG, "User header callback cancelled "
 										"handshake");
-				state = WS_PARSE_STATE_USER_ABORT;
-				break;
+				return WS_PARSE_STATE_USER_ABORT;
 			}
 		}
 
 		if (_ws_validate_http_headers(ws, header_name, header_val))
 		{
 			LIBWS_LOG(LIBWS_ERR, "	invalid");
-			state = WS_PARSE_STATE_ERROR;
-			break;
+			return WS_PARSE_STATE_ERROR;
 		}
 
 		LIBWS_LOG(LIBWS_DEBUG2, "	valid");
-
-		_ws_free(line);
-		line = NULL;
-
-		if (header_name) 
-		{
-			_ws_free(header_name);
-			header_name = NULL;
-		}
-
-		if (header_val)
-		{
-			_ws_free(header_val);
-			header_val = NULL;
-		}
 	}
 
-	if (line) _ws_free(line);
-	if (header_name) _ws_free(header_name);
-	if (header_val) _ws_free(header_val);
+	LIBWS_LOG(LIBWS_DEBUG2, "End of HTTP response");
+
+	evbuffer_drain(in, len);
 
-	return state;
+	return WS_PARSE_STATE_SUCCESS;
 }
 
 ws_parse_state_t _ws_read_server_handshake_reply(ws_t ws, struct evbuffer *in)
 {
-	char *line = NULL;
-	char *header_name = NULL;
-	char *header_val = NULL;
-	int major_version;
-	int minor_version;
-	int status_code;
 	ws_parse_state_t parse_state;
 	assert(ws);
 	assert(in);
@@ -558,45 +664,10 @@ ws_parse_state_t _ws_read_server_handshake_reply(ws_t ws, struct evbuffer *in)
 		}
 		case WS_CONNECT_STATE_SENT_REQ:
 		{
+			// Read the status line and HTTP headers in one go.
 			ws->http_header_flags = 0;
 
-			// Parse status line HTTP/1.1 200 OK...
-			if ((parse_state = _ws_read_http_status(ws, in, 
-							&major_version, &minor_version, &status_code)) 
-							!= WS_PARSE_STATE_SUCCESS)
-			{
-				return parse_state;
-			}
-
-			LIBWS_LOG(LIBWS_DEBUG, "HTTP/%d.%d %d", 
-					major_version, minor_version, status_code);
-
-			if ((major_version != 1) || (minor_version != 1))
-			{
-				LIBWS_LOG(LIBWS_ERR, "Server using unsupported HTTP "
-									 "version %d.%d",
-										major_version, minor_version);
-				return WS_PARSE_STATE_ERROR;
-			}
-
-			if (status_code != HTTP_STATUS_SWITCHING_PROTOCOLS_101)
-			{
-				// TODO: This must not be invalid. Could be a redirect for instance (add callback for this, so the user can decide to follow it... and also add auto follow support).
-
-				LIBWS_LOG(LIBWS_ERR, "Invalid HTTP status code (%d)", 
-									status_code);
-				return WS_PARSE_STATE_ERROR;
-			}
-
-			ws->connect_state = WS_CONNECT_STATE_PARSED_STATUS;
-			// Fall through.
-		} 
-		case WS_CONNECT_STATE_PARSED_STATUS:
-		{
-			LIBWS_LOG(LIBWS_DEBUG, "Reading headers");
-
-			// Read the HTTP headers.
-			if ((parse_state = _ws_read_http_headers(ws, in)) 
+			if ((parse_state = _ws_read_http_response(ws, in)) 
 				!= WS_PARSE_STATE_SUCCESS)
 			{
 				return parse_state;
@@ -605,8 +676,8 @@ ws_parse_state_t _ws_read_server_handshake_reply(ws_t ws, struct evbuffer *in)
 			LIBWS_LOG(LIBWS_DEBUG, "Successfully parsed HTTP headers");
 
 			ws->connect_state = WS_CONNECT_STATE_PARSED_HEADERS;
-			// Fall through.
 		}
+		// Fall through.
 		case WS_CONNECT_STATE_PARSED_HEADERS:
 		{
 			ws_http_header_flags_t f = ws->http_header_flags;
@@ -632,7 +703,7 @@ ws_parse_state_t _ws_read_server_handshake_reply(ws_t ws, struct evbuffer *in)
 
 			if (!(f & WS_HAS_VALID_WS_PROTOCOL_HEADER))
 			{
-				if (ws->num_subprotocols > 0)
+				if (ws_get_subprotocol_count(ws) > 0)
 				{
 					LIBWS_LOG(LIBWS_WARN, "Server did not reply to my "
 											"subprotocol request");
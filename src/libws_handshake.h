@@ -18,11 +18,57 @@ typedef enum ws_http_header_flags_e
 
 int _ws_generate_handshake_key(ws_t ws);
 
+///
+/// Renders a handshake request.
+///
+/// @param[in]  out                 The buffer to add the request to.
+/// @param[in]  server              The server hostname.
+/// @param[in]  port                The server port.
+/// @param[in]  uri                 The uri, or NULL.
+/// @param[in]  origin              The origin, or NULL.
+/// @param[in]  subprotocols        The subprotocols.
+/// @param[in]  num_subprotocols    The number of subprotocols.
+/// @param[in]  key                 The handshake key.
+/// @param[out] key_offset          If not NULL, set to where the key
+///                                 starts in the request.
+///
+/// @returns                        0 on success.
+///
+int _ws_render_handshake(struct evbuffer *out, const char *server, int port,
+						const char *uri, const char *origin,
+						char **subprotocols, size_t num_subprotocols,
+						const char *key, size_t *key_offset);
+
 int _ws_send_handshake(ws_t ws, struct evbuffer *out);
 
+///
+/// Parses a HTTP header line in place. The line is split at the colon,
+/// and the value has its surrounding whitespace skipped.
+///
+/// @param[in]  line        The NUL terminated line, modified.
+/// @param[out] header_name Set to the name, pointing into the line.
+/// @param[out] header_val  Set to the value, pointing into the line.
+///
+/// @returns                0 on success.
+///
 int _ws_parse_http_header(char *line, char **header_name, char **header_val);
 
-int _ws_read_server_handshake_reply(ws_t ws, struct evbuffer *in);
+///
+/// Parses the status line and headers of the HTTP upgrade response,
+/// once all of it has been received. The response is parsed in place
+/// and passed to the header callback without being copied.
+///
+/// Responses larger than ws_s#max_handshake_size are rejected.
+///
+/// @param[in] ws   The websocket context.
+/// @param[in] in   The received data, the response is drained from it.
+///
+/// @returns        #WS_PARSE_STATE_NEED_MORE until the whole response
+///                 is received.
+///
+ws_parse_state_t _ws_read_http_response(ws_t ws, struct evbuffer *in);
+
+ws_parse_state_t _ws_read_server_handshake_reply(ws_t ws, struct evbuffer *in);
 
 int _ws_check_server_protocol_list(ws_t ws, const char *val);
 
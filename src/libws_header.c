@@ -101,10 +101,17 @@ ws_parse_state_t ws_unpack_header(ws_header_t *h, size_t *header_len,
 	// Read masking key.
 	if (h->mask_bit)
 	{
-		uint32_t *mask_ptr = (uint32_t *)&b[*header_len];
-		// TODO: Hmm shouldn't it be ntohl here? (doesn't work with RFC examples though).
-		h->mask = (*mask_ptr);
-		*header_len += 4;
+		if (len < (*header_len + 4))
+		{
+			goto need_more;
+		}
+		else
+		{
+			uint32_t *mask_ptr = (uint32_t *)&b[*header_len];
+			// TODO: Hmm shouldn't it be ntohl here? (doesn't work with RFC examples though).
+			h->mask = (*mask_ptr);
+			*header_len += 4;
+		}
 	}
 
 	return WS_PARSE_STATE_SUCCESS;
@@ -0,0 +1,126 @@
+#include "libws_config.h"
+#include <string.h>
+#include "libws_histogram.h"
+
+#define WS_HISTOGRAM_MAX_VALUE ((((uint64_t)1) << WS_HISTOGRAM_MAX_BITS) - 1)
+
+static int _ws_histogram_msb(uint64_t value)
+{
+	int msb = 0;
+
+	while (value >>= 1)
+	{
+		msb++;
+	}
+
+	return msb;
+}
+
+static int _ws_histogram_index(uint64_t value)
+{
+	int shift;
+
+	if (value > WS_HISTOGRAM_MAX_VALUE)
+	{
+		value = WS_HISTOGRAM_MAX_VALUE;
+	}
+
+	// Exact counts for the first two sub bucket ranges.
+	if (value < (2 * WS_HISTOGRAM_SUB_BUCKETS))
+	{
+		return (int)value;
+	}
+
+	// Keep the top WS_HISTOGRAM_SUB_BUCKET_BITS + 1 bits of the value.
+	shift = _ws_histogram_msb(value) - WS_HISTOGRAM_SUB_BUCKET_BITS;
+
+	return (shift * WS_HISTOGRAM_SUB_BUCKETS) + (int)(value >> shift);
+}
+
+static uint64_t _ws_histogram_value(int index)
+{
+	int shift;
+	uint64_t sub;
+
+	if (index < (2 * WS_HISTOGRAM_SUB_BUCKETS))
+	{
+		return (uint64_t)index;
+	}
+
+	shift = (index / WS_HISTOGRAM_SUB_BUCKETS) - 1;
+	sub = (uint64_t)(index - (shift * WS_HISTOGRAM_SUB_BUCKETS));
+
+	// Middle of the bucket.
+	return (sub << shift) + ((((uint64_t)1) << shift) >> 1);
+}
+
+void _ws_histogram_reset(ws_histogram_t *h)
+{
+	memset(h, 0, sizeof(*h));
+}
+
+void _ws_histogram_record(ws_histogram_t *h, uint64_t value)
+{
+	if ((h->count == 0) || (value < h->min))
+	{
+		h->min = value;
+	}
+
+	if (value > h->max)
+	{
+		h->max = value;
+	}
+
+	h->count++;
+	h->sum += value;
+	h->counts[_ws_histogram_index(value)]++;
+}
+
+uint64_t _ws_histogram_percentile(const ws_histogram_t *h, double percentile)
+{
+	int i;
+	uint64_t seen = 0;
+	uint64_t wanted;
+	uint64_t value;
+
+	if (h->count == 0)
+	{
+		return 0;
+	}
+
+	if (percentile >= 100.0)
+	{
+		return h->max;
+	}
+
+	if (percentile < 0.0)
+	{
+		percentile = 0.0;
+	}
+
+	// The rank of the value we are looking for, at least 1.
+	wanted = (uint64_t)(((percentile / 100.0) * (double)h->count) + 0.5);
+
+	if (wanted == 0)
+	{
+		wanted = 1;
+	}
+
+	for (i = 0; i < WS_HISTOGRAM_BUCKETS; i++)
+	{
+		seen += h->counts[i];
+
+		if (seen >= wanted)
+		{
+			value = _ws_histogram_value(i);
+
+			// The bucket midpoint may be outside what was recorded.
+			if (value < h->min) value = h->min;
+			if (value > h->max) value = h->max;
+
+			return value;
+		}
+	}
+
+	return h->max;
+}
@@ -0,0 +1,53 @@
+
+#ifndef __LIBWS_HISTOGRAM_H__
+#define __LIBWS_HISTOGRAM_H__
+
+///
+/// @internal
+/// @file libws_histogram.h
+///
+/// A fixed size log-linear histogram, in the style of HdrHistogram.
+/// Values below 2 * #WS_HISTOGRAM_SUB_BUCKETS are counted exactly,
+/// larger values are counted in buckets that are 1/#WS_HISTOGRAM_SUB_BUCKETS
+/// of their power of two wide, so the relative error is at most ~3%.
+///
+
+#include "libws_config.h"
+#include <stdint.h>
+
+#define WS_HISTOGRAM_SUB_BUCKET_BITS 5
+#define WS_HISTOGRAM_SUB_BUCKETS (1 << WS_HISTOGRAM_SUB_BUCKET_BITS)
+
+/// Largest value that can be recorded is 2^WS_HISTOGRAM_MAX_BITS - 1,
+/// anything above that is counted as the max.
+#define WS_HISTOGRAM_MAX_BITS 32
+
+#define WS_HISTOGRAM_BUCKETS \
+    (((WS_HISTOGRAM_MAX_BITS - WS_HISTOGRAM_SUB_BUCKET_BITS) \
+        * WS_HISTOGRAM_SUB_BUCKETS) + WS_HISTOGRAM_SUB_BUCKETS)
+
+typedef struct ws_histogram_s
+{
+    uint64_t count;         ///< Number of recorded values.
+    uint64_t min;           ///< Smallest recorded value.
+    uint64_t max;           ///< Largest recorded value.
+    uint64_t sum;           ///< Sum of all recorded values.
+    uint32_t counts[WS_HISTOGRAM_BUCKETS];
+} ws_histogram_t;
+
+void _ws_histogram_reset(ws_histogram_t *h);
+
+void _ws_histogram_record(ws_histogram_t *h, uint64_t value);
+
+///
+/// Gets the value at a percentile.
+///
+/// @param[in] h            The histogram.
+/// @param[in] percentile   The percentile, 0 - 100.
+///
+/// @returns                The value, rounded to the middle of its
+///                         bucket. 0 if nothing has been recorded.
+///
+uint64_t _ws_histogram_percentile(const ws_histogram_t *h, double percentile);
+
+#endif // __LIBWS_HISTOGRAM_H__
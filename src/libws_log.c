@@ -13,7 +13,7 @@
 #include <WinSock2.h>
 #endif // _WIN32
 
-static int _ws_log_level = LIBWS_NONE;
+int _ws_log_level = LIBWS_NONE;
 static ws_log_callback_f _ws_log_cb;
 
 ///
@@ -126,4 +126,9 @@ void ws_set_log_cb(ws_log_callback_f func)
 	_ws_log_cb = func;
 }
 
+ws_log_callback_f ws_get_log_cb()
+{
+	return _ws_log_cb;
+}
+
 
@@ -4,6 +4,7 @@
 
 #include "libws_config.h"
 #include <stdarg.h>
+#include <stdio.h>
 
 #define LIBWS_NONE		(0 << 0)
 #define LIBWS_CRIT		(1 << 0)
@@ -23,17 +24,49 @@
 #define _LIBWS_FUNC_	__func__
 #endif
 
+///
+/// Log calls with a lower priority than this are compiled out,
+/// set using the LIBWS_LOG_MIN_LEVEL CMake option.
+///
+#ifndef LIBWS_LOG_MIN_LEVEL
+#define LIBWS_LOG_MIN_LEVEL LIBWS_TRACE
+#endif
+
+#if defined(__GNUC__)
+#define LIBWS_UNLIKELY(x) __builtin_expect(!!(x), 0)
+#else
+#define LIBWS_UNLIKELY(x) (x)
+#endif
+
 #ifdef LIBWS_WITH_LOG
 
+///
+/// The priorities that are logged, see #ws_set_log_level.
+/// Only exposed so #LIBWS_LOG can check it inline.
+///
+extern int _ws_log_level;
+
+///
+/// Checks if a priority is logged, before any log arguments
+/// are evaluated.
+///
+#define LIBWS_LOG_ENABLED(prio) \
+	(((prio) <= LIBWS_LOG_MIN_LEVEL) && LIBWS_UNLIKELY(_ws_log_level & (prio)))
+
 // http://stackoverflow.com/questions/5588855/standard-alternative-to-gccs-va-args-trick
 #define LIBWS_LOG(prio, fmt, ...) \
-	libws_log(prio, __FILE__, _LIBWS_FUNC_, __LINE__, fmt, ##__VA_ARGS__)
+	do \
+	{ \
+		if (LIBWS_LOG_ENABLED(prio)) \
+			libws_log(prio, __FILE__, _LIBWS_FUNC_, __LINE__, fmt, ##__VA_ARGS__); \
+	} while (0)
 
 void libws_log(int prio, const char *file, 
 	const char *func, int line, const char *fmt, ...);
 
 #else
 
+#define LIBWS_LOG_ENABLED(prio) 0
 #define LIBWS_LOG(prio, fmt, ...)
 #define LIBWS_LOGTRACE(fmt, ...) LIBWS_LOG(LIBWS_TRACE, fmt, ...)
 
@@ -42,6 +75,10 @@ void libws_log(int prio, const char *file,
 #define LIBWS_LOG_MASK(priority) (1 << (priority))
 #define LIBWS_LOG_UPTO(priority) ((priority) | ((priority) - 1))
 
+///
+/// Sets the priorities to log, a mask of LIBWS_CRIT, LIBWS_ERR and so on.
+/// Priorities below #LIBWS_LOG_MIN_LEVEL are never logged.
+///
 void ws_set_log_level(int prio);
 int ws_get_log_level();
 
@@ -50,10 +87,64 @@ typedef void (*ws_log_callback_f)(int prio, const
 				const char *fmt, va_list args);
 
 void ws_set_log_cb(ws_log_callback_f func);
+ws_log_callback_f ws_get_log_cb();
 
 void ws_default_log_cb(int prio, const char *file, 
 	const char *func, int line, const char *fmt, va_list args);
 
 const char *ws_log_get_prio_str(int prio);
 
+#ifdef LIBWS_WITH_LOG
+
+///
+/// Starts logging to per thread ring buffers instead of the log
+/// callback. Log calls only copy their arguments and a timestamp,
+/// the formatting and writing is done later by #ws_log_ring_flush,
+/// either from a background thread or by the application.
+///
+/// When a thread logs faster than the rings are flushed its records
+/// are dropped, see #ws_log_ring_get_dropped. Strings are copied and
+/// may be truncated, everything else is formatted as if it was
+/// logged right away. The format strings must outlive the records.
+///
+/// Other threads may keep logging while the log ring is started or
+/// stopped. The rings are kept until the process exits, since such a
+/// thread might still be writing to its ring, and are reused when
+/// the log ring is started again with the same number of slots.
+/// Starting and stopping must not be done from several threads at once.
+///
+/// @param[in] slots        Records per thread, rounded up to a power
+///                         of two. 0 for the default.
+/// @param[in] interval_ms  How often a background thread flushes the
+///                         rings. 0 to not start a thread.
+/// @param[in] out          Where the formatted lines are written,
+///                         NULL for stdout.
+///
+/// @returns                0 on success, -1 on failure or if already
+///                         started.
+///
+int ws_log_ring_start(size_t slots, unsigned int interval_ms, FILE *out);
+
+///
+/// Formats and writes the records in all rings, safe to call
+/// from any thread.
+///
+/// @returns                The number of records written.
+///
+size_t ws_log_ring_flush();
+
+///
+/// Gets the number of records that were dropped since
+/// #ws_log_ring_start because a ring was full.
+///
+uint64_t ws_log_ring_get_dropped();
+
+///
+/// Stops the background thread, flushes what's left and
+/// restores the previous log callback.
+///
+void ws_log_ring_stop();
+
+#endif // LIBWS_WITH_LOG
+
 #endif // __LIBWS_LOG_H__
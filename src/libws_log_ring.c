@@ -0,0 +1,875 @@
+#include "libws_config.h"
+#include <assert.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <unistd.h>
+#endif
+#include <event2/util.h>
+#include "libws_log.h"
+#include "libws_private.h"
+#include "libws_log_ring.h"
+
+#ifdef LIBWS_WITH_LOG
+
+#if defined(__GNUC__)
+#define _WS_LOAD_ACQUIRE(ptr) __atomic_load_n((ptr), __ATOMIC_ACQUIRE)
+#define _WS_STORE_RELEASE(ptr, val) __atomic_store_n((ptr), (val), __ATOMIC_RELEASE)
+#else
+// Volatile accesses are acquire and release on MSVC.
+#define _WS_LOAD_ACQUIRE(ptr) (*(volatile size_t *)(ptr))
+#define _WS_STORE_RELEASE(ptr, val) (*(volatile size_t *)(ptr) = (val))
+#endif
+
+#ifdef _WIN32
+typedef SRWLOCK ws_log_lock_t;
+#define _WS_LOG_LOCK_INIT SRWLOCK_INIT
+#define _ws_log_lock(l) AcquireSRWLockExclusive(l)
+#define _ws_log_unlock(l) ReleaseSRWLockExclusive(l)
+#else
+typedef pthread_mutex_t ws_log_lock_t;
+#define _WS_LOG_LOCK_INIT PTHREAD_MUTEX_INITIALIZER
+#define _ws_log_lock(l) pthread_mutex_lock(l)
+#define _ws_log_unlock(l) pthread_mutex_unlock(l)
+#endif
+
+typedef struct ws_log_ring_s
+{
+    struct ws_log_ring_s *next; ///< All rings, see #_ws_log_rings.
+    size_t mask;                ///< Slots - 1.
+    ws_log_record_t *records;   ///< The slots.
+    size_t dropped;             ///< Records dropped since the ring
+                                /// was full, written by the owner.
+    size_t dropped_base;        ///< ws_log_ring_s#dropped when the log
+                                /// ring was started, by the consumer.
+    char pad[64];               ///< Keeps head and tail on their
+                                /// own cache lines.
+    size_t head;                ///< Next slot to write, by the owner.
+    char pad2[64];
+    size_t tail;                ///< Next slot to read, by the consumer.
+} ws_log_ring_t;
+
+LIBWS_THREAD_LOCAL struct ws_s *_ws_log_conn;
+
+// The ring of this thread, if it was created for the current
+// generation, bumped each time the rings are retired.
+static LIBWS_THREAD_LOCAL ws_log_ring_t *_ws_log_ring_mine;
+static LIBWS_THREAD_LOCAL size_t _ws_log_ring_mine_gen;
+static LIBWS_THREAD_LOCAL int _ws_log_ring_creating;
+static size_t _ws_log_ring_gen;
+
+// Guards the list of rings and consuming from them. A thread might
+// still be logging to its ring after the log ring was stopped, so
+// rings are never freed. They are reused by the next start, or
+// retired if it uses another number of slots.
+static ws_log_lock_t _ws_log_ring_lock = _WS_LOG_LOCK_INIT;
+static ws_log_ring_t *_ws_log_rings;
+static ws_log_ring_t *_ws_log_rings_retired;
+static size_t _ws_log_ring_slots;
+static uint64_t _ws_log_ring_lost;
+static int _ws_log_ring_started;
+static FILE *_ws_log_ring_out;
+static ws_log_callback_f _ws_log_ring_prev_cb;
+
+// Converts the monotonic timestamps to wall clock time.
+static uint64_t _ws_log_ring_mono_start;
+static struct timeval _ws_log_ring_wall_start;
+
+static unsigned int _ws_log_ring_interval_ms;
+static size_t _ws_log_ring_running;
+#ifdef _WIN32
+static HANDLE _ws_log_ring_thread;
+#else
+static pthread_t _ws_log_ring_thread;
+#endif
+static int _ws_log_ring_has_thread;
+
+typedef enum ws_log_length_e
+{
+	WS_LOG_LEN_NONE,
+	WS_LOG_LEN_HH,
+	WS_LOG_LEN_H,
+	WS_LOG_LEN_L,
+	WS_LOG_LEN_LL,
+	WS_LOG_LEN_J,
+	WS_LOG_LEN_Z,
+	WS_LOG_LEN_T,
+	WS_LOG_LEN_LONG_DOUBLE
+} ws_log_length_t;
+
+///
+/// A conversion specification in a format string.
+///
+typedef struct ws_log_spec_s
+{
+	const char *start;			///< The '%'.
+	const char *end;			///< After the conversion character.
+	int width_star;				///< Width is an argument.
+	int prec_star;				///< Precision is an argument.
+	ws_log_length_t length;		///< Length modifier.
+	char conv;					///< Conversion character.
+} ws_log_spec_t;
+
+///
+/// Finds the next conversion specification.
+///
+/// @returns Pointer to the '%', or NULL if there are no more.
+///
+static const char *_ws_log_next_spec(const char *fmt, ws_log_spec_t *spec)
+{
+	const char *p;
+
+	while ((p = strchr(fmt, '%')))
+	{
+		memset(spec, 0, sizeof(*spec));
+		spec->start = p++;
+
+		while (*p && strchr("-+ #0'", *p)) p++;
+
+		if (*p == '*')
+		{
+			spec->width_star = 1;
+			p++;
+		}
+
+		while ((*p >= '0') && (*p <= '9')) p++;
+
+		if (*p == '.')
+		{
+			p++;
+
+			if (*p == '*')
+			{
+				spec->prec_star = 1;
+				p++;
+			}
+
+			while ((*p >= '0') && (*p <= '9')) p++;
+		}
+
+		switch (*p)
+		{
+			case 'h':
+				spec->length = (p[1] == 'h') ? WS_LOG_LEN_HH : WS_LOG_LEN_H;
+				p += (p[1] == 'h') ? 2 : 1;
+				break;
+			case 'l':
+				spec->length = (p[1] == 'l') ? WS_LOG_LEN_LL : WS_LOG_LEN_L;
+				p += (p[1] == 'l') ? 2 : 1;
+				break;
+			case 'q': spec->length = WS_LOG_LEN_LL; p++; break;
+			case 'j': spec->length = WS_LOG_LEN_J; p++; break;
+			case 'z': spec->length = WS_LOG_LEN_Z; p++; break;
+			case 't': spec->length = WS_LOG_LEN_T; p++; break;
+			case 'L': spec->length = WS_LOG_LEN_LONG_DOUBLE; p++; break;
+		}
+
+		spec->conv = *p;
+		spec->end = *p ? p + 1 : p;
+
+		return spec->start;
+	}
+
+	return NULL;
+}
+
+static int _ws_log_put(ws_log_record_t *rec, const void *val, size_t len)
+{
+	if ((rec->len + len) > sizeof(rec->args))
+	{
+		rec->truncated = 1;
+		return -1;
+	}
+
+	memcpy(&rec->args[rec->len], val, len);
+	rec->len += len;
+	return 0;
+}
+
+static int _ws_log_get(const ws_log_record_t *rec, size_t *pos,
+						void *val, size_t len)
+{
+	if ((*pos + len) > rec->len)
+		return -1;
+
+	memcpy(val, &rec->args[*pos], len);
+	*pos += len;
+	return 0;
+}
+
+static int _ws_log_put_string(ws_log_record_t *rec, const char *s)
+{
+	size_t len;
+	unsigned char is_null = (s == NULL);
+
+	// A flag, then the string including the NUL.
+	if (_ws_log_put(rec, &is_null, 1))
+		return -1;
+
+	if (is_null)
+		return 0;
+
+	if (rec->len >= sizeof(rec->args))
+	{
+		rec->truncated = 1;
+		return -1;
+	}
+
+	len = strlen(s);
+
+	if ((rec->len + len + 1) > sizeof(rec->args))
+	{
+		// Keep what fits.
+		len = sizeof(rec->args) - rec->len - 1;
+		rec->truncated = 1;
+	}
+
+	memcpy(&rec->args[rec->len], s, len);
+	rec->args[rec->len + len] = '\0';
+	rec->len += len + 1;
+
+	return 0;
+}
+
+void _ws_log_record_pack(ws_log_record_t *rec, const char *fmt, va_list args)
+{
+	ws_log_spec_t spec;
+	int64_t ival;
+	uint64_t uval;
+	double dval;
+	int star;
+
+	rec->len = 0;
+	rec->truncated = 0;
+
+	while (_ws_log_next_spec(fmt, &spec))
+	{
+		fmt = spec.end;
+
+		if (spec.width_star)
+		{
+			star = va_arg(args, int);
+			if (_ws_log_put(rec, &star, sizeof(star))) return;
+		}
+
+		if (spec.prec_star)
+		{
+			star = va_arg(args, int);
+			if (_ws_log_put(rec, &star, sizeof(star))) return;
+		}
+
+		switch (spec.conv)
+		{
+			case '%':
+				break;
+			case 'd':
+			case 'i':
+			{
+				switch (spec.length)
+				{
+					case WS_LOG_LEN_L: ival = va_arg(args, long); break;
+					case WS_LOG_LEN_LL: ival = va_arg(args, long long); break;
+					case WS_LOG_LEN_J: ival = va_arg(args, intmax_t); break;
+					case WS_LOG_LEN_Z: ival = (ptrdiff_t)va_arg(args, size_t); break;
+					case WS_LOG_LEN_T: ival = va_arg(args, ptrdiff_t); break;
+					default: ival = va_arg(args, int); break;
+				}
+
+				if (_ws_log_put(rec, &ival, sizeof(ival))) return;
+				break;
+			}
+			case 'u':
+			case 'o':
+			case 'x':
+			case 'X':
+			{
+				switch (spec.length)
+				{
+					case WS_LOG_LEN_L: uval = va_arg(args, unsigned long); break;
+					case WS_LOG_LEN_LL: uval = va_arg(args, unsigned long long); break;
+					case WS_LOG_LEN_J: uval = va_arg(args, uintmax_t); break;
+					case WS_LOG_LEN_Z: uval = va_arg(args, size_t); break;
+					case WS_LOG_LEN_T: uval = (size_t)va_arg(args, ptrdiff_t); break;
+					default: uval = va_arg(args, unsigned int); break;
+				}
+
+				if (_ws_log_put(rec, &uval, sizeof(uval))) return;
+				break;
+			}
+			case 'c':
+			{
+				ival = va_arg(args, int);
+				if (_ws_log_put(rec, &ival, sizeof(ival))) return;
+				break;
+			}
+			case 'e': case 'E':
+			case 'f': case 'F':
+			case 'g': case 'G':
+			case 'a': case 'A':
+			{
+				if (spec.length == WS_LOG_LEN_LONG_DOUBLE)
+					dval = (double)va_arg(args, long double);
+				else
+					dval = va_arg(args, double);
+
+				if (_ws_log_put(rec, &dval, sizeof(dval))) return;
+				break;
+			}
+			case 'p':
+			{
+				uval = (uintptr_t)va_arg(args, void *);
+				if (_ws_log_put(rec, &uval, sizeof(uval))) return;
+				break;
+			}
+			case 's':
+			{
+				if (_ws_log_put_string(rec, va_arg(args, const char *)))
+					return;
+				break;
+			}
+			case 'n':
+			{
+				// Nothing is written back.
+				(void)va_arg(args, void *);
+				break;
+			}
+			default:
+			{
+				// Unknown argument type, the rest can't be packed.
+				rec->truncated = 1;
+				return;
+			}
+		}
+	}
+}
+
+///
+/// Appends to the formatted message, keeping track of the length.
+///
+static void _ws_log_append(char *buf, size_t size, size_t *len,
+							const char *spec, ...)
+{
+	int ret;
+	va_list args;
+
+	if (*len >= size - 1)
+		return;
+
+	va_start(args, spec);
+	ret = vsnprintf(&buf[*len], size - *len, spec, args);
+	va_end(args);
+
+	if (ret > 0)
+	{
+		*len += ((size_t)ret < (size - *len)) ? (size_t)ret : (size - *len - 1);
+	}
+}
+
+size_t _ws_log_record_format(const ws_log_record_t *rec,
+							char *buf, size_t size)
+{
+	const char *fmt;
+	const char *p;
+	const char *text;
+	char spec_buf[64];
+	size_t spec_len;
+	size_t pos = 0;
+	size_t len = 0;
+	ws_log_spec_t spec;
+	int64_t ival;
+	uint64_t uval;
+	double dval;
+	int star;
+	unsigned char is_null;
+
+	assert(rec);
+	assert(buf);
+	assert(size > 0);
+
+	buf[0] = '\0';
+	fmt = rec->fmt;
+
+	while (_ws_log_next_spec(fmt, &spec))
+	{
+		// The text up to the specification.
+		_ws_log_append(buf, size, &len, "%.*s",
+						(int)(spec.start - fmt), fmt);
+		fmt = spec.end;
+
+		// Copy the specification, with the '*' replaced by the values.
+		spec_len = 0;
+
+		for (p = spec.start; (p < spec.end)
+			&& (spec_len < sizeof(spec_buf) - 16); p++)
+		{
+			if (*p == '*')
+			{
+				if (_ws_log_get(rec, &pos, &star, sizeof(star)))
+					goto truncated;
+
+				spec_len += sprintf(&spec_buf[spec_len], "%d", star);
+			}
+			else
+			{
+				spec_buf[spec_len++] = *p;
+			}
+		}
+
+		spec_buf[spec_len] = '\0';
+
+		switch (spec.conv)
+		{
+			case '%':
+				_ws_log_append(buf, size, &len, "%%");
+				break;
+			case 'd':
+			case 'i':
+			case 'c':
+			{
+				if (_ws_log_get(rec, &pos, &ival, sizeof(ival)))
+					goto truncated;
+
+				switch (spec.length)
+				{
+					case WS_LOG_LEN_L: _ws_log_append(buf, size, &len, spec_buf, (long)ival); break;
+					case WS_LOG_LEN_LL: _ws_log_append(buf, size, &len, spec_buf, (long long)ival); break;
+					case WS_LOG_LEN_J: _ws_log_append(buf, size, &len, spec_buf, (intmax_t)ival); break;
+					case WS_LOG_LEN_Z: _ws_log_append(buf, size, &len, spec_buf, (size_t)ival); break;
+					case WS_LOG_LEN_T: _ws_log_append(buf, size, &len, spec_buf, (ptrdiff_t)ival); break;
+					default: _ws_log_append(buf, size, &len, spec_buf, (int)ival); break;
+				}
+				break;
+			}
+			case 'u':
+			case 'o':
+			case 'x':
+			case 'X':
+			{
+				if (_ws_log_get(rec, &pos, &uval, sizeof(uval)))
+					goto truncated;
+
+				switch (spec.length)
+				{
+					case WS_LOG_LEN_L: _ws_log_append(buf, size, &len, spec_buf, (unsigned long)uval); break;
+					case WS_LOG_LEN_LL: _ws_log_append(buf, size, &len, spec_buf, (unsigned long long)uval); break;
+					case WS_LOG_LEN_J: _ws_log_append(buf, size, &len, spec_buf, (uintmax_t)uval); break;
+					case WS_LOG_LEN_Z: _ws_log_append(buf, size, &len, spec_buf, (size_t)uval); break;
+					case WS_LOG_LEN_T: _ws_log_append(buf, size, &len, spec_buf, (ptrdiff_t)uval); break;
+					default: _ws_log_append(buf, size, &len, spec_buf, (unsigned int)uval); break;
+				}
+				break;
+			}
+			case 'e': case 'E':
+			case 'f': case 'F':
+			case 'g': case 'G':
+			case 'a': case 'A':
+			{
+				if (_ws_log_get(rec, &pos, &dval, sizeof(dval)))
+					goto truncated;
+
+				if (spec.length == WS_LOG_LEN_LONG_DOUBLE)
+					_ws_log_append(buf, size, &len, spec_buf, (long double)dval);
+				else
+					_ws_log_append(buf, size, &len, spec_buf, dval);
+				break;
+			}
+			case 'p':
+			{
+				if (_ws_log_get(rec, &pos, &uval, sizeof(uval)))
+					goto truncated;
+
+				_ws_log_append(buf, size, &len, spec_buf, (void *)(uintptr_t)uval);
+				break;
+			}
+			case 's':
+			{
+				if (_ws_log_get(rec, &pos, &is_null, 1))
+					goto truncated;
+
+				if (is_null)
+				{
+					text = NULL;
+				}
+				else
+				{
+					if (pos >= rec->len)
+						goto truncated;
+
+					text = (const char *)&rec->args[pos];
+					pos += strlen(text) + 1;
+				}
+
+				_ws_log_append(buf, size, &len, spec_buf, text ? text : "(null)");
+				break;
+			}
+			case 'n':
+				break;
+			default:
+				goto truncated;
+		}
+	}
+
+	_ws_log_append(buf, size, &len, "%s", fmt);
+
+	if (rec->truncated)
+	{
+		_ws_log_append(buf, size, &len, " [truncated]");
+	}
+
+	return len;
+
+truncated:
+	_ws_log_append(buf, size, &len, "... [truncated]");
+	return len;
+}
+
+static uint64_t _ws_log_ring_now_ns()
+{
+	#ifdef _WIN32
+	LARGE_INTEGER freq;
+	LARGE_INTEGER now;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&now);
+	return (uint64_t)(now.QuadPart / freq.QuadPart) * 1000000000
+		+ (uint64_t)(now.QuadPart % freq.QuadPart) * 1000000000 / freq.QuadPart;
+	#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+	#endif
+}
+
+static ws_log_ring_t *_ws_log_ring_new(size_t slots)
+{
+	ws_log_ring_t *ring;
+	#ifdef LIBWS_WITH_MEMORY_ACCOUNTING
+	// Not charged to the connection that happened to log first.
+	ws_mem_account_t *prev = _ws_mem_enter(NULL);
+	#endif
+
+	if ((ring = (ws_log_ring_t *)_ws_calloc(1, sizeof(ws_log_ring_t))))
+	{
+		ring->mask = slots - 1;
+
+		if (!(ring->records = (ws_log_record_t *)
+				_ws_malloc(slots * sizeof(ws_log_record_t))))
+		{
+			_ws_free(ring);
+			ring = NULL;
+		}
+	}
+
+	#ifdef LIBWS_WITH_MEMORY_ACCOUNTING
+	_ws_mem_leave(prev);
+	#endif
+
+	return ring;
+}
+
+///
+/// Gets the ring of the calling thread, creating it the first time.
+///
+static ws_log_ring_t *_ws_log_ring_get()
+{
+	ws_log_ring_t *ring;
+	size_t gen = _WS_LOAD_ACQUIRE(&_ws_log_ring_gen);
+
+	if (_ws_log_ring_mine && (_ws_log_ring_mine_gen == gen))
+		return _ws_log_ring_mine;
+
+	// Anything logged while creating the ring is lost.
+	if (_ws_log_ring_creating)
+		return NULL;
+
+	_ws_log_ring_creating = 1;
+	ring = _ws_log_ring_new(_WS_LOAD_ACQUIRE(&_ws_log_ring_slots));
+	_ws_log_ring_creating = 0;
+
+	if (!ring)
+		return NULL;
+
+	_ws_log_lock(&_ws_log_ring_lock);
+	ring->next = _ws_log_rings;
+	_ws_log_rings = ring;
+	_ws_log_unlock(&_ws_log_ring_lock);
+
+	_ws_log_ring_mine = ring;
+	_ws_log_ring_mine_gen = gen;
+
+	return ring;
+}
+
+///
+/// Log callback that only records the arguments.
+///
+static void _ws_log_ring_cb(int prio, const char *file,
+				const char *func, int line, const char *fmt, va_list args)
+{
+	size_t head;
+	ws_log_record_t *rec;
+	ws_log_ring_t *ring;
+
+	if (!(ring = _ws_log_ring_get()))
+	{
+		_ws_log_lock(&_ws_log_ring_lock);
+		_ws_log_ring_lost++;
+		_ws_log_unlock(&_ws_log_ring_lock);
+		return;
+	}
+
+	head = ring->head;
+
+	if ((head - _WS_LOAD_ACQUIRE(&ring->tail)) > ring->mask)
+	{
+		_WS_STORE_RELEASE(&ring->dropped, ring->dropped + 1);
+		return;
+	}
+
+	rec = &ring->records[head & ring->mask];
+	rec->time_ns = _ws_log_ring_now_ns();
+	rec->conn = _ws_log_conn;
+	rec->fmt = fmt;
+	rec->func = func;
+	rec->line = line;
+	rec->prio = (unsigned short)prio;
+	_ws_log_record_pack(rec, fmt, args);
+
+	_WS_STORE_RELEASE(&ring->head, head + 1);
+}
+
+///
+/// Writes a record, called with the ring lock held.
+///
+static void _ws_log_ring_write(const ws_log_record_t *rec)
+{
+	char msg[1024];
+	uint64_t usec;
+	time_t sec;
+	struct tm tm;
+	// Records come in bursts, the date only changes once a second.
+	static char timebuf[64];
+	static time_t timebuf_sec = (time_t)-1;
+
+	_ws_log_record_format(rec, msg, sizeof(msg));
+
+	usec = (uint64_t)_ws_log_ring_wall_start.tv_sec * 1000000
+		+ _ws_log_ring_wall_start.tv_usec
+		+ (rec->time_ns - _ws_log_ring_mono_start) / 1000;
+	sec = (time_t)(usec / 1000000);
+
+	if (sec != timebuf_sec)
+	{
+		#ifdef _WIN32
+		localtime_s(&tm, &sec);
+		#else
+		localtime_r(&sec, &tm);
+		#endif
+
+		strftime(timebuf, sizeof(timebuf), "%Y-%m-%d %H:%M:%S", &tm);
+		timebuf_sec = sec;
+	}
+
+	// Same layout as ws_default_log_cb, with the connection.
+	fprintf(_ws_log_ring_out, "[%s.%06u] %6s, %4d:%-32s: %p: %s\n",
+			timebuf, (unsigned)(usec % 1000000),
+			ws_log_get_prio_str(rec->prio), rec->line, rec->func,
+			rec->conn, msg);
+}
+
+size_t ws_log_ring_flush()
+{
+	size_t count = 0;
+	size_t tail;
+	size_t head;
+	ws_log_ring_t *ring;
+
+	_ws_log_lock(&_ws_log_ring_lock);
+
+	// Stopped, the output might be closed.
+	if (!_ws_log_ring_out)
+	{
+		_ws_log_unlock(&_ws_log_ring_lock);
+		return 0;
+	}
+
+	for (ring = _ws_log_rings; ring; ring = ring->next)
+	{
+		tail = ring->tail;
+		head = _WS_LOAD_ACQUIRE(&ring->head);
+
+		while (tail != head)
+		{
+			_ws_log_ring_write(&ring->records[tail & ring->mask]);
+			tail++;
+			count++;
+
+			// Let the producer have the slot back right away.
+			_WS_STORE_RELEASE(&ring->tail, tail);
+		}
+	}
+
+	if (count)
+	{
+		fflush(_ws_log_ring_out);
+	}
+
+	_ws_log_unlock(&_ws_log_ring_lock);
+
+	return count;
+}
+
+uint64_t ws_log_ring_get_dropped()
+{
+	uint64_t dropped;
+	ws_log_ring_t *ring;
+
+	_ws_log_lock(&_ws_log_ring_lock);
+
+	dropped = _ws_log_ring_lost;
+
+	for (ring = _ws_log_rings; ring; ring = ring->next)
+	{
+		dropped += _WS_LOAD_ACQUIRE(&ring->dropped) - ring->dropped_base;
+	}
+
+	_ws_log_unlock(&_ws_log_ring_lock);
+
+	return dropped;
+}
+
+#ifdef _WIN32
+static DWORD WINAPI _ws_log_ring_thread_main(LPVOID arg)
+#else
+static void *_ws_log_ring_thread_main(void *arg)
+#endif
+{
+	while (_WS_LOAD_ACQUIRE(&_ws_log_ring_running))
+	{
+		ws_log_ring_flush();
+
+		#ifdef _WIN32
+		Sleep(_ws_log_ring_interval_ms);
+		#else
+		usleep(_ws_log_ring_interval_ms * 1000);
+		#endif
+	}
+
+	return 0;
+}
+
+int ws_log_ring_start(size_t slots, unsigned int interval_ms, FILE *out)
+{
+	size_t n = 16;
+	ws_log_ring_t *ring;
+
+	if (_ws_log_ring_started)
+	{
+		LIBWS_LOG(LIBWS_ERR, "Log ring already started");
+		return -1;
+	}
+
+	if (!slots)
+		slots = WS_LOG_RING_DEFAULT_SLOTS;
+
+	while (n < slots)
+		n <<= 1;
+
+	_ws_log_lock(&_ws_log_ring_lock);
+
+	if (n != _ws_log_ring_slots)
+	{
+		// Each thread creates a new ring the next time it logs.
+		while ((ring = _ws_log_rings))
+		{
+			_ws_log_rings = ring->next;
+			ring->next = _ws_log_rings_retired;
+			_ws_log_rings_retired = ring;
+		}
+
+		_WS_STORE_RELEASE(&_ws_log_ring_slots, n);
+		_WS_STORE_RELEASE(&_ws_log_ring_gen, _ws_log_ring_gen + 1);
+	}
+	else
+	{
+		// Skip what was logged after the last flush of an earlier start.
+		for (ring = _ws_log_rings; ring; ring = ring->next)
+		{
+			_WS_STORE_RELEASE(&ring->tail, _WS_LOAD_ACQUIRE(&ring->head));
+			ring->dropped_base = _WS_LOAD_ACQUIRE(&ring->dropped);
+		}
+	}
+
+	_ws_log_ring_lost = 0;
+	_ws_log_ring_out = out ? out : stdout;
+	_ws_log_ring_interval_ms = interval_ms;
+	_ws_log_ring_mono_start = _ws_log_ring_now_ns();
+	evutil_gettimeofday(&_ws_log_ring_wall_start, NULL);
+
+	_ws_log_unlock(&_ws_log_ring_lock);
+
+	if (interval_ms)
+	{
+		_WS_STORE_RELEASE(&_ws_log_ring_running, 1);
+
+		#ifdef _WIN32
+		_ws_log_ring_has_thread = ((_ws_log_ring_thread = CreateThread(NULL,
+				0, _ws_log_ring_thread_main, NULL, 0, NULL)) != NULL);
+		#else
+		_ws_log_ring_has_thread = !pthread_create(&_ws_log_ring_thread,
+				NULL, _ws_log_ring_thread_main, NULL);
+		#endif
+
+		if (!_ws_log_ring_has_thread)
+		{
+			_WS_STORE_RELEASE(&_ws_log_ring_running, 0);
+			LIBWS_LOG(LIBWS_ERR, "Failed to start the log ring thread");
+			return -1;
+		}
+	}
+
+	_ws_log_ring_prev_cb = ws_get_log_cb();
+	ws_set_log_cb(_ws_log_ring_cb);
+	_ws_log_ring_started = 1;
+
+	return 0;
+}
+
+void ws_log_ring_stop()
+{
+	if (!_ws_log_ring_started)
+		return;
+
+	ws_set_log_cb(_ws_log_ring_prev_cb);
+	_ws_log_ring_started = 0;
+
+	if (_ws_log_ring_has_thread)
+	{
+		_WS_STORE_RELEASE(&_ws_log_ring_running, 0);
+
+		#ifdef _WIN32
+		WaitForSingleObject(_ws_log_ring_thread, INFINITE);
+		CloseHandle(_ws_log_ring_thread);
+		#else
+		pthread_join(_ws_log_ring_thread, NULL);
+		#endif
+
+		_ws_log_ring_has_thread = 0;
+	}
+
+	ws_log_ring_flush();
+
+	// Records from threads that were still in the log callback
+	// are dropped by the next start.
+	_ws_log_lock(&_ws_log_ring_lock);
+	_ws_log_ring_out = NULL;
+	_ws_log_unlock(&_ws_log_ring_lock);
+}
+
+#endif // LIBWS_WITH_LOG
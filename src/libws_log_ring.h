@@ -0,0 +1,100 @@
+
+#ifndef __LIBWS_LOG_RING_H__
+#define __LIBWS_LOG_RING_H__
+
+///
+/// @internal
+/// @file libws_log_ring.h
+///
+/// Deferred logging, see #ws_log_ring_start.
+///
+/// Each thread that logs gets its own ring of fixed size records, with
+/// a single producer (the thread) and a single consumer (whoever holds
+/// the ring lock in #ws_log_ring_flush), so logging takes no locks.
+///
+/// A record holds the format string pointer and the raw arguments,
+/// the format string is walked to know their types, both when they're
+/// packed and when the record is formatted.
+///
+
+#include "libws_config.h"
+#include "libws_private_config.h"
+#include "libws_types.h"
+#include <stdarg.h>
+#include <stddef.h>
+
+#define WS_LOG_RING_DEFAULT_SLOTS 4096
+#define WS_LOG_RECORD_ARGS_SIZE 200 ///< Room for packed arguments,
+                                    /// a record is about 256 bytes.
+
+typedef struct ws_log_record_s
+{
+    uint64_t time_ns;           ///< Monotonic timestamp.
+    const void *conn;           ///< Connection that was being serviced,
+                                /// see #_ws_log_enter.
+    const char *fmt;            ///< Format string, not copied.
+    const char *func;           ///< Function that logged.
+    int line;                   ///< Line that logged.
+    unsigned short prio;        ///< Priority of the record.
+    unsigned short truncated;   ///< Not all arguments fit.
+    size_t len;                 ///< Bytes used in #args.
+    unsigned char args[WS_LOG_RECORD_ARGS_SIZE];
+                                ///< Packed arguments.
+} ws_log_record_t;
+
+#ifdef LIBWS_WITH_LOG
+
+///
+/// The connection being serviced by this thread, included in
+/// the records so log lines can be told apart.
+///
+extern LIBWS_THREAD_LOCAL struct ws_s *_ws_log_conn;
+
+///
+/// Tags log records with a connection until #_ws_log_leave.
+///
+/// @returns The previous connection, to pass to #_ws_log_leave.
+///
+static LIBWS_INLINE struct ws_s *_ws_log_enter(struct ws_s *ws)
+{
+    struct ws_s *prev = _ws_log_conn;
+    _ws_log_conn = ws;
+    return prev;
+}
+
+static LIBWS_INLINE void _ws_log_leave(struct ws_s *prev)
+{
+    _ws_log_conn = prev;
+}
+
+///
+/// Packs the arguments for a format string into a record.
+///
+/// @param[out] rec     The record, sets #ws_log_record_t::args, len
+///                     and truncated.
+/// @param[in]  fmt     The format string.
+/// @param[in]  args    The arguments.
+///
+void _ws_log_record_pack(ws_log_record_t *rec, const char *fmt, va_list args);
+
+///
+/// Formats the message of a record, as vsnprintf would have
+/// formatted it when it was logged.
+///
+/// @param[in]  rec     The record.
+/// @param[out] buf     Buffer for the message, always NUL terminated.
+/// @param[in]  size    Size of the buffer.
+///
+/// @returns            Length of the message in the buffer.
+///
+size_t _ws_log_record_format(const ws_log_record_t *rec,
+                            char *buf, size_t size);
+
+#else
+
+#define _ws_log_enter(ws) NULL
+#define _ws_log_leave(prev)
+
+#endif // LIBWS_WITH_LOG
+
+#endif // __LIBWS_LOG_RING_H__
@@ -0,0 +1,428 @@
+#include "libws_config.h"
+#include <assert.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+#include <windows.h>
+#endif
+#include <event2/util.h>
+#include "libws_log.h"
+#include "libws.h"
+#include "libws_private.h"
+#include "libws_metrics.h"
+
+#ifdef LIBWS_WITH_STATS
+
+#if defined(_WIN32)
+#define _WS_CAS_PTR(ptr, old, new) \
+	(InterlockedCompareExchangePointer((PVOID volatile *)(ptr), \
+									(new), (old)) == (old))
+#define _WS_ATOMIC_INC(val) InterlockedIncrement((LONG volatile *)(val))
+#elif defined(__GNUC__)
+#define _WS_CAS_PTR(ptr, old, new) __sync_bool_compare_and_swap((ptr), (old), (new))
+#define _WS_ATOMIC_INC(val) __sync_add_and_fetch((val), 1)
+#else
+// No atomics, only safe when all bases are created on one thread.
+#define _WS_CAS_PTR(ptr, old, new) ((*(ptr) = (new)), 1)
+#define _WS_ATOMIC_INC(val) (++(*(val)))
+#endif
+
+#ifdef LIBWS_HAVE_THREAD_LOCAL
+LIBWS_THREAD_LOCAL unsigned int _ws_metrics_cached_id;
+LIBWS_THREAD_LOCAL ws_metrics_shard_t *_ws_metrics_cached;
+LIBWS_THREAD_LOCAL ws_metrics_shard_t *_ws_metrics_alloc_cached;
+#endif
+
+// The address of this is unique for each thread. Without thread
+// local storage it's the same for all, so each list has one shard
+// and nothing is cached, the cache could point into another base.
+static LIBWS_THREAD_LOCAL char _ws_metrics_thread_token;
+
+static unsigned int _ws_metrics_next_id;
+
+// Allocation counters are process wide, these are never freed.
+static ws_metrics_shard_t *_ws_metrics_alloc_shards;
+
+static const char *_ws_metrics_state_names[WS_STATE_COUNT] =
+{
+	"dns_lookup",
+	"closing",
+	"closing_uncleanly",
+	"closed_cleanly",
+	"closed_uncleanly",
+	"connecting",
+	"connected"
+};
+
+static const char *_ws_metrics_failure_names[WS_HANDSHAKE_FAIL_COUNT] =
+{
+	"connect",
+	"tls",
+	"timeout",
+	"reply"
+};
+
+void _ws_metrics_init(ws_metrics_t *m)
+{
+	assert(m);
+
+	m->shards = NULL;
+
+	// 0 is what the thread local cache starts out as.
+	do
+	{
+		m->id = (unsigned int)_WS_ATOMIC_INC(&_ws_metrics_next_id);
+	}
+	while (m->id == 0);
+}
+
+void _ws_metrics_destroy(ws_metrics_t *m)
+{
+	ws_metrics_shard_t *shard;
+	ws_metrics_shard_t *next;
+	assert(m);
+
+	for (shard = m->shards; shard; shard = next)
+	{
+		next = shard->next;
+		free(shard);
+	}
+
+	m->shards = NULL;
+
+	#ifdef LIBWS_HAVE_THREAD_LOCAL
+	if (_ws_metrics_cached_id == m->id)
+	{
+		_ws_metrics_cached_id = 0;
+		_ws_metrics_cached = NULL;
+	}
+	#endif
+}
+
+///
+/// Finds the shard owned by the calling thread in a list,
+/// or pushes a new one onto it.
+///
+/// The shards are allocated with plain calloc, since the
+/// allocation counters are kept in shards themselves.
+///
+static ws_metrics_shard_t *_ws_metrics_find_shard(ws_metrics_shard_t **list)
+{
+	ws_metrics_shard_t *shard;
+	ws_metrics_shard_t *head;
+
+	for (shard = *list; shard; shard = shard->next)
+	{
+		if (shard->owner == &_ws_metrics_thread_token)
+			return shard;
+	}
+
+	if (!(shard = (ws_metrics_shard_t *)calloc(1, sizeof(ws_metrics_shard_t))))
+	{
+		return NULL;
+	}
+
+	shard->owner = &_ws_metrics_thread_token;
+
+	do
+	{
+		head = *list;
+		shard->next = head;
+	}
+	while (!_WS_CAS_PTR(list, head, shard));
+
+	return shard;
+}
+
+// Counters are dropped here instead of failing, if we are out of memory.
+static ws_metrics_shard_t _ws_metrics_dummy_shard;
+
+ws_metrics_shard_t *_ws_metrics_shard_slow(ws_metrics_t *m)
+{
+	ws_metrics_shard_t *shard;
+	assert(m);
+
+	if (!(shard = _ws_metrics_find_shard(&m->shards)))
+	{
+		return &_ws_metrics_dummy_shard;
+	}
+
+	#ifdef LIBWS_HAVE_THREAD_LOCAL
+	_ws_metrics_cached = shard;
+	_ws_metrics_cached_id = m->id;
+	#endif
+
+	return shard;
+}
+
+ws_metrics_shard_t *_ws_metrics_alloc_shard_slow()
+{
+	ws_metrics_shard_t *shard;
+
+	if (!(shard = _ws_metrics_find_shard(&_ws_metrics_alloc_shards)))
+	{
+		return &_ws_metrics_dummy_shard;
+	}
+
+	#ifdef LIBWS_HAVE_THREAD_LOCAL
+	_ws_metrics_alloc_cached = shard;
+	#endif
+
+	return shard;
+}
+
+static void _ws_metrics_sum(ws_base_metrics_t *metrics,
+							const ws_metrics_shard_t *shards)
+{
+	int i;
+	int64_t connections[WS_STATE_COUNT];
+	const ws_metrics_shard_t *s;
+
+	memset(connections, 0, sizeof(connections));
+
+	for (s = shards; s; s = s->next)
+	{
+		for (i = 0; i < WS_STATE_COUNT; i++)
+			connections[i] += s->connections[i];
+
+		for (i = 0; i < WS_HANDSHAKE_FAIL_COUNT; i++)
+			metrics->handshake_failures[i] += s->handshake_failures[i];
+
+		for (i = 0; i < WS_METRICS_CLOSE_STATUS_COUNT; i++)
+			metrics->closes[i] += s->closes[i];
+
+		metrics->connects += s->connects;
+		metrics->handshakes += s->handshakes;
+		metrics->bytes_in += s->bytes_in;
+		metrics->bytes_out += s->bytes_out;
+		metrics->msgs_in += s->msgs_in;
+		metrics->msgs_out += s->msgs_out;
+		metrics->allocs += s->allocs;
+		metrics->frees += s->frees;
+	}
+
+	for (i = 0; i < WS_STATE_COUNT; i++)
+	{
+		if (connections[i] > 0)
+			metrics->connections[i] += (uint64_t)connections[i];
+	}
+}
+
+///
+/// Appends formatted text to a buffer.
+///
+typedef struct ws_metrics_writer_s
+{
+	char *buf;
+	size_t size;
+	size_t len;
+	int overflow;	///< Set if the buffer was too small.
+} ws_metrics_writer_t;
+
+static void _ws_metrics_printf(ws_metrics_writer_t *w, const char *fmt, ...)
+{
+	int ret;
+	va_list args;
+
+	if (w->overflow)
+		return;
+
+	va_start(args, fmt);
+	ret = evutil_vsnprintf(w->buf + w->len, w->size - w->len, fmt, args);
+	va_end(args);
+
+	if ((ret < 0) || ((size_t)ret >= (w->size - w->len)))
+	{
+		w->overflow = 1;
+		return;
+	}
+
+	w->len += (size_t)ret;
+}
+
+static void _ws_metrics_write_prometheus(ws_metrics_writer_t *w,
+										const ws_base_metrics_t *m)
+{
+	int i;
+
+	_ws_metrics_printf(w, "# TYPE libws_connections gauge\n");
+
+	for (i = 0; i < WS_STATE_COUNT; i++)
+	{
+		_ws_metrics_printf(w, "libws_connections{state=\"%s\"} %" PRIu64 "\n",
+						_ws_metrics_state_names[i], m->connections[i]);
+	}
+
+	_ws_metrics_printf(w,
+		"# TYPE libws_connects_total counter\n"
+		"libws_connects_total %" PRIu64 "\n"
+		"# TYPE libws_handshakes_total counter\n"
+		"libws_handshakes_total %" PRIu64 "\n"
+		"# TYPE libws_handshake_failures_total counter\n",
+		m->connects, m->handshakes);
+
+	for (i = 0; i < WS_HANDSHAKE_FAIL_COUNT; i++)
+	{
+		_ws_metrics_printf(w,
+			"libws_handshake_failures_total{reason=\"%s\"} %" PRIu64 "\n",
+			_ws_metrics_failure_names[i], m->handshake_failures[i]);
+	}
+
+	_ws_metrics_printf(w, "# TYPE libws_closes_total counter\n");
+
+	for (i = 0; i < WS_METRICS_CLOSE_STATUS_COUNT; i++)
+	{
+		if (!m->closes[i])
+			continue;
+
+		if (i < (WS_METRICS_CLOSE_STATUS_COUNT - 1))
+		{
+			_ws_metrics_printf(w,
+				"libws_closes_total{status=\"%d\"} %" PRIu64 "\n",
+				1000 + i, m->closes[i]);
+		}
+		else
+		{
+			_ws_metrics_printf(w,
+				"libws_closes_total{status=\"other\"} %" PRIu64 "\n",
+				m->closes[i]);
+		}
+	}
+
+	_ws_metrics_printf(w,
+		"# TYPE libws_bytes_total counter\n"
+		"libws_bytes_total{direction=\"in\"} %" PRIu64 "\n"
+		"libws_bytes_total{direction=\"out\"} %" PRIu64 "\n"
+		"# TYPE libws_messages_total counter\n"
+		"libws_messages_total{direction=\"in\"} %" PRIu64 "\n"
+		"libws_messages_total{direction=\"out\"} %" PRIu64 "\n"
+		"# TYPE libws_allocations_total counter\n"
+		"libws_allocations_total %" PRIu64 "\n"
+		"# TYPE libws_frees_total counter\n"
+		"libws_frees_total %" PRIu64 "\n",
+		m->bytes_in, m->bytes_out, m->msgs_in, m->msgs_out,
+		m->allocs, m->frees);
+}
+
+static void _ws_metrics_write_json(ws_metrics_writer_t *w,
+									const ws_base_metrics_t *m)
+{
+	int i;
+	const char *sep = "";
+
+	_ws_metrics_printf(w, "{\"connections\":{");
+
+	for (i = 0; i < WS_STATE_COUNT; i++)
+	{
+		_ws_metrics_printf(w, "%s\"%s\":%" PRIu64, (i ? "," : ""),
+						_ws_metrics_state_names[i], m->connections[i]);
+	}
+
+	_ws_metrics_printf(w, "},\"connects\":%" PRIu64
+						",\"handshakes\":%" PRIu64
+						",\"handshake_failures\":{",
+						m->connects, m->handshakes);
+
+	for (i = 0; i < WS_HANDSHAKE_FAIL_COUNT; i++)
+	{
+		_ws_metrics_printf(w, "%s\"%s\":%" PRIu64, (i ? "," : ""),
+						_ws_metrics_failure_names[i], m->handshake_failures[i]);
+	}
+
+	_ws_metrics_printf(w, "},\"closes\":{");
+
+	for (i = 0; i < WS_METRICS_CLOSE_STATUS_COUNT; i++)
+	{
+		if (!m->closes[i])
+			continue;
+
+		if (i < (WS_METRICS_CLOSE_STATUS_COUNT - 1))
+		{
+			_ws_metrics_printf(w, "%s\"%d\":%" PRIu64,
+							sep, 1000 + i, m->closes[i]);
+		}
+		else
+		{
+			_ws_metrics_printf(w, "%s\"other\":%" PRIu64, sep, m->closes[i]);
+		}
+
+		sep = ",";
+	}
+
+	_ws_metrics_printf(w, "},\"bytes_in\":%" PRIu64
+						",\"bytes_out\":%" PRIu64
+						",\"msgs_in\":%" PRIu64
+						",\"msgs_out\":%" PRIu64
+						",\"allocs\":%" PRIu64
+						",\"frees\":%" PRIu64 "}\n",
+						m->bytes_in, m->bytes_out, m->msgs_in, m->msgs_out,
+						m->allocs, m->frees);
+}
+
+#endif // LIBWS_WITH_STATS
+
+int ws_base_get_metrics(ws_base_t base, ws_base_metrics_t *metrics)
+{
+	assert(base);
+	assert(metrics);
+
+	memset(metrics, 0, sizeof(ws_base_metrics_t));
+
+	#ifdef LIBWS_WITH_STATS
+	_ws_metrics_sum(metrics, base->metrics.shards);
+	_ws_metrics_sum(metrics, _ws_metrics_alloc_shards);
+	return 0;
+	#else
+	LIBWS_LOG(LIBWS_ERR, "Compiled without statistics support");
+	return -1;
+	#endif
+}
+
+int ws_base_write_metrics(ws_base_t base, char *buf, size_t len,
+						ws_metrics_format_t format)
+{
+	#ifdef LIBWS_WITH_STATS
+	ws_base_metrics_t metrics;
+	ws_metrics_writer_t w;
+	assert(base);
+	assert(buf);
+
+	ws_base_get_metrics(base, &metrics);
+
+	if (!len)
+	{
+		LIBWS_LOG(LIBWS_ERR, "Empty metrics buffer");
+		return -1;
+	}
+
+	w.buf = buf;
+	w.size = len;
+	w.len = 0;
+	w.overflow = 0;
+
+	switch (format)
+	{
+		case WS_METRICS_PROMETHEUS:
+			_ws_metrics_write_prometheus(&w, &metrics);
+			break;
+		case WS_METRICS_JSON:
+			_ws_metrics_write_json(&w, &metrics);
+			break;
+		default:
+			LIBWS_LOG(LIBWS_ERR, "Unknown metrics format %d", format);
+			return -1;
+	}
+
+	if (w.overflow)
+	{
+		LIBWS_LOG(LIBWS_ERR, "Metrics buffer of %lu bytes too small", len);
+		return -1;
+	}
+
+	return (int)w.len;
+	#else
+	LIBWS_LOG(LIBWS_ERR, "Compiled without statistics support");
+	return -1;
+	#endif
+}
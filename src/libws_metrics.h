@@ -0,0 +1,111 @@
+
+#ifndef __LIBWS_METRICS_H__
+#define __LIBWS_METRICS_H__
+
+///
+/// @internal
+/// @file libws_metrics.h
+///
+/// Base wide metrics. Each thread updates its own shard of the
+/// counters without any locking, the shards are summed when the
+/// metrics are read.
+///
+/// Without thread local storage all threads share one shard, so the
+/// counters are only exact when a single thread uses libws.
+///
+
+#include "libws_config.h"
+#include "libws_private_config.h"
+#include "libws_types.h"
+
+#ifdef LIBWS_WITH_STATS
+
+///
+/// The counters updated by a single thread.
+///
+typedef struct ws_metrics_shard_s
+{
+    struct ws_metrics_shard_s *next;
+    const void *owner;          ///< Token identifying the owning thread.
+    int64_t connections[WS_STATE_COUNT];
+                                ///< Can go negative if a connection
+                                /// changes state on another thread.
+    uint64_t connects;
+    uint64_t handshakes;
+    uint64_t handshake_failures[WS_HANDSHAKE_FAIL_COUNT];
+    uint64_t closes[WS_METRICS_CLOSE_STATUS_COUNT];
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t msgs_in;
+    uint64_t msgs_out;
+    uint64_t allocs;
+    uint64_t frees;
+} ws_metrics_shard_t;
+
+///
+/// Metrics for a base, embedded in ws_base_s.
+///
+typedef struct ws_metrics_s
+{
+    unsigned int id;            ///< Unique id, never 0.
+    ws_metrics_shard_t *shards; ///< One shard per thread.
+} ws_metrics_t;
+
+#ifdef LIBWS_HAVE_THREAD_LOCAL
+extern LIBWS_THREAD_LOCAL unsigned int _ws_metrics_cached_id;
+extern LIBWS_THREAD_LOCAL ws_metrics_shard_t *_ws_metrics_cached;
+extern LIBWS_THREAD_LOCAL ws_metrics_shard_t *_ws_metrics_alloc_cached;
+#endif
+
+void _ws_metrics_init(ws_metrics_t *m);
+void _ws_metrics_destroy(ws_metrics_t *m);
+
+///
+/// Finds or creates the shard for the calling thread.
+///
+ws_metrics_shard_t *_ws_metrics_shard_slow(ws_metrics_t *m);
+
+///
+/// Finds or creates the process wide allocation
+/// counters for the calling thread.
+///
+ws_metrics_shard_t *_ws_metrics_alloc_shard_slow();
+
+///
+/// Gets the shard of the calling thread. This is a single compare
+/// unless the thread last used another base.
+///
+static LIBWS_INLINE ws_metrics_shard_t *_ws_metrics_shard(ws_metrics_t *m)
+{
+    #ifdef LIBWS_HAVE_THREAD_LOCAL
+    if (_ws_metrics_cached_id == m->id)
+        return _ws_metrics_cached;
+    #endif
+
+    return _ws_metrics_shard_slow(m);
+}
+
+static LIBWS_INLINE ws_metrics_shard_t *_ws_metrics_alloc_shard()
+{
+    #ifdef LIBWS_HAVE_THREAD_LOCAL
+    if (_ws_metrics_alloc_cached)
+        return _ws_metrics_alloc_cached;
+    #endif
+
+    return _ws_metrics_alloc_shard_slow();
+}
+
+///
+/// Maps a close status to its slot in ws_base_metrics_t#closes.
+///
+static LIBWS_INLINE int _ws_metrics_close_index(ws_close_status_t status)
+{
+    if ((status >= 1000) && (status < (1000 + WS_METRICS_CLOSE_STATUS_COUNT - 1)))
+        return (int)status - 1000;
+
+    return WS_METRICS_CLOSE_STATUS_COUNT - 1;
+}
+
+#endif // LIBWS_WITH_STATS
+
+#endif // __LIBWS_METRICS_H__
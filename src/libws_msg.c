@@ -0,0 +1,205 @@
+#include "libws_config.h"
+#include <assert.h>
+#include <string.h>
+#ifdef _WIN32
+#include <windows.h>
+#endif
+#include "libws_log.h"
+#include "libws.h"
+#include "libws_private.h"
+#include "libws_msg.h"
+
+#if defined(_WIN32)
+#define _WS_CAS_PTR(ptr, old, new) \
+	(InterlockedCompareExchangePointer((PVOID volatile *)(ptr), \
+									(new), (old)) == (old))
+#define _WS_ATOMIC_INC(val) InterlockedIncrement((LONG volatile *)(val))
+#define _WS_ATOMIC_DEC(val) InterlockedDecrement((LONG volatile *)(val))
+#elif defined(__GNUC__)
+#define _WS_CAS_PTR(ptr, old, new) __sync_bool_compare_and_swap((ptr), (old), (new))
+#define _WS_ATOMIC_INC(val) __sync_add_and_fetch((val), 1)
+#define _WS_ATOMIC_DEC(val) __sync_sub_and_fetch((val), 1)
+#else
+// No atomics, only safe when handles stay on the base thread.
+#define _WS_CAS_PTR(ptr, old, new) ((*(ptr) = (new)), 1)
+#define _WS_ATOMIC_INC(val) (++(*(val)))
+#define _WS_ATOMIC_DEC(val) (--(*(val)))
+#endif
+
+#ifdef LIBWS_HAVE_THREAD_LOCAL
+// The address of this is unique for each thread.
+static LIBWS_THREAD_LOCAL char _ws_msg_thread_token;
+#endif
+
+void _ws_msg_base_init(ws_base_t base)
+{
+	assert(base);
+
+	#ifdef LIBWS_HAVE_THREAD_LOCAL
+	base->msg_thread = &_ws_msg_thread_token;
+	#else
+	base->msg_thread = NULL;
+	#endif
+	base->msg_returned = NULL;
+	_ws_slab_init(&base->msg_slab, &base->allocator, sizeof(ws_msg_s), 64);
+}
+
+static void _ws_msg_free(ws_msg_t *msg)
+{
+	ws_base_t base = msg->ws_base;
+
+	_ws_arena_reset(&msg->arena, &base->arena_blocks);
+	_ws_slab_free(&base->msg_slab, msg);
+}
+
+void _ws_msg_collect(ws_base_t base)
+{
+	ws_msg_t *msg;
+	ws_msg_t *next;
+	assert(base);
+
+	if (!base->msg_returned)
+		return;
+
+	// Take the whole list, other threads push onto an empty one.
+	do
+	{
+		msg = base->msg_returned;
+	}
+	while (!_WS_CAS_PTR(&base->msg_returned, msg, NULL));
+
+	for (; msg; msg = next)
+	{
+		next = msg->next;
+		_ws_msg_free(msg);
+	}
+}
+
+void _ws_msg_base_destroy(ws_base_t base)
+{
+	assert(base);
+
+	_ws_msg_collect(base);
+
+	if (base->msg_slab.in_use)
+	{
+		LIBWS_LOG(LIBWS_ERR, "%lu message handles not released",
+				(unsigned long)base->msg_slab.in_use);
+	}
+
+	_ws_slab_destroy(&base->msg_slab);
+}
+
+ws_msg_t *ws_get_msg(ws_t ws)
+{
+	ws_msg_t *msg;
+	assert(ws);
+
+	if (ws->msg_handle)
+	{
+		return ws->msg_handle;
+	}
+
+	// Only while the default message end callback delivers a message.
+	if (!ws->msg_delivering)
+	{
+		LIBWS_LOG(LIBWS_ERR, "No message is being delivered");
+		return NULL;
+	}
+
+	_ws_msg_collect(ws->ws_base);
+
+	if (!(msg = (ws_msg_t *)_ws_slab_alloc(&ws->ws_base->msg_slab)))
+	{
+		LIBWS_LOG(LIBWS_CRIT, "Out of memory!");
+		return NULL;
+	}
+
+	msg->next = NULL;
+	msg->ws_base = ws->ws_base;
+	msg->refcount = 1;
+	msg->binary = ws->msg_isbinary;
+	msg->data = ws->msg_data;
+	msg->len = ws->msg_len;
+
+	// Take over the arena, the connection starts a new one
+	// for the next message.
+	msg->arena = ws->arena;
+	ws->arena.blocks = NULL;
+	ws->msg_data = NULL;
+	ws->msg_cap = 0;
+
+	ws->msg_handle = msg;
+
+	return msg;
+}
+
+const char *ws_msg_data(const ws_msg_t *msg)
+{
+	assert(msg);
+	return msg->data;
+}
+
+uint64_t ws_msg_len(const ws_msg_t *msg)
+{
+	assert(msg);
+	return msg->len;
+}
+
+int ws_msg_is_binary(const ws_msg_t *msg)
+{
+	assert(msg);
+	return msg->binary;
+}
+
+ws_msg_t *ws_msg_retain(ws_msg_t *msg)
+{
+	assert(msg);
+	assert(msg->refcount > 0);
+
+	_WS_ATOMIC_INC(&msg->refcount);
+
+	return msg;
+}
+
+void ws_msg_release(ws_msg_t *msg)
+{
+	ws_base_t base;
+	ws_msg_t *head;
+
+	if (!msg)
+		return;
+
+	assert(msg->refcount > 0);
+
+	if (_WS_ATOMIC_DEC(&msg->refcount) != 0)
+		return;
+
+	base = msg->ws_base;
+
+	#ifdef LIBWS_HAVE_THREAD_LOCAL
+	if (base->msg_thread == &_ws_msg_thread_token)
+	{
+		_ws_msg_free(msg);
+		return;
+	}
+	#endif
+
+	// The base isn't thread safe, let its own thread free it.
+	// Without thread local storage we can't tell which thread
+	// this is, so that's always done.
+	do
+	{
+		head = base->msg_returned;
+		msg->next = head;
+	}
+	while (!_WS_CAS_PTR(&base->msg_returned, head, msg));
+}
+
+void _ws_msg_delivered(ws_t ws)
+{
+	ws_msg_t *msg = ws->msg_handle;
+
+	ws->msg_handle = NULL;
+	ws_msg_release(msg);
+}
@@ -0,0 +1,58 @@
+
+#ifndef __LIBWS_MSG_H__
+#define __LIBWS_MSG_H__
+
+///
+/// @internal
+/// @file libws_msg.h
+///
+/// Retained message handles, see #ws_get_msg.
+///
+/// A handle takes over the arena the message was received into, so
+/// keeping it costs no copy. Handles come from a slab in the base.
+///
+/// The reference count is atomic so a handle can be released on any
+/// thread. Only the thread that created the base gives the memory
+/// back though: a handle released elsewhere is pushed on a lock free
+/// list in the base, which the base thread collects later.
+///
+
+#include "libws_config.h"
+#include "libws_private_config.h"
+#include "libws_types.h"
+#include "libws_alloc.h"
+
+typedef struct ws_msg_s
+{
+    struct ws_msg_s *next;      ///< On ws_base_s#msg_returned.
+    struct ws_base_s *ws_base;  ///< The base the memory belongs to.
+    volatile int refcount;      ///< Changed atomically.
+    int binary;                 ///< Binary or text message.
+    char *data;                 ///< The payload, NUL terminated.
+    uint64_t len;               ///< Bytes of payload.
+    ws_arena_t arena;           ///< Owns ws_msg_s#data.
+} ws_msg_s;
+
+///
+/// Sets up the message handles of a base.
+///
+void _ws_msg_base_init(struct ws_base_s *base);
+
+///
+/// Frees the handles released on other threads, then the slab.
+///
+void _ws_msg_base_destroy(struct ws_base_s *base);
+
+///
+/// Frees the handles released on other threads. Only call this
+/// on the thread that created the base.
+///
+void _ws_msg_collect(struct ws_base_s *base);
+
+///
+/// Drops the reference the library holds on the handle given out
+/// for the message being delivered, after the message callback.
+///
+void _ws_msg_delivered(ws_t ws);
+
+#endif // __LIBWS_MSG_H__
@@ -1,6 +1,13 @@
-
 #include "libws_config.h"
 #include <assert.h>
+#include <string.h>
+#ifdef _WIN32
+#include <winsock2.h>
+#else
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#endif
 #include "libws_log.h"
 #include "libws.h"
 #include "libws_private.h"
@@ -8,12 +15,176 @@
 #include <openssl/ssl.h>
 #include <openssl/rand.h>
 #include <event2/event.h>
+#include <event2/buffer.h>
 #include <event2/listener.h>
 #include <event2/bufferevent_ssl.h>
 
 // TODO: Allow setting client cert: SSL_CTX_use_certificate_file(ssl_ctx, "my_apple_cert_key.pem", SSL_FILETYPE_PEM);
 // http://www.provos.org/index.php?/archives/79-OpenSSL-Client-Certificates-and-Libevent-2.0.3-alpha.html
 
+///
+/// An entry in the client session cache of a base.
+///
+typedef struct ws_ssl_session_s
+{
+	struct ws_ssl_session_s *next;
+	SSL_SESSION *session;		///< The session we hold a reference to.
+	int port;					///< Server port.
+	char host[1];				///< Server host name (allocated to fit).
+} ws_ssl_session_t;
+
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+static void *_ws_openssl_malloc(size_t num, const char *file, int line)
+{
+	return _ws_malloc(num);
+}
+
+static void *_ws_openssl_realloc(void *ptr, size_t num, const char *file, int line)
+{
+	return _ws_realloc(ptr, num);
+}
+
+static void _ws_openssl_free(void *ptr, const char *file, int line)
+{
+	_ws_free(ptr);
+}
+#else
+#define _ws_openssl_malloc _ws_malloc
+#define _ws_openssl_realloc _ws_realloc
+#define _ws_openssl_free _ws_free
+#endif
+
+int _ws_openssl_set_memory_functions()
+{
+	if (!CRYPTO_set_mem_functions(_ws_openssl_malloc,
+								_ws_openssl_realloc, _ws_openssl_free))
+	{
+		return -1;
+	}
+
+	return 0;
+}
+
+///
+/// Finds a cached session entry, and moves it first in the list.
+///
+static ws_ssl_session_t *_ws_openssl_find_session(ws_base_t base,
+												const char *host, int port)
+{
+	ws_ssl_session_t *prev = NULL;
+	ws_ssl_session_t *s;
+
+	for (s = base->ssl_sessions; s; prev = s, s = s->next)
+	{
+		if ((s->port == port) && !strcmp(s->host, host))
+		{
+			if (prev)
+			{
+				prev->next = s->next;
+				s->next = base->ssl_sessions;
+				base->ssl_sessions = s;
+			}
+
+			return s;
+		}
+	}
+
+	return NULL;
+}
+
+static void _ws_openssl_free_sessions(ws_base_t base, size_t keep)
+{
+	ws_ssl_session_t **s = &base->ssl_sessions;
+	ws_ssl_session_t *tmp;
+	size_t i = 0;
+
+	// Skip the most recently used sessions we want to keep.
+	while (*s && (i < keep))
+	{
+		s = &(*s)->next;
+		i++;
+	}
+
+	while (*s)
+	{
+		tmp = *s;
+		*s = tmp->next;
+		SSL_SESSION_free(tmp->session);
+		_ws_free(tmp);
+		base->ssl_session_count--;
+	}
+}
+
+int _ws_openssl_cache_session(ws_base_t base, const char *host, int port,
+								SSL_SESSION *session)
+{
+	ws_ssl_session_t *s;
+	assert(base);
+	assert(host);
+
+	if (base->ssl_session_max == 0)
+		return -1;
+
+	LIBWS_LOG(LIBWS_DEBUG, "Caching SSL session for %s:%d", host, port);
+
+	if ((s = _ws_openssl_find_session(base, host, port)))
+	{
+		SSL_SESSION_free(s->session);
+		s->session = session;
+		return 0;
+	}
+
+	if (!(s = (ws_ssl_session_t *)_ws_malloc(sizeof(ws_ssl_session_t)
+											+ strlen(host))))
+	{
+		LIBWS_LOG(LIBWS_ERR, "Out of memory!");
+		return -1;
+	}
+
+	strcpy(s->host, host);
+	s->port = port;
+	s->session = session;
+	s->next = base->ssl_sessions;
+	base->ssl_sessions = s;
+	base->ssl_session_count++;
+
+	if (base->ssl_session_count > base->ssl_session_max)
+	{
+		_ws_openssl_free_sessions(base, base->ssl_session_max);
+	}
+
+	return 0;
+}
+
+SSL_SESSION *_ws_openssl_get_session(ws_base_t base, const char *host,
+									int port)
+{
+	ws_ssl_session_t *s;
+	assert(base);
+	assert(host);
+
+	if (!(s = _ws_openssl_find_session(base, host, port)))
+		return NULL;
+
+	return s->session;
+}
+
+///
+/// OpenSSL callback for when a new session (or TLS 1.3 ticket) has been
+/// received from a server. We take over the reference to the session.
+///
+static int _ws_openssl_new_session_cb(SSL *ssl, SSL_SESSION *session)
+{
+	ws_t ws = (ws_t)SSL_get_app_data(ssl);
+
+	if (!ws || !ws->server)
+		return 0;
+
+	// Returning 1 tells OpenSSL we kept the reference.
+	return !_ws_openssl_cache_session(ws->ws_base, ws->server, ws->port,
+									session);
+}
+
 int _ws_global_openssl_init(ws_base_t ws_base)
 {
 	SSL_library_init();
@@ -27,61 +198,346 @@ int _ws_global_openssl_init(ws_base_t ws_base)
 		return -1;
 	}
 
+	// Setup the SSL context shared by all connections in this base.
+	if (!(ws_base->ssl_ctx = SSL_CTX_new(SSLv23_client_method())))
+	{
+		LIBWS_LOG(LIBWS_ERR, "Failed to create OpenSSL context");
+		return -1;
+	}
+
+	#if OPENSSL_VERSION_NUMBER >= 0x10000000L
+	SSL_CTX_set_mode(ws_base->ssl_ctx, SSL_MODE_RELEASE_BUFFERS);
+	#endif
+
+	// We keep our own client session cache keyed by host:port,
+	// since OpenSSL only does lookups for the server side.
+	SSL_CTX_set_session_cache_mode(ws_base->ssl_ctx,
+			SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+	SSL_CTX_sess_set_new_cb(ws_base->ssl_ctx, _ws_openssl_new_session_cb);
+	ws_base->ssl_session_max = WS_DEFAULT_SSL_SESSION_CACHE_SIZE;
+
 	return 0;
 }
 
 void _ws_global_openssl_destroy(ws_base_t ws_base)
 {
+	_ws_openssl_free_sessions(ws_base, 0);
+
+	if (ws_base->ssl_ctx)
+	{
+		SSL_CTX_free(ws_base->ssl_ctx);
+		ws_base->ssl_ctx = NULL;
+	}
+
 	CRYPTO_cleanup_all_ex_data();
 	ERR_free_strings();
 	ERR_remove_state(0);
 	EVP_cleanup();
 }
 
-int _ws_openssl_init(ws_t ws, ws_base_t ws_base)
+int ws_base_set_ssl_ca_paths(ws_base_t base, const char *ca_file,
+							const char *ca_path)
+{
+	assert(base);
+	assert(base->ssl_ctx);
+
+	if (!ca_file && !ca_path)
+	{
+		if (!SSL_CTX_set_default_verify_paths(base->ssl_ctx))
+		{
+			LIBWS_LOG(LIBWS_ERR, "Failed to load default CA paths");
+			return -1;
+		}
+	}
+	else if (!SSL_CTX_load_verify_locations(base->ssl_ctx, ca_file, ca_path))
+	{
+		LIBWS_LOG(LIBWS_ERR, "Failed to load CA file \"%s\" / path \"%s\"",
+				ca_file ? ca_file : "", ca_path ? ca_path : "");
+		return -1;
+	}
+
+	base->ssl_verify = 1;
+
+	return 0;
+}
+
+int ws_base_set_ssl_ciphers(ws_base_t base, const char *ciphers)
+{
+	assert(base);
+	assert(base->ssl_ctx);
+
+	if (!ciphers || !SSL_CTX_set_cipher_list(base->ssl_ctx, ciphers))
+	{
+		LIBWS_LOG(LIBWS_ERR, "Invalid cipher list \"%s\"",
+				ciphers ? ciphers : "");
+		return -1;
+	}
+
+	return 0;
+}
+
+int ws_base_set_ssl_min_version(ws_base_t base, libws_tls_version_t version)
+{
+	#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+	int v = 0;
+	assert(base);
+	assert(base->ssl_ctx);
+
+	switch (version)
+	{
+		case LIBWS_TLS_ANY: v = 0; break;
+		case LIBWS_TLS_1_0: v = TLS1_VERSION; break;
+		case LIBWS_TLS_1_1: v = TLS1_1_VERSION; break;
+		case LIBWS_TLS_1_2: v = TLS1_2_VERSION; break;
+		#ifdef TLS1_3_VERSION
+		case LIBWS_TLS_1_3: v = TLS1_3_VERSION; break;
+		#endif
+		default:
+			LIBWS_LOG(LIBWS_ERR, "Unsupported TLS version %d", version);
+			return -1;
+	}
+
+	if (!SSL_CTX_set_min_proto_version(base->ssl_ctx, v))
+	{
+		LIBWS_LOG(LIBWS_ERR, "Failed to set min TLS version");
+		return -1;
+	}
+
+	return 0;
+	#else
+	LIBWS_LOG(LIBWS_ERR, "Setting min TLS version requires OpenSSL 1.1.0");
+	return -1;
+	#endif
+}
+
+int ws_base_set_ssl_alpn(ws_base_t base, const unsigned char *protos,
+						unsigned int protos_len)
+{
+	#if OPENSSL_VERSION_NUMBER >= 0x10002000L
+	assert(base);
+	assert(base->ssl_ctx);
+
+	// Note that this function returns 0 on success.
+	if (SSL_CTX_set_alpn_protos(base->ssl_ctx, protos, protos_len))
+	{
+		LIBWS_LOG(LIBWS_ERR, "Failed to set ALPN protocols");
+		return -1;
+	}
+
+	return 0;
+	#else
+	LIBWS_LOG(LIBWS_ERR, "ALPN requires OpenSSL 1.0.2");
+	return -1;
+	#endif
+}
+
+void ws_base_set_ssl_session_cache(ws_base_t base, size_t max_sessions)
+{
+	assert(base);
+
+	base->ssl_session_max = max_sessions;
+	_ws_openssl_free_sessions(base, max_sessions);
+}
+
+size_t ws_base_get_ssl_session_count(ws_base_t base)
+{
+	assert(base);
+	return base->ssl_session_count;
+}
+
+int ws_is_ssl_session_reused(ws_t ws)
+{
+	assert(ws);
+	return ws->ssl_session_reused;
+}
+
+void ws_set_ssl_early_data(ws_t ws, int enabled)
+{
+	assert(ws);
+	ws->ssl_early_data = enabled;
+}
+
+int ws_is_ssl_early_data_accepted(ws_t ws)
 {
 	assert(ws);
-	assert(ws_base);
+	return ws->ssl_early_data_accepted;
+}
+
+///
+/// Sets the max record size for what OpenSSL writes next,
+/// based on the bytes written since the connection was idle.
+///
+static void _ws_openssl_set_record_size(ws_t ws)
+{
+	size_t size = (ws->tls_record_sent < ws->tls_record_ramp)
+				? ws->tls_record_small : ws->tls_record_large;
+
+	if (size != ws->tls_record_size)
+	{
+		LIBWS_LOG(LIBWS_DEBUG2, "TLS record size %u", (unsigned)size);
+
+		// Lowering the max fragment also lowers the split fragment,
+		// so that has to be raised again explicitly.
+		SSL_set_max_send_fragment(ws->ssl, size);
+		SSL_set_split_send_fragment(ws->ssl, size);
+		ws->tls_record_size = size;
+	}
+}
+
+///
+/// Called as data is queued on the output and drained from it after
+/// OpenSSL wrote it, so the record size follows what has actually been
+/// written and applies to the next write. Queued data that hasn't
+/// been written yet doesn't count towards the ramp.
+///
+static void _ws_openssl_record_cb(struct evbuffer *buf,
+								const struct evbuffer_cb_info *info,
+								void *arg)
+{
+	ws_t ws = (ws_t)arg;
+	struct timeval now;
+	struct timeval idle;
 
-	LIBWS_LOG(LIBWS_DEBUG, "OpenSSL init");
+	if (!ws->ssl)
+		return;
 
-	// Setup the SSL context.
+	event_base_gettimeofday_cached(ws->ws_base->ev_base, &now);
+
+	// We've been idle if everything had been written,
+	// and that was long enough ago.
+	if (info->n_added && !info->orig_size)
 	{
-		const SSL_METHOD *ssl_method = SSLv23_client_method();
+		evutil_timersub(&now, &ws->tls_record_last, &idle);
 
-		if (!(ws->ssl_ctx = SSL_CTX_new(ssl_method)))
+		if (evutil_timercmp(&idle, &ws->tls_record_idle, >=))
 		{
-			LIBWS_LOG(LIBWS_ERR, "Failed to create OpenSSL context");
-			return -1;
+			ws->tls_record_sent = 0;
 		}
+	}
 
-		#if OPENSSL_VERSION_NUMBER >= 0x10000000L
-		SSL_CTX_set_options(ws->ssl_ctx, SSL_MODE_RELEASE_BUFFERS);
-		#endif
+	if (info->n_deleted)
+	{
+		ws->tls_record_sent += info->n_deleted;
+
+		if (!evbuffer_get_length(buf))
+		{
+			ws->tls_record_last = now;
+		}
 	}
 
-	if (!(ws->ssl = SSL_new(ws->ssl_ctx)))
+	_ws_openssl_set_record_size(ws);
+}
+
+int ws_set_tls_record_policy(ws_t ws, size_t small_size, size_t large_size,
+							size_t ramp_bytes, struct timeval idle)
+{
+	assert(ws);
+
+	if (small_size == 0)
+	{
+		ws->tls_record_small = 0;
+		ws->tls_record_size = 0;
+
+		if (ws->tls_record_cb && ws->bev)
+		{
+			evbuffer_remove_cb_entry(bufferevent_get_output(ws->bev),
+									ws->tls_record_cb);
+		}
+
+		ws->tls_record_cb = NULL;
+
+		// Go back to the OpenSSL default.
+		if (ws->ssl)
+		{
+			SSL_set_max_send_fragment(ws->ssl, SSL3_RT_MAX_PLAIN_LENGTH);
+			SSL_set_split_send_fragment(ws->ssl, SSL3_RT_MAX_PLAIN_LENGTH);
+		}
+
+		return 0;
+	}
+
+	if ((small_size < 512) || (large_size > SSL3_RT_MAX_PLAIN_LENGTH)
+	 || (small_size > large_size))
+	{
+		LIBWS_LOG(LIBWS_ERR, "Invalid TLS record sizes %u and %u, must be "
+				"within 512 and %d bytes", (unsigned)small_size,
+				(unsigned)large_size, SSL3_RT_MAX_PLAIN_LENGTH);
 		return -1;
+	}
+
+	ws->tls_record_small = small_size;
+	ws->tls_record_large = large_size;
+	ws->tls_record_ramp = ramp_bytes;
+	ws->tls_record_idle = idle;
+	ws->tls_record_sent = 0;
+	ws->tls_record_size = 0;
+
+	if (ws->tls_record_cb && ws->ssl)
+	{
+		_ws_openssl_set_record_size(ws);
+	}
 
 	return 0;
 }
 
-void _ws_openssl_destroy(ws_t ws)
+void _ws_openssl_start_record_policy(ws_t ws)
 {
-	_ws_openssl_close(ws);
+	assert(ws);
+
+	if (!ws->tls_record_small || !ws->ssl || !ws->bev || ws->tls_record_cb)
+		return;
+
+	// Small records are pointless if the kernel holds them back
+	// waiting for an ACK, so turn off Nagle on the first send.
+	{
+		int one = 1;
+		evutil_socket_t fd = bufferevent_getfd(ws->bev);
+
+		if ((fd >= 0) && setsockopt(fd, IPPROTO_TCP, TCP_NODELAY,
+									(const char *)&one, sizeof(one)))
+		{
+			LIBWS_LOG(LIBWS_WARN, "Failed to set TCP_NODELAY");
+		}
+	}
 
-	if (ws->ssl_ctx)
+	if (!(ws->tls_record_cb = evbuffer_add_cb(bufferevent_get_output(ws->bev),
+											_ws_openssl_record_cb, ws)))
 	{
-		SSL_CTX_sess_set_remove_cb(ws->ssl_ctx, NULL);
-		SSL_CTX_free(ws->ssl_ctx);
-		ws->ssl_ctx = NULL;
+		LIBWS_LOG(LIBWS_ERR, "Failed to watch the output for the "
+							"TLS record policy");
+		return;
 	}
+
+	_ws_openssl_set_record_size(ws);
 }
 
 int _ws_openssl_close(ws_t ws)
 {
 	LIBWS_LOG(LIBWS_TRACE, "OpenSSL close");
 
+	if (ws->ssl_early_data_buf)
+	{
+		evbuffer_free(ws->ssl_early_data_buf);
+		ws->ssl_early_data_buf = NULL;
+	}
+
+	// We never got to hand over the SSL session to the bufferevent.
+	if (ws->ssl_early_data_pending)
+	{
+		// Still sending the client hello, so the socket is ours too.
+		if (ws->ssl_early_data_event)
+		{
+			evutil_socket_t fd = event_get_fd(ws->ssl_early_data_event);
+			event_free(ws->ssl_early_data_event);
+			ws->ssl_early_data_event = NULL;
+			evutil_closesocket(fd);
+		}
+
+		ws->ssl_early_data_pending = 0;
+		SSL_free(ws->ssl);
+		ws->ssl = NULL;
+	}
+
 	//
 	// SSL_RECEIVED_SHUTDOWN tells SSL_shutdown to act as if we had already
 	// received a close notify from the other end.  SSL_shutdown will then
@@ -97,7 +553,13 @@ int _ws_openssl_close(ws_t ws)
 	{
 		SSL_set_shutdown(ws->ssl, SSL_RECEIVED_SHUTDOWN);
 		SSL_shutdown(ws->ssl);
-		SSL_free(ws->ssl);
+
+		// The SSL session is freed together with the bufferevent.
+		if (!ws->bev)
+		{
+			SSL_free(ws->ssl);
+		}
+
 		ws->ssl = NULL;
 	}
 
@@ -106,20 +568,300 @@ int _ws_openssl_close(ws_t ws)
 	return 0;
 }
 
+///
+/// Checks if we can send early data using the session that
+/// is about to be resumed.
+///
+static int _ws_openssl_can_send_early_data(ws_t ws)
+{
+	#ifdef SSL_EARLY_DATA_ACCEPTED
+	SSL_SESSION *session;
+
+	if (!ws->ssl_early_data)
+		return 0;
+
+	if (!(session = SSL_get_session(ws->ssl)))
+		return 0;
+
+	return (SSL_SESSION_get_max_early_data(session) > 0);
+	#else
+	return 0;
+	#endif
+}
+
 struct bufferevent * _ws_create_bufferevent_openssl_socket(ws_t ws)
 {
+	SSL_SESSION *session;
 	struct bufferevent *bev = NULL;
-	assert(ws->ssl_ctx);
-	assert(ws->ssl);
+	ws_base_t base;
+	assert(ws);
+	assert(!ws->ssl);
+
+	base = ws->ws_base;
+	assert(base->ssl_ctx);
+
+	ws->ssl_session_reused = 0;
+	ws->ssl_early_data_accepted = 0;
+
+	if (!(ws->ssl = SSL_new(base->ssl_ctx)))
+	{
+		LIBWS_LOG(LIBWS_ERR, "Failed to create SSL session");
+		return NULL;
+	}
 
-	if (!(bev = bufferevent_openssl_socket_new(ws->ws_base->ev_base, -1, 
-			ws->ssl, BUFFEREVENT_SSL_CONNECTING, 
+	// A new connection starts out idle. The record size is set on
+	// the first send, so the handshake is not affected.
+	ws->tls_record_sent = 0;
+	ws->tls_record_size = 0;
+	ws->tls_record_cb = NULL;
+	evutil_timerclear(&ws->tls_record_last);
+
+	SSL_set_app_data(ws->ssl, ws);
+
+	#ifdef SSL_CTRL_SET_TLSEXT_HOSTNAME
+	SSL_set_tlsext_host_name(ws->ssl, ws->server);
+	#endif
+
+	if (base->ssl_verify && (ws->use_ssl != LIBWS_SSL_SELFSIGNED))
+	{
+		SSL_set_verify(ws->ssl, SSL_VERIFY_PEER, NULL);
+
+		#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+		SSL_set1_host(ws->ssl, ws->server);
+		#endif
+	}
+
+	// Try to resume a previous session to this server.
+	if ((session = _ws_openssl_get_session(base, ws->server, ws->port)))
+	{
+		LIBWS_LOG(LIBWS_DEBUG, "Resuming SSL session for %s:%d",
+				ws->server, ws->port);
+		SSL_set_session(ws->ssl, session);
+	}
+
+	// To send early data we must write it together with the client hello
+	// ourselves, which the OpenSSL bufferevent cannot do. So we first
+	// connect a plain socket, and hand it over once connected.
+	// See _ws_openssl_send_early_data.
+	if (_ws_openssl_can_send_early_data(ws))
+	{
+		if (!(bev = bufferevent_socket_new(ws->ws_base->ev_base, -1,
+										BEV_OPT_CLOSE_ON_FREE)))
+		{
+			LIBWS_LOG(LIBWS_ERR, "Failed to create socket");
+			SSL_free(ws->ssl);
+			ws->ssl = NULL;
+			return NULL;
+		}
+
+		ws->ssl_early_data_pending = 1;
+		return bev;
+	}
+
+	if (!(bev = bufferevent_openssl_socket_new(ws->ws_base->ev_base, -1,
+			ws->ssl, BUFFEREVENT_SSL_CONNECTING,
 			BEV_OPT_CLOSE_ON_FREE|BEV_OPT_DEFER_CALLBACKS)))
 	{
 		LIBWS_LOG(LIBWS_ERR, "Failed to create SSL socket");
+		SSL_free(ws->ssl);
+		ws->ssl = NULL;
 		return NULL;
 	}
 
 	return bev;
 }
 
+#ifdef SSL_EARLY_DATA_ACCEPTED
+static void _ws_openssl_info_cb(const SSL *ssl, int where, int ret)
+{
+	ws_t ws = (ws_t)SSL_get_app_data(ssl);
+
+	if (!(where & SSL_CB_HANDSHAKE_DONE) || !ws || !ws->bev)
+		return;
+
+	SSL_set_info_callback((SSL *)ssl, NULL);
+
+	// Since the bufferevent was created in the open state it will not
+	// report that it has connected, so do it ourselves.
+	bufferevent_trigger_event(ws->bev, BEV_EVENT_CONNECTED,
+							BEV_TRIG_DEFER_CALLBACKS);
+}
+#endif // SSL_EARLY_DATA_ACCEPTED
+
+int _ws_openssl_send_early_data(ws_t ws, event_callback_fn retry_cb)
+{
+	#ifdef SSL_EARLY_DATA_ACCEPTED
+	evutil_socket_t fd;
+	size_t len;
+	size_t written = 0;
+	unsigned char *data;
+	struct bufferevent *bev = NULL;
+	enum bufferevent_ssl_state state = BUFFEREVENT_SSL_OPEN;
+	assert(ws);
+	assert(ws->ssl_early_data_pending);
+
+	if (ws->bev)
+	{
+		LIBWS_LOG(LIBWS_DEBUG, "Sending handshake as early data");
+
+		// Take over the connected socket from the plain bufferevent.
+		fd = bufferevent_getfd(ws->bev);
+		bufferevent_setfd(ws->bev, -1);
+		bufferevent_free(ws->bev);
+		ws->bev = NULL;
+
+		SSL_set_fd(ws->ssl, fd);
+
+		if (!(ws->ssl_early_data_buf = evbuffer_new()))
+		{
+			LIBWS_LOG(LIBWS_ERR, "Out of memory!");
+			goto fail;
+		}
+
+		if (_ws_send_handshake(ws, ws->ssl_early_data_buf))
+		{
+			LIBWS_LOG(LIBWS_ERR, "Failed to assemble handshake");
+			goto fail;
+		}
+	}
+	else
+	{
+		// Called again once the socket is ready.
+		fd = SSL_get_fd(ws->ssl);
+	}
+
+	len = evbuffer_get_length(ws->ssl_early_data_buf);
+	data = evbuffer_pullup(ws->ssl_early_data_buf, -1);
+
+	if (len > SSL_SESSION_get_max_early_data(SSL_get_session(ws->ssl)))
+	{
+		// Nothing has been sent yet, so do a normal handshake
+		// and send the websocket handshake after it.
+		LIBWS_LOG(LIBWS_DEBUG, "Handshake of %lu bytes too big for early data",
+				(unsigned long)len);
+		evbuffer_free(ws->ssl_early_data_buf);
+		ws->ssl_early_data_buf = NULL;
+		state = BUFFEREVENT_SSL_CONNECTING;
+	}
+	else if (!SSL_write_early_data(ws->ssl, data, len, &written))
+	{
+		// Sends the client hello together with the early data.
+		int err = SSL_get_error(ws->ssl, 0);
+
+		if ((err != SSL_ERROR_WANT_WRITE) && (err != SSL_ERROR_WANT_READ))
+		{
+			LIBWS_LOG(LIBWS_ERR, "Failed to write early data");
+			goto fail;
+		}
+
+		// The bufferevent can't finish sending the client hello, so wait
+		// for the socket ourselves and then retry with the same data.
+		LIBWS_LOG(LIBWS_DEBUG, "Early data not sent, waiting for the socket");
+		ERR_clear_error();
+
+		if (ws->ssl_early_data_event)
+		{
+			event_free(ws->ssl_early_data_event);
+		}
+
+		if (!(ws->ssl_early_data_event = event_new(ws->ws_base->ev_base, fd,
+				(err == SSL_ERROR_WANT_WRITE) ? EV_WRITE : EV_READ,
+				retry_cb, (void *)ws))
+		 || event_add(ws->ssl_early_data_event, NULL))
+		{
+			LIBWS_LOG(LIBWS_ERR, "Failed to wait for the socket");
+			goto fail;
+		}
+
+		return 1;
+	}
+
+	ERR_clear_error();
+
+	if (ws->ssl_early_data_event)
+	{
+		event_free(ws->ssl_early_data_event);
+		ws->ssl_early_data_event = NULL;
+	}
+
+	// The handshake has already started, and creating the bufferevent in
+	// the connecting state would restart it. Instead we let it complete
+	// on the first read, and get notified when it is done.
+	if (state == BUFFEREVENT_SSL_OPEN)
+	{
+		SSL_set_info_callback(ws->ssl, _ws_openssl_info_cb);
+	}
+
+	if (!(bev = bufferevent_openssl_socket_new(ws->ws_base->ev_base, fd,
+			ws->ssl, state, BEV_OPT_CLOSE_ON_FREE|BEV_OPT_DEFER_CALLBACKS)))
+	{
+		LIBWS_LOG(LIBWS_ERR, "Failed to create SSL socket");
+		goto fail;
+	}
+
+	ws->ssl_early_data_pending = 0;
+	ws->bev = bev;
+
+	return 0;
+fail:
+	if (ws->ssl_early_data_event)
+	{
+		event_free(ws->ssl_early_data_event);
+		ws->ssl_early_data_event = NULL;
+	}
+
+	// The SSL session is still ours.
+	evutil_closesocket(fd);
+	return -1;
+	#else
+	return -1;
+	#endif
+}
+
+int _ws_openssl_finish_early_data(ws_t ws, struct evbuffer *out)
+{
+	#ifdef SSL_EARLY_DATA_ACCEPTED
+	assert(ws);
+	assert(ws->ssl);
+	assert(ws->ssl_early_data_buf);
+
+	// OpenSSL waits for us to end the early data before sending
+	// the last handshake messages, reading alone will not do it.
+	if (SSL_do_handshake(ws->ssl) != 1)
+	{
+		int err = SSL_get_error(ws->ssl, 0);
+
+		if ((err != SSL_ERROR_WANT_WRITE) && (err != SSL_ERROR_WANT_READ))
+		{
+			LIBWS_LOG(LIBWS_ERR, "Failed to complete SSL handshake");
+			return -1;
+		}
+	}
+
+	if (SSL_get_early_data_status(ws->ssl) == SSL_EARLY_DATA_ACCEPTED)
+	{
+		LIBWS_LOG(LIBWS_DEBUG, "Server accepted early data");
+		ws->ssl_early_data_accepted = 1;
+		evbuffer_free(ws->ssl_early_data_buf);
+		ws->ssl_early_data_buf = NULL;
+		return 0;
+	}
+
+	// The server never saw the handshake, so send it again.
+	LIBWS_LOG(LIBWS_DEBUG, "Server rejected early data, resending handshake");
+
+	if (evbuffer_add_buffer(out, ws->ssl_early_data_buf))
+	{
+		LIBWS_LOG(LIBWS_ERR, "Failed to resend handshake");
+		return -1;
+	}
+
+	evbuffer_free(ws->ssl_early_data_buf);
+	ws->ssl_early_data_buf = NULL;
+
+	return 0;
+	#else
+	return -1;
+	#endif
+}
+
@@ -6,12 +6,66 @@ void _ws_global_openssl_destroy(struct ws_base_s *ws_base);
 
 int _ws_global_openssl_init(struct ws_base_s *ws_base);
 
-int _ws_openssl_init(struct ws_s *ws, struct ws_base_s *ws_base);
+int _ws_openssl_close(struct ws_s *ws);
 
-void _ws_openssl_destroy(struct ws_s *ws);
+///
+/// Caches a client session for a server, replacing any earlier one.
+/// The least recently used sessions are dropped when the cache is full.
+///
+/// @param[in] base     The base the cache belongs to.
+/// @param[in] host     The server host name, of any length.
+/// @param[in] port     The server port.
+/// @param[in] session  The session, the cache takes over the
+///                     reference on success.
+///
+/// @returns 0 on success, -1 if the session was not cached.
+///
+int _ws_openssl_cache_session(struct ws_base_s *base, const char *host,
+                              int port, SSL_SESSION *session);
 
-int _ws_openssl_close(struct ws_s *ws);
+///
+/// Gets the cached session for a server, and marks it most recently used.
+///
+/// @returns The session, owned by the cache, or NULL.
+///
+SSL_SESSION *_ws_openssl_get_session(struct ws_base_s *base,
+                                     const char *host, int port);
+
+///
+/// Makes OpenSSL allocate memory through libws.
+///
+/// @returns 0 on success, -1 if OpenSSL already allocated memory.
+///
+int _ws_openssl_set_memory_functions();
+
+///
+/// Starts applying the TLS record policy to the connection, before
+/// the first data is sent. The record size is then picked each time
+/// OpenSSL writes from the output, see #ws_set_tls_record_policy.
+///
+void _ws_openssl_start_record_policy(struct ws_s *ws);
 
 struct bufferevent *_ws_create_bufferevent_openssl_socket(struct ws_s *ws);
 
+///
+/// Hands over the connected socket to OpenSSL, and sends the
+/// websocket handshake together with the client hello. If the
+/// handshake is too big for early data, it is sent normally after
+/// the TLS handshake instead.
+///
+/// @param[in] ws       The websocket context.
+/// @param[in] retry_cb Called when the socket is ready, if the
+///                     client hello could not be sent at once.
+///
+/// @returns 0 when the socket is handed over to ws_s#bev, 1 if it
+///          must be called again from retry_cb, -1 on failure.
+///
+int _ws_openssl_send_early_data(struct ws_s *ws, event_callback_fn retry_cb);
+
+///
+/// Called when the TLS handshake is complete after sending early data.
+/// Resends the websocket handshake if the server rejected it.
+///
+int _ws_openssl_finish_early_data(struct ws_s *ws, struct evbuffer *out);
+
 #endif // __LIBWS_H_OPENSSL__
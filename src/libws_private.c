@@ -28,8 +28,11 @@
 #include "libws.h"
 #include "libws_handshake.h"
 #include "libws_utf8.h"
+#include "libws_template.h"
+#include "libws_log_ring.h"
 
 #ifdef LIBWS_WITH_OPENSSL
+#include <event2/bufferevent_ssl.h>
 #include "libws_openssl.h"
 #endif 
 
@@ -37,28 +40,238 @@ static ws_malloc_replacement_f 	replaced_ws_malloc = NULL;
 static ws_free_replacement_f	replaced_ws_free = NULL;
 static ws_realloc_replacement_f	replaced_ws_realloc = NULL;
 
+static void *_ws_raw_malloc(size_t size)
+{
+	return replaced_ws_malloc ? replaced_ws_malloc(size) : malloc(size);
+}
+
+static void *_ws_raw_realloc(void *ptr, size_t size)
+{
+	return replaced_ws_realloc ? replaced_ws_realloc(ptr, size) : realloc(ptr, size);
+}
+
+static void _ws_raw_free(void *ptr)
+{
+	if (replaced_ws_free)
+		replaced_ws_free(ptr);
+	else
+		free(ptr);
+}
+
+#ifdef LIBWS_WITH_MEMORY_ACCOUNTING
+
 void *_ws_malloc(size_t size)
 {
+	void *block;
+
 	if (size == 0)
 		return NULL;
 
-	if (replaced_ws_malloc)
-		return replaced_ws_malloc(size);
-	
-	return malloc(size);
+	_WS_STATS(_ws_metrics_alloc_shard()->allocs++);
+
+	// Reuse what was freed on this thread before, since libevent
+	// allocates and frees evbuffer chains for each read and write.
+	if (!(block = _ws_mem_cache_get(size)))
+	{
+		block = _ws_raw_malloc(_ws_mem_block_size(size));
+	}
+
+	return _ws_mem_track(block, size);
 }
 
 void *_ws_realloc(void *ptr, size_t size)
 {
-	return replaced_ws_realloc ? replaced_ws_realloc(ptr, size) : realloc(ptr, size);
+	void *block;
+	void *p;
+	ws_mem_header_t *h;
+	ws_mem_account_t *prev_mem;
+	int c;
+
+	if (!ptr)
+		return _ws_malloc(size);
+
+	if (size == 0)
+	{
+		_ws_free(ptr);
+		return NULL;
+	}
+
+	h = WS_MEM_HEADER(ptr);
+	c = _ws_mem_cache_class(size);
+
+	// Still fits the same size class.
+	if ((c >= 0) && (c == _ws_mem_cache_class(h->size)))
+	{
+		return _ws_mem_retrack(h, size);
+	}
+
+	if ((c < 0) && (_ws_mem_cache_class(h->size) < 0))
+	{
+		if (!(block = _ws_raw_realloc(h, size + WS_MEM_HEADER_SIZE)))
+			return NULL;
+
+		return _ws_mem_retrack(block, size);
+	}
+
+	// Moving to or from a cached size, keep the same account.
+	prev_mem = _ws_mem_enter(h->account);
+	p = _ws_malloc(size);
+	_ws_mem_leave(prev_mem);
+
+	if (!p)
+		return NULL;
+
+	memcpy(p, ptr, (size < h->size) ? size : h->size);
+	_ws_free(ptr);
+
+	return p;
 }
 
 void _ws_free(void *ptr)
 {
-	if (replaced_ws_free)
-		replaced_ws_free(ptr);
-	else
-		free(ptr);
+	ws_mem_header_t *h;
+
+	if (!ptr)
+		return;
+
+	_WS_STATS(_ws_metrics_alloc_shard()->frees++);
+
+	h = (ws_mem_header_t *)_ws_mem_untrack(ptr);
+
+	if (_ws_mem_cache_put(h, h->size, _ws_raw_free))
+	{
+		_ws_raw_free(h);
+	}
+}
+
+void *_ws_calloc(size_t count, size_t size)
+{
+	void *p = NULL;
+
+	if (!count || !size)
+		return NULL;
+
+	if (count > (((size_t)-1) / size))
+		goto fail;
+
+	if (!(p = _ws_malloc(count * size)))
+		goto fail;
+
+	return memset(p, 0, count * size);
+fail:
+	errno = ENOMEM;
+	return NULL;
+}
+
+char *_ws_strdup(const char *str)
+{
+	size_t len;
+	void *p = NULL;
+
+	if (!str)
+	{
+		errno = EINVAL;
+		return NULL;
+	}
+
+	len = strlen(str);
+
+	if ((p = _ws_malloc(len + 1)))
+	{
+		return memcpy(p, str, len + 1);
+	}
+
+	errno = ENOMEM;
+	return NULL;
+}
+
+static int _ws_memory_hooks_installed = 0;
+static int _ws_memory_hooks_frozen = 0;
+
+void _ws_freeze_memory_hooks()
+{
+	_ws_memory_hooks_frozen = 1;
+}
+
+int _ws_install_memory_hooks()
+{
+	if (_ws_memory_hooks_installed)
+		return 0;
+
+	// Blocks libevent already handed out have no header.
+	if (_ws_memory_hooks_frozen)
+	{
+		LIBWS_LOG(LIBWS_ERR, "The memory hooks must be installed "
+							"before ws_global_init");
+		return -1;
+	}
+
+	_ws_memory_hooks_installed = 1;
+
+	// From now on everything libevent and OpenSSL allocates gets a
+	// header, so this must happen before they've allocated anything.
+	event_set_mem_functions(_ws_malloc, _ws_realloc, _ws_free);
+
+	#ifdef LIBWS_WITH_OPENSSL
+	if (_ws_openssl_set_memory_functions())
+	{
+		// OpenSSL refuses once it has allocated anything,
+		// then its memory simply isn't accounted for.
+		LIBWS_LOG(LIBWS_DEBUG, "OpenSSL memory is not accounted for");
+	}
+	#endif
+
+	return 0;
+}
+
+void _ws_set_memory_functions(ws_malloc_replacement_f malloc_replace,
+							 ws_free_replacement_f free_replace,
+							 ws_realloc_replacement_f realloc_replace)
+{
+	// Blocks must not be handed out by one malloc and freed by another.
+	_ws_free_cached_memory();
+
+	replaced_ws_malloc = malloc_replace;
+	replaced_ws_free = free_replace;
+	replaced_ws_realloc = realloc_replace;
+
+	// libevent and OpenSSL always go through the functions
+	// above, which in turn use the replacements.
+	if (_ws_install_memory_hooks())
+	{
+		LIBWS_LOG(LIBWS_ERR, "libevent and OpenSSL keep their own "
+							"memory functions");
+	}
+}
+
+void _ws_free_cached_memory()
+{
+	_ws_mem_cache_flush_all();
+}
+
+#else
+
+void *_ws_malloc(size_t size)
+{
+	if (size == 0)
+		return NULL;
+
+	_WS_STATS(_ws_metrics_alloc_shard()->allocs++);
+
+	return _ws_raw_malloc(size);
+}
+
+void *_ws_realloc(void *ptr, size_t size)
+{
+	_WS_STATS(if (!ptr) _ws_metrics_alloc_shard()->allocs++);
+	return _ws_raw_realloc(ptr, size);
+}
+
+void _ws_free(void *ptr)
+{
+	_WS_STATS(if (ptr) _ws_metrics_alloc_shard()->frees++);
+
+	_ws_raw_free(ptr);
 }
 
 void *_ws_calloc(size_t count, size_t size)
@@ -68,6 +281,8 @@ void *_ws_calloc(size_t count, size_t size)
 	if (!count || !size)
 		return NULL;
 
+	_WS_STATS(_ws_metrics_alloc_shard()->allocs++);
+
 	if (replaced_ws_malloc)
 	{
 		size_t sz = count * size;
@@ -100,6 +315,8 @@ char *_ws_strdup(const char *str)
 		return NULL;
 	}
 
+	_WS_STATS(_ws_metrics_alloc_shard()->allocs++);
+
 	if (replaced_ws_malloc)
 	{
 		size_t len = strlen(str);
@@ -135,119 +352,528 @@ void _ws_set_memory_functions(ws_malloc_replacement_f malloc_replace,
 	replaced_ws_free = free_replace;
 	replaced_ws_realloc = realloc_replace;
 
-	event_set_mem_functions(malloc_replace, realloc_replace, free_replace);
+	event_set_mem_functions(malloc_replace, realloc_replace, free_replace);
+
+	#ifdef LIBWS_WITH_OPENSSL
+	// Through _ws_malloc, which uses the replacements, since the
+	// OpenSSL functions take extra arguments since 1.1.0.
+	_ws_openssl_set_memory_functions();
+	#endif
+}
+
+#endif // LIBWS_WITH_MEMORY_ACCOUNTING
+
+void _ws_callbacks_init(ws_callbacks_t *cbs)
+{
+	assert(cbs);
+
+	memset(cbs, 0, sizeof(ws_callbacks_t));
+	cbs->refcount = 1;
+
+	cbs->ping_cb = ws_default_onping_cb;
+	cbs->pong_cb = ws_default_onpong_cb;
+	cbs->msg_begin_cb = ws_default_msg_begin_cb;
+	cbs->msg_frame_cb = ws_default_msg_frame_cb;
+	cbs->msg_end_cb = ws_default_msg_end_cb;
+	cbs->msg_frame_begin_cb = ws_default_msg_frame_begin_cb;
+	cbs->msg_frame_data_cb = ws_default_msg_frame_data_cb;
+	cbs->msg_frame_end_cb = ws_default_msg_frame_end_cb;
+}
+
+ws_cold_t *_ws_get_cold(ws_t ws)
+{
+	assert(ws);
+
+	if (!ws->cold)
+	{
+		if (!(ws->cold = (ws_cold_t *)_ws_slab_alloc(&ws->ws_base->cold_slab)))
+		{
+			LIBWS_LOG(LIBWS_CRIT, "Out of memory!");
+			return NULL;
+		}
+
+		memset(ws->cold, 0, sizeof(ws_cold_t));
+		ws->cold->server_close_status = WS_CLOSE_STATUS_NORMAL_1000;
+	}
+
+	return ws->cold;
+}
+
+void _ws_free_cold(ws_t ws)
+{
+	assert(ws);
+
+	if (!ws->cold)
+		return;
+
+	ws_clear_subprotocols(ws);
+
+	if (ws->cold->origin)
+	{
+		_ws_allocator_free(_WS_ALLOCATOR(ws->ws_base), ws->cold->origin);
+	}
+
+	_ws_slab_free(&ws->ws_base->cold_slab, ws->cold);
+	ws->cold = NULL;
+}
+
+const char *_ws_get_origin(ws_t ws)
+{
+	assert(ws);
+
+	if (ws->cold && ws->cold->origin)
+		return ws->cold->origin;
+
+	return ws->tmpl ? ws->tmpl->origin : NULL;
+}
+
+char **_ws_get_subprotocol_list(ws_t ws, size_t *count)
+{
+	assert(ws);
+	assert(count);
+
+	if (ws->cold && ws->cold->num_subprotocols)
+	{
+		*count = ws->cold->num_subprotocols;
+		return ws->cold->subprotocols;
+	}
+
+	if (ws->tmpl)
+	{
+		*count = ws->tmpl->num_subprotocols;
+		return ws->tmpl->subprotocols;
+	}
+
+	*count = 0;
+	return NULL;
+}
+
+///
+/// Timer for when a connection attempt times out.
+///
+static void _ws_connection_timeout_cb(void *arg)
+{
+	char buf[256];
+	ws_t ws = (ws_t)arg;
+	assert(ws);
+
+	LIBWS_LOG(LIBWS_ERR, "Websocket connection timed out after %ld seconds "
+						 "for %s", ws->connect_timeout.tv_sec, 
+						 ws_get_uri(ws, buf, sizeof(buf)));
+
+	_WS_STATS(_WS_METRICS(ws->ws_base)->handshake_failures[
+				WS_HANDSHAKE_FAIL_TIMEOUT]++);
+
+	if (ws->cbs->connect_timeout_cb)
+	{
+		ws->cbs->connect_timeout_cb(ws, ws->connect_timeout, 
+									ws->cbs->connect_timeout_arg);
+	}
+}
+
+static void _ws_pong_timeout_cb(void *arg)
+{
+	ws_t ws = (ws_t)arg;
+	assert(ws);
+
+	// TODO: Make sure we delete this event if the ws->cbs->pong_timeout_cb is set to NULL while waiting for event to time out.
+
+	if (ws->cbs->pong_timeout_cb)
+	{
+		ws->cbs->pong_timeout_cb(ws, ws->pong_timeout, ws->cbs->pong_timeout_arg);
+	}
+}
+
+static int _ws_setup_timeout(ws_t ws, ws_timer_t *timer, struct timeval *tv)
+{
+	assert(ws);
+	assert(timer);
+	assert(tv);
+
+	LIBWS_LOG(LIBWS_TRACE, "Setting up new timeout");
+
+	if (_ws_timer_add(&ws->ws_base->timers, timer, tv))
+	{
+		LIBWS_LOG(LIBWS_ERR, "Failed to add timeout");
+		return -1;
+	}
+
+	return 0;
+}
+
+int _ws_setup_pong_timeout(ws_t ws)
+{
+	assert(ws);
+	return _ws_setup_timeout(ws, &ws->pong_timeout_timer, &ws->pong_timeout);
+}
+
+int _ws_setup_connection_timeout(ws_t ws)
+{	
+	struct timeval tv = {WS_DEFAULT_CONNECT_TIMEOUT, 0};
+	assert(ws);
+	 
+	if (ws->connect_timeout.tv_sec > 0)
+	{
+		tv = ws->connect_timeout;
+	}
+
+	return _ws_setup_timeout(ws, &ws->connect_timeout_timer, &tv);
+}
+
+// Keepalive pings carry this prefix followed by the 64-bit
+// send time in microseconds, in network byte order.
+#define WS_KEEPALIVE_MAGIC "lwsk"
+#define WS_KEEPALIVE_MAGIC_LEN 4
+#define WS_KEEPALIVE_PAYLOAD_LEN (WS_KEEPALIVE_MAGIC_LEN + 8)
+
+static uint64_t _ws_timeval_to_us(const struct timeval *tv)
+{
+	return ((uint64_t)tv->tv_sec * 1000000) + (uint64_t)tv->tv_usec;
+}
+
+static void _ws_us_to_timeval(uint64_t us, struct timeval *tv)
+{
+	tv->tv_sec = (long)(us / 1000000);
+	tv->tv_usec = (long)(us % 1000000);
+}
+
+static int _ws_keepalive_schedule(ws_t ws, const struct timeval *tv)
+{
+	assert(ws);
+
+	if (_ws_timer_add(&ws->ws_base->timers, &ws->keepalive_timer, tv))
+	{
+		LIBWS_LOG(LIBWS_ERR, "Failed to add keepalive timer");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int _ws_keepalive_send_ping(ws_t ws)
+{
+	int i;
+	uint64_t sent;
+	char payload[WS_KEEPALIVE_PAYLOAD_LEN];
+	assert(ws);
+
+	evutil_gettimeofday(&ws->keepalive_sent, NULL);
+	sent = _ws_timeval_to_us(&ws->keepalive_sent);
+
+	memcpy(payload, WS_KEEPALIVE_MAGIC, WS_KEEPALIVE_MAGIC_LEN);
+
+	for (i = 0; i < 8; i++)
+	{
+		payload[WS_KEEPALIVE_MAGIC_LEN + i] = (char)(sent >> (56 - (8 * i)));
+	}
+
+	LIBWS_LOG(LIBWS_DEBUG, "Send keepalive ping");
+
+	if (_ws_send_frame_raw(ws, WS_OPCODE_PING_0X9, payload, sizeof(payload)))
+	{
+		return -1;
+	}
+
+	ws->keepalive_waiting = 1;
+
+	return _ws_keepalive_schedule(ws, &ws->keepalive_timeout);
+}
+
+static void _ws_keepalive_cb(void *arg)
+{
+	ws_t ws = (ws_t)arg;
+	struct timeval now;
+	struct timeval idle;
+	assert(ws);
+
+	if (ws->keepalive_waiting)
+	{
+		LIBWS_LOG(LIBWS_ERR, "Keepalive timeout! No pong received within "
+							 "%ld.%06ld seconds, initiating an unclean close",
+							 (long)ws->keepalive_timeout.tv_sec,
+							 (long)ws->keepalive_timeout.tv_usec);
+
+		_ws_shutdown(ws);
+		_ws_set_state(ws, WS_STATE_CLOSED_UNCLEANLY);
+		_WS_STATS(_WS_METRICS(ws->ws_base)->closes[
+					_ws_metrics_close_index(WS_CLOSE_STATUS_ABNORMAL_1006)]++);
+
+		if (ws->cbs->close_cb)
+		{
+			char reason[] = "Keepalive timeout";
+			ws->cbs->close_cb(ws, WS_CLOSE_STATUS_ABNORMAL_1006,
+						reason, sizeof(reason), ws->cbs->close_arg);
+		}
+
+		return;
+	}
+
+	if (ws->keepalive_skip_active && evutil_timerisset(&ws->last_recv))
+	{
+		event_base_gettimeofday_cached(ws->ws_base->ev_base, &now);
+
+		if (!evutil_timercmp(&now, &ws->last_recv, <))
+		{
+			evutil_timersub(&now, &ws->last_recv, &idle);
+
+			if (evutil_timercmp(&idle, &ws->keepalive_interval, <))
+			{
+				// Data arrived recently, so the connection is alive. Check
+				// again one interval after the last data was received.
+				evutil_timersub(&ws->keepalive_interval, &idle, &idle);
+				_ws_keepalive_schedule(ws, &idle);
+				return;
+			}
+		}
+	}
+
+	if (_ws_keepalive_send_ping(ws))
+	{
+		LIBWS_LOG(LIBWS_ERR, "Failed to send keepalive ping");
+	}
+}
+
+///
+/// Handles the pong reply to a keepalive ping.
+///
+/// @returns 1 if the pong was a reply to the outstanding
+///          keepalive ping, 0 otherwise.
+///
+static int _ws_keepalive_handle_pong(ws_t ws)
+{
+	int i;
+	uint64_t sent = 0;
+	uint64_t now_us;
+	uint64_t next_us;
+	struct timeval now;
+	struct timeval next;
+	assert(ws);
+
+	if (!ws->keepalive_waiting
+		|| (ws->ctrl_len != WS_KEEPALIVE_PAYLOAD_LEN)
+		|| memcmp(ws->cold->ctrl_payload, WS_KEEPALIVE_MAGIC, 
+					WS_KEEPALIVE_MAGIC_LEN))
+	{
+		return 0;
+	}
+
+	for (i = 0; i < 8; i++)
+	{
+		sent = (sent << 8) 
+			| (unsigned char)ws->cold->ctrl_payload[WS_KEEPALIVE_MAGIC_LEN + i];
+	}
+
+	// A pong for an earlier ping that already timed out.
+	if (sent != _ws_timeval_to_us(&ws->keepalive_sent))
+	{
+		return 0;
+	}
+
+	evutil_gettimeofday(&now, NULL);
+	now_us = _ws_timeval_to_us(&now);
+
+	// Ignore the sample if the clock was set back.
+	if (now_us >= sent)
+	{
+		ws->last_rtt = now_us - sent;
+		_ws_histogram_record(ws->rtt, ws->last_rtt);
+
+		LIBWS_LOG(LIBWS_DEBUG, "Keepalive round trip %llu us", 
+				(unsigned long long)ws->last_rtt);
+	}
+
+	ws->keepalive_waiting = 0;
+
+	// Keep the ping schedule, the next ping is due one
+	// interval after this one was sent.
+	next_us = sent + _ws_timeval_to_us(&ws->keepalive_interval);
+	_ws_us_to_timeval((next_us > now_us) ? (next_us - now_us) : 0, &next);
+	_ws_keepalive_schedule(ws, &next);
+
+	return 1;
+}
+
+int _ws_keepalive_start(ws_t ws)
+{
+	uint64_t interval_us;
+	uint32_t spread;
+	struct timeval first;
+	assert(ws);
+
+	if (!evutil_timerisset(&ws->keepalive_interval))
+	{
+		return 0;
+	}
 
-	#ifdef LIBWS_WITH_OPENSSL
-	CRYPTO_set_mem_functions(malloc_replace, realloc_replace, free_replace);
-	#endif
+	ws->keepalive_waiting = 0;
+	ws->last_rtt = 0;
+	evutil_timerclear(&ws->last_recv);
+	_ws_histogram_reset(ws->rtt);
+
+	// Spread the connections of a base evenly over the interval by
+	// stepping with the golden ratio. Connections that are started at
+	// the same time would otherwise send all their pings on the same tick.
+	spread = (uint32_t)(ws->ws_base->keepalive_seq++ * 2654435769u);
+	interval_us = _ws_timeval_to_us(&ws->keepalive_interval);
+	_ws_us_to_timeval(interval_us 
+		- (uint64_t)((double)interval_us * ((double)spread / 4294967296.0)),
+		&first);
+
+	return _ws_keepalive_schedule(ws, &first);
 }
 
 ///
-/// Event for when a connection attempt times out.
+/// Forgets the pending coalesced pong, its ping is never answered.
 ///
-static void _ws_connection_timeout_event(evutil_socket_t fd, short what, void *arg)
+static void _ws_drop_pong(ws_t ws)
 {
-	char buf[256];
-	ws_t ws = (ws_t)arg;
 	assert(ws);
 
-	LIBWS_LOG(LIBWS_ERR, "Websocket connection timed out after %ld seconds "
-						 "for %s", ws->connect_timeout.tv_sec, 
-						 ws_get_uri(ws, buf, sizeof(buf)));
-
-	if (ws->connect_timeout_cb)
+	if (ws->cold && ws->cold->pong_pending)
 	{
-		ws->connect_timeout_cb(ws, ws->connect_timeout, ws->connect_timeout_arg);
+		_WS_STATS(ws->stats.pongs_suppressed++);
+		ws->cold->pong_pending = 0;
 	}
 }
 
-static void _ws_pong_timeout_event(evutil_socket_t fd, short what, void *arg)
+int _ws_queue_pong(ws_t ws, const char *msg, size_t len)
 {
-	ws_t ws = (ws_t)arg;
+	ws_cold_t *cold;
 	assert(ws);
 
-	// TODO: Make sure we delete this event if the ws->pong_timeout_cb is set to NULL while waiting for event to time out.
+	if (len > WS_CONTROL_MAX_PAYLOAD_LEN)
+	{
+		LIBWS_LOG(LIBWS_ERR, "Pong payload too big");
+		return -1;
+	}
+
+	if (!(cold = _ws_get_cold(ws)))
+	{
+		return -1;
+	}
+
+	// Only the most recent ping has to be answered.
+	_ws_drop_pong(ws);
 
-	if (ws->pong_timeout_cb)
+	if (len)
 	{
-		ws->pong_timeout_cb(ws, ws->pong_timeout, ws->pong_arg);
+		memcpy(cold->pong_payload, msg, len);
 	}
+
+	cold->pong_len = len;
+	cold->pong_pending = 1;
+
+	return 0;
 }
 
-static int _ws_setup_timeout_event(ws_t ws, event_callback_fn func, 
-									struct event **ev, struct timeval *tv)
+void _ws_flush_pong(ws_t ws)
 {
+	ws_cold_t *cold;
+	struct timeval now;
+	struct timeval next;
 	assert(ws);
-	assert(ev);
-	assert(func);
-	assert(tv);
 
-	LIBWS_LOG(LIBWS_TRACE, "Setting up new timeout event");
+	cold = ws->cold;
 
-	if (*ev)
+	if (!cold || !cold->pong_pending)
 	{
-		event_free(*ev);
-		*ev = NULL;
+		return;
 	}
 
-	if (!(*ev = evtimer_new(ws->ws_base->ev_base, 
-							func, (void *)ws)))
+	if (ws->sent_close || !ws->bev)
 	{
-		LIBWS_LOG(LIBWS_ERR, "Failed to create timeout event");
-		return -1;
+		_ws_drop_pong(ws);
+		return;
 	}
 
-	if (evtimer_add(*ev, tv))
+	if (evutil_timerisset(&ws->pong_interval))
 	{
-		LIBWS_LOG(LIBWS_ERR, "Failed to add timeout event");
-		event_free(*ev);
-		*ev = NULL;
-		return -1;
+		event_base_gettimeofday_cached(ws->ws_base->ev_base, &now);
+		evutil_timeradd(&ws->last_pong, &ws->pong_interval, &next);
+
+		// Too soon, unless the clock was set back.
+		if (evutil_timercmp(&now, &next, <)
+		 && !evutil_timercmp(&now, &ws->last_pong, <))
+		{
+			if (!_ws_timer_pending(&ws->pong_reply_timer))
+			{
+				evutil_timersub(&next, &now, &next);
+
+				if (_ws_timer_add(&ws->ws_base->timers, 
+								&ws->pong_reply_timer, &next))
+				{
+					LIBWS_LOG(LIBWS_ERR, "Failed to add pong timer");
+				}
+			}
+
+			return;
+		}
+
+		ws->last_pong = now;
 	}
 
-	return 0;
+	cold->pong_pending = 0;
+
+	if (ws_send_pong(ws, cold->pong_payload, cold->pong_len))
+	{
+		LIBWS_LOG(LIBWS_ERR, "Failed to send pong");
+	}
 }
 
-int _ws_setup_pong_timeout(ws_t ws)
+static void _ws_pong_reply_cb(void *arg)
+{
+	_ws_flush_pong((ws_t)arg);
+}
+
+void _ws_init_timers(ws_t ws)
 {
 	assert(ws);
-	return _ws_setup_timeout_event(ws, _ws_pong_timeout_event,
-				&ws->pong_timeout_event, &ws->pong_timeout);
+
+	_ws_timer_init(&ws->connect_timeout_timer, _ws_connection_timeout_cb, ws);
+	_ws_timer_init(&ws->pong_timeout_timer, _ws_pong_timeout_cb, ws);
+	_ws_timer_init(&ws->close_timeout_timer, _ws_close_timeout_cb, ws);
+	_ws_timer_init(&ws->keepalive_timer, _ws_keepalive_cb, ws);
+	_ws_timer_init(&ws->pong_reply_timer, _ws_pong_reply_cb, ws);
 }
 
-int _ws_setup_connection_timeout(ws_t ws)
-{	
-	struct timeval tv = {WS_DEFAULT_CONNECT_TIMEOUT, 0};
+void _ws_destroy_timers(ws_t ws)
+{
+	ws_timer_wheel_t *timers;
+	assert(ws);
+
+	timers = &ws->ws_base->timers;
+
+	_ws_timer_del(timers, &ws->connect_timeout_timer);
+	_ws_timer_del(timers, &ws->pong_timeout_timer);
+	_ws_timer_del(timers, &ws->close_timeout_timer);
+	_ws_timer_del(timers, &ws->keepalive_timer);
+	_ws_timer_del(timers, &ws->pong_reply_timer);
+}
+
+void _ws_keepalive_stop(ws_t ws)
+{
 	assert(ws);
-	 
-	if (ws->connect_timeout.tv_sec > 0)
-	{
-		tv = ws->connect_timeout;
-	}
 
-	return _ws_setup_timeout_event(ws, _ws_connection_timeout_event, 
-									&ws->connect_timeout_event, &tv);
+	_ws_timer_del(&ws->ws_base->timers, &ws->keepalive_timer);
+	ws->keepalive_waiting = 0;
 }
 
 static int _ws_handle_close_frame(ws_t ws)
 {
-	ws_header_t *h;
+	ws_cold_t *cold;
 	assert(ws);
 	LIBWS_LOG(LIBWS_TRACE, "Close frame");
+	_WS_STATS(_ws_stats_count_msg(ws, WS_OPCODE_CLOSE_0X8, ws->ctrl_len, 0));
 
-	h = &ws->header;
+	cold = ws->cold;
 
-	ws->server_close_status = (uint16_t)WS_CLOSE_STATUS_NORMAL_1000;
-	ws->server_reason = NULL;
-	ws->server_reason_len = 0;
+	cold->server_close_status = (uint16_t)WS_CLOSE_STATUS_NORMAL_1000;
+	cold->server_reason = NULL;
+	cold->server_reason_len = 0;
 
-	if (ws->close_timeout_event)
-	{
-		event_free(ws->close_timeout_event);
-		ws->close_timeout_event = NULL;
-	}
+	_ws_timer_del(&ws->ws_base->timers, &ws->close_timeout_timer);
 
-	ws->state = WS_STATE_CLOSING;
+	_ws_set_state(ws, WS_STATE_CLOSING);
 	ws->received_close = 1;
 
 	// The Close frame MAY contain a body (the "Application data" portion of
@@ -262,7 +888,7 @@ static int _ws_handle_close_frame(ws_t ws)
 			LIBWS_LOG(LIBWS_ERR, "Close frame application data lacking "
 								 "status code");
 
-			ws->server_close_status = WS_CLOSE_STATUS_STATUS_CODE_EXPECTED_1005;
+			cold->server_close_status = WS_CLOSE_STATUS_STATUS_CODE_EXPECTED_1005;
 
 			ws_close_with_status(ws, WS_CLOSE_STATUS_PROTOCOL_ERR_1002);
 			return 0;
@@ -272,20 +898,20 @@ static int _ws_handle_close_frame(ws_t ws)
 			LIBWS_LOG(LIBWS_DEBUG, "Reading server close status and reason "
 					" (payload length %lu)", ws->ctrl_len);
 
-			ws->server_close_status = 
-				(ws_close_status_t)ntohs(*((uint16_t *)ws->ctrl_payload));
-			ws->server_reason = &ws->ctrl_payload[2];
-			ws->server_reason_len = ws->ctrl_len - 2;
-			ws->server_reason[ws->server_reason_len] = '\0';
+			cold->server_close_status = 
+				(ws_close_status_t)ntohs(*((uint16_t *)cold->ctrl_payload));
+			cold->server_reason = &cold->ctrl_payload[2];
+			cold->server_reason_len = ws->ctrl_len - 2;
+			cold->server_reason[cold->server_reason_len] = '\0';
 
 			LIBWS_LOG(LIBWS_INFO, "Got close status %d, \"%s\"", 
-				ws->server_close_status, 
-				ws->server_reason);
+				cold->server_close_status, 
+				cold->server_reason);
 
-			if (!WS_IS_PEER_CLOSE_STATUS_VALID(ws->server_close_status))
+			if (!WS_IS_PEER_CLOSE_STATUS_VALID(cold->server_close_status))
 			{
 				LIBWS_LOG(LIBWS_ERR, "Invalid close code from peer %d", 
-							ws->server_close_status);
+							cold->server_close_status);
 				ws_close_with_status(ws, WS_CLOSE_STATUS_PROTOCOL_ERR_1002);
 				return 0;
 			}
@@ -293,7 +919,7 @@ static int _ws_handle_close_frame(ws_t ws)
 			// Validate UTF8 text.
 			ws->utf8_state = WS_UTF8_ACCEPT;
 			ws_utf8_validate(&ws->utf8_state, 
-							ws->server_reason, ws->server_reason_len);
+							cold->server_reason, cold->server_reason_len);
 
 			if (ws->utf8_state == WS_UTF8_REJECT)
 			{
@@ -315,11 +941,11 @@ static int _ws_handle_close_frame(ws_t ws)
 	// data.
 	if (!ws->sent_close)
 	{
-		LIBWS_LOG(LIBWS_INFO, "Echoing status code %d", ws->server_close_status);
+		LIBWS_LOG(LIBWS_INFO, "Echoing status code %d", cold->server_close_status);
 		return ws_close_with_status_reason(ws, 
-			ws->server_close_status, 
-			ws->server_reason, 
-			ws->server_reason_len);
+			cold->server_close_status, 
+			cold->server_reason, 
+			cold->server_reason_len);
 	}
 
 	return 0;
@@ -329,8 +955,10 @@ int _ws_handle_ping_frame(ws_t ws)
 {
 	assert(ws);
 	LIBWS_LOG(LIBWS_TRACE, "  Ping frame");
+	_WS_STATS(_ws_stats_count_msg(ws, WS_OPCODE_PING_0X9, ws->ctrl_len, 0));
 
-	ws->ping_cb(ws, ws->ctrl_payload, ws->ctrl_len, 1, NULL);
+	ws->cbs->ping_cb(ws, ws->cold->ctrl_payload, ws->ctrl_len, 1, 
+					ws->cbs->ping_arg);
 
 	return 0;
 }
@@ -339,8 +967,18 @@ int _ws_handle_pong_frame(ws_t ws)
 {
 	assert(ws);
 	LIBWS_LOG(LIBWS_TRACE, "  Pong frame");
+	_WS_STATS(_ws_stats_count_msg(ws, WS_OPCODE_PONG_0XA, ws->ctrl_len, 0));
+
+	// Replies to our own keepalive pings are not passed on.
+	if (_ws_keepalive_handle_pong(ws))
+	{
+		return 0;
+	}
+
+	_ws_timer_del(&ws->ws_base->timers, &ws->pong_timeout_timer);
 
-	ws->pong_cb(ws, ws->ctrl_payload, ws->ctrl_len, 0, NULL);
+	ws->cbs->pong_cb(ws, ws->cold->ctrl_payload, ws->ctrl_len, 0, 
+					ws->cbs->pong_arg);
 
 	return 0;
 }
@@ -355,6 +993,12 @@ int _ws_handle_control_frame(ws_t ws)
 
 	assert(WS_OPCODE_IS_CONTROL(h->opcode));
 
+	// Allocated when the frame began.
+	if (!ws->cold)
+	{
+		return -1;
+	}
+
 	switch (h->opcode)
 	{
 		case WS_OPCODE_CLOSE_0X8: return _ws_handle_close_frame(ws);
@@ -373,6 +1017,21 @@ int _ws_handle_control_frame(ws_t ws)
 	return 0;
 }
 
+///
+/// Checks if all message and frame callbacks are the defaults, so
+/// only the message callback sees the data. Then the payload can be
+/// read straight into the message, see #_ws_read_frame_direct.
+///
+static int _ws_msg_is_direct(const ws_callbacks_t *cbs)
+{
+	return (cbs->msg_begin_cb == ws_default_msg_begin_cb)
+		&& (cbs->msg_frame_cb == ws_default_msg_frame_cb)
+		&& (cbs->msg_end_cb == ws_default_msg_end_cb)
+		&& (cbs->msg_frame_begin_cb == ws_default_msg_frame_begin_cb)
+		&& (cbs->msg_frame_data_cb == ws_default_msg_frame_data_cb)
+		&& (cbs->msg_frame_end_cb == ws_default_msg_frame_end_cb);
+}
+
 int _ws_handle_frame_begin(ws_t ws)
 {
 	assert(ws);
@@ -384,8 +1043,14 @@ int _ws_handle_frame_begin(ws_t ws)
 	if (WS_OPCODE_IS_CONTROL(ws->header.opcode))
 	{
 		LIBWS_LOG(LIBWS_DEBUG, "  Control frame");
-		memset(ws->ctrl_payload, 0, sizeof(ws->ctrl_payload));
 		ws->ctrl_len = 0;
+
+		if (!_ws_get_cold(ws))
+		{
+			return -1;
+		}
+
+		memset(ws->cold->ctrl_payload, 0, sizeof(ws->cold->ctrl_payload));
 		return 0;
 	}
 
@@ -397,13 +1062,32 @@ int _ws_handle_frame_begin(ws_t ws)
 		ws->in_msg = 1;
 		ws->utf8_state = WS_UTF8_ACCEPT;
 		ws->msg_isbinary = (ws->header.opcode == WS_OPCODE_BINARY_0X2);
+		ws->msg_provided = (ws->cbs->recv_alloc_cb && ws->cbs->recv_commit_cb);
+		ws->msg_direct = !ws->msg_provided && _ws_msg_is_direct(ws->cbs);
+		_WS_STATS(ws->stats_msg_in_len = 0);
 
-		LIBWS_LOG(LIBWS_DEBUG, "Call message begin callback");
-		ws->msg_begin_cb(ws, ws->msg_begin_arg);
+		// A provided message has nothing to begin, the application
+		// gets the payload as it arrives.
+		if (ws->msg_direct)
+		{
+			ws_default_msg_begin_cb(ws, NULL);
+		}
+		else if (!ws->msg_provided)
+		{
+			LIBWS_LOG(LIBWS_DEBUG, "Call message begin callback");
+			ws->cbs->msg_begin_cb(ws, ws->cbs->msg_begin_arg);
+		}
 	}
 
-	LIBWS_LOG(LIBWS_DEBUG, "Call frame begin callback");
-	ws->msg_frame_begin_cb(ws, ws->msg_frame_begin_arg);
+	_WS_STATS(ws->stats_msg_in_len += ws->header.payload_len);
+
+	// The default frame begin callback has nothing to do,
+	// the previous frame was already added to the message.
+	if (!ws->msg_direct && !ws->msg_provided)
+	{
+		LIBWS_LOG(LIBWS_DEBUG, "Call frame begin callback");
+		ws->cbs->msg_frame_begin_cb(ws, ws->cbs->msg_frame_begin_arg);
+	}
 
 	return 0;
 }
@@ -418,6 +1102,11 @@ int _ws_handle_frame_data(ws_t ws, char *buf, size_t len)
 	{
 		size_t total_len = (ws->ctrl_len + len);
 
+		if (!ws->cold)
+		{
+			return -1;
+		}
+
 		if (total_len > WS_CONTROL_MAX_PAYLOAD_LEN)
 		{
 			LIBWS_LOG(LIBWS_ERR, "Control payload too big %u, only %u allowed",
@@ -431,17 +1120,64 @@ int _ws_handle_frame_data(ws_t ws, char *buf, size_t len)
 		}
 
 		LIBWS_LOG(LIBWS_DEBUG, "   Append %lu bytes to ctrl payload[%lu]", len, ws->ctrl_len);
-		memcpy(&ws->ctrl_payload[ws->ctrl_len], buf, len);
+		memcpy(&ws->cold->ctrl_payload[ws->ctrl_len], buf, len);
 		ws->ctrl_len += len;
 
 		return ret;
 	}
 
-	ws->msg_frame_data_cb(ws, buf, len, ws->msg_frame_data_arg);
+	ws->cbs->msg_frame_data_cb(ws, buf, len, ws->cbs->msg_frame_data_arg);
 
 	return ret;
 }
 
+static void _ws_reset_message(ws_t ws)
+{
+	assert(ws);
+
+	ws->in_msg = 0;
+	ws->msg_provided = 0;
+	ws->recv_dst = NULL;
+	ws->recv_dst_len = 0;
+	ws->recv_dst_cap = 0;
+
+	// Give back the message scratch memory to the base.
+	_ws_arena_reset(&ws->arena, &ws->ws_base->arena_blocks);
+	ws->msg_data = NULL;
+	ws->msg_len = 0;
+	ws->msg_cap = 0;
+	ws->msg_frame_len = 0;
+}
+
+///
+/// Drops the message being received. If the application has seen
+/// the start of it, it is told the message will never end.
+///
+static void _ws_abort_message(ws_t ws, ws_close_status_t status)
+{
+	assert(ws);
+
+	// Already told when the rest of the message is being skipped.
+	if (ws->in_msg && !ws->recv_too_big)
+	{
+		if (ws->msg_provided)
+		{
+			if (ws->cbs->recv_commit_cb)
+			{
+				ws->cbs->recv_commit_cb(ws, ws->recv_dst, ws->recv_dst_len,
+					ws->msg_isbinary, WS_RECV_MSG_ABORTED,
+					ws->cbs->recv_buffer_arg);
+			}
+		}
+		else if (ws->cbs->msg_abort_cb)
+		{
+			ws->cbs->msg_abort_cb(ws, status, ws->cbs->msg_abort_arg);
+		}
+	}
+
+	_ws_reset_message(ws);
+}
+
 int _ws_handle_frame_end(ws_t ws)
 {
 	assert(ws);
@@ -453,12 +1189,42 @@ int _ws_handle_frame_end(ws_t ws)
 		return _ws_handle_control_frame(ws);
 	}
 
-	ws->msg_frame_end_cb(ws, ws->msg_frame_end_arg);
+	if (ws->msg_provided)
+	{
+		// Buffers are committed as they fill up, there is
+		// only something left to say for an empty final frame.
+		if (ws->header.fin && !ws->header.payload_len)
+		{
+			ws->cbs->recv_commit_cb(ws, NULL, 0, ws->msg_isbinary, 1,
+									ws->cbs->recv_buffer_arg);
+		}
+	}
+	else if (ws->msg_direct)
+	{
+		ws_default_msg_frame_cb(ws, NULL, 0, NULL);
+	}
+	else
+	{
+		ws->cbs->msg_frame_end_cb(ws, ws->cbs->msg_frame_end_arg);
+	}
 
 	if (ws->header.fin)
 	{
-		ws->msg_end_cb(ws, ws->msg_end_arg);
-		ws->in_msg = 0;
+		_WS_STATS(_ws_stats_count_msg(ws, ws->msg_isbinary
+					? WS_OPCODE_BINARY_0X2 : WS_OPCODE_TEXT_0X1,
+					ws->stats_msg_in_len, 0));
+
+		// A provided message was committed with its last buffer.
+		if (ws->msg_direct)
+		{
+			ws_default_msg_end_cb(ws, NULL);
+		}
+		else if (!ws->msg_provided)
+		{
+			ws->cbs->msg_end_cb(ws, ws->cbs->msg_end_arg);
+		}
+
+		_ws_reset_message(ws);
 	}
 
 	ws->has_header = 0;
@@ -497,17 +1263,256 @@ int _ws_validate_header(ws_t ws)
 		return -1;
 	}
 
-	// If we're in a message, we must either get a continuation frame
-	// or an interjected control frame such as a ping.
-	if (ws->in_msg 
-		&& ((h->opcode != WS_OPCODE_CONTINUATION_0X0) 
-			&& !WS_OPCODE_IS_CONTROL(h->opcode)))
-	{
-		LIBWS_LOG(LIBWS_ERR, "Didn't get continuation frame when "
-							"still in message. opcode %d (%s)",
-							h->opcode,
-							ws_opcode_str(h->opcode));
-		return -1;
+	// If we're in a message, we must either get a continuation frame
+	// or an interjected control frame such as a ping.
+	if (ws->in_msg 
+		&& ((h->opcode != WS_OPCODE_CONTINUATION_0X0) 
+			&& !WS_OPCODE_IS_CONTROL(h->opcode)))
+	{
+		LIBWS_LOG(LIBWS_ERR, "Didn't get continuation frame when "
+							"still in message. opcode %d (%s)",
+							h->opcode,
+							ws_opcode_str(h->opcode));
+		return -1;
+	}
+
+	return 0;
+}
+
+///
+/// Checks the declared length of a received data frame against
+/// ws_s#max_frame_size_recv and ws_s#max_message_size, before
+/// any of its payload has been buffered.
+///
+/// @param[in]	ws 	The websocket session context.
+///
+/// @returns 		0 if within the limits, -1 if the connection
+///					is being closed.
+///
+static int _ws_check_recv_limits(ws_t ws)
+{
+	ws_header_t *h = &ws->header;
+	uint64_t msg_len;
+
+	if (WS_OPCODE_IS_CONTROL(h->opcode))
+	{
+		return 0;
+	}
+
+	msg_len = (h->opcode == WS_OPCODE_CONTINUATION_0X0) ? ws->recv_msg_len : 0;
+
+	if (ws->max_frame_size_recv && (h->payload_len > ws->max_frame_size_recv))
+	{
+		LIBWS_LOG(LIBWS_WARN, "Frame of %llu bytes is over the limit of %llu",
+				(unsigned long long)h->payload_len,
+				(unsigned long long)ws->max_frame_size_recv);
+	}
+	else if (ws->max_message_size
+		&& (h->payload_len > (ws->max_message_size - msg_len)))
+	{
+		LIBWS_LOG(LIBWS_WARN, "Message of at least %llu bytes is over "
+				"the limit of %llu",
+				(unsigned long long)(msg_len + h->payload_len),
+				(unsigned long long)ws->max_message_size);
+	}
+	else
+	{
+		ws->recv_msg_len = msg_len + h->payload_len;
+		return 0;
+	}
+
+	// Drop the partial message, it is never delivered.
+	_ws_abort_message(ws, WS_CLOSE_STATUS_MESSAGE_TOO_BIG_1009);
+	ws->recv_too_big = 1;
+	_WS_STATS(ws->stats.msgs_too_big_in++);
+	ws_close_with_status(ws, WS_CLOSE_STATUS_MESSAGE_TOO_BIG_1009);
+
+	return -1;
+}
+
+///
+/// Gets the mask to unmask a frame with, starting at an offset
+/// into the payload.
+///
+static uint32_t _ws_mask_at(uint32_t mask, uint64_t offset)
+{
+	size_t i;
+	uint32_t rotated;
+	uint8_t *m = (uint8_t *)&mask;
+	uint8_t *r = (uint8_t *)&rotated;
+
+	for (i = 0; i < 4; i++)
+	{
+		r[i] = m[(i + offset) & 3];
+	}
+
+	return rotated;
+}
+
+///
+/// Validates the UTF8 of a part of a text message, and closes
+/// the connection if it is invalid.
+///
+static void _ws_validate_utf8(ws_t ws, const char *buf, size_t len)
+{
+	LIBWS_LOG(LIBWS_DEBUG2, "About to validate UTF8, state = %d"
+			" len = %d", ws->utf8_state, len);
+
+	ws_utf8_validate(&ws->utf8_state, buf, len);
+
+	// Either the UTF8 is invalid, or a codepoint is not
+	// complete in the finish frame.
+	if ((ws->utf8_state == WS_UTF8_REJECT) 
+	|| ((ws->utf8_state != WS_UTF8_ACCEPT) && (ws->header.fin)
+		&& (ws->recv_frame_len == ws->header.payload_len)))
+	{
+		LIBWS_LOG(LIBWS_ERR, "Invalid UTF8!");
+
+		ws_close_with_status(ws, 
+			WS_CLOSE_STATUS_INCONSISTENT_DATA_1007);
+	}
+
+	LIBWS_LOG(LIBWS_DEBUG2, "Validated UTF8, state = %d", 
+			ws->utf8_state);
+}
+
+///
+/// Reads frame payload straight into the message, without
+/// copying it through the frame callbacks. See #_ws_msg_is_direct.
+///
+/// @param[in]	ws 		The websocket context.
+/// @param[in]	in 		The input buffer.
+/// @param[in]	len 	Bytes to read, at most what is left of the frame.
+///
+/// @returns 			0 on success, -1 if out of memory.
+///
+static int _ws_read_frame_direct(ws_t ws, struct evbuffer *in, size_t len)
+{
+	char *dst;
+	int bytes_read;
+
+	// Only the header has arrived so far.
+	if (!len)
+	{
+		return 0;
+	}
+
+	if (_ws_msg_reserve(ws, len))
+	{
+		return -1;
+	}
+
+	dst = ws->msg_data + ws->msg_len + ws->msg_frame_len;
+
+	if ((bytes_read = evbuffer_remove(in, dst, len)) < 0)
+	{
+		return -1;
+	}
+
+	if (ws->header.mask_bit)
+	{
+		ws_unmask_payload(_ws_mask_at(ws->header.mask, ws->recv_frame_len),
+						dst, bytes_read);
+	}
+
+	ws->recv_frame_len += bytes_read;
+	ws->msg_frame_len += bytes_read;
+	_WS_STATS(ws->stats.bytes_in += bytes_read);
+	_WS_STATS(_WS_METRICS(ws->ws_base)->bytes_in += bytes_read);
+
+	LIBWS_LOG(LIBWS_DEBUG2, "read: %d (%llu of %llu bytes)", 
+			bytes_read, ws->recv_frame_len, ws->header.payload_len);
+
+	if (!ws->msg_isbinary)
+	{
+		_ws_validate_utf8(ws, dst, bytes_read);
+	}
+
+	return 0;
+}
+
+///
+/// Reads frame payload into buffers handed out by the application.
+/// See #ws_set_recv_buffer_provider.
+///
+/// @param[in]	ws 		The websocket context.
+/// @param[in]	in 		The input buffer.
+/// @param[in]	len 	Bytes to read, at most what is left of the frame.
+///
+/// @returns 			0 on success, -1 if no buffer was handed out.
+///
+static int _ws_read_frame_provided(ws_t ws, struct evbuffer *in, size_t len)
+{
+	char *dst;
+	int bytes_read;
+	size_t chunk;
+	uint64_t cap;
+
+	while (len)
+	{
+		if (!ws->recv_dst)
+		{
+			cap = ws->header.payload_len - ws->recv_frame_len;
+
+			if (!(ws->recv_dst = ws->cbs->recv_alloc_cb(ws, &cap,
+							ws->msg_isbinary, ws->cbs->recv_buffer_arg))
+				|| !cap)
+			{
+				ws->recv_dst = NULL;
+				return -1;
+			}
+
+			// Never span frames, the mask and fin bit are per frame.
+			if (cap > (ws->header.payload_len - ws->recv_frame_len))
+			{
+				cap = ws->header.payload_len - ws->recv_frame_len;
+			}
+
+			ws->recv_dst_cap = cap;
+			ws->recv_dst_len = 0;
+		}
+
+		chunk = len;
+
+		if (chunk > (ws->recv_dst_cap - ws->recv_dst_len))
+		{
+			chunk = (size_t)(ws->recv_dst_cap - ws->recv_dst_len);
+		}
+
+		dst = ws->recv_dst + ws->recv_dst_len;
+
+		if ((bytes_read = evbuffer_remove(in, dst, chunk)) <= 0)
+		{
+			return -1;
+		}
+
+		if (ws->header.mask_bit)
+		{
+			ws_unmask_payload(_ws_mask_at(ws->header.mask, ws->recv_frame_len),
+							dst, bytes_read);
+		}
+
+		len -= bytes_read;
+		ws->recv_frame_len += bytes_read;
+		ws->recv_dst_len += bytes_read;
+		_WS_STATS(ws->stats.bytes_in += bytes_read);
+		_WS_STATS(_WS_METRICS(ws->ws_base)->bytes_in += bytes_read);
+
+		if (!ws->msg_isbinary)
+		{
+			_ws_validate_utf8(ws, dst, bytes_read);
+		}
+
+		if (ws->recv_dst_len == ws->recv_dst_cap)
+		{
+			dst = ws->recv_dst;
+			ws->recv_dst = NULL;
+
+			ws->cbs->recv_commit_cb(ws, dst, ws->recv_dst_len,
+				ws->msg_isbinary,
+				ws->header.fin && (ws->recv_frame_len == ws->header.payload_len),
+				ws->cbs->recv_buffer_arg);
+		}
 	}
 
 	return 0;
@@ -515,14 +1520,32 @@ int _ws_validate_header(ws_t ws)
 
 void _ws_read_websocket(ws_t ws, struct evbuffer *in)
 {
+	int over_limit;
 	assert(ws);
 	assert(ws->bev);
 	assert(in);
 
 	LIBWS_LOG(LIBWS_DEBUG2, "Read websocket data");
 
-	while (evbuffer_get_length(in))
+	// Stop if the message callback paused reading.
+	while (!ws->read_paused && evbuffer_get_length(in))
 	{
+		over_limit = _ws_check_memory_limit(ws, ws->in_msg
+				? WS_CLOSE_STATUS_MESSAGE_TOO_BIG_1009
+				: WS_CLOSE_STATUS_POLICY_VIOLATION_1008);
+
+		if (ws->recv_too_big)
+		{
+			over_limit = -1;
+		}
+
+		if (over_limit && ws->msg_cap)
+		{
+			// Drop the partial message, it is never delivered.
+			_ws_abort_message(ws, WS_CLOSE_STATUS_MESSAGE_TOO_BIG_1009);
+			ws->in_msg = 1;
+		}
+
 		// First read the websocket header.
 		if (!ws->has_header)
 		{
@@ -555,6 +1578,9 @@ void _ws_read_websocket(ws_t ws, struct evbuffer *in)
 				{
 					ws_header_t *h = &ws->header;
 					ws->has_header = 1;
+					_WS_STATS(ws->stats.frames_in++);
+					_WS_STATS(ws->stats.bytes_in += header_len);
+					_WS_STATS(_WS_METRICS(ws->ws_base)->bytes_in += header_len);
 
 					LIBWS_LOG(LIBWS_DEBUG2, "Got header (%lu bytes):\n"
 						"fin = %d, rsv = {%d,%d,%d}, mask_bit = %d, opcode = 0x%x (%s), "
@@ -568,22 +1594,67 @@ void _ws_read_websocket(ws_t ws, struct evbuffer *in)
 						// TODO: Error! close
 						LIBWS_LOG(LIBWS_ERR, "Failed to drain header buffer");
 					}
+
+					if (_ws_check_recv_limits(ws))
+					{
+						over_limit = -1;
+					}
 					break;
 				}
 				case WS_PARSE_STATE_NEED_MORE:
 					LIBWS_LOG(LIBWS_DEBUG2, " Need more header data");
-					return;
+					goto done;
 				case WS_PARSE_STATE_ERROR:
 					LIBWS_LOG(LIBWS_ERR, "Error protocol violation in header");
 					ws_close_with_status(ws, WS_CLOSE_STATUS_PROTOCOL_ERR_1002);
-					return;
+					goto done;
 				case WS_PARSE_STATE_USER_ABORT:
 					// TODO: What to do here?
 					LIBWS_LOG(LIBWS_ERR, "User abort");
 					break;
 			}
 
-			_ws_handle_frame_begin(ws);
+			if (ws->recv_too_big && !WS_OPCODE_IS_CONTROL(ws->header.opcode))
+			{
+				// Skipped below, don't start a message for it.
+				ws->recv_frame_len = 0;
+				ws->in_msg = 1;
+			}
+			else
+			{
+				_ws_handle_frame_begin(ws);
+			}
+		}
+
+		if (ws->has_header && over_limit
+			&& !WS_OPCODE_IS_CONTROL(ws->header.opcode))
+		{
+			// Skip data frames without buffering them, but keep
+			// parsing control frames so we see the close reply.
+			size_t skip_len = evbuffer_get_length(in);
+			size_t remaining = (size_t)(ws->header.payload_len - ws->recv_frame_len);
+
+			if (skip_len > remaining)
+			{
+				skip_len = remaining;
+			}
+
+			evbuffer_drain(in, skip_len);
+			ws->recv_frame_len += skip_len;
+
+			if (ws->recv_frame_len == ws->header.payload_len)
+			{
+				ws->has_header = 0;
+
+				if (ws->header.fin)
+				{
+					ws->in_msg = 0;
+					ws->recv_msg_len = 0;
+					ws->recv_too_big = 0;
+				}
+			}
+
+			continue;
 		}
 
 		if (ws->has_header)
@@ -605,17 +1676,57 @@ void _ws_read_websocket(ws_t ws, struct evbuffer *in)
 			{
 				_ws_handle_frame_end(ws);
 			}
+			else if (ws->msg_provided
+					&& !WS_OPCODE_IS_CONTROL(ws->header.opcode))
+			{
+				if (_ws_read_frame_provided(ws, in, recv_len))
+				{
+					LIBWS_LOG(LIBWS_ERR, "No receive buffer provided");
+					ws_close_with_status(ws,
+						WS_CLOSE_STATUS_UNEXPECTED_CONDITION_1011);
+					goto done;
+				}
+
+				if (ws->recv_frame_len == ws->header.payload_len)
+				{
+					_ws_handle_frame_end(ws);
+				}
+			}
+			else if (ws->msg_direct
+					&& !WS_OPCODE_IS_CONTROL(ws->header.opcode))
+			{
+				if (_ws_read_frame_direct(ws, in, recv_len))
+				{
+					LIBWS_LOG(LIBWS_CRIT, "Out of memory!");
+					ws_close_with_status(ws,
+						WS_CLOSE_STATUS_UNEXPECTED_CONDITION_1011);
+					goto done;
+				}
+
+				if (ws->recv_frame_len == ws->header.payload_len)
+				{
+					_ws_handle_frame_end(ws);
+				}
+			}
 			else
 			{
 				int bytes_read;
-				char *buf = (char *)_ws_malloc(recv_len);
+				char buf[WS_READ_BUF_SIZE];
+
+				// Anything more is read in the next round of the loop.
+				if (recv_len > sizeof(buf))
+				{
+					recv_len = sizeof(buf);
+				}
 
 				// TODO: Maybe we should only do evbuffer_pullup here instead
 				// and pass that pointer on instead.
 				bytes_read = evbuffer_remove(in, buf, recv_len);
 				ws->recv_frame_len += bytes_read;
+				_WS_STATS(ws->stats.bytes_in += bytes_read);
+				_WS_STATS(_WS_METRICS(ws->ws_base)->bytes_in += bytes_read);
 
-				if (bytes_read != recv_len)
+				if ((size_t)bytes_read != recv_len)
 				{
 					LIBWS_LOG(LIBWS_ERR, "Wanted to read %u but only got %d", 
 							recv_len, bytes_read);
@@ -626,32 +1737,16 @@ void _ws_read_websocket(ws_t ws, struct evbuffer *in)
 
 				if (ws->header.mask_bit)
 				{
-					ws_unmask_payload(ws->header.mask, buf, bytes_read);
+					ws_unmask_payload(_ws_mask_at(ws->header.mask,
+									ws->recv_frame_len - bytes_read),
+									buf, bytes_read);
 				}
 
 				// Validate UTF8 text. Control frames are handled seperately.
 				if (!ws->msg_isbinary 
 				 && !WS_OPCODE_IS_CONTROL(ws->header.opcode))
 				{
-					LIBWS_LOG(LIBWS_DEBUG2, "About to validate UTF8, state = %d"
-							" len = %d", ws->utf8_state, bytes_read);
-
-					ws_utf8_validate(&ws->utf8_state, 
-										buf, bytes_read);
-
-					// Either the UTF8 is invalid, or a codepoint is not
-					// complete in the finish frame.
-					if ((ws->utf8_state == WS_UTF8_REJECT) 
-					|| ((ws->utf8_state != WS_UTF8_ACCEPT) && (ws->header.fin)))
-					{
-						LIBWS_LOG(LIBWS_ERR, "Invalid UTF8!");
-
-						ws_close_with_status(ws, 
-							WS_CLOSE_STATUS_INCONSISTENT_DATA_1007);
-					}
-
-					LIBWS_LOG(LIBWS_DEBUG2, "Validated UTF8, state = %d", 
-							ws->utf8_state);
+					_ws_validate_utf8(ws, buf, bytes_read);
 				}
 
 				if (_ws_handle_frame_data(ws, buf, bytes_read))
@@ -671,23 +1766,21 @@ void _ws_read_websocket(ws_t ws, struct evbuffer *in)
 						_ws_handle_frame_end(ws);
 					}
 				}
-
-				_ws_free(buf);
 			}
 		}
 	}
 
+done:
+	// Answer the latest of the pings read above, also when
+	// the input ends in the middle of a frame.
+	_ws_flush_pong(ws);
+
 	LIBWS_LOG(LIBWS_DEBUG, "    %lu bytes left after websocket read", 
 			evbuffer_get_length(in));
 }
 
-///
-/// Libevent bufferevent callback for when there is data to be read
-/// on the websocket socket.
-///
-static void _ws_read_callback(struct bufferevent *bev, void *ptr)
+static void _ws_handle_read(ws_t ws, struct bufferevent *bev)
 {
-	ws_t ws = (ws_t)ptr;
 	struct evbuffer *in;
 	assert(ws);
 	assert(bev);
@@ -696,6 +1789,12 @@ static void _ws_read_callback(struct bufferevent *bev, void *ptr)
 	LIBWS_LOG(LIBWS_DEBUG, "Read callback");
 
 	in = bufferevent_get_input(ws->bev);
+	_WS_STATS_MAX(ws->stats.peak_in_queue_bytes, evbuffer_get_length(in));
+
+	if (_ws_timer_pending(&ws->keepalive_timer))
+	{
+		event_base_gettimeofday_cached(ws->ws_base->ev_base, &ws->last_recv);
+	}
 
 	if (ws->connect_state != WS_CONNECT_STATE_HANDSHAKE_COMPLETE)
 	{
@@ -707,18 +1806,42 @@ static void _ws_read_callback(struct bufferevent *bev, void *ptr)
 		switch ((state = _ws_read_server_handshake_reply(ws, in)))
 		{
 			case WS_PARSE_STATE_ERROR:
-				// TODO: Do anything else here?
+			{
 				_ws_shutdown(ws);
-				break;
+				_ws_set_state(ws, WS_STATE_CLOSED_UNCLEANLY);
+				_WS_STATS(_WS_METRICS(ws->ws_base)->handshake_failures[
+							WS_HANDSHAKE_FAIL_REPLY]++);
+				_WS_STATS(_WS_METRICS(ws->ws_base)->closes[
+							_ws_metrics_close_index(WS_CLOSE_STATUS_ABNORMAL_1006)]++);
+
+				if (ws->cbs->close_cb)
+				{
+					char reason[] = "Handshake failed";
+					ws->cbs->close_cb(ws, WS_CLOSE_STATUS_ABNORMAL_1006,
+								reason, sizeof(reason), ws->cbs->close_arg);
+				}
+
+				return;
+			}
 			case WS_PARSE_STATE_NEED_MORE: return;
 			case WS_PARSE_STATE_SUCCESS:
 			{
-				ws->state = WS_STATE_CONNECTED;
+				// Only needed to validate the reply.
+				_ws_free(ws->handshake_key_base64);
+				ws->handshake_key_base64 = NULL;
 
-				if (ws->connect_cb)
+				_ws_set_state(ws, WS_STATE_CONNECTED);
+				_WS_STATS(_WS_METRICS(ws->ws_base)->handshakes++);
+
+				if (_ws_keepalive_start(ws))
+				{
+					LIBWS_LOG(LIBWS_ERR, "Failed to start keepalive pings");
+				}
+
+				if (ws->cbs->connect_cb)
 				{
 					LIBWS_LOG(LIBWS_DEBUG, "Calling connect callback");
-					ws->connect_cb(ws, ws->connect_arg);
+					ws->cbs->connect_cb(ws, ws->cbs->connect_arg);
 				}
 			}
 			case WS_PARSE_STATE_USER_ABORT:
@@ -731,6 +1854,26 @@ static void _ws_read_callback(struct bufferevent *bev, void *ptr)
 	_ws_read_websocket(ws, in);
 }
 
+///
+/// Libevent bufferevent callback for when there is data to be read
+/// on the websocket socket.
+///
+static void _ws_read_callback(struct bufferevent *bev, void *ptr)
+{
+	ws_t ws = (ws_t)ptr;
+	ws_t prev_log = _ws_log_enter(ws);
+	#ifdef LIBWS_WITH_MEMORY_ACCOUNTING
+	ws_mem_account_t *prev = _ws_mem_enter(ws->mem);
+	#endif
+
+	_ws_handle_read(ws, bev);
+
+	#ifdef LIBWS_WITH_MEMORY_ACCOUNTING
+	_ws_mem_leave(prev);
+	#endif
+	_ws_log_leave(prev_log);
+}
+
 ///
 /// Libevent bufferevent callback for when a write is done on
 /// the websocket socket.
@@ -744,6 +1887,58 @@ static void _ws_write_callback(struct bufferevent *bev, void *ptr)
 	LIBWS_LOG(LIBWS_DEBUG, "Write callback");
 }
 
+static void _ws_event_callback(struct bufferevent *bev, short events, void *ptr);
+
+///
+/// Fails a connection attempt after the TCP connection is made
+/// but before the websocket handshake could be sent.
+///
+static void _ws_connect_failed(ws_t ws, ws_handshake_failure_t failure,
+								const char *reason)
+{
+	assert(ws);
+
+	_ws_shutdown(ws);
+	_ws_set_state(ws, WS_STATE_CLOSED_UNCLEANLY);
+	_WS_STATS(_WS_METRICS(ws->ws_base)->handshake_failures[failure]++);
+	_WS_STATS(_WS_METRICS(ws->ws_base)->closes[
+				_ws_metrics_close_index(WS_CLOSE_STATUS_ABNORMAL_1006)]++);
+
+	if (ws->cbs->close_cb)
+	{
+		ws->cbs->close_cb(ws, WS_CLOSE_STATUS_ABNORMAL_1006,
+					reason, strlen(reason) + 1, ws->cbs->close_arg);
+	}
+}
+
+#ifdef LIBWS_WITH_OPENSSL
+///
+/// Starts the TLS handshake and sends the websocket handshake as
+/// early data, then reads from the new OpenSSL bufferevent.
+///
+static void _ws_send_early_data(evutil_socket_t fd, short what, void *arg)
+{
+	ws_t ws = (ws_t)arg;
+	assert(ws);
+
+	switch (_ws_openssl_send_early_data(ws, _ws_send_early_data))
+	{
+		case -1:
+			_ws_connect_failed(ws, WS_HANDSHAKE_FAIL_TLS,
+								"Failed to send early data");
+			return;
+		case 1:
+			// Called again once the socket is ready.
+			return;
+	}
+
+	bufferevent_setcb(ws->bev, _ws_read_callback, _ws_write_callback,
+					_ws_event_callback, (void *)ws);
+	bufferevent_enable(ws->bev,
+			ws->read_paused ? EV_WRITE : (EV_READ | EV_WRITE));
+}
+#endif // LIBWS_WITH_OPENSSL
+
 static void _ws_connected_event(struct bufferevent *bev, short events, void *arg)
 {
 	ws_t ws = (ws_t)arg;
@@ -751,19 +1946,31 @@ static void _ws_connected_event(struct bufferevent *bev, short events, void *arg
 	char buf[1024];
 	LIBWS_LOG(LIBWS_DEBUG, "Connected to %s", ws_get_uri(ws, buf, sizeof(buf)));
 
-	if (ws->connect_timeout_event)
+	#ifdef LIBWS_WITH_OPENSSL
+	// Only the TCP connection is done, start the TLS handshake.
+	if (ws->ssl_early_data_pending)
 	{
-		LIBWS_LOG(LIBWS_DEBUG, "Freeing connect timeout event");
-		event_free(ws->connect_timeout_event);
-		ws->connect_timeout_event = NULL;
+		_ws_send_early_data(-1, 0, ws);
+		return;
 	}
+	#endif // LIBWS_WITH_OPENSSL
+
+	LIBWS_LOG(LIBWS_DEBUG, "Cancelling connect timeout");
+	_ws_timer_del(&ws->ws_base->timers, &ws->connect_timeout_timer);
 
-	bufferevent_enable(ws->bev, EV_READ | EV_WRITE);
+	bufferevent_enable(ws->bev,
+			ws->read_paused ? EV_WRITE : (EV_READ | EV_WRITE));
 
 	#ifdef LIBWS_WITH_OPENSSL
+	if (ws->ssl)
 	{
 		int rc = SSL_get_verify_result(ws->ssl);
 
+		ws->ssl_session_reused = SSL_session_reused(ws->ssl);
+
+		LIBWS_LOG(LIBWS_DEBUG, "SSL session %s",
+				ws->ssl_session_reused ? "resumed" : "negotiated");
+
 		if(rc != X509_V_OK) 
 		{
   			if (rc == X509_V_ERR_DEPTH_ZERO_SELF_SIGNED_CERT 
@@ -773,6 +1980,19 @@ static void _ws_connected_event(struct bufferevent *bev, short events, void *arg
   				// TODO: Fail if use_ssl is not set to allow self-signed.
   			}
   		}
+
+		// The handshake was already sent as early data.
+		if (ws->ssl_early_data_buf)
+		{
+			if (_ws_openssl_finish_early_data(ws, bufferevent_get_output(ws->bev)))
+			{
+				LIBWS_LOG(LIBWS_ERR, "Failed to send handshake");
+				_ws_connect_failed(ws, WS_HANDSHAKE_FAIL_TLS,
+									"Failed to send handshake");
+			}
+
+			return;
+		}
 	}
 	#endif
 
@@ -781,6 +2001,8 @@ static void _ws_connected_event(struct bufferevent *bev, short events, void *arg
 	if (_ws_send_handshake(ws, bufferevent_get_output(ws->bev)))
 	{
 		LIBWS_LOG(LIBWS_ERR, "Failed to assemble handshake");
+		_ws_connect_failed(ws, WS_HANDSHAKE_FAIL_CONNECT,
+							"Failed to assemble handshake");
 		return;
 	}
 }
@@ -789,6 +2011,8 @@ static void _ws_eof_event(struct bufferevent *bev, short events, void *ptr)
 {
 	ws_t ws = (ws_t)ptr;
 	ws_close_status_t status;
+	const char *reason = NULL;
+	size_t reason_len = 0;
 	struct evbuffer *in;
 	assert(ws);
 
@@ -803,8 +2027,6 @@ static void _ws_eof_event(struct bufferevent *bev, short events, void *ptr)
 		_ws_read_websocket(ws, in);
 	}
 
-	status = ws->server_close_status;
-
 	LIBWS_LOG(LIBWS_DEBUG, "Sent close frame %s, received close frame %s", 
 							ws->sent_close ? "TRUE" : "FALSE", 
 							ws->received_close ? "TRUE" : "FALSE");
@@ -813,19 +2035,30 @@ static void _ws_eof_event(struct bufferevent *bev, short events, void *ptr)
 
 	if (!ws->received_close)
 	{
-		ws->state = WS_STATE_CLOSED_UNCLEANLY;
+		_ws_set_state(ws, WS_STATE_CLOSED_UNCLEANLY);
 		status = WS_CLOSE_STATUS_ABNORMAL_1006;
 	}
+	else
+	{
+		// The close frame allocated the cold state.
+		_ws_set_state(ws, WS_STATE_CLOSED_CLEANLY);
+		status = ws->cold->server_close_status;
+		reason = ws->cold->server_reason;
+		reason_len = ws->cold->server_reason_len;
+	}
 
-	if (ws->close_cb)
+	_WS_STATS(_WS_METRICS(ws->ws_base)->closes[
+				_ws_metrics_close_index(status)]++);
+
+	if (ws->cbs->close_cb)
 	{
 		LIBWS_LOG(LIBWS_DEBUG, "Call close callback");
 
-		ws->close_cb(ws, 
+		ws->cbs->close_cb(ws, 
 			status,
-			ws->server_reason,
-			ws->server_reason_len,
-			ws->close_arg);
+			reason,
+			reason_len,
+			ws->cbs->close_arg);
 	}
 	else
 	{
@@ -837,11 +2070,28 @@ static void _ws_error_event(struct bufferevent *bev, short events, void *ptr)
 {
 	const char *err_msg;
 	int err;
+	ws_close_status_t status;
 	ws_t ws = (ws_t)ptr;
 	assert(ws);
 
 	LIBWS_LOG(LIBWS_DEBUG, "Error raised");
 
+	#ifdef LIBWS_WITH_STATS
+	if (ws->connect_state != WS_CONNECT_STATE_HANDSHAKE_COMPLETE)
+	{
+		ws_handshake_failure_t reason = WS_HANDSHAKE_FAIL_CONNECT;
+
+		#ifdef LIBWS_WITH_OPENSSL
+		if (ws->ssl && bufferevent_get_openssl_error(bev))
+		{
+			reason = WS_HANDSHAKE_FAIL_TLS;
+		}
+		#endif
+
+		_WS_METRICS(ws->ws_base)->handshake_failures[reason]++;
+	}
+	#endif // LIBWS_WITH_STATS
+
 	if (ws->state == WS_STATE_DNS_LOOKUP)
 	{
 		err = bufferevent_socket_get_dns_error(ws->bev);
@@ -859,23 +2109,25 @@ static void _ws_error_event(struct bufferevent *bev, short events, void *ptr)
 		// See if the serve closed on us.
 		_ws_read_websocket(ws, bufferevent_get_input(ws->bev));
 
-		if (!ws->received_close)
-		{
-			ws->server_close_status = WS_CLOSE_STATUS_ABNORMAL_1006;
-		}
+		status = ws->received_close ? ws->cold->server_close_status
+									: WS_CLOSE_STATUS_ABNORMAL_1006;
+
+		_ws_set_state(ws, WS_STATE_CLOSED_UNCLEANLY);
+		_WS_STATS(_WS_METRICS(ws->ws_base)->closes[
+					_ws_metrics_close_index(status)]++);
 
-		if (ws->close_cb)
+		if (ws->cbs->close_cb)
 		{
 			LIBWS_LOG(LIBWS_ERR, "Abnormal close by server");
-			ws->close_cb(ws, ws->server_close_status, 
-				err_msg, strlen(err_msg), ws->close_arg);
+			ws->cbs->close_cb(ws, status, 
+				err_msg, strlen(err_msg), ws->cbs->close_arg);
 		}
 	}
 
 	// TODO: Should there even be an erro callback?
-	if (ws->err_cb)
+	if (ws->cbs->err_cb)
 	{
-		ws->err_cb(ws, err, err_msg, ws->err_arg);
+		ws->cbs->err_cb(ws, err, err_msg, ws->cbs->err_arg);
 	}
 	else
 	{
@@ -883,13 +2135,8 @@ static void _ws_error_event(struct bufferevent *bev, short events, void *ptr)
 	}
 }
 
-///
-/// Libevent bufferevent callback for when an event occurs on
-/// the websocket socket.
-///
-static void _ws_event_callback(struct bufferevent *bev, short events, void *ptr)
+static void _ws_handle_event(ws_t ws, struct bufferevent *bev, short events)
 {
-	ws_t ws = (ws_t)ptr;
 	assert(ws);
 
 	if (events & BEV_EVENT_CONNECTED)
@@ -926,6 +2173,26 @@ static void _ws_event_callback(struct bufferevent *bev, short events, void *ptr)
 	}
 }
 
+///
+/// Libevent bufferevent callback for when an event occurs on
+/// the websocket socket.
+///
+static void _ws_event_callback(struct bufferevent *bev, short events, void *ptr)
+{
+	ws_t ws = (ws_t)ptr;
+	ws_t prev_log = _ws_log_enter(ws);
+	#ifdef LIBWS_WITH_MEMORY_ACCOUNTING
+	ws_mem_account_t *prev = _ws_mem_enter(ws->mem);
+	#endif
+
+	_ws_handle_event(ws, bev, events);
+
+	#ifdef LIBWS_WITH_MEMORY_ACCOUNTING
+	_ws_mem_leave(prev);
+	#endif
+	_ws_log_leave(prev_log);
+}
+
 int _ws_create_bufferevent_socket(ws_t ws)
 {
 	int ret = 0;
@@ -958,6 +2225,11 @@ int _ws_create_bufferevent_socket(ws_t ws)
 	bufferevent_setcb(ws->bev, _ws_read_callback, _ws_write_callback, 
 					_ws_event_callback, (void *)ws);
 
+	if (ws->read_watermark)
+	{
+		bufferevent_setwatermark(ws->bev, EV_READ, 0, ws->read_watermark);
+	}
+
 	return ret;
 fail:
 	if (ws->bev)
@@ -984,6 +2256,9 @@ static void _ws_builtin_no_copy_cleanup_wrapper(const void *data,
 
 int _ws_send_data(ws_t ws, char *msg, uint64_t len, int no_copy)
 {
+	#ifdef LIBWS_WITH_MEMORY_ACCOUNTING
+	ws_mem_account_t *prev_mem;
+	#endif
 	// TODO: We supply a len of uint64_t, evbuffer_add uses size_t...
 	assert(ws);
 
@@ -995,6 +2270,15 @@ int _ws_send_data(ws_t ws, char *msg, uint64_t len, int no_copy)
 		return -1;
 	}
 
+	#ifdef LIBWS_WITH_OPENSSL
+	_ws_openssl_start_record_policy(ws);
+	#endif
+
+	#ifdef LIBWS_WITH_MEMORY_ACCOUNTING
+	// The send buffer belongs to the connection.
+	prev_mem = _ws_mem_enter(ws->mem);
+	#endif
+
 	// If in no copy mode we only add a reference to the passed
 	// buffer to the underlying bufferevent, and let it use the
 	// user supplied cleanup function when it has sent the data.
@@ -1005,7 +2289,7 @@ int _ws_send_data(ws_t ws, char *msg, uint64_t len, int no_copy)
 			(void *)msg, (size_t)len, _ws_builtin_no_copy_cleanup_wrapper, (void *)ws))
 		{
 			LIBWS_LOG(LIBWS_ERR, "Failed to write reference to send buffer");
-			return -1;
+			goto fail;
 		}
 	}
 	else
@@ -1015,17 +2299,33 @@ int _ws_send_data(ws_t ws, char *msg, uint64_t len, int no_copy)
 						msg, (size_t)len))
 		{
 			LIBWS_LOG(LIBWS_ERR, "Failed to write to send buffer");
-			return -1;
+			goto fail;
 		}
 	}
 
+	#ifdef LIBWS_WITH_MEMORY_ACCOUNTING
+	_ws_mem_leave(prev_mem);
+	#endif
+
+	_WS_STATS(ws->stats.bytes_out += len);
+	_WS_STATS(_WS_METRICS(ws->ws_base)->bytes_out += len);
+	_WS_STATS_MAX(ws->stats.peak_out_queue_bytes,
+				evbuffer_get_length(bufferevent_get_output(ws->bev)));
+
 	return 0;
+fail:
+	#ifdef LIBWS_WITH_MEMORY_ACCOUNTING
+	_ws_mem_leave(prev_mem);
+	#endif
+
+	return -1;
 }
 
 int _ws_send_frame_raw(ws_t ws, ws_opcode_t opcode, char *data, uint64_t datalen)
 {
 	uint8_t header_buf[WS_HDR_MAX_SIZE];
 	size_t header_len = 0;
+	ws_header_t header;
 
 	assert(ws);
 
@@ -1046,12 +2346,13 @@ int _ws_send_frame_raw(ws_t ws, ws_opcode_t opcode, char *data, uint64_t datalen
 		return -1;
 	}
 
-	// Pack and send header.
+	// Pack and send header. This is kept apart from ws->header since
+	// we might be sending in the middle of receiving a frame.
 	{
-		memset(&ws->header, 0, sizeof(ws_header_t));
+		memset(&header, 0, sizeof(ws_header_t));
 
-		ws->header.fin = 0x1;
-		ws->header.opcode = opcode;
+		header.fin = 0x1;
+		header.opcode = opcode;
 		
 		if (datalen > WS_MAX_PAYLOAD_LEN)
 		{
@@ -1061,35 +2362,49 @@ int _ws_send_frame_raw(ws_t ws, ws_opcode_t opcode, char *data, uint64_t datalen
 			return -1;
 		}
 
-		ws->header.mask_bit = 0x1;
-		ws->header.payload_len = datalen;
+		header.mask_bit = 0x1;
+		header.payload_len = datalen;
 
-		if (_ws_get_random_mask(ws, (char *)&ws->header.mask, sizeof(uint32_t)) 
+		if (_ws_get_random_mask(ws, (char *)&header.mask, sizeof(uint32_t)) 
 			!= sizeof(uint32_t))
 		{
 		 	return -1;
 		}
 
-		ws_pack_header(&ws->header, header_buf, sizeof(header_buf), &header_len);
+		ws_pack_header(&header, header_buf, sizeof(header_buf), &header_len);
 		
 		if (_ws_send_data(ws, (char *)header_buf, (uint64_t)header_len, 0))
 		{
 			LIBWS_LOG(LIBWS_ERR, "Failed to send frame header");
 			return -1;
 		}
+
+		_WS_STATS(ws->stats.frames_out++);
 	}
 
 	// Send the data.
 	{
-		ws_mask_payload(ws->header.mask, data, datalen);
+		ws_mask_payload(header.mask, data, datalen);
 
-		if (_ws_send_data(ws, data, datalen, 1))
+		// Control frame payloads are usually on the stack, so
+		// those are always copied.
+		if (_ws_send_data(ws, data, datalen, !WS_OPCODE_IS_CONTROL(opcode)))
 		{
 			LIBWS_LOG(LIBWS_ERR, "Failed to send frame data");
 			return -1;
 		}
 	}
 
+	_WS_STATS(_ws_stats_count_msg(ws, opcode, datalen, 1));
+
+	// The frame is queued either way, but don't let a peer that
+	// doesn't read make us run out of memory. This is only done
+	// between frames so the close frame can't end up inside one.
+	if (ws->send_state == WS_SEND_STATE_NONE)
+	{
+		_ws_check_memory_limit(ws, WS_CLOSE_STATUS_POLICY_VIOLATION_1008);
+	}
+
 	return 0;
 }
 
@@ -1099,11 +2414,9 @@ void _ws_shutdown(ws_t ws)
 
 	LIBWS_LOG(LIBWS_TRACE, "Websocket shutdown");
 
-	if (ws->connect_timeout_event)
-	{
-		event_free(ws->connect_timeout_event);
-		ws->connect_timeout_event = NULL;
-	}
+	_ws_destroy_timers(ws);
+	_ws_drop_pong(ws);
+	ws->keepalive_waiting = 0;
 
 	#ifdef LIBWS_WITH_OPENSSL
 	_ws_openssl_close(ws);
@@ -1122,7 +2435,7 @@ void _ws_shutdown(ws_t ws)
 	LIBWS_LOG(LIBWS_TRACE, "End");
 }
 
-void _ws_close_timeout_cb(evutil_socket_t fd, short what, void *arg)
+void _ws_close_timeout_cb(void *arg)
 {
 	ws_t ws = (ws_t)arg;
 	assert(ws);
@@ -1148,7 +2461,68 @@ void _ws_close_timeout_cb(evutil_socket_t fd, short what, void *arg)
 	LIBWS_LOG(LIBWS_ERR, "Initiating an unclean close");
 
 	_ws_shutdown(ws);
+	_ws_set_state(ws, WS_STATE_CLOSED_UNCLEANLY);
+	_WS_STATS(_WS_METRICS(ws->ws_base)->closes[
+				_ws_metrics_close_index(WS_CLOSE_STATUS_ABNORMAL_1006)]++);
+
+	if (ws->cbs->close_cb)
+	{
+		char reason[] = "Close timeout";
+		ws->cbs->close_cb(ws, WS_CLOSE_STATUS_ABNORMAL_1006,
+					reason, sizeof(reason), ws->cbs->close_arg);
+	}
+}
+
+void _ws_set_state(ws_t ws, ws_state_t state)
+{
+	#ifdef LIBWS_WITH_STATS
+	ws_metrics_shard_t *m = _WS_METRICS(ws->ws_base);
+	m->connections[ws->state]--;
+	m->connections[state]++;
+	#endif
+
+	ws->state = state;
+}
+
+#ifdef LIBWS_WITH_STATS
+void _ws_stats_count_msg(ws_t ws, ws_opcode_t opcode, uint64_t len, int out)
+{
+	ws_stats_t *s = &ws->stats;
+
+	switch (opcode)
+	{
+		case WS_OPCODE_TEXT_0X1:
+		case WS_OPCODE_BINARY_0X2:
+		{
+			if (out)
+			{
+				_WS_METRICS(ws->ws_base)->msgs_out++;
+				if (opcode == WS_OPCODE_TEXT_0X1) s->text_msgs_out++;
+				else s->binary_msgs_out++;
+				_WS_STATS_MAX(s->largest_msg_out, len);
+			}
+			else
+			{
+				_WS_METRICS(ws->ws_base)->msgs_in++;
+				if (opcode == WS_OPCODE_TEXT_0X1) s->text_msgs_in++;
+				else s->binary_msgs_in++;
+				_WS_STATS_MAX(s->largest_msg_in, len);
+			}
+			break;
+		}
+		case WS_OPCODE_PING_0X9:
+			if (out) s->pings_out++; else s->pings_in++;
+			break;
+		case WS_OPCODE_PONG_0XA:
+			if (out) s->pongs_out++; else s->pongs_in++;
+			break;
+		case WS_OPCODE_CLOSE_0X8:
+			if (out) s->closes_out++; else s->closes_in++;
+			break;
+		default: break;
+	}
 }
+#endif // LIBWS_WITH_STATS
 
 int _ws_send_close(ws_t ws, ws_close_status_t status_code, 
 					const char *reason, size_t reason_len)
@@ -1210,10 +2584,31 @@ int _ws_get_random_mask(ws_t ws, char *buf, size_t len)
 	return i;
 }
 
+static void _ws_common_timeout(ws_t ws, const struct timeval *tv,
+								struct timeval *common)
+{
+	const struct timeval *c = NULL;
+
+	if (evutil_timerisset(tv))
+	{
+		c = event_base_init_common_timeout(ws->ws_base->ev_base, tv);
+	}
+
+	// Libevent only supports a limited number of common timeouts.
+	*common = c ? *c : *tv;
+}
+
 void _ws_set_timeouts(ws_t ws)
 {
+	struct timeval recv_timeout;
+	struct timeval send_timeout;
 	assert(ws);
-	assert(ws->bev);
+
+	// Set when connecting.
+	if (!ws->bev)
+	{
+		return;
+	}
 
 	// TODO: Maybe a workaround for this problem?:
 	// Setting a timeout to NULL is supposed to remove it; 
@@ -1223,7 +2618,42 @@ void _ws_set_timeouts(ws_t ws)
 	// and/or having your eventcb function ignore BEV_TIMEOUT 
 	// events when you don’t want them.)
 
-	bufferevent_set_timeouts(ws->bev, &ws->recv_timeout, &ws->send_timeout);
+	// Connections tend to share the same timeouts, libevent keeps
+	// these in a queue instead of its heap, making them O(1).
+	_ws_common_timeout(ws, &ws->recv_timeout, &recv_timeout);
+	_ws_common_timeout(ws, &ws->send_timeout, &send_timeout);
+
+	bufferevent_set_timeouts(ws->bev, &recv_timeout, &send_timeout);
+}
+
+int _ws_check_memory_limit(ws_t ws, ws_close_status_t status)
+{
+	assert(ws);
+
+	#ifdef LIBWS_WITH_MEMORY_ACCOUNTING
+	if (!ws->mem->over_limit)
+	{
+		return 0;
+	}
+
+	if (ws->mem->over_limit == 1)
+	{
+		// Set first, closing sends data which ends up here again.
+		ws->mem->over_limit = 2;
+
+		LIBWS_LOG(LIBWS_WARN, "Memory limit reached, %lu bytes in use "
+				"(limit %lu, base %lu of %lu), closing connection",
+				(unsigned long)ws->mem->bytes, (unsigned long)ws->mem->limit,
+				(unsigned long)ws->ws_base->mem.bytes,
+				(unsigned long)ws->ws_base->mem.limit);
+
+		ws_close_with_status(ws, status);
+	}
+
+	return -1;
+	#else
+	return 0;
+	#endif // LIBWS_WITH_MEMORY_ACCOUNTING
 }
 
 void _ws_destroy_event(struct event **event)
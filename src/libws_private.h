@@ -16,6 +16,10 @@
 #include "libws_header.h"
 #include "libws_utf8.h"
 #include "libws_handshake.h"
+#include "libws_metrics.h"
+#include "libws_histogram.h"
+#include "libws_timer.h"
+#include "libws_alloc.h"
 
 #ifdef _WIN32
 #include <time.h>
@@ -62,128 +66,202 @@ typedef struct ws_base_s
 
     struct event_base *ev_base;  ///< Libevent event base.
     struct evdns_base *dns_base; ///< Libevent DNS base.
+    unsigned int keepalive_seq;  ///< Used to stagger keepalive pings
+                                 /// of different connections.
+    ws_timer_wheel_t timers;     ///< Timeouts for all connections.
+    ws_callbacks_t default_cbs;  ///< Default callbacks, shared by all
+                                 /// connections that don't set their own.
+    ws_allocator_t allocator;    ///< Memory for the connections,
+                                 /// see #ws_base_set_allocator.
+    ws_slab_t conn_slab;         ///< Connection contexts.
+    ws_slab_t cold_slab;         ///< Rarely used connection state.
+    ws_slab_t arena_blocks;      ///< Blocks for the connection arenas.
+    ws_slab_t msg_slab;          ///< Message handles, see #ws_get_msg.
+    struct ws_msg_s *msg_returned;
+                                 ///< Handles released on other threads,
+                                 /// freed by the base thread.
+    const void *msg_thread;      ///< The thread that created the base,
+                                 /// NULL without thread local storage.
+
+    #ifdef LIBWS_WITH_MEMORY_ACCOUNTING
+    ws_mem_account_t mem;        ///< Bytes used by the base and all
+                                 /// of its connections.
+    ws_slab_t mem_slab;          ///< Accounts for the connections.
+    #endif
+
+    #ifdef LIBWS_WITH_STATS
+    ws_metrics_t metrics;        ///< Metrics for all connections.
+    #endif
+
+    #ifdef LIBWS_WITH_OPENSSL
+    ///
+    /// @defgroup BaseOpenSSL OpenSSL variables
+    /// @{
+    ///
+    SSL_CTX *ssl_ctx;           ///< SSL context shared by all connections.
+    int ssl_verify;             ///< Verify the server certificate
+                                /// (set when CA paths are configured).
+    struct ws_ssl_session_s *ssl_sessions;
+                                ///< Client session cache, most
+                                /// recently used first.
+    size_t ssl_session_count;   ///< Number of cached sessions.
+    size_t ssl_session_max;     ///< Max cached sessions, 0 disables.
+    /// @}
+    #endif // LIBWS_WITH_OPENSSL
 } ws_base_s;
 
+///
+/// Connection state that is rarely used, allocated the first
+/// time it is needed so idle connections stay small.
+///
+typedef struct ws_cold_s
+{
+    char *origin;
+    char **subprotocols;
+    size_t num_subprotocols;
+    ws_close_status_t server_close_status; 
+                                ///< The Close status the server sent.
+    char *server_reason;        ///< Server close reason data.
+    size_t server_reason_len;   ///< Server close reason length.
+    char ctrl_payload[WS_CONTROL_MAX_PAYLOAD_LEN + 1];
+                                ///< Control frame payload, with room
+                                /// to NUL terminate a close reason.
+    char pong_payload[WS_CONTROL_MAX_PAYLOAD_LEN];
+                                ///< Payload of the latest ping, waiting
+                                /// for a coalesced pong.
+    size_t pong_len;            ///< Length of ws_cold_s#pong_payload.
+    int pong_pending;           ///< A coalesced pong is waiting to be sent.
+} ws_cold_t;
+
 ///
 /// Context for a websocket connection.
 ///
 typedef struct ws_s
 {
-    struct ws_base_s *ws_base; ///< Base context that this
-                               /// websocket session belongs to.
-
     ///
-    /// @defgroup StateVariables State Variables
+    /// @defgroup HotVariables Hot variables
+    /// Touched for every frame that is sent or received, keep these
+    /// together in the first two cache lines.
     /// @{
     ///
+    struct ws_base_s *ws_base; ///< Base context that this
+                               /// websocket session belongs to.
+    struct bufferevent *bev;    ///< Buffer event socket.
+    ws_callbacks_t *cbs;        ///< Callbacks, possibly shared
+                                /// with other connections.
     ws_state_t state;                 ///< Websocket state.
     ws_connect_state_t connect_state; ///< Connection handshake state.
+    ws_header_t header;         ///< Header for received websocket frame.
+
+    uint64_t recv_frame_len;    ///< The amount of bytes that have been read
+                                /// for the current frame so far.
+    uint64_t recv_msg_len;      ///< Declared length of the frames of the
+                                /// current message so far.
+    int recv_too_big;           ///< A frame went over the receive limits,
+                                /// data frames are skipped until the
+                                /// message ends.
+    int has_header;             ///< Has the websocket header been read yet?
+    int in_msg;                 ///< Are we inside a message?
+    int msg_isbinary;           ///< The opcode of the current message.
+    int msg_direct;             ///< The current message is read straight
+                                /// into ws_s#msg_data, since only the
+                                /// message callback is set.
+    int msg_provided;           ///< The current message is read into buffers
+                                /// from #ws_set_recv_buffer_provider.
+    ws_utf8_state_t utf8_state; ///< Current state of utf8 validator.
+    size_t ctrl_len;            ///< Length of the control payload.
+    uint64_t max_message_size;  ///< Largest message to receive, 0 for no limit.
+    uint64_t max_frame_size_recv;
+                                ///< Largest frame to receive, 0 for no limit.
+    char *msg_data;             ///< The message being received,
+                                /// allocated from ws_s#arena.
+    size_t msg_len;             ///< Bytes of the message so far.
+    size_t msg_cap;             ///< Bytes allocated for ws_s#msg_data.
+    size_t msg_frame_len;       ///< Bytes of the current frame, stored
+                                /// right after the message.
+    ws_arena_t arena;           ///< Scratch for the message being received,
+                                /// reset after the message callback.
+    struct ws_msg_s *msg_handle;
+                                ///< Handle given out for the message
+                                /// being delivered, see #ws_get_msg.
+    int msg_delivering;         ///< In the message callback.
+    char *recv_dst;             ///< The provided buffer being filled.
+    uint64_t recv_dst_len;      ///< Bytes written to ws_s#recv_dst.
+    uint64_t recv_dst_cap;      ///< Size of ws_s#recv_dst.
+    #ifdef LIBWS_WITH_MEMORY_ACCOUNTING
+    ws_mem_account_t *mem;      ///< Bytes used by the connection. Might
+                                /// outlive it until libevent lets go.
+    #endif
+    ws_send_state_t send_state; ///< The state for sending data.
+    int binary_mode;            ///< If this is set messages
+                                /// will be sent as binary.
+    uint64_t frame_size;        ///< The frame size of the frame
+                                /// currently being sent.
+
+    uint64_t frame_data_sent;   ///< The number of bytes sent so
+                                /// far of the current frame.
+    uint64_t max_frame_size;    ///< The max frame size to allow before chunking.
+    ws_no_copy_cleanup_f no_copy_cleanup_cb;
+                                ///< If set, any data written to
+                                /// the websocket will be freed 
+                                /// using this callback.
+    void *no_copy_extra;        ///< User supplied argument for
+                                /// the ws_s#no_copy_cleanup_cb
     void *user_state;
-    /// @}
- 
-    ///
-    /// @defgroup LibeventVariables Libevent Variables
-    /// @{
-    ///
-    struct bufferevent *bev;    ///< Buffer event socket.
+    int received_close;         ///< Did we receive a close frame?
+    int sent_close;             ///< Have we sent a close frame?
     /// @}
 
     ///
-    /// @defgroup Callbacks Callback functions
+    /// @defgroup Timeouts Timeouts
     /// @{
     ///
-    ws_msg_callback_f msg_cb;   ///< Callback for when a message
-                                /// is received on the websocket.
-    void *msg_arg;              ///< The user supplied argument to pass to the
-                                /// the ws_s#msg_cb callback.
-    ws_msg_begin_callback_f msg_begin_cb; ///< Message begin callback.
-    void *msg_begin_arg;        ///< User supplied argument for
-                                /// the ws_s#msg_begin_cb.
-    ws_msg_frame_callback_f msg_frame_cb;
-                                ///< Callback for when a frame in a message 
-                                /// has arrived.
-    void *msg_frame_arg;        ///< User supplied argument for
-                                /// the ws_s#msg_frame_cb.
-    ws_msg_end_callback_f msg_end_cb; ///< Callback for when a message ends.
-    void *msg_end_arg;          ///< User supplied argument for
-                                /// the ws_s#msg_end_cb.
-    ws_msg_frame_begin_callback_f msg_frame_begin_cb; 
-                                ///< Callback for when a frame begins (when the
-                                /// header has been read).
-    void *msg_frame_begin_arg;  ///< User supplied argument
-                                /// for the ws_s#msg_frame_begin_cb
-    ws_msg_frame_data_callback_f msg_frame_data_cb;
-                                ///< Callback for when data
-                                /// in a frame is received.
-    void *msg_frame_data_arg;   ///< User supplied argument for
-                                /// the ws_s#msg_frame_data_cb.
-    ws_msg_frame_end_callback_f msg_frame_end_cb;
-                                ///< Callback for when a frame ends.
-    void *msg_frame_end_arg;    ///< User supplied argument for
-                                /// the ws_s#msg_frame_end_cb.
-    ws_err_callback_f err_cb;   ///< Callback for when an error occurs on 
-                                /// the websocket connection.
-    void *err_arg;              ///< The user supplied argument
-                                /// to pass to the ws_s#error_cb callback.
-    ws_close_callback_f close_cb;
-                                ///< Callback for when the websocket connection
-                                /// is closed.
-    void *close_arg;            ///< The user supplied argument
-                                /// to pass to the ws_s#close_cb
-                                /// callback.
-
-    ///
-    /// @defgroup ConnectionCallback Connection callback
-    /// @{
-    ///
-    ws_connect_callback_f connect_cb;
-                                ///< Callback for when the
-                                /// connection is complete.
-    void *connect_arg;          ///< The user supplied argument
-    ws_timeout_callback_f connect_timeout_cb;
-                                ///< Connection timeout callback.
+    ws_timer_t connect_timeout_timer;
+                                ///< Timer that is fired when the
+                                /// connection times out.
+    ws_timer_t pong_timeout_timer;
+    ws_timer_t close_timeout_timer;
+                                ///< Timeout for waiting for a close reply.
+    ws_timer_t keepalive_timer; ///< Fires for the next ping, or when
+                                /// the outstanding ping times out.
     struct timeval connect_timeout;
                                 ///< Connection timeout.
-    void *connect_timeout_arg;  ///< The user supplied argument that is passed
-                                /// to the ws_s#connect_timeout_cb callback.
-    struct event *connect_timeout_event; 
-                                ///< Libevent event that is fired when the
-                                /// connection times out.
-    /// @}
-
-    ws_timeout_callback_f recv_timeout_cb;
     struct timeval recv_timeout;
-    void *recv_timeout_arg;
-
-    ws_timeout_callback_f send_timeout_cb;
     struct timeval send_timeout;
-    void *send_timeout_arg;
-
-    ///
-    /// @defgroup PongCallback Pong callback
-    /// @{
-    ///
-    ws_msg_callback_f pong_cb;  ///< User supplied callback for
-                                /// when a pong frame is received.
-    void *pong_arg;             ///< The user supplied argument that will be 
-                                /// passed to the pong callback.
-    ws_timeout_callback_f pong_timeout_cb;
-    void *pong_timeout_arg;
     struct timeval pong_timeout;
-    struct event *pong_timeout_event;
     /// @}
 
     ///
-    /// @defgroup PingCallback Ping callback
+    /// @defgroup Keepalive Keepalive pings
     /// @{
     ///
-    ws_msg_callback_f ping_cb;
-    void *ping_arg;
+    struct timeval keepalive_interval;
+                                ///< Time between pings, 0 when disabled.
+    struct timeval keepalive_timeout;
+                                ///< Time to wait for a pong before closing.
+    int keepalive_skip_active;  ///< Don't ping if data was received
+                                /// within the last interval.
+    int keepalive_waiting;      ///< A keepalive ping is waiting for its pong.
+    struct timeval keepalive_sent;
+                                ///< When the outstanding ping was sent.
+    struct timeval last_recv;   ///< When data was last received.
+    uint64_t last_rtt;          ///< The latest round trip time (us).
+    struct ws_histogram_s *rtt; ///< Round trip times, allocated
+                                /// when keepalive is enabled.
     /// @}
 
-    ws_header_callback_f header_cb;
-    void *header_arg;
-    ws_http_header_flags_t http_header_flags;
+    ///
+    /// @defgroup PongCoalescing Coalesced pong replies
+    /// @{
+    ///
+    int pong_coalesce;          ///< Answer only the latest ping of a read,
+                                /// see #ws_set_pong_coalescing.
+    struct timeval pong_interval;
+                                ///< Min time between pongs, 0 for no limit.
+    struct timeval last_pong;   ///< When the last coalesced pong was sent.
+    ws_timer_t pong_reply_timer;
+                                ///< Sends the pending pong once
+                                /// ws_s#pong_interval has passed.
     /// @}
 
     ///
@@ -193,76 +271,162 @@ typedef struct ws_s
     char *server;
     char *uri;
     int port;
-    char *handshake_key_base64;
-    char *origin;
-    char **subprotocols;
-    size_t num_subprotocols;
+    ws_http_header_flags_t http_header_flags;
+    size_t max_handshake_size;  ///< Largest HTTP upgrade response allowed.
+    char *handshake_key_base64; ///< Only kept until the handshake is done.
+    struct ws_cold_s *cold;     ///< Rarely used state, allocated on
+                                /// first use, see _ws_get_cold.
+    struct ws_template_s *tmpl; ///< The template the connection was
+                                /// created from, if any.
     /// @}
 
-    int binary_mode;            ///< If this is set messages
-                                /// will be sent as binary.
-       int debug_level;
-    uint64_t max_frame_size;    ///< The max frame size to allow before chunking.
+    int debug_level;
+
+    struct ev_token_bucket_cfg *rate_limits;
+                                ///< Rate limits.
+    size_t read_watermark;      ///< Stop reading from the socket when this
+                                /// much input is buffered, 0 for no limit.
+    int read_paused;            ///< Reading paused by #ws_pause_read.
 
+    #ifdef LIBWS_WITH_STATS
     ///
-    /// @defgroup FrameReceive Frame receive variables
+    /// @defgroup Stats Traffic statistics
     /// @{
     ///
-    struct evbuffer *msg;       ///< Buffer that is used to
-                                /// build an incoming message.
-    struct evbuffer *frame_data;///< Data for the current frame.
-    uint64_t recv_frame_len;    ///< The amount of bytes that have been read
-                                /// for the current frame so far.
-    int has_header;             ///< Has the websocket header been read yet?
-    ws_header_t header;         ///< Header for received websocket frame.
-    int in_msg;                 ///< Are we inside a message?
-    int msg_isbinary;           ///< The opcode of the current message.
-    ws_utf8_state_t utf8_state; ///< Current state of utf8 validator.
-    char ctrl_payload[WS_CONTROL_MAX_PAYLOAD_LEN];
-                                ///< Control frame payload.
-    size_t ctrl_len;            ///< Length of the control payload.
-    int received_close;         ///< Did we receive a close frame?
-    int sent_close;             ///< Have we sent a close frame?
-    struct event *close_timeout_event; 
-                                ///< Timeout even for waiting for a close reply.
-    ws_close_status_t server_close_status; 
-                                ///< The Close status the server sent.
-    char *server_reason;        ///< Server close reason data.
-    size_t server_reason_len;   ///< Server close reason length.
-    /// @}
-    
-    ///
-    /// @defgroup FrameSend Frame send variables
-    /// @{
-    ///
-    uint64_t frame_size;        ///< The frame size of the frame
-                                /// currently being sent.
-    uint64_t frame_data_sent;   ///< The number of bytes sent so
-                                /// far of the current frame.
-    ws_send_state_t send_state; ///< The state for sending data.
-    ws_no_copy_cleanup_f no_copy_cleanup_cb;
-                                ///< If set, any data written to
-                                /// the websocket will be freed 
-                                /// using this callback.
-    void *no_copy_extra;        ///< User supplied argument for
-                                /// the ws_s#no_copy_cleanup_cb
+    ws_stats_t stats;           ///< Traffic counters, see #ws_get_stats.
+    uint64_t stats_msg_in_len;  ///< Payload received so far
+                                /// for the current message.
+    uint64_t stats_msg_out_len; ///< Payload sent so far
+                                /// for the current message.
     /// @}
+    #endif // LIBWS_WITH_STATS
 
-    struct ev_token_bucket_cfg *rate_limits;
-                                ///< Rate limits.
     #ifdef LIBWS_WITH_OPENSSL
     ///
     /// @defgroup OpenSSL OpenSSL variables
     ///
     libws_ssl_state_t use_ssl;  ///< If SSL should be used or not.
-    SSL_CTX *ssl_ctx;
-    SSL *ssl;                   ///< SSL session.
+    SSL *ssl;                   ///< SSL session. Owned by ws_s#bev
+                                /// once the bufferevent is created.
+    int ssl_session_reused;     ///< Was a cached session resumed
+                                /// for the last connection.
+    int ssl_early_data;         ///< Send the handshake as TLS 1.3
+                                /// early data when resuming.
+    int ssl_early_data_pending; ///< The TCP connection is not yet
+                                /// handed over to OpenSSL, ws_s#ssl
+                                /// is not owned by ws_s#bev.
+    int ssl_early_data_accepted;///< Did the server accept the
+                                /// early data for the last connection.
+    struct evbuffer *ssl_early_data_buf;
+                                ///< The handshake sent as early data,
+                                /// resent if the server rejects it.
+    struct event *ssl_early_data_event;
+                                ///< Waits for the socket when the
+                                /// client hello could not be sent
+                                /// at once. Owns the socket.
+    size_t tls_record_small;    ///< Record size after being idle,
+                                /// 0 disables the record policy.
+    size_t tls_record_large;    ///< Record size for sustained transfer.
+    size_t tls_record_ramp;     ///< Bytes to send using small records
+                                /// before switching to large ones.
+    struct timeval tls_record_idle;
+                                ///< Idle time before going back to
+                                /// small records.
+    size_t tls_record_size;     ///< Current max record size.
+    uint64_t tls_record_sent;   ///< Bytes written since last idle.
+    struct timeval tls_record_last;
+                                ///< When the output was last
+                                /// completely written.
+    struct evbuffer_cb_entry *tls_record_cb;
+                                ///< Applies the record policy as
+                                /// the output is written.
     #endif // LIBWS_WITH_OPENSSL
 } ws_s;
 
+///
+/// Updates the traffic statistics, compiled away
+/// without LIBWS_WITH_STATS.
+///
+#ifdef LIBWS_WITH_STATS
+#define _WS_STATS(stmt) stmt
+#define _WS_STATS_MAX(field, val) if ((val) > (field)) (field) = (val)
+#define _WS_METRICS(base) _ws_metrics_shard(&(base)->metrics)
+#else
+#define _WS_STATS(stmt)
+#define _WS_STATS_MAX(field, val)
+#endif
+
+///
+/// The allocator of a base.
+///
+#define _WS_ALLOCATOR(base) (&(base)->allocator)
+
+///
+/// Size of the stack buffer frame payloads are read into.
+///
+#define WS_READ_BUF_SIZE (16 * 1024)
+
+///
+/// Sets the default callbacks in a callback table.
+///
+/// @param[in] cbs  The callback table.
+///
+void _ws_callbacks_init(ws_callbacks_t *cbs);
+
+///
+/// Gets the rarely used state of a connection,
+/// allocating it the first time.
+///
+/// @param[in] ws   The websocket context.
+///
+/// @returns        The cold state or NULL if out of memory.
+///
+ws_cold_t *_ws_get_cold(ws_t ws);
+
+///
+/// Frees the rarely used state of a connection.
+///
+/// @param[in] ws   The websocket context.
+///
+void _ws_free_cold(ws_t ws);
+
+///
+/// Gets the origin of a connection, falling back
+/// to the one of its template.
+///
+/// @param[in] ws   The websocket context.
+///
+/// @returns        The origin or NULL if none is set.
+///
+const char *_ws_get_origin(ws_t ws);
+
+///
+/// Gets the subprotocols of a connection, falling back
+/// to the ones of its template. The list is not a copy.
+///
+/// @param[in]  ws      The websocket context.
+/// @param[out] count   The number of subprotocols.
+///
+/// @returns            The subprotocols, or NULL if there are none.
+///
+char **_ws_get_subprotocol_list(ws_t ws, size_t *count);
+
+///
+/// Sets up the callbacks of the timers of a connection.
+///
+/// @param[in] ws   The websocket context.
+///
+void _ws_init_timers(ws_t ws);
+
+///
+/// Cancels all timers of a connection.
+///
+/// @param[in] ws   The websocket context.
+///
+void _ws_destroy_timers(ws_t ws);
 
 ///
-/// Creates a timeout event for when connecting.
+/// Arms the timeout for when connecting.
 ///
 /// @param[in] ws   The websocket context.
 ///
@@ -271,7 +435,7 @@ typedef struct ws_s
 int _ws_setup_connection_timeout(ws_t ws);
 
 ///
-/// Creates a timeout event for an expected pong reply.
+/// Arms the timeout for an expected pong reply.
 ///
 /// @param[in] ws   The websocket context.
 ///
@@ -279,6 +443,44 @@ int _ws_setup_connection_timeout(ws_t ws);
 ///
 int _ws_setup_pong_timeout(ws_t ws);
 
+///
+/// Schedules the first keepalive ping for a connection, if
+/// keepalive is enabled. The first ping is staggered within the
+/// interval so that connections started together don't ping together.
+///
+/// @param[in] ws   The websocket context.
+///
+/// @returns        0 on success.
+///
+int _ws_keepalive_start(ws_t ws);
+
+///
+/// Stops any scheduled keepalive ping.
+///
+/// @param[in] ws   The websocket context.
+///
+void _ws_keepalive_stop(ws_t ws);
+
+///
+/// Keeps the payload of a ping to be answered by a coalesced pong,
+/// replacing the one of any earlier ping that is not answered yet.
+///
+/// @param[in] ws   The websocket context.
+/// @param[in] msg  The ping payload.
+/// @param[in] len  Length of the payload.
+///
+/// @returns        0 on success.
+///
+int _ws_queue_pong(ws_t ws, const char *msg, size_t len);
+
+///
+/// Sends the pending coalesced pong, unless one was sent within
+/// ws_s#pong_interval. It is then sent when the interval is up.
+///
+/// @param[in] ws   The websocket context.
+///
+void _ws_flush_pong(ws_t ws);
+
 /// 
 /// Creates the libevent bufferevent socket.
 ///
@@ -318,6 +520,26 @@ int _ws_send_data(ws_t ws, char *msg, uint64_t len, int no_copy);
 int _ws_send_frame_raw(ws_t ws, ws_opcode_t opcode, 
                         char *data, uint64_t datalen);
 
+#ifdef LIBWS_WITH_STATS
+///
+/// Counts a complete message or control frame by its opcode.
+///
+/// @param[in] ws       The websocket context.
+/// @param[in] opcode   The opcode of the first frame of the message.
+/// @param[in] len      The payload length of the message.
+/// @param[in] out      Was the message sent or received?
+///
+void _ws_stats_count_msg(ws_t ws, ws_opcode_t opcode, uint64_t len, int out);
+#endif
+
+///
+/// Sets the state of the connection.
+///
+/// @param[in] ws       The websocket context.
+/// @param[in] state    The new state.
+///
+void _ws_set_state(ws_t ws, ws_state_t state);
+
 ///
 /// Sends a close frame.
 ///
@@ -344,7 +566,7 @@ void _ws_shutdown(ws_t ws);
 /// server. If this times out, we will initiate an unclean shutdown since
 /// the servern hasn't initiated the TCP close.
 ///
-void _ws_close_timeout_cb(evutil_socket_t fd, short what, void *arg);
+void _ws_close_timeout_cb(void *arg);
 
 ///
 /// Randomizes the contents of #buf. This is used for generating
@@ -366,6 +588,25 @@ int _ws_get_random_mask(ws_t ws, char *buf, size_t len);
 /// 
 void _ws_set_timeouts(ws_t ws);
 
+///
+/// Parses the websocket frames in #in and calls the message callbacks.
+///
+/// @param[in] ws      The websocket context.
+/// @param[in] in      The received data, parsed data is drained.
+///
+void _ws_read_websocket(ws_t ws, struct evbuffer *in);
+
+///
+/// Makes room for another extra bytes in the message buffer, after
+/// the message so far and the frame that is being received.
+///
+/// @param[in] ws      The websocket context.
+/// @param[in] extra   Bytes to make room for.
+///
+/// @returns           0 on success, -1 if out of memory.
+///
+int _ws_msg_reserve(ws_t ws, size_t extra);
+
 ///
 /// Replacement malloc.
 ///
@@ -398,6 +639,39 @@ void _ws_set_memory_functions(ws_malloc_replacement_f malloc_replace,
                              ws_free_replacement_f free_replace,
                              ws_realloc_replacement_f realloc_replace);
 
+#ifdef LIBWS_WITH_MEMORY_ACCOUNTING
+///
+/// Makes libevent and OpenSSL allocate through #_ws_malloc,
+/// so their memory is accounted for. Only done once.
+///
+/// @returns 0 on success, -1 if #_ws_freeze_memory_hooks was called.
+///
+int _ws_install_memory_hooks();
+
+///
+/// Called once libws itself has used libevent, after which
+/// the hooks can no longer be installed safely.
+///
+void _ws_freeze_memory_hooks();
+
+///
+/// Frees the blocks #_ws_free keeps around for reuse, see
+/// #_ws_mem_cache_flush_all.
+///
+void _ws_free_cached_memory();
+#endif
+
+///
+/// Closes a connection that went over its memory limit,
+/// or the limit of its base. Only closes it once.
+///
+/// @param[in] ws       The websocket context.
+/// @param[in] status   The close status to use.
+///
+/// @returns 0 if within the limits, -1 if over.
+///
+int _ws_check_memory_limit(ws_t ws, ws_close_status_t status);
+
 ///
 /// Frees and NULLs an libevent event.
 ///
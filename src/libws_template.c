@@ -0,0 +1,354 @@
+
+#include "libws_config.h"
+#include <assert.h>
+#include <string.h>
+#include <event2/buffer.h>
+#include "libws_log.h"
+#include "libws.h"
+#include "libws_private.h"
+#include "libws_handshake.h"
+#include "libws_template.h"
+
+//
+// Templates are shared and outlive the connections that happen
+// to be running when they allocate, so charge them to no one.
+//
+
+static void *_ws_template_malloc(size_t size)
+{
+	void *p;
+	#ifdef LIBWS_WITH_MEMORY_ACCOUNTING
+	ws_mem_account_t *prev = _ws_mem_enter(NULL);
+	#endif
+
+	p = _ws_malloc(size);
+
+	#ifdef LIBWS_WITH_MEMORY_ACCOUNTING
+	_ws_mem_leave(prev);
+	#endif
+
+	return p;
+}
+
+static void *_ws_template_realloc(void *ptr, size_t size)
+{
+	void *p;
+	#ifdef LIBWS_WITH_MEMORY_ACCOUNTING
+	ws_mem_account_t *prev = _ws_mem_enter(NULL);
+	#endif
+
+	p = _ws_realloc(ptr, size);
+
+	#ifdef LIBWS_WITH_MEMORY_ACCOUNTING
+	_ws_mem_leave(prev);
+	#endif
+
+	return p;
+}
+
+static char *_ws_template_strdup(const char *str)
+{
+	char *s;
+	size_t len = strlen(str) + 1;
+
+	if (!(s = (char *)_ws_template_malloc(len)))
+		return NULL;
+
+	memcpy(s, str, len);
+
+	return s;
+}
+
+///
+/// Drops the rendered request, done whenever something
+/// that goes into it changes.
+///
+static void _ws_template_invalidate(ws_template_t tmpl)
+{
+	if (tmpl->req) _ws_free(tmpl->req);
+	if (tmpl->req_server) _ws_free(tmpl->req_server);
+	if (tmpl->req_uri) _ws_free(tmpl->req_uri);
+
+	tmpl->req = NULL;
+	tmpl->req_server = NULL;
+	tmpl->req_uri = NULL;
+	tmpl->req_len = 0;
+	tmpl->req_key_offset = 0;
+	tmpl->req_port = 0;
+}
+
+static int _ws_template_render(ws_template_t tmpl, const char *server,
+								int port, const char *uri)
+{
+	int ret = -1;
+	size_t len;
+	size_t key_offset;
+	struct evbuffer *buf = NULL;
+	#ifdef LIBWS_WITH_MEMORY_ACCOUNTING
+	ws_mem_account_t *prev = _ws_mem_enter(NULL);
+	#endif
+
+	_ws_template_invalidate(tmpl);
+
+	LIBWS_LOG(LIBWS_DEBUG, "Render template handshake for %s:%d/%s",
+							server, port, uri);
+
+	if (!(buf = evbuffer_new()))
+	{
+		goto fail;
+	}
+
+	if (_ws_render_handshake(buf, server, port, uri, tmpl->origin,
+							tmpl->subprotocols, tmpl->num_subprotocols,
+							"", &key_offset))
+	{
+		goto fail;
+	}
+
+	len = evbuffer_get_length(buf);
+
+	if (!(tmpl->req = (char *)_ws_malloc(len))
+		|| !(tmpl->req_server = _ws_strdup(server))
+		|| !(tmpl->req_uri = _ws_strdup(uri)))
+	{
+		goto fail;
+	}
+
+	evbuffer_remove(buf, tmpl->req, len);
+	tmpl->req_len = len;
+	tmpl->req_key_offset = key_offset;
+	tmpl->req_port = port;
+
+	ret = 0;
+
+fail:
+	if (ret)
+	{
+		LIBWS_LOG(LIBWS_ERR, "Failed to render template handshake");
+		_ws_template_invalidate(tmpl);
+	}
+
+	if (buf) evbuffer_free(buf);
+
+	#ifdef LIBWS_WITH_MEMORY_ACCOUNTING
+	_ws_mem_leave(prev);
+	#endif
+
+	return ret;
+}
+
+int _ws_template_send_handshake(ws_template_t tmpl, ws_t ws,
+								struct evbuffer *out)
+{
+	size_t key_len;
+	const char *uri;
+	assert(tmpl);
+	assert(ws);
+	assert(ws->server);
+	assert(ws->handshake_key_base64);
+	assert(out);
+
+	uri = ws->uri ? ws->uri : "";
+
+	if (!tmpl->req
+		|| (tmpl->req_port != ws->port)
+		|| strcmp(tmpl->req_server, ws->server)
+		|| strcmp(tmpl->req_uri, uri))
+	{
+		if (_ws_template_render(tmpl, ws->server, ws->port, uri))
+		{
+			return -1;
+		}
+	}
+
+	key_len = strlen(ws->handshake_key_base64);
+
+	if (evbuffer_expand(out, tmpl->req_len + key_len)
+		|| evbuffer_add(out, tmpl->req, tmpl->req_key_offset)
+		|| evbuffer_add(out, ws->handshake_key_base64, key_len)
+		|| evbuffer_add(out, tmpl->req + tmpl->req_key_offset,
+						tmpl->req_len - tmpl->req_key_offset))
+	{
+		return -1;
+	}
+
+	return 0;
+}
+
+ws_template_t _ws_template_ref(ws_template_t tmpl)
+{
+	assert(tmpl);
+	tmpl->refcount++;
+	return tmpl;
+}
+
+void _ws_template_unref(ws_template_t tmpl)
+{
+	size_t i;
+
+	if (!tmpl)
+		return;
+
+	assert(tmpl->refcount > 0);
+
+	if (--tmpl->refcount > 0)
+		return;
+
+	_ws_template_invalidate(tmpl);
+	ws_callbacks_unref(tmpl->cbs);
+
+	if (tmpl->origin) _ws_free(tmpl->origin);
+
+	for (i = 0; i < tmpl->num_subprotocols; i++)
+	{
+		_ws_free(tmpl->subprotocols[i]);
+	}
+
+	if (tmpl->subprotocols) _ws_free(tmpl->subprotocols);
+
+	_ws_free(tmpl);
+}
+
+int ws_template_new(ws_template_t *tmpl, ws_base_t base)
+{
+	struct ws_template_s *t;
+	assert(tmpl);
+	assert(base);
+
+	if (!(t = (struct ws_template_s *)_ws_template_malloc(sizeof(*t))))
+	{
+		LIBWS_LOG(LIBWS_CRIT, "Out of memory!");
+		*tmpl = NULL;
+		return -1;
+	}
+
+	memset(t, 0, sizeof(*t));
+	t->refcount = 1;
+	t->ws_base = base;
+	t->cbs = ws_callbacks_ref(&base->default_cbs);
+
+	*tmpl = t;
+
+	return 0;
+}
+
+void ws_template_free(ws_template_t *tmpl)
+{
+	if (!tmpl || !(*tmpl))
+		return;
+
+	_ws_template_unref(*tmpl);
+	*tmpl = NULL;
+}
+
+void ws_template_set_callbacks(ws_template_t tmpl, ws_callbacks_t *cbs)
+{
+	ws_callbacks_t *old;
+	assert(tmpl);
+	assert(cbs);
+
+	old = tmpl->cbs;
+	tmpl->cbs = ws_callbacks_ref(cbs);
+	ws_callbacks_unref(old);
+}
+
+ws_callbacks_t *ws_template_get_callbacks(ws_template_t tmpl)
+{
+	assert(tmpl);
+	return tmpl->cbs;
+}
+
+int ws_template_set_origin(ws_template_t tmpl, const char *origin)
+{
+	char *s;
+	assert(tmpl);
+	assert(origin);
+
+	if (!(s = _ws_template_strdup(origin)))
+	{
+		LIBWS_LOG(LIBWS_ERR, "Could not copy origin string. Out of memory!");
+		return -1;
+	}
+
+	if (tmpl->origin) _ws_free(tmpl->origin);
+	tmpl->origin = s;
+
+	_ws_template_invalidate(tmpl);
+
+	return 0;
+}
+
+int ws_template_add_subprotocol(ws_template_t tmpl, const char *subprotocol)
+{
+	char **subprotocols;
+	assert(tmpl);
+	assert(subprotocol);
+
+	if (!(subprotocols = (char **)_ws_template_realloc(tmpl->subprotocols,
+						(tmpl->num_subprotocols + 1) * sizeof(char *))))
+	{
+		LIBWS_LOG(LIBWS_ERR, "Out of memory!");
+		return -1;
+	}
+
+	tmpl->subprotocols = subprotocols;
+
+	if (!(subprotocols[tmpl->num_subprotocols] =
+			_ws_template_strdup(subprotocol)))
+	{
+		LIBWS_LOG(LIBWS_ERR, "Out of memory!");
+		return -1;
+	}
+
+	tmpl->num_subprotocols++;
+
+	_ws_template_invalidate(tmpl);
+
+	return 0;
+}
+
+int ws_template_set_max_frame_size(ws_template_t tmpl, uint64_t max_frame_size)
+{
+	assert(tmpl);
+
+	if (max_frame_size > WS_MAX_PAYLOAD_LEN)
+	{
+		LIBWS_LOG(LIBWS_ERR, "Max frame size cannot exceed max payload length");
+		return -1;
+	}
+
+	tmpl->max_frame_size = max_frame_size;
+
+	return 0;
+}
+
+#ifdef LIBWS_WITH_OPENSSL
+void ws_template_set_ssl_state(ws_template_t tmpl, libws_ssl_state_t ssl)
+{
+	assert(tmpl);
+	tmpl->use_ssl = ssl;
+}
+#endif // LIBWS_WITH_OPENSSL
+
+int ws_init_from_template(ws_t *ws, ws_template_t tmpl)
+{
+	struct ws_s *w;
+	assert(ws);
+	assert(tmpl);
+
+	if (ws_init(ws, tmpl->ws_base))
+	{
+		return -1;
+	}
+
+	w = *ws;
+	w->tmpl = _ws_template_ref(tmpl);
+	ws_set_callbacks(w, tmpl->cbs);
+	w->max_frame_size = tmpl->max_frame_size;
+
+	#ifdef LIBWS_WITH_OPENSSL
+	w->use_ssl = tmpl->use_ssl;
+	#endif
+
+	return 0;
+}
@@ -0,0 +1,80 @@
+
+#ifndef __LIBWS_TEMPLATE_H__
+#define __LIBWS_TEMPLATE_H__
+
+///
+/// @internal
+/// @file libws_template.h
+///
+/// Connection templates. Connections created from a template share
+/// its callbacks, origin and subprotocols by reference, and send a
+/// handshake request that was rendered once with only the key left
+/// to fill in.
+///
+
+#include "libws_config.h"
+#include <stdint.h>
+#include <stddef.h>
+#include <event2/buffer.h>
+#include "libws_types.h"
+
+typedef struct ws_template_s
+{
+    int refcount;               ///< The owner and every connection
+                                /// created from the template.
+    struct ws_base_s *ws_base;  ///< Base the connections belong to.
+    ws_callbacks_t *cbs;        ///< Callbacks for the connections.
+    char *origin;
+    char **subprotocols;
+    size_t num_subprotocols;
+    uint64_t max_frame_size;
+
+    #ifdef LIBWS_WITH_OPENSSL
+    libws_ssl_state_t use_ssl;  ///< If SSL should be used or not.
+    #endif
+
+    ///
+    /// @defgroup TemplateRequest Pre-rendered handshake request
+    /// @{
+    ///
+    char *req;                  ///< The request, without a key.
+    size_t req_len;             ///< Length of ws_template_s#req.
+    size_t req_key_offset;      ///< Where the key goes.
+    char *req_server;           ///< The server it was rendered for.
+    char *req_uri;              ///< The uri it was rendered for.
+    int req_port;               ///< The port it was rendered for.
+    /// @}
+} ws_template_s;
+
+///
+/// Takes a reference to a template.
+///
+/// @param[in] tmpl The template.
+///
+/// @returns        The template.
+///
+ws_template_t _ws_template_ref(ws_template_t tmpl);
+
+///
+/// Releases a reference to a template,
+/// it is freed when the last one is released.
+///
+/// @param[in] tmpl The template.
+///
+void _ws_template_unref(ws_template_t tmpl);
+
+///
+/// Sends the handshake request of a connection created from a
+/// template, rendering the request first if the connection goes
+/// to another server, port or uri than the last one.
+///
+/// @param[in] tmpl The template.
+/// @param[in] ws   The websocket context, with a handshake key.
+/// @param[in] out  The buffer to add the request to.
+///
+/// @returns        0 on success.
+///
+int _ws_template_send_handshake(ws_template_t tmpl, ws_t ws,
+                                struct evbuffer *out);
+
+#endif // __LIBWS_TEMPLATE_H__
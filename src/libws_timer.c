@@ -0,0 +1,417 @@
+#include "libws_config.h"
+#include <assert.h>
+#include <string.h>
+#include "libws_log.h"
+#include "libws_timer.h"
+
+#define WS_TIMER_RESOLUTION_US (WS_TIMER_RESOLUTION_MS * 1000)
+
+static void _ws_timer_list_init(ws_timer_t *head)
+{
+	head->next = head;
+	head->prev = head;
+}
+
+static void _ws_timer_link(ws_timer_t *head, ws_timer_t *timer)
+{
+	timer->next = head;
+	timer->prev = head->prev;
+	head->prev->next = timer;
+	head->prev = timer;
+}
+
+static void _ws_timer_unlink(ws_timer_t *timer)
+{
+	timer->prev->next = timer->next;
+	timer->next->prev = timer->prev;
+	timer->next = NULL;
+	timer->prev = NULL;
+}
+
+///
+/// Gets the current tick, counted from when the wheel was created.
+///
+static uint64_t _ws_timer_wheel_tick(ws_timer_wheel_t *wheel)
+{
+	struct timeval now;
+	struct timeval elapsed;
+
+	evutil_gettime_monotonic(wheel->clock, &now);
+	evutil_timersub(&now, &wheel->start, &elapsed);
+
+	return (((uint64_t)elapsed.tv_sec * 1000000) + (uint64_t)elapsed.tv_usec)
+			/ WS_TIMER_RESOLUTION_US;
+}
+
+///
+/// Makes sure the tick event fires no later than the given tick.
+///
+static int _ws_timer_wheel_schedule(ws_timer_wheel_t *wheel, uint64_t tick)
+{
+	uint64_t at_us;
+	struct timeval at;
+	struct timeval now;
+	struct timeval delay;
+
+	if (wheel->scheduled && (wheel->scheduled <= tick))
+	{
+		return 0;
+	}
+
+	at_us = tick * WS_TIMER_RESOLUTION_US;
+	at.tv_sec = (long)(at_us / 1000000);
+	at.tv_usec = (long)(at_us % 1000000);
+	evutil_timeradd(&at, &wheel->start, &at);
+
+	evutil_gettime_monotonic(wheel->clock, &now);
+
+	if (evutil_timercmp(&at, &now, >))
+	{
+		evutil_timersub(&at, &now, &delay);
+	}
+	else
+	{
+		evutil_timerclear(&delay);
+	}
+
+	if (event_add(wheel->tick_event, &delay))
+	{
+		LIBWS_LOG(LIBWS_ERR, "Failed to add timer wheel event");
+		return -1;
+	}
+
+	wheel->scheduled = tick;
+
+	return 0;
+}
+
+///
+/// Puts a timer in the slot for its expiry, relative to the
+/// current tick of the wheel.
+///
+/// @returns The tick the slot is due, when it expires or
+///          when it is cascaded to a lower level.
+///
+static uint64_t _ws_timer_wheel_insert(ws_timer_wheel_t *wheel,
+										ws_timer_t *timer)
+{
+	int level;
+	int shift = 0;
+	uint64_t expires = timer->expires;
+
+	if ((expires - wheel->now) >= WS_TIMER_WHEEL_SPAN)
+	{
+		expires = wheel->now + WS_TIMER_WHEEL_SPAN - 1;
+	}
+
+	for (level = 0; level < (WS_TIMER_WHEEL_LEVELS - 1); level++)
+	{
+		if ((expires - wheel->now)
+			< ((uint64_t)1 << (shift + WS_TIMER_WHEEL_BITS)))
+		{
+			break;
+		}
+
+		shift += WS_TIMER_WHEEL_BITS;
+	}
+
+	_ws_timer_link(&wheel->slots[level]
+					[(expires >> shift) & WS_TIMER_WHEEL_MASK], timer);
+
+	return (expires >> shift) << shift;
+}
+
+///
+/// Moves the timers of the current slot on a level to the levels below.
+///
+static void _ws_timer_wheel_cascade(ws_timer_wheel_t *wheel, int level)
+{
+	ws_timer_t *head;
+	ws_timer_t *timer;
+	ws_timer_t cascaded;
+
+	head = &wheel->slots[level][(wheel->now >> (level * WS_TIMER_WHEEL_BITS))
+								& WS_TIMER_WHEEL_MASK];
+
+	if (head->next == head)
+	{
+		return;
+	}
+
+	// Take the whole slot first, a parked timer might go back into it.
+	cascaded.next = head->next;
+	cascaded.prev = head->prev;
+	cascaded.next->prev = &cascaded;
+	cascaded.prev->next = &cascaded;
+	_ws_timer_list_init(head);
+
+	while (cascaded.next != &cascaded)
+	{
+		timer = cascaded.next;
+		_ws_timer_unlink(timer);
+		_ws_timer_wheel_insert(wheel, timer);
+	}
+}
+
+static void _ws_timer_wheel_schedule_next(ws_timer_wheel_t *wheel)
+{
+	int level;
+	int shift;
+	uint64_t i;
+	uint64_t slot;
+	uint64_t tick;
+	uint64_t next = 0;
+	ws_timer_t *head;
+
+	if (!wheel->count)
+	{
+		return;
+	}
+
+	// Wake up for the first slot that has timers on each level, level 0
+	// slots expire and the others are cascaded at their start.
+	for (level = 0; level < WS_TIMER_WHEEL_LEVELS; level++)
+	{
+		shift = level * WS_TIMER_WHEEL_BITS;
+		slot = wheel->now >> shift;
+
+		// Nothing on this level can be due before the next one above.
+		if (next && (next <= ((slot + 1) << shift)))
+		{
+			break;
+		}
+
+		for (i = 1; i <= WS_TIMER_WHEEL_SLOTS; i++)
+		{
+			head = &wheel->slots[level][(slot + i) & WS_TIMER_WHEEL_MASK];
+
+			if (head->next != head)
+			{
+				tick = (slot + i) << shift;
+
+				if (!next || (tick < next))
+				{
+					next = tick;
+				}
+
+				break;
+			}
+		}
+	}
+
+	if (next)
+	{
+		_ws_timer_wheel_schedule(wheel, next);
+	}
+}
+
+void _ws_timer_wheel_run(ws_timer_wheel_t *wheel, uint64_t cur)
+{
+	int level;
+	size_t due = 0;
+	ws_timer_t expired;
+	ws_timer_t *head;
+	ws_timer_t *timer;
+	assert(wheel);
+
+	_ws_timer_list_init(&expired);
+
+	while (wheel->now < cur)
+	{
+		// If the event loop was blocked for long, don't
+		// step through the ticks once nothing is left.
+		if (wheel->count == due)
+		{
+			wheel->now = cur;
+			break;
+		}
+
+		wheel->now++;
+
+		for (level = 1; level < WS_TIMER_WHEEL_LEVELS; level++)
+		{
+			if (wheel->now & (((uint64_t)1 << (level * WS_TIMER_WHEEL_BITS)) - 1))
+			{
+				break;
+			}
+
+			_ws_timer_wheel_cascade(wheel, level);
+		}
+
+		head = &wheel->slots[0][wheel->now & WS_TIMER_WHEEL_MASK];
+
+		while (head->next != head)
+		{
+			timer = head->next;
+			_ws_timer_unlink(timer);
+			_ws_timer_link(&expired, timer);
+			due++;
+		}
+	}
+
+	// The callbacks may cancel, re-arm or free any timer,
+	// so only ever take the first one from the list.
+	while (expired.next != &expired)
+	{
+		timer = expired.next;
+		_ws_timer_unlink(timer);
+		wheel->count--;
+
+		timer->cb(timer->arg);
+	}
+
+	_ws_timer_wheel_schedule_next(wheel);
+}
+
+static void _ws_timer_wheel_tick_event(evutil_socket_t fd, short what, void *arg)
+{
+	ws_timer_wheel_t *wheel = (ws_timer_wheel_t *)arg;
+	assert(wheel);
+
+	wheel->scheduled = 0;
+	_ws_timer_wheel_run(wheel, _ws_timer_wheel_tick(wheel));
+}
+
+int _ws_timer_wheel_init(ws_timer_wheel_t *wheel, struct event_base *ev_base)
+{
+	int i;
+	int level;
+	assert(wheel);
+	assert(ev_base);
+
+	memset(wheel, 0, sizeof(ws_timer_wheel_t));
+
+	for (level = 0; level < WS_TIMER_WHEEL_LEVELS; level++)
+	{
+		for (i = 0; i < WS_TIMER_WHEEL_SLOTS; i++)
+		{
+			_ws_timer_list_init(&wheel->slots[level][i]);
+		}
+	}
+
+	if (!(wheel->clock = evutil_monotonic_timer_new()))
+	{
+		LIBWS_LOG(LIBWS_CRIT, "Out of memory!");
+		goto fail;
+	}
+
+	if (evutil_configure_monotonic_time(wheel->clock, EV_MONOT_PRECISE))
+	{
+		LIBWS_LOG(LIBWS_ERR, "Failed to configure monotonic clock");
+		goto fail;
+	}
+
+	if (!(wheel->tick_event = evtimer_new(ev_base,
+								_ws_timer_wheel_tick_event, wheel)))
+	{
+		LIBWS_LOG(LIBWS_ERR, "Failed to create timer wheel event");
+		goto fail;
+	}
+
+	evutil_gettime_monotonic(wheel->clock, &wheel->start);
+
+	return 0;
+fail:
+	_ws_timer_wheel_destroy(wheel);
+	return -1;
+}
+
+void _ws_timer_wheel_destroy(ws_timer_wheel_t *wheel)
+{
+	assert(wheel);
+
+	if (wheel->tick_event)
+	{
+		event_free(wheel->tick_event);
+		wheel->tick_event = NULL;
+	}
+
+	if (wheel->clock)
+	{
+		evutil_monotonic_timer_free(wheel->clock);
+		wheel->clock = NULL;
+	}
+}
+
+void _ws_timer_init(ws_timer_t *timer, ws_timer_callback_f cb, void *arg)
+{
+	assert(timer);
+	assert(!_ws_timer_pending(timer));
+
+	timer->cb = cb;
+	timer->arg = arg;
+}
+
+int _ws_timer_add(ws_timer_wheel_t *wheel, ws_timer_t *timer,
+				const struct timeval *tv)
+{
+	uint64_t cur;
+	uint64_t ticks = 0;
+	assert(wheel);
+	assert(timer);
+	assert(timer->cb);
+	assert(tv);
+
+	_ws_timer_del(wheel, timer);
+
+	cur = _ws_timer_wheel_tick(wheel);
+
+	// Nothing to catch up on.
+	if (!wheel->count)
+	{
+		wheel->now = cur;
+	}
+
+	if (tv->tv_sec >= 0)
+	{
+		ticks = (((uint64_t)tv->tv_sec * 1000000) + (uint64_t)tv->tv_usec
+				+ WS_TIMER_RESOLUTION_US - 1) / WS_TIMER_RESOLUTION_US;
+	}
+
+	// We're somewhere inside the current tick, so
+	// count from the next one to never fire early.
+	timer->expires = cur + 1 + ticks;
+	wheel->count++;
+
+	return _ws_timer_wheel_schedule(wheel,
+								_ws_timer_wheel_insert(wheel, timer));
+}
+
+void _ws_timer_del(ws_timer_wheel_t *wheel, ws_timer_t *timer)
+{
+	assert(wheel);
+	assert(timer);
+
+	if (!_ws_timer_pending(timer))
+	{
+		return;
+	}
+
+	_ws_timer_unlink(timer);
+	wheel->count--;
+}
+
+int _ws_timer_remaining(ws_timer_wheel_t *wheel, ws_timer_t *timer,
+						struct timeval *tv)
+{
+	uint64_t cur;
+	uint64_t left_us;
+	assert(wheel);
+	assert(timer);
+	assert(tv);
+
+	if (!_ws_timer_pending(timer))
+	{
+		evutil_timerclear(tv);
+		return -1;
+	}
+
+	cur = _ws_timer_wheel_tick(wheel);
+	left_us = (timer->expires > cur)
+			? ((timer->expires - cur) * WS_TIMER_RESOLUTION_US) : 0;
+
+	tv->tv_sec = (long)(left_us / 1000000);
+	tv->tv_usec = (long)(left_us % 1000000);
+
+	return 0;
+}
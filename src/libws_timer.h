@@ -0,0 +1,115 @@
+
+#ifndef __LIBWS_TIMER_H__
+#define __LIBWS_TIMER_H__
+
+///
+/// @internal
+/// @file libws_timer.h
+///
+/// A hierarchical timer wheel, one per base, driven by a single
+/// libevent timer. Timers are embedded in the structure that owns
+/// them, so arming and cancelling is O(1) and never allocates.
+///
+/// There are #WS_TIMER_WHEEL_LEVELS levels of #WS_TIMER_WHEEL_SLOTS
+/// slots. A slot on level 0 is #WS_TIMER_RESOLUTION_MS, and a slot on
+/// each level above spans a whole turn of the level below. When time
+/// reaches the start of a higher slot, its timers are cascaded down,
+/// so a timer is moved at most once per level, and a long timeout
+/// never has to be looked at on every turn of level 0.
+///
+/// Timers further away than #WS_TIMER_WHEEL_SPAN (about 4.6 hours)
+/// are parked on the last slot they reach and cascaded again.
+///
+
+#include "libws_config.h"
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef _WIN32
+#include <time.h>
+#else
+#include <sys/time.h>
+#endif
+
+#include <event2/event.h>
+#include <event2/util.h>
+
+#define WS_TIMER_WHEEL_BITS 6
+#define WS_TIMER_WHEEL_SLOTS (1 << WS_TIMER_WHEEL_BITS)
+#define WS_TIMER_WHEEL_MASK (WS_TIMER_WHEEL_SLOTS - 1)
+#define WS_TIMER_WHEEL_LEVELS 4
+#define WS_TIMER_WHEEL_SPAN \
+    ((uint64_t)1 << (WS_TIMER_WHEEL_BITS * WS_TIMER_WHEEL_LEVELS))
+#define WS_TIMER_RESOLUTION_MS 1
+
+typedef void (*ws_timer_callback_f)(void *arg);
+
+typedef struct ws_timer_s
+{
+    struct ws_timer_s *next;    ///< NULL when the timer isn't armed.
+    struct ws_timer_s *prev;
+    uint64_t expires;           ///< The tick the timer expires on.
+    ws_timer_callback_f cb;
+    void *arg;
+} ws_timer_t;
+
+typedef struct ws_timer_wheel_s
+{
+    struct event *tick_event;   ///< Fires when the next slot is due.
+    struct evutil_monotonic_timer *clock;
+    struct timeval start;       ///< Monotonic time of tick 0.
+    uint64_t now;               ///< The last tick that has been run.
+    uint64_t scheduled;         ///< The tick ws_timer_wheel_s#tick_event
+                                /// is set for, 0 if it isn't.
+    size_t count;               ///< Number of armed timers.
+    ws_timer_t slots[WS_TIMER_WHEEL_LEVELS][WS_TIMER_WHEEL_SLOTS];
+                                ///< List heads.
+} ws_timer_wheel_t;
+
+int _ws_timer_wheel_init(ws_timer_wheel_t *wheel, struct event_base *ev_base);
+
+void _ws_timer_wheel_destroy(ws_timer_wheel_t *wheel);
+
+///
+/// Moves the wheel forward and runs the timers that expired,
+/// done by the tick event with the current tick.
+///
+/// @param[in] wheel    The timer wheel.
+/// @param[in] cur      The tick to move up to.
+///
+void _ws_timer_wheel_run(ws_timer_wheel_t *wheel, uint64_t cur);
+
+///
+/// Sets the callback of a timer. Must be done before it's armed.
+///
+void _ws_timer_init(ws_timer_t *timer, ws_timer_callback_f cb, void *arg);
+
+///
+/// Arms a timer, if it is already armed it is rescheduled.
+/// The timer is called at most one tick later than asked for.
+///
+/// @param[in] wheel    The timer wheel.
+/// @param[in] timer    The timer.
+/// @param[in] tv       Time from now until the timer expires.
+///
+/// @returns            0 on success.
+///
+int _ws_timer_add(ws_timer_wheel_t *wheel, ws_timer_t *timer,
+                  const struct timeval *tv);
+
+///
+/// Cancels a timer. Does nothing if it isn't armed.
+///
+void _ws_timer_del(ws_timer_wheel_t *wheel, ws_timer_t *timer);
+
+#define _ws_timer_pending(timer) ((timer)->next != NULL)
+
+///
+/// Gets the time left until a timer expires.
+///
+/// @returns 0 if the timer is armed, -1 otherwise.
+///
+int _ws_timer_remaining(ws_timer_wheel_t *wheel, ws_timer_t *timer,
+                        struct timeval *tv);
+
+#endif // __LIBWS_TIMER_H__
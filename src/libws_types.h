@@ -14,6 +14,8 @@
 
 typedef struct ws_s *ws_t;
 typedef struct ws_base_s *ws_base_t;
+typedef struct ws_template_s *ws_template_t;
+typedef struct ws_msg_s ws_msg_t;
 
 typedef enum ws_opcode_e
 {
@@ -228,6 +230,7 @@ typedef struct ws_header_s
 
 #define WS_MAX_FRAME_SIZE 0x7FFFFFFFFFFFFFFF
 #define WS_DEFAULT_CONNECT_TIMEOUT 60
+#define WS_DEFAULT_MAX_HANDSHAKE_SIZE (8 * 1024)
 
 typedef enum ws_state_e
 {
@@ -240,6 +243,8 @@ typedef enum ws_state_e
 	WS_STATE_CONNECTED
 } ws_state_t;
 
+#define WS_STATE_COUNT (WS_STATE_CONNECTED + 1)
+
 typedef enum ws_parse_state_e
 {
 	WS_PARSE_STATE_USER_ABORT = -2,
@@ -255,8 +260,121 @@ typedef enum libws_ssl_state_e
 	LIBWS_SSL_ON,
 	LIBWS_SSL_SELFSIGNED
 } libws_ssl_state_t;
+
+typedef enum libws_tls_version_e
+{
+	LIBWS_TLS_ANY,
+	LIBWS_TLS_1_0,
+	LIBWS_TLS_1_1,
+	LIBWS_TLS_1_2,
+	LIBWS_TLS_1_3
+} libws_tls_version_t;
+
+#define WS_DEFAULT_SSL_SESSION_CACHE_SIZE 64
+
+// Small TLS records fit in a single TCP segment on a 1500 byte MTU path.
+#define WS_DEFAULT_TLS_RECORD_SMALL 1400
+#define WS_DEFAULT_TLS_RECORD_LARGE 16384
+#define WS_DEFAULT_TLS_RECORD_RAMP (1024 * 1024)
+#define WS_DEFAULT_TLS_RECORD_IDLE_MS 1000
 #endif // LIBWS_WITH_OPENSSL
 
+///
+/// Traffic statistics for a websocket connection.
+/// Byte counts are for websocket frames, and do not include
+/// the HTTP upgrade handshake.
+///
+typedef struct ws_stats_s
+{
+	uint64_t bytes_in;				///< Frame bytes received (headers included).
+	uint64_t bytes_out;				///< Frame bytes sent (headers included).
+	uint64_t frames_in;				///< Frames received.
+	uint64_t frames_out;			///< Frames sent.
+	uint64_t text_msgs_in;			///< Text messages received.
+	uint64_t text_msgs_out;			///< Text messages sent.
+	uint64_t binary_msgs_in;		///< Binary messages received.
+	uint64_t binary_msgs_out;		///< Binary messages sent.
+	uint64_t pings_in;				///< Pings received.
+	uint64_t pings_out;				///< Pings sent.
+	uint64_t pongs_in;				///< Pongs received.
+	uint64_t pongs_out;				///< Pongs sent.
+	uint64_t closes_in;				///< Close frames received.
+	uint64_t closes_out;			///< Close frames sent.
+	uint64_t largest_msg_in;		///< Largest message payload received.
+	uint64_t largest_msg_out;		///< Largest message payload sent.
+	uint64_t in_queue_bytes;		///< Bytes waiting in the input buffer.
+	uint64_t out_queue_bytes;		///< Bytes waiting in the output buffer.
+	uint64_t peak_in_queue_bytes;	///< Largest input buffer seen.
+	uint64_t peak_out_queue_bytes;	///< Largest output buffer seen.
+	uint64_t msgs_too_big_in;		///< Messages rejected for exceeding
+									///  #ws_set_max_message_size or
+									///  #ws_set_max_frame_size_recv.
+	uint64_t pongs_suppressed;		///< Pings not answered since a later ping
+									///  was, see #ws_set_pong_coalescing.
+} ws_stats_t;
+
+///
+/// Round trip times measured by the keepalive pings,
+/// all times are in microseconds.
+///
+typedef struct ws_rtt_stats_s
+{
+	uint64_t count;					///< Number of samples.
+	uint64_t min;					///< Fastest round trip.
+	uint64_t max;					///< Slowest round trip.
+	uint64_t mean;					///< Average round trip.
+	uint64_t p50;					///< Median round trip.
+	uint64_t p90;					///< 90th percentile.
+	uint64_t p99;					///< 99th percentile.
+	uint64_t last;					///< The latest sample.
+} ws_rtt_stats_t;
+
+///
+/// Reasons for a connection attempt failing before
+/// the websocket handshake completed.
+///
+typedef enum ws_handshake_failure_e
+{
+	WS_HANDSHAKE_FAIL_CONNECT,	///< DNS lookup or TCP connect failed.
+	WS_HANDSHAKE_FAIL_TLS,		///< The TLS handshake failed.
+	WS_HANDSHAKE_FAIL_TIMEOUT,	///< The connection attempt timed out.
+	WS_HANDSHAKE_FAIL_REPLY,	///< Invalid HTTP upgrade reply from the server.
+	WS_HANDSHAKE_FAIL_COUNT
+} ws_handshake_failure_t;
+
+///
+/// Closes are counted per close status for 1000 - 1015,
+/// with any other status counted in the last slot.
+///
+#define WS_METRICS_CLOSE_STATUS_COUNT 17
+
+typedef enum ws_metrics_format_e
+{
+	WS_METRICS_PROMETHEUS,		///< Prometheus text exposition format.
+	WS_METRICS_JSON				///< A JSON object.
+} ws_metrics_format_t;
+
+///
+/// Metrics aggregated over all connections of a base.
+///
+typedef struct ws_base_metrics_s
+{
+	uint64_t connections[WS_STATE_COUNT];
+								///< Websocket contexts per #ws_state_t.
+	uint64_t connects;			///< Connection attempts.
+	uint64_t handshakes;		///< Completed websocket handshakes.
+	uint64_t handshake_failures[WS_HANDSHAKE_FAIL_COUNT];
+								///< Failed attempts per reason.
+	uint64_t closes[WS_METRICS_CLOSE_STATUS_COUNT];
+								///< Closed connections per close status.
+	uint64_t bytes_in;			///< Frame bytes received.
+	uint64_t bytes_out;			///< Frame bytes sent.
+	uint64_t msgs_in;			///< Data messages received.
+	uint64_t msgs_out;			///< Data messages sent.
+	uint64_t allocs;			///< Allocations by libws (process wide).
+	uint64_t frees;				///< Frees by libws (process wide).
+} ws_base_metrics_t;
+
 #define WS_RANDOM_PATH "/dev/urandom"
 
 typedef void (*ws_msg_callback_f)(ws_t ws, char *msg, uint64_t len,
@@ -283,9 +401,84 @@ typedef void (*ws_no_copy_cleanup_f)(ws_t ws, const void *data,
 						uint64_t datalen, void *extra);
 typedef int (*ws_header_callback_f)(ws_t ws, const char *header_name,
 				const char *header_val, void *arg);
+typedef char *(*ws_recv_alloc_callback_f)(ws_t ws, uint64_t *len,
+				int binary, void *arg);
+typedef void (*ws_recv_commit_callback_f)(ws_t ws, char *buf, uint64_t len,
+				int binary, int msg_end, void *arg);
+typedef void (*ws_msg_abort_callback_f)(ws_t ws, ws_close_status_t status,
+				void *arg);
+
+///
+/// Passed as msg_end to a #ws_recv_commit_callback_f when the message
+/// is dropped before its end, see #ws_set_recv_buffer_provider.
+///
+#define WS_RECV_MSG_ABORTED -1
+
+///
+/// A table of callbacks, shared by all connections that use it.
+/// Create one with #ws_callbacks_new, fill in the callbacks and
+/// give it to connections using #ws_set_callbacks.
+///
+/// Setting a single callback on a connection with one of the
+/// ws_set_on..._cb functions gives that connection its own copy.
+///
+/// The reference count is not thread safe, only share a table
+/// between connections of the same base.
+///
+typedef struct ws_callbacks_s
+{
+	int refcount;				///< Don't touch, see #ws_callbacks_unref.
+	ws_msg_callback_f msg_cb;
+	void *msg_arg;
+	ws_msg_begin_callback_f msg_begin_cb;
+	void *msg_begin_arg;
+	ws_msg_frame_callback_f msg_frame_cb;
+	void *msg_frame_arg;
+	ws_msg_end_callback_f msg_end_cb;
+	void *msg_end_arg;
+	ws_msg_frame_begin_callback_f msg_frame_begin_cb;
+	void *msg_frame_begin_arg;
+	ws_msg_frame_data_callback_f msg_frame_data_cb;
+	void *msg_frame_data_arg;
+	ws_msg_frame_end_callback_f msg_frame_end_cb;
+	void *msg_frame_end_arg;
+	ws_err_callback_f err_cb;
+	void *err_arg;
+	ws_close_callback_f close_cb;
+	void *close_arg;
+	ws_connect_callback_f connect_cb;
+	void *connect_arg;
+	ws_timeout_callback_f connect_timeout_cb;
+	void *connect_timeout_arg;
+	ws_timeout_callback_f recv_timeout_cb;
+	void *recv_timeout_arg;
+	ws_timeout_callback_f send_timeout_cb;
+	void *send_timeout_arg;
+	ws_msg_callback_f ping_cb;
+	void *ping_arg;
+	ws_msg_callback_f pong_cb;
+	void *pong_arg;
+	ws_timeout_callback_f pong_timeout_cb;
+	void *pong_timeout_arg;
+	ws_header_callback_f header_cb;
+	void *header_arg;
+	ws_recv_alloc_callback_f recv_alloc_cb;
+	ws_recv_commit_callback_f recv_commit_cb;
+	void *recv_buffer_arg;		///< Passed to both buffer provider callbacks.
+	ws_msg_abort_callback_f msg_abort_cb;
+	void *msg_abort_arg;
+} ws_callbacks_t;
 
 typedef void *(*ws_malloc_replacement_f)(size_t bytes);
 typedef void (*ws_free_replacement_f)(void *ptr);
 typedef void *(*ws_realloc_replacement_f)(void *ptr, size_t bytes);
 
+///
+/// Allocator functions for a single base, see #ws_base_set_allocator.
+/// The context given when setting them is passed to every call.
+///
+typedef void *(*ws_base_malloc_f)(void *ctx, size_t bytes);
+typedef void (*ws_base_free_f)(void *ctx, void *ptr);
+typedef void *(*ws_base_realloc_f)(void *ctx, void *ptr, size_t bytes);
+
 #endif // __LIBWS_TYPES_H__
@@ -0,0 +1,75 @@
+#include "libws_test_helpers.h"
+#include "libws.h"
+#include "libws_crypto.h"
+#include "libws_log.h"
+#include <string.h>
+
+int TEST_ws_base64_encode(int argc, char *argv[])
+{
+	int ret = 0;
+	size_t i;
+	size_t len;
+	unsigned v;
+	char out[80];
+	unsigned char bin[48];
+	// RFC 4648 section 10.
+	const char *vectors[][2] =
+	{
+		{ "", "" },
+		{ "f", "Zg==" },
+		{ "fo", "Zm8=" },
+		{ "foo", "Zm9v" },
+		{ "foob", "Zm9vYg==" },
+		{ "fooba", "Zm9vYmE=" },
+		{ "foobar", "Zm9vYmFy" }
+	};
+
+	libws_test_HEADLINE("TEST_ws_base64_encode");
+	if (libws_test_init(argc, argv)) return -1;
+
+	libws_test_STATUS("Test vectors:");
+
+	for (i = 0; i < sizeof(vectors) / sizeof(vectors[0]); i++)
+	{
+		memset(out, 'x', sizeof(out));
+		len = _ws_base64_encode(vectors[i][0], strlen(vectors[i][0]), out);
+
+		if ((len != strlen(vectors[i][1])) || strcmp(out, vectors[i][1]))
+		{
+			libws_test_FAILURE("  \"%s\" encoded to \"%s\", expected \"%s\"",
+								vectors[i][0], out, vectors[i][1]);
+			ret = -1;
+		}
+		else
+		{
+			libws_test_SUCCESS("  \"%s\" -> \"%s\"", vectors[i][0], out);
+		}
+	}
+
+	libws_test_STATUS("Every character in the alphabet:");
+	{
+		// Packs the values 0 to 63, six bits each.
+		for (i = 0, v = 0; i < sizeof(bin); i += 3, v += 4)
+		{
+			bin[i] = (unsigned char)((v << 2) | ((v + 1) >> 4));
+			bin[i + 1] = (unsigned char)((((v + 1) & 15) << 4) | ((v + 2) >> 2));
+			bin[i + 2] = (unsigned char)((((v + 2) & 3) << 6) | (v + 3));
+		}
+
+		len = _ws_base64_encode(bin, sizeof(bin), out);
+
+		if ((len != 64) || strcmp(out, "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+										"abcdefghijklmnopqrstuvwxyz"
+										"0123456789+/"))
+		{
+			libws_test_FAILURE("  Got \"%s\"", out);
+			ret = -1;
+		}
+		else
+		{
+			libws_test_SUCCESS("  Got \"%s\"", out);
+		}
+	}
+
+	return ret;
+}
@@ -0,0 +1,324 @@
+#include "libws.h"
+#include "libws_private.h"
+#include "libws_test_helpers.h"
+#include "libws_test_server.h"
+#include <string.h>
+#include <stdlib.h>
+
+#define ALLOC_CHURN 100
+#define ALLOC_WARMUP 4
+#define ALLOC_MESSAGES 64
+#define ALLOC_MSG_SIZE 3000
+#define ALLOC_BIG_MSG_SIZE (64 * 1024)
+
+typedef struct alloc_count_s
+{
+	int allocs;
+	int frees;
+	int live;
+} alloc_count_t;
+
+typedef struct alloc_test_s
+{
+	ws_base_t base;
+	alloc_count_t count;
+	char msg[ALLOC_BIG_MSG_SIZE + 1];
+	size_t msg_len;
+	int received;
+	int bad;
+	int warm_allocs;
+	int steady_allocs;
+	int closed;
+} alloc_test_t;
+
+static void *alloc_malloc(void *ctx, size_t size)
+{
+	alloc_count_t *c = (alloc_count_t *)ctx;
+	c->allocs++;
+	c->live++;
+	return malloc(size);
+}
+
+static void alloc_free(void *ctx, void *ptr)
+{
+	alloc_count_t *c = (alloc_count_t *)ctx;
+
+	if (!ptr)
+		return;
+
+	c->frees++;
+	c->live--;
+	free(ptr);
+}
+
+static void *alloc_realloc(void *ctx, void *ptr, size_t size)
+{
+	if (!ptr)
+		return alloc_malloc(ctx, size);
+
+	if (size == 0)
+	{
+		alloc_free(ctx, ptr);
+		return NULL;
+	}
+
+	return realloc(ptr, size);
+}
+
+static void alloc_send(alloc_test_t *t, ws_t ws, size_t len)
+{
+	size_t i;
+	char *buf = (char *)malloc(len + 1);
+
+	// Sending masks the data in place, so keep a copy to compare with.
+	for (i = 0; i < len; i++)
+	{
+		t->msg[i] = 'a' + ((t->received + i) % 26);
+	}
+
+	t->msg[len] = '\0';
+	t->msg_len = len;
+
+	memcpy(buf, t->msg, len + 1);
+	ws_send_msg_ex(ws, buf, len, 0);
+	free(buf);
+}
+
+static void alloc_onconnect(ws_t ws, void *arg)
+{
+	alloc_test_t *t = (alloc_test_t *)arg;
+	alloc_send(t, ws, ALLOC_MSG_SIZE);
+}
+
+static void alloc_onmsg(ws_t ws, char *msg, uint64_t len,
+						int binary, void *arg)
+{
+	alloc_test_t *t = (alloc_test_t *)arg;
+
+	if ((len != t->msg_len) || memcmp(msg, t->msg, t->msg_len)
+		|| (msg[len] != '\0'))
+	{
+		t->bad++;
+	}
+
+	t->received++;
+
+	if (t->received == ALLOC_WARMUP)
+	{
+		t->warm_allocs = t->count.allocs;
+	}
+
+	if (t->received < ALLOC_MESSAGES)
+	{
+		alloc_send(t, ws, ALLOC_MSG_SIZE);
+	}
+	else if (t->received == ALLOC_MESSAGES)
+	{
+		t->steady_allocs = t->count.allocs;
+
+		// Bigger than an arena block.
+		alloc_send(t, ws, ALLOC_BIG_MSG_SIZE);
+	}
+	else
+	{
+		ws_base_quit(t->base, 1);
+	}
+}
+
+static void alloc_onclose(ws_t ws, ws_close_status_t status,
+						const char *reason, size_t reason_len, void *arg)
+{
+	alloc_test_t *t = (alloc_test_t *)arg;
+	t->closed++;
+	ws_base_quit(t->base, 0);
+}
+
+static void alloc_give_up(evutil_socket_t fd, short what, void *arg)
+{
+	alloc_test_t *t = (alloc_test_t *)arg;
+	libws_test_FAILURE("Timed out");
+	ws_base_quit(t->base, 0);
+}
+
+int TEST_ws_base_set_allocator(int argc, char **argv)
+{
+	int i;
+	int ret = 0;
+	int before;
+	ws_t ws = NULL;
+	alloc_test_t *t = NULL;
+	libws_test_server_t *srv = NULL;
+	struct event *give_up = NULL;
+	struct timeval give_up_tv = {10, 0};
+
+	libws_test_HEADLINE("TEST_ws_base_set_allocator");
+
+	if (!(t = (alloc_test_t *)calloc(1, sizeof(alloc_test_t))))
+	{
+		libws_test_FAILURE("Out of memory");
+		return -1;
+	}
+
+	if (ws_global_init(&t->base))
+	{
+		libws_test_FAILURE("Failed to init global state");
+		ret = -1;
+		goto fail;
+	}
+
+	if (!ws_base_set_allocator(t->base, alloc_malloc, NULL, NULL, &t->count))
+	{
+		libws_test_FAILURE("Accepted an incomplete allocator");
+		ret = -1;
+	}
+
+	if (ws_base_set_allocator(t->base, alloc_malloc, alloc_free,
+								alloc_realloc, &t->count))
+	{
+		libws_test_FAILURE("Failed to set allocator");
+		ret = -1;
+		goto fail;
+	}
+
+	if (ws_init(&ws, t->base))
+	{
+		libws_test_FAILURE("Failed to init websocket state");
+		ret = -1;
+		goto fail;
+	}
+
+	if (!ws_base_set_allocator(t->base, NULL, NULL, NULL, NULL))
+	{
+		libws_test_FAILURE("Changed the allocator with a connection open");
+		ret = -1;
+	}
+
+	ws_destroy(&ws);
+
+	if (t->count.allocs == 0)
+	{
+		libws_test_FAILURE("The connection was not allocated by the allocator");
+		ret = -1;
+		goto fail;
+	}
+
+	libws_test_STATUS("Create and destroy %d connections", ALLOC_CHURN);
+
+	before = t->count.allocs;
+
+	for (i = 0; i < ALLOC_CHURN; i++)
+	{
+		if (ws_init(&ws, t->base))
+		{
+			libws_test_FAILURE("Failed to init websocket state");
+			ret = -1;
+			goto fail;
+		}
+
+		ws_destroy(&ws);
+	}
+
+	if (t->count.allocs != before)
+	{
+		libws_test_FAILURE("%d allocations for %d connections",
+							t->count.allocs - before, ALLOC_CHURN);
+		ret = -1;
+	}
+	else
+	{
+		libws_test_SUCCESS("No allocations for %d connections", ALLOC_CHURN);
+	}
+
+	libws_test_STATUS("Echo %d messages of %d bytes",
+						ALLOC_MESSAGES, ALLOC_MSG_SIZE);
+
+	if (!(srv = libws_test_server_new(t->base->ev_base, 0)))
+	{
+		libws_test_FAILURE("Failed to start test server");
+		ret = -1;
+		goto fail;
+	}
+
+	if (ws_init(&ws, t->base))
+	{
+		libws_test_FAILURE("Failed to init websocket state");
+		ret = -1;
+		goto fail;
+	}
+
+	ws_set_onconnect_cb(ws, alloc_onconnect, t);
+	ws_set_onmsg_cb(ws, alloc_onmsg, t);
+	ws_set_onclose_cb(ws, alloc_onclose, t);
+
+	if (ws_connect(ws, "127.0.0.1", libws_test_server_get_port(srv), ""))
+	{
+		libws_test_FAILURE("Failed to connect to test server");
+		ret = -1;
+		goto fail;
+	}
+
+	give_up = evtimer_new(t->base->ev_base, alloc_give_up, t);
+	evtimer_add(give_up, &give_up_tv);
+
+	ws_base_service_blocking(t->base);
+
+	if ((t->received != (ALLOC_MESSAGES + 1)) || t->closed)
+	{
+		libws_test_FAILURE("Received %d of %d messages, %d closed",
+							t->received, ALLOC_MESSAGES + 1, t->closed);
+		ret = -1;
+		goto fail;
+	}
+
+	if (t->bad)
+	{
+		libws_test_FAILURE("%d messages were corrupted", t->bad);
+		ret = -1;
+	}
+	else
+	{
+		libws_test_SUCCESS("All messages were intact");
+	}
+
+	if (ws->arena.blocks || (ws->ws_base->arena_blocks.in_use != 0))
+	{
+		libws_test_FAILURE("Message memory was not given back");
+		ret = -1;
+	}
+
+	libws_test_STATUS("%d allocations before warmup, %d after the "
+						"small messages, %d in total",
+						t->warm_allocs, t->steady_allocs, t->count.allocs);
+
+	// The last message is bigger than an arena block, so it
+	// is expected to get its memory from the allocator.
+	if (t->steady_allocs != t->warm_allocs)
+	{
+		libws_test_FAILURE("Messages allocated memory after warmup");
+		ret = -1;
+	}
+	else
+	{
+		libws_test_SUCCESS("No allocations per message after warmup");
+	}
+
+fail:
+	if (give_up) event_free(give_up);
+	ws_destroy(&ws);
+	if (srv) libws_test_server_free(srv);
+
+	if (t->base)
+	{
+		ws_global_destroy(&t->base);
+	}
+
+	if (t->count.live != 0)
+	{
+		libws_test_FAILURE("%d allocations were not freed", t->count.live);
+		ret = -1;
+	}
+
+	free(t);
+
+	return ret;
+}
@@ -0,0 +1,120 @@
+#include "libws_test_helpers.h"
+#include "libws.h"
+#include "libws_private.h"
+#ifdef LIBWS_WITH_OPENSSL
+#include <openssl/ssl.h>
+#include "libws_openssl.h"
+#endif
+#include <string.h>
+
+#ifdef LIBWS_WITH_OPENSSL
+
+#define SESSION_TEST_HOST_LEN 400
+
+///
+/// Caches a new session, returns it so it can be looked up.
+///
+static SSL_SESSION *cache(ws_base_t base, const char *host, int port)
+{
+	SSL_SESSION *session;
+
+	if (!(session = SSL_SESSION_new()))
+		return NULL;
+
+	if (_ws_openssl_cache_session(base, host, port, session))
+	{
+		SSL_SESSION_free(session);
+		return NULL;
+	}
+
+	return session;
+}
+
+static int check(ws_base_t base, const char *name, size_t count,
+				int ok)
+{
+	if (!ok || (ws_base_get_ssl_session_count(base) != count))
+	{
+		libws_test_FAILURE("%s: %u sessions cached", name,
+					(unsigned)ws_base_get_ssl_session_count(base));
+		return -1;
+	}
+
+	libws_test_SUCCESS("%s", name);
+	return 0;
+}
+
+#endif // LIBWS_WITH_OPENSSL
+
+int TEST_ws_base_set_ssl_session_cache(int argc, char *argv[])
+{
+	int ret = 0;
+	ws_base_t base = NULL;
+	#ifdef LIBWS_WITH_OPENSSL
+	char host1[SESSION_TEST_HOST_LEN + 1];
+	char host2[SESSION_TEST_HOST_LEN + 1];
+	SSL_SESSION *s1;
+	SSL_SESSION *s2;
+	SSL_SESSION *s3;
+	#endif
+
+	libws_test_HEADLINE("TEST_ws_base_set_ssl_session_cache");
+	if (libws_test_init(argc, argv)) return -1;
+
+	#ifndef LIBWS_WITH_OPENSSL
+	libws_test_SKIPPED("Not compiled with OpenSSL");
+	#else
+
+	if (ws_global_init(&base))
+	{
+		libws_test_FAILURE("Failed to init global state");
+		return -1;
+	}
+
+	// Only the last character differs.
+	memset(host1, 'a', SESSION_TEST_HOST_LEN);
+	host1[SESSION_TEST_HOST_LEN] = '\0';
+	memcpy(host2, host1, sizeof(host2));
+	host2[SESSION_TEST_HOST_LEN - 1] = 'b';
+
+	libws_test_STATUS("Cache keys:");
+
+	s1 = cache(base, host1, 443);
+	s2 = cache(base, host2, 443);
+	ret |= check(base, "  Long hosts with the same prefix", 2,
+				s1 && s2
+				&& (_ws_openssl_get_session(base, host1, 443) == s1)
+				&& (_ws_openssl_get_session(base, host2, 443) == s2));
+
+	s3 = cache(base, host1, 8443);
+	ret |= check(base, "  Same host on another port", 3,
+				s3 && (_ws_openssl_get_session(base, host1, 8443) == s3)
+				&& (_ws_openssl_get_session(base, host1, 443) == s1));
+
+	s1 = cache(base, host1, 443);
+	ret |= check(base, "  New session for a cached server", 3,
+				s1 && (_ws_openssl_get_session(base, host1, 443) == s1));
+
+	libws_test_STATUS("Least recently used first out:");
+
+	ws_base_set_ssl_session_cache(base, 2);
+	ret |= check(base, "  Shrinking drops the oldest", 2,
+				!_ws_openssl_get_session(base, host2, 443));
+
+	// host1:8443 is now the least recently used.
+	_ws_openssl_get_session(base, host1, 8443);
+	_ws_openssl_get_session(base, host1, 443);
+	s2 = cache(base, host2, 443);
+	ret |= check(base, "  Full cache drops the oldest", 2,
+				s2 && !_ws_openssl_get_session(base, host1, 8443)
+				&& (_ws_openssl_get_session(base, host1, 443) == s1)
+				&& (_ws_openssl_get_session(base, host2, 443) == s2));
+
+	ws_base_set_ssl_session_cache(base, 0);
+	ret |= check(base, "  Disabled", 0, !cache(base, host1, 443));
+
+	ws_global_destroy(&base);
+	#endif // LIBWS_WITH_OPENSSL
+
+	return ret;
+}
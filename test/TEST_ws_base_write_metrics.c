@@ -0,0 +1,229 @@
+#include "libws.h"
+#include "libws_private.h"
+#include "libws_test_helpers.h"
+#include "libws_test_server.h"
+#include <string.h>
+
+typedef struct metrics_test_s
+{
+	ws_base_t base;
+	int closed;
+} metrics_test_t;
+
+static void metrics_onmsg(ws_t ws, char *msg, uint64_t len,
+						int binary, void *arg)
+{
+	ws_close(ws);
+}
+
+static void metrics_onconnect(ws_t ws, void *arg)
+{
+	char text[] = "hello";
+	ws_send_msg(ws, text);
+}
+
+static void metrics_onclose(ws_t ws, ws_close_status_t status,
+						const char *reason, size_t reason_len, void *arg)
+{
+	metrics_test_t *t = (metrics_test_t *)arg;
+	t->closed = 1;
+	ws_base_quit(t->base, 1);
+}
+
+static int check_metric(const char *name, uint64_t val, uint64_t expected)
+{
+	if (val != expected)
+	{
+		libws_test_FAILURE("%s = %llu, expected %llu", name,
+			(unsigned long long)val, (unsigned long long)expected);
+		return -1;
+	}
+
+	libws_test_SUCCESS("%s = %llu", name, (unsigned long long)val);
+	return 0;
+}
+
+static int check_contains(const char *text, const char *expected)
+{
+	if (!strstr(text, expected))
+	{
+		libws_test_FAILURE("Missing \"%s\"", expected);
+		return -1;
+	}
+
+	libws_test_SUCCESS("Contains \"%s\"", expected);
+	return 0;
+}
+
+static int run_connection(metrics_test_t *t, ws_t ws, int port)
+{
+	t->closed = 0;
+
+	if (ws_connect(ws, "127.0.0.1", port, ""))
+	{
+		libws_test_FAILURE("Failed to connect to port %d", port);
+		return -1;
+	}
+
+	ws_base_service_blocking(t->base);
+
+	if (!t->closed)
+	{
+		libws_test_FAILURE("Connection was never closed");
+		return -1;
+	}
+
+	return 0;
+}
+
+int TEST_ws_base_write_metrics(int argc, char **argv)
+{
+	int ret = 0;
+	int len;
+	ws_base_t base = NULL;
+	ws_t ws = NULL;
+	ws_base_metrics_t m;
+	metrics_test_t t;
+	libws_test_server_t *srv = NULL;
+	char buf[4096];
+
+	libws_test_HEADLINE("TEST_ws_base_write_metrics");
+
+	memset(&t, 0, sizeof(t));
+
+	if (ws_global_init(&base))
+	{
+		libws_test_FAILURE("Failed to init global state");
+		return -1;
+	}
+
+	t.base = base;
+
+	#ifndef LIBWS_WITH_STATS
+	if (ws_base_write_metrics(base, buf, sizeof(buf), WS_METRICS_JSON) >= 0)
+	{
+		libws_test_FAILURE("Got metrics without statistics support");
+		ret = -1;
+	}
+	else
+	{
+		libws_test_SKIPPED("Compiled without statistics support");
+	}
+
+	goto fail;
+	#endif
+
+	if (ws_init(&ws, base))
+	{
+		libws_test_FAILURE("Failed to init websocket state");
+		ret = -1;
+		goto fail;
+	}
+
+	if (!(srv = libws_test_server_new(base->ev_base, 0)))
+	{
+		libws_test_FAILURE("Failed to start test server");
+		ret = -1;
+		goto fail;
+	}
+
+	ws_set_onconnect_cb(ws, metrics_onconnect, &t);
+	ws_set_onmsg_cb(ws, metrics_onmsg, &t);
+	ws_set_onclose_cb(ws, metrics_onclose, &t);
+
+	libws_test_STATUS("Echo a message and close");
+
+	if (run_connection(&t, ws, libws_test_server_get_port(srv)))
+	{
+		ret = -1;
+		goto fail;
+	}
+
+	// Nothing should be listening on port 1.
+	libws_test_STATUS("Connect to a closed port");
+
+	if (run_connection(&t, ws, 1))
+	{
+		ret = -1;
+		goto fail;
+	}
+
+	ws_base_get_metrics(base, &m);
+
+	ret |= check_metric("connects", m.connects, 2);
+	ret |= check_metric("handshakes", m.handshakes, 1);
+	ret |= check_metric("connect failures",
+				m.handshake_failures[WS_HANDSHAKE_FAIL_CONNECT], 1);
+	ret |= check_metric("closes 1000", m.closes[0], 1);
+	ret |= check_metric("closes 1006", m.closes[6], 1);
+	ret |= check_metric("closed uncleanly",
+				m.connections[WS_STATE_CLOSED_UNCLEANLY], 1);
+	ret |= check_metric("connected", m.connections[WS_STATE_CONNECTED], 0);
+	ret |= check_metric("msgs_in", m.msgs_in, 1);
+	ret |= check_metric("msgs_out", m.msgs_out, 1);
+
+	if (m.allocs == 0)
+	{
+		libws_test_FAILURE("No allocations counted");
+		ret = -1;
+	}
+	else
+	{
+		libws_test_SUCCESS("%llu allocations", (unsigned long long)m.allocs);
+	}
+
+	libws_test_STATUS("Write Prometheus metrics");
+
+	if ((len = ws_base_write_metrics(base, buf, sizeof(buf),
+									WS_METRICS_PROMETHEUS)) <= 0)
+	{
+		libws_test_FAILURE("Failed to write metrics");
+		ret = -1;
+		goto fail;
+	}
+
+	libws_test_SUCCESS("Wrote %d bytes", len);
+	ret |= check_contains(buf, "libws_connections{state=\"closed_uncleanly\"} 1\n");
+	ret |= check_contains(buf, "libws_connects_total 2\n");
+	ret |= check_contains(buf, "libws_handshake_failures_total{reason=\"connect\"} 1\n");
+	ret |= check_contains(buf, "libws_closes_total{status=\"1000\"} 1\n");
+
+	libws_test_STATUS("Write JSON metrics");
+
+	if ((len = ws_base_write_metrics(base, buf, sizeof(buf),
+									WS_METRICS_JSON)) <= 0)
+	{
+		libws_test_FAILURE("Failed to write metrics");
+		ret = -1;
+		goto fail;
+	}
+
+	libws_test_SUCCESS("Wrote %d bytes", len);
+	ret |= check_contains(buf, "\"connects\":2,");
+	ret |= check_contains(buf, "\"closes\":{\"1000\":1,\"1006\":1}");
+
+	libws_test_STATUS("Write to a too small buffer");
+
+	if (ws_base_write_metrics(base, buf, 32, WS_METRICS_JSON) != -1)
+	{
+		libws_test_FAILURE("Expected failure for a 32 byte buffer");
+		ret = -1;
+	}
+	else
+	{
+		libws_test_SUCCESS("Failed as expected");
+	}
+
+fail:
+	ws_destroy(&ws);
+
+	if (srv)
+	{
+		libws_test_server_free(srv);
+	}
+
+	ws_global_destroy(&base);
+
+	return ret;
+}
+
@@ -40,7 +40,6 @@ int TEST_ws_check_server_protocol_list(int argc, char *argv[])
 	ws_base_t base = NULL;
 	ws_t ws = NULL;
 	size_t i;
-	size_t count = 0;
 	char *protocols[] = {"arne", "weises", "julafton"};
 
 	libws_test_HEADLINE("TEST_ws_check_server_protocol_list");
@@ -0,0 +1,217 @@
+#include "libws_test_helpers.h"
+#include "libws.h"
+#include "libws_private.h"
+#include "libws_header.h"
+#include "libws_msg.h"
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <string.h>
+#include <stdlib.h>
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+
+#define GET_MSG_COUNT 3
+
+typedef struct get_msg_test_s
+{
+	ws_msg_t *msgs[GET_MSG_COUNT];
+	int count;
+	int same_handle;
+} get_msg_test_t;
+
+static void onmsg(ws_t ws, char *msg, uint64_t len, int binary, void *arg)
+{
+	get_msg_test_t *t = (get_msg_test_t *)arg;
+	ws_msg_t *m = ws_get_msg(ws);
+
+	if (!m || (t->count >= GET_MSG_COUNT))
+		return;
+
+	// Asking again gives the same handle.
+	t->same_handle += (ws_get_msg(ws) == m)
+					&& (ws_msg_data(m) == msg) && (ws_msg_len(m) == len);
+
+	t->msgs[t->count++] = ws_msg_retain(m);
+}
+
+static void add_frame(struct evbuffer *frames, ws_opcode_t opcode, int fin,
+						const char *payload, size_t len)
+{
+	ws_header_t h;
+	uint8_t header[WS_HDR_MAX_SIZE];
+	size_t header_len;
+
+	memset(&h, 0, sizeof(h));
+	h.fin = fin;
+	h.opcode = opcode;
+	h.payload_len = len;
+	ws_pack_header(&h, header, sizeof(header), &header_len);
+
+	evbuffer_add(frames, header, header_len);
+	evbuffer_add(frames, payload, len);
+}
+
+#ifndef _WIN32
+static void *release_thread(void *arg)
+{
+	ws_msg_release((ws_msg_t *)arg);
+	return NULL;
+}
+#endif
+
+int TEST_ws_get_msg(int argc, char *argv[])
+{
+	int ret = 0;
+	int i;
+	char *payloads[GET_MSG_COUNT];
+	size_t sizes[GET_MSG_COUNT] = { 10, 100000, 3000 };
+	ws_base_t base = NULL;
+	ws_t ws = NULL;
+	struct evbuffer *in = NULL;
+	get_msg_test_t t;
+
+	libws_test_HEADLINE("TEST_ws_get_msg");
+	if (libws_test_init(argc, argv)) return -1;
+
+	memset(&t, 0, sizeof(t));
+	memset(payloads, 0, sizeof(payloads));
+
+	if (ws_global_init(&base))
+	{
+		libws_test_FAILURE("Failed to init global state");
+		return -1;
+	}
+
+	if (!(in = evbuffer_new())
+		|| ws_init(&ws, base)
+		|| !(ws->bev = bufferevent_socket_new(base->ev_base, -1, 0)))
+	{
+		libws_test_FAILURE("Failed to init websocket state");
+		ret = -1;
+		goto fail;
+	}
+
+	ws->state = WS_STATE_CONNECTED;
+	ws_set_onmsg_cb(ws, onmsg, &t);
+
+	libws_test_STATUS("Retain messages:");
+
+	if (ws_get_msg(ws))
+	{
+		libws_test_FAILURE("  Got a handle outside the message callback");
+		ret = -1;
+	}
+
+	for (i = 0; i < GET_MSG_COUNT; i++)
+	{
+		if (!(payloads[i] = malloc(sizes[i])))
+		{
+			libws_test_FAILURE("Out of memory");
+			ret = -1;
+			goto fail;
+		}
+
+		memset(payloads[i], 'a' + i, sizes[i]);
+	}
+
+	// The last one is fragmented.
+	add_frame(in, WS_OPCODE_TEXT_0X1, 1, payloads[0], sizes[0]);
+	add_frame(in, WS_OPCODE_BINARY_0X2, 1, payloads[1], sizes[1]);
+	add_frame(in, WS_OPCODE_TEXT_0X1, 0, payloads[2], 1000);
+	add_frame(in, WS_OPCODE_CONTINUATION_0X0, 1, &payloads[2][1000],
+				sizes[2] - 1000);
+	_ws_read_websocket(ws, in);
+
+	if ((t.count != GET_MSG_COUNT) || (t.same_handle != GET_MSG_COUNT))
+	{
+		libws_test_FAILURE("  Got %d handles, %d the same when asked again",
+							t.count, t.same_handle);
+		ret = -1;
+		goto fail;
+	}
+
+	for (i = 0; i < GET_MSG_COUNT; i++)
+	{
+		if ((ws_msg_len(t.msgs[i]) != sizes[i])
+			|| memcmp(ws_msg_data(t.msgs[i]), payloads[i], sizes[i])
+			|| ws_msg_data(t.msgs[i])[sizes[i]]
+			|| (ws_msg_is_binary(t.msgs[i]) != (i == 1)))
+		{
+			libws_test_FAILURE("  Message %d changed after its callback", i);
+			ret = -1;
+		}
+		else
+		{
+			libws_test_SUCCESS("  Message %d of %u bytes kept", i,
+								(unsigned)sizes[i]);
+		}
+	}
+
+	libws_test_STATUS("Release messages:");
+
+	#ifndef _WIN32
+	{
+		pthread_t thread;
+
+		if (pthread_create(&thread, NULL, release_thread, t.msgs[1]))
+		{
+			libws_test_FAILURE("  Failed to start thread");
+			ret = -1;
+			goto fail;
+		}
+
+		pthread_join(thread, NULL);
+		t.msgs[1] = NULL;
+
+		// Given back by the base thread.
+		if ((base->msg_slab.in_use != GET_MSG_COUNT) || !base->msg_returned)
+		{
+			libws_test_FAILURE("  Freed on the releasing thread");
+			ret = -1;
+		}
+		else
+		{
+			libws_test_SUCCESS("  Released on another thread");
+		}
+
+		_ws_msg_collect(base);
+	}
+	#endif
+
+	for (i = 0; i < GET_MSG_COUNT; i++)
+	{
+		ws_msg_release(t.msgs[i]);
+		t.msgs[i] = NULL;
+	}
+
+	#ifndef LIBWS_HAVE_THREAD_LOCAL
+	// The releasing thread is unknown, so they are always deferred.
+	_ws_msg_collect(base);
+	#endif
+
+	if (base->msg_slab.in_use || base->msg_returned)
+	{
+		libws_test_FAILURE("  %u handles still in use",
+							(unsigned)base->msg_slab.in_use);
+		ret = -1;
+	}
+	else
+	{
+		libws_test_SUCCESS("  All handles back on the free list");
+	}
+
+fail:
+	for (i = 0; i < GET_MSG_COUNT; i++)
+	{
+		ws_msg_release(t.msgs[i]);
+		free(payloads[i]);
+	}
+
+	if (ws) ws->state = WS_STATE_CLOSED_CLEANLY;
+	ws_destroy(&ws);
+	if (in) evbuffer_free(in);
+	ws_global_destroy(&base);
+
+	return ret;
+}
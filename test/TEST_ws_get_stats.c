@@ -0,0 +1,203 @@
+#include "libws.h"
+#include "libws_private.h"
+#include "libws_test_helpers.h"
+#include "libws_test_server.h"
+#include <string.h>
+
+typedef struct stats_test_s
+{
+	ws_base_t base;
+	int msgs;
+	int pongs;
+	int closed;
+} stats_test_t;
+
+static void stats_check_done(ws_t ws, stats_test_t *t)
+{
+	if ((t->msgs == 2) && (t->pongs == 1))
+	{
+		ws_close(ws);
+	}
+}
+
+static void stats_onmsg(ws_t ws, char *msg, uint64_t len,
+						int binary, void *arg)
+{
+	stats_test_t *t = (stats_test_t *)arg;
+	t->msgs++;
+	stats_check_done(ws, t);
+}
+
+static void stats_onpong(ws_t ws, char *msg, uint64_t len,
+						int binary, void *arg)
+{
+	stats_test_t *t = (stats_test_t *)ws_get_user_state(ws);
+	t->pongs++;
+	stats_check_done(ws, t);
+}
+
+static void stats_onconnect(ws_t ws, void *arg)
+{
+	char text[] = "hello";
+	char ping[] = "ping";
+	char binary[1000];
+
+	memset(binary, 0xAB, sizeof(binary));
+
+	ws_send_msg(ws, text);
+	ws_send_msg_ex(ws, binary, sizeof(binary), 1);
+	ws_send_ping_ex(ws, ping, 4);
+}
+
+static void stats_onclose(ws_t ws, ws_close_status_t status,
+						const char *reason, size_t reason_len, void *arg)
+{
+	stats_test_t *t = (stats_test_t *)arg;
+	t->closed = 1;
+	ws_base_quit(t->base, 1);
+}
+
+static int check_stat(const char *name, uint64_t val, uint64_t expected)
+{
+	if (val != expected)
+	{
+		libws_test_FAILURE("%s = %llu, expected %llu", name,
+			(unsigned long long)val, (unsigned long long)expected);
+		return -1;
+	}
+
+	libws_test_SUCCESS("%s = %llu", name, (unsigned long long)val);
+	return 0;
+}
+
+int TEST_ws_get_stats(int argc, char **argv)
+{
+	int ret = 0;
+	ws_base_t base = NULL;
+	ws_t ws = NULL;
+	ws_stats_t stats;
+	stats_test_t t;
+	libws_test_server_t *srv = NULL;
+
+	libws_test_HEADLINE("TEST_ws_get_stats");
+
+	memset(&t, 0, sizeof(t));
+
+	if (ws_global_init(&base))
+	{
+		libws_test_FAILURE("Failed to init global state");
+		return -1;
+	}
+
+	t.base = base;
+
+	if (ws_init(&ws, base))
+	{
+		libws_test_FAILURE("Failed to init websocket state");
+		ret = -1;
+		goto fail;
+	}
+
+	#ifndef LIBWS_WITH_STATS
+	if (!ws_get_stats(ws, &stats))
+	{
+		libws_test_FAILURE("Got stats without statistics support");
+		ret = -1;
+	}
+	else
+	{
+		libws_test_SKIPPED("Compiled without statistics support");
+	}
+
+	goto fail;
+	#endif
+
+	if (ws_get_stats(ws, &stats))
+	{
+		libws_test_FAILURE("Failed to get stats");
+		ret = -1;
+		goto fail;
+	}
+
+	ret |= check_stat("frames_in after init", stats.frames_in, 0);
+	ret |= check_stat("bytes_out after init", stats.bytes_out, 0);
+
+	if (!(srv = libws_test_server_new(base->ev_base, 0)))
+	{
+		libws_test_FAILURE("Failed to start test server");
+		ret = -1;
+		goto fail;
+	}
+
+	ws_set_user_state(ws, &t);
+	ws_set_onconnect_cb(ws, stats_onconnect, &t);
+	ws_set_onmsg_cb(ws, stats_onmsg, &t);
+	ws_set_onpong_cb(ws, stats_onpong, &t);
+	ws_set_onclose_cb(ws, stats_onclose, &t);
+
+	libws_test_STATUS("Send a text, binary and ping message to echo server");
+
+	if (ws_connect(ws, "127.0.0.1", libws_test_server_get_port(srv), ""))
+	{
+		libws_test_FAILURE("Failed to connect to test server");
+		ret = -1;
+		goto fail;
+	}
+
+	ws_base_service_blocking(base);
+
+	if (!t.closed)
+	{
+		libws_test_FAILURE("Connection was never closed");
+		ret = -1;
+		goto fail;
+	}
+
+	ws_get_stats(ws, &stats);
+
+	ret |= check_stat("text_msgs_out", stats.text_msgs_out, 1);
+	ret |= check_stat("binary_msgs_out", stats.binary_msgs_out, 1);
+	ret |= check_stat("pings_out", stats.pings_out, 1);
+	ret |= check_stat("closes_out", stats.closes_out, 1);
+	ret |= check_stat("text_msgs_in", stats.text_msgs_in, 1);
+	ret |= check_stat("binary_msgs_in", stats.binary_msgs_in, 1);
+	ret |= check_stat("pongs_in", stats.pongs_in, 1);
+	ret |= check_stat("closes_in", stats.closes_in, 1);
+	ret |= check_stat("frames_out", stats.frames_out, 4);
+	ret |= check_stat("frames_in", stats.frames_in, 4);
+	ret |= check_stat("largest_msg_out", stats.largest_msg_out, 1000);
+	ret |= check_stat("largest_msg_in", stats.largest_msg_in, 1000);
+
+	// Masked client frames: 6 byte header (8 with extended length).
+	ret |= check_stat("bytes_out", stats.bytes_out,
+						(5 + 6) + (1000 + 8) + (4 + 6) + (2 + 6));
+
+	// Unmasked server frames: 2 byte header (4 with extended length).
+	ret |= check_stat("bytes_in", stats.bytes_in,
+						(5 + 2) + (1000 + 4) + (4 + 2) + (2 + 2));
+
+	if (stats.peak_out_queue_bytes < 1000)
+	{
+		libws_test_FAILURE("peak_out_queue_bytes = %llu, expected at least 1000",
+			(unsigned long long)stats.peak_out_queue_bytes);
+		ret = -1;
+	}
+	else
+	{
+		libws_test_SUCCESS("peak_out_queue_bytes = %llu",
+			(unsigned long long)stats.peak_out_queue_bytes);
+	}
+
+fail:
+	ws_destroy(&ws);
+
+	if (srv)
+	{
+		libws_test_server_free(srv);
+	}
+
+	ws_global_destroy(&base);
+
+	return ret;
+}
+
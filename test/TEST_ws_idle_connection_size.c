@@ -0,0 +1,366 @@
+#include "libws.h"
+#include "libws_private.h"
+#include "libws_test_helpers.h"
+#include "libws_test_server.h"
+#include <string.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+#ifndef _WIN32
+#include <unistd.h>
+#include <sys/wait.h>
+#endif
+
+#define IDLE_WARMUP 8
+#define IDLE_CONNECTIONS 64
+#define IDLE_MAX_CONNECTIONS (IDLE_WARMUP + IDLE_CONNECTIONS)
+
+// Room to store the size in front of each allocation,
+// keeping the returned pointer 16 byte aligned.
+#define IDLE_ALLOC_HEADER 16
+
+#define IDLE_FIELD_END(field) \
+	(offsetof(struct ws_s, field) + sizeof(((struct ws_s *)0)->field))
+
+typedef struct idle_test_s
+{
+	ws_base_t base;
+	ws_t ws[IDLE_MAX_CONNECTIONS];
+	int target;
+	int connected;
+	int closed;
+} idle_test_t;
+
+static size_t idle_live_bytes;
+
+static void *idle_malloc(size_t size)
+{
+	char *p;
+
+	if (!(p = (char *)malloc(size + IDLE_ALLOC_HEADER)))
+		return NULL;
+
+	*((size_t *)p) = size;
+	idle_live_bytes += size;
+
+	return p + IDLE_ALLOC_HEADER;
+}
+
+static void idle_free(void *ptr)
+{
+	char *p;
+
+	if (!ptr)
+		return;
+
+	p = (char *)ptr - IDLE_ALLOC_HEADER;
+	idle_live_bytes -= *((size_t *)p);
+	free(p);
+}
+
+static void *idle_realloc(void *ptr, size_t size)
+{
+	char *p;
+	size_t old_size;
+
+	if (!ptr)
+		return idle_malloc(size);
+
+	if (size == 0)
+	{
+		idle_free(ptr);
+		return NULL;
+	}
+
+	p = (char *)ptr - IDLE_ALLOC_HEADER;
+	old_size = *((size_t *)p);
+
+	if (!(p = (char *)realloc(p, size + IDLE_ALLOC_HEADER)))
+		return NULL;
+
+	*((size_t *)p) = size;
+	idle_live_bytes = idle_live_bytes - old_size + size;
+
+	return p + IDLE_ALLOC_HEADER;
+}
+
+static void idle_onconnect(ws_t ws, void *arg)
+{
+	idle_test_t *t = (idle_test_t *)arg;
+
+	if (++t->connected == t->target)
+	{
+		ws_base_quit(t->base, 1);
+	}
+}
+
+static void idle_onclose(ws_t ws, ws_close_status_t status,
+						const char *reason, size_t reason_len, void *arg)
+{
+	idle_test_t *t = (idle_test_t *)arg;
+	t->closed++;
+	ws_base_quit(t->base, 0);
+}
+
+static void idle_give_up(evutil_socket_t fd, short what, void *arg)
+{
+	idle_test_t *t = (idle_test_t *)arg;
+	libws_test_FAILURE("Timed out");
+	ws_base_quit(t->base, 0);
+}
+
+#ifndef _WIN32
+static void idle_server_quit(evutil_socket_t fd, short what, void *arg)
+{
+	event_base_loopbreak((struct event_base *)arg);
+}
+
+///
+/// Runs the echo server in a child process, so that
+/// its allocations are not counted.
+///
+static void idle_server_run(int port_fd, int quit_fd)
+{
+	int port = -1;
+	struct event_base *base = NULL;
+	struct event *quit = NULL;
+	libws_test_server_t *srv = NULL;
+
+	if ((base = event_base_new())
+		&& (srv = libws_test_server_new(base, 0)))
+	{
+		port = libws_test_server_get_port(srv);
+	}
+
+	if (write(port_fd, &port, sizeof(port)) != sizeof(port))
+	{
+		port = -1;
+	}
+
+	if (port > 0)
+	{
+		quit = event_new(base, quit_fd, EV_READ, idle_server_quit, base);
+		event_add(quit, NULL);
+		event_base_dispatch(base);
+		event_free(quit);
+	}
+
+	if (srv) libws_test_server_free(srv);
+	if (base) event_base_free(base);
+
+	_exit(0);
+}
+#endif // _WIN32
+
+static int idle_connect(idle_test_t *t, ws_callbacks_t *cbs,
+						int port, int count)
+{
+	int i;
+	struct event *give_up = NULL;
+	struct timeval give_up_tv = {5, 0};
+
+	for (i = t->target; i < (t->target + count); i++)
+	{
+		if (ws_init(&t->ws[i], t->base))
+		{
+			libws_test_FAILURE("Failed to init websocket state");
+			return -1;
+		}
+
+		ws_set_callbacks(t->ws[i], cbs);
+
+		if (ws_connect(t->ws[i], "127.0.0.1", port, ""))
+		{
+			libws_test_FAILURE("Failed to connect to test server");
+			return -1;
+		}
+	}
+
+	t->target += count;
+
+	give_up = evtimer_new(t->base->ev_base, idle_give_up, t);
+	evtimer_add(give_up, &give_up_tv);
+
+	ws_base_service_blocking(t->base);
+
+	event_free(give_up);
+
+	if ((t->connected != t->target) || t->closed)
+	{
+		libws_test_FAILURE("%d of %d connections connected, %d closed",
+							t->connected, t->target, t->closed);
+		return -1;
+	}
+
+	return 0;
+}
+
+int TEST_ws_idle_connection_size(int argc, char **argv)
+{
+	int i;
+	int ret = 0;
+	size_t hot_end = 0;
+	size_t before;
+	idle_test_t t;
+	ws_callbacks_t *cbs = NULL;
+	#ifndef _WIN32
+	int port = -1;
+	int port_pipe[2];
+	int quit_pipe[2];
+	pid_t pid;
+	#endif
+
+	libws_test_HEADLINE("TEST_ws_idle_connection_size");
+
+	#ifdef _WIN32
+	libws_test_SKIPPED("Needs fork() to run the server separately");
+	return 0;
+	#else
+
+	memset(&t, 0, sizeof(t));
+
+	// The fields read for every received frame.
+	hot_end = IDLE_FIELD_END(header);
+	if (IDLE_FIELD_END(recv_frame_len) > hot_end) hot_end = IDLE_FIELD_END(recv_frame_len);
+	if (IDLE_FIELD_END(has_header) > hot_end) hot_end = IDLE_FIELD_END(has_header);
+	if (IDLE_FIELD_END(in_msg) > hot_end) hot_end = IDLE_FIELD_END(in_msg);
+	if (IDLE_FIELD_END(utf8_state) > hot_end) hot_end = IDLE_FIELD_END(utf8_state);
+	if (IDLE_FIELD_END(ctrl_len) > hot_end) hot_end = IDLE_FIELD_END(ctrl_len);
+
+	libws_test_STATUS("sizeof(struct ws_s) = %u, sizeof(ws_cold_t) = %u, "
+					"sizeof(ws_callbacks_t) = %u",
+					(unsigned)sizeof(struct ws_s), (unsigned)sizeof(ws_cold_t),
+					(unsigned)sizeof(ws_callbacks_t));
+	libws_test_STATUS("Receive state ends at byte %u, hot state at byte %u",
+					(unsigned)hot_end, (unsigned)IDLE_FIELD_END(sent_close));
+
+	if (hot_end > 128)
+	{
+		libws_test_FAILURE("Receive state is not within the first "
+							"two cache lines");
+		ret = -1;
+	}
+
+	if ((pipe(port_pipe) != 0) || (pipe(quit_pipe) != 0))
+	{
+		libws_test_FAILURE("Failed to create pipes");
+		return -1;
+	}
+
+	if ((pid = fork()) < 0)
+	{
+		libws_test_FAILURE("Failed to fork server");
+		return -1;
+	}
+
+	if (pid == 0)
+	{
+		close(port_pipe[0]);
+		close(quit_pipe[1]);
+		idle_server_run(port_pipe[1], quit_pipe[0]);
+	}
+
+	close(port_pipe[1]);
+	close(quit_pipe[0]);
+
+	if ((read(port_pipe[0], &port, sizeof(port)) != sizeof(port))
+		|| (port <= 0))
+	{
+		libws_test_FAILURE("Failed to start test server");
+		ret = -1;
+		goto fail;
+	}
+
+	// Must be set before anything is allocated.
+	ws_set_memory_functions(idle_malloc, idle_free, idle_realloc);
+
+	if (ws_global_init(&t.base))
+	{
+		libws_test_FAILURE("Failed to init global state");
+		ret = -1;
+		goto fail;
+	}
+
+	if (!(cbs = ws_callbacks_new()))
+	{
+		libws_test_FAILURE("Failed to create callbacks");
+		ret = -1;
+		goto fail;
+	}
+
+	cbs->connect_cb = idle_onconnect;
+	cbs->connect_arg = &t;
+	cbs->close_cb = idle_onclose;
+	cbs->close_arg = &t;
+
+	// Get one time allocations, such as the event
+	// base growing its lists, out of the way.
+	if (idle_connect(&t, cbs, port, IDLE_WARMUP))
+	{
+		ret = -1;
+		goto fail;
+	}
+
+	before = idle_live_bytes;
+
+	libws_test_STATUS("Connect %d idle connections", IDLE_CONNECTIONS);
+
+	if (idle_connect(&t, cbs, port, IDLE_CONNECTIONS))
+	{
+		ret = -1;
+		goto fail;
+	}
+
+	libws_test_SUCCESS("%u bytes per idle connection",
+			(unsigned)((idle_live_bytes - before) / IDLE_CONNECTIONS));
+
+	for (i = 0; i < t.target; i++)
+	{
+		if (t.ws[i]->cold || t.ws[i]->handshake_key_base64)
+		{
+			libws_test_FAILURE("Connection %d kept state it doesn't need", i);
+			ret = -1;
+			break;
+		}
+
+		if (ws_get_callbacks(t.ws[i]) != cbs)
+		{
+			libws_test_FAILURE("Connection %d has its own callbacks", i);
+			ret = -1;
+			break;
+		}
+	}
+
+	// Setting a callback gives a connection its own copy.
+	ws_set_onmsg_cb(t.ws[0], NULL, NULL);
+
+	if ((ws_get_callbacks(t.ws[0]) == cbs)
+		|| (ws_get_callbacks(t.ws[0])->connect_cb != idle_onconnect))
+	{
+		libws_test_FAILURE("Setting a callback changed the shared table");
+		ret = -1;
+	}
+
+fail:
+	for (i = 0; i < IDLE_MAX_CONNECTIONS; i++)
+	{
+		ws_destroy(&t.ws[i]);
+	}
+
+	ws_callbacks_unref(cbs);
+
+	if (t.base)
+	{
+		ws_global_destroy(&t.base);
+	}
+
+	// The counting functions are left in place, OpenSSL
+	// keeps some of its memory until the process exits.
+
+	close(quit_pipe[1]);
+	close(port_pipe[0]);
+	waitpid(pid, NULL, 0);
+
+	return ret;
+	#endif // _WIN32
+}
@@ -0,0 +1,282 @@
+#include "libws.h"
+#include "libws_private.h"
+#include "libws_handshake.h"
+#include "libws_test_helpers.h"
+#include "libws_test_server.h"
+#include <event2/buffer.h>
+#include <string.h>
+
+#define TEMPLATE_CONNECTIONS 8
+
+typedef struct template_test_s
+{
+	ws_base_t base;
+	int connected;
+	int closed;
+} template_test_t;
+
+static void template_onconnect(ws_t ws, void *arg)
+{
+	template_test_t *t = (template_test_t *)arg;
+
+	if (++t->connected == TEMPLATE_CONNECTIONS)
+	{
+		ws_base_quit(t->base, 0);
+	}
+}
+
+static void template_onclose(ws_t ws, ws_close_status_t status,
+						const char *reason, size_t reason_len, void *arg)
+{
+	template_test_t *t = (template_test_t *)arg;
+	t->closed++;
+	ws_base_quit(t->base, 0);
+}
+
+static void template_give_up(evutil_socket_t fd, short what, void *arg)
+{
+	template_test_t *t = (template_test_t *)arg;
+	libws_test_FAILURE("Timed out");
+	ws_base_quit(t->base, 0);
+}
+
+///
+/// Sends the handshake of a connection and compares it to
+/// the request rendered for its own configuration and key.
+///
+static int check_handshake(ws_t ws, const char *server, int port,
+							const char *uri)
+{
+	int ret = 0;
+	size_t len;
+	size_t num_subprotocols;
+	char **subprotocols;
+	struct evbuffer *out = evbuffer_new();
+	struct evbuffer *expect = evbuffer_new();
+
+	if (!out || !expect)
+	{
+		libws_test_FAILURE("Failed to allocate evbuffer");
+		ret = -1;
+		goto fail;
+	}
+
+	if (ws->server) _ws_free(ws->server);
+	if (ws->uri) _ws_free(ws->uri);
+	ws->server = _ws_strdup(server);
+	ws->uri = _ws_strdup(uri);
+	ws->port = port;
+
+	if (_ws_send_handshake(ws, out))
+	{
+		libws_test_FAILURE("Failed to send handshake");
+		ret = -1;
+		goto fail;
+	}
+
+	subprotocols = _ws_get_subprotocol_list(ws, &num_subprotocols);
+
+	if (_ws_render_handshake(expect, server, port, uri, _ws_get_origin(ws),
+							subprotocols, num_subprotocols,
+							ws->handshake_key_base64, NULL))
+	{
+		libws_test_FAILURE("Failed to render handshake");
+		ret = -1;
+		goto fail;
+	}
+
+	len = evbuffer_get_length(out);
+
+	if ((len != evbuffer_get_length(expect))
+		|| memcmp(evbuffer_pullup(out, len), evbuffer_pullup(expect, len), len))
+	{
+		libws_test_FAILURE("Unexpected handshake for %s:%d/%s",
+							server, port, uri);
+		ret = -1;
+		goto fail;
+	}
+
+	libws_test_SUCCESS("Handshake for %s:%d/%s as expected",
+						server, port, uri);
+
+fail:
+	if (out) evbuffer_free(out);
+	if (expect) evbuffer_free(expect);
+
+	return ret;
+}
+
+int TEST_ws_init_from_template(int argc, char **argv)
+{
+	int i;
+	int ret = 0;
+	size_t count = 0;
+	char **subprotocols = NULL;
+	template_test_t t;
+	ws_template_t tmpl = NULL;
+	ws_callbacks_t *cbs = NULL;
+	ws_t ws = NULL;
+	ws_t conns[TEMPLATE_CONNECTIONS];
+	libws_test_server_t *srv = NULL;
+	struct event *give_up = NULL;
+	struct timeval give_up_tv = {10, 0};
+
+	libws_test_HEADLINE("TEST_ws_init_from_template");
+
+	if (libws_test_init(argc, argv)) return -1;
+
+	memset(&t, 0, sizeof(t));
+	memset(conns, 0, sizeof(conns));
+
+	if (ws_global_init(&t.base))
+	{
+		libws_test_FAILURE("Failed to init global state");
+		return -1;
+	}
+
+	if (ws_template_new(&tmpl, t.base)
+		|| !(cbs = ws_callbacks_new()))
+	{
+		libws_test_FAILURE("Failed to create template");
+		ret = -1;
+		goto fail;
+	}
+
+	cbs->connect_cb = template_onconnect;
+	cbs->connect_arg = &t;
+	cbs->close_cb = template_onclose;
+	cbs->close_arg = &t;
+	ws_template_set_callbacks(tmpl, cbs);
+	ws_callbacks_unref(cbs);
+
+	if (ws_template_set_origin(tmpl, "example.com")
+		|| ws_template_add_subprotocol(tmpl, "echo")
+		|| ws_template_add_subprotocol(tmpl, "chat")
+		|| ws_template_set_max_frame_size(tmpl, 1024))
+	{
+		libws_test_FAILURE("Failed to configure template");
+		ret = -1;
+		goto fail;
+	}
+
+	libws_test_STATUS("Connections share the template state");
+	{
+		if (ws_init_from_template(&ws, tmpl))
+		{
+			libws_test_FAILURE("Failed to init websocket from template");
+			ret = -1;
+			goto fail;
+		}
+
+		if ((ws_get_callbacks(ws) != cbs)
+			|| (ws_get_max_frame_size(ws) != 1024)
+			|| (ws_get_subprotocol_count(ws) != 2))
+		{
+			libws_test_FAILURE("Connection did not get the template state");
+			ret = -1;
+		}
+		else
+		{
+			libws_test_SUCCESS("Connection got the template state");
+		}
+
+		if (!(subprotocols = ws_get_subprotocols(ws, &count))
+			|| (count != 2)
+			|| strcmp(subprotocols[0], "echo")
+			|| strcmp(subprotocols[1], "chat"))
+		{
+			libws_test_FAILURE("Unexpected template subprotocols");
+			ret = -1;
+		}
+		else
+		{
+			libws_test_SUCCESS("Got the template subprotocols");
+		}
+
+		ws_free_subprotocols_list(subprotocols, count);
+	}
+
+	libws_test_STATUS("Handshake requests from a template");
+	{
+		// Rendered once, then only the key is filled in.
+		ret |= check_handshake(ws, "example.com", 123, "some_uri/path");
+		ret |= check_handshake(ws, "example.com", 123, "some_uri/path");
+
+		// Rendered again for another destination.
+		ret |= check_handshake(ws, "example.com", 456, "some_uri/path");
+		ret |= check_handshake(ws, "example.org", 456, "");
+
+		// The connection's own settings replace the template's.
+		ws_add_subprotocol(ws, "other");
+		ret |= check_handshake(ws, "example.com", 123, "some_uri/path");
+
+		if (ws_get_subprotocol_count(ws) != 1)
+		{
+			libws_test_FAILURE("Own subprotocols did not replace the template");
+			ret = -1;
+		}
+
+		ws_destroy(&ws);
+	}
+
+	libws_test_STATUS("Connect %d connections from a template",
+						TEMPLATE_CONNECTIONS);
+	{
+		if (!(srv = libws_test_server_new(t.base->ev_base, 0)))
+		{
+			libws_test_FAILURE("Failed to start test server");
+			ret = -1;
+			goto fail;
+		}
+
+		for (i = 0; i < TEMPLATE_CONNECTIONS; i++)
+		{
+			if (ws_init_from_template(&conns[i], tmpl)
+				|| ws_connect(conns[i], "127.0.0.1",
+							libws_test_server_get_port(srv), "echo"))
+			{
+				libws_test_FAILURE("Failed to connect to test server");
+				ret = -1;
+				goto fail;
+			}
+		}
+
+		// The connections keep the template alive.
+		ws_template_free(&tmpl);
+
+		give_up = evtimer_new(t.base->ev_base, template_give_up, &t);
+		evtimer_add(give_up, &give_up_tv);
+
+		ws_base_service_blocking(t.base);
+
+		if ((t.connected != TEMPLATE_CONNECTIONS) || t.closed)
+		{
+			libws_test_FAILURE("%d of %d connected, %d closed",
+								t.connected, TEMPLATE_CONNECTIONS, t.closed);
+			ret = -1;
+		}
+		else
+		{
+			libws_test_SUCCESS("All connections from the template connected");
+		}
+	}
+
+fail:
+	if (give_up) event_free(give_up);
+	ws_destroy(&ws);
+
+	for (i = 0; i < TEMPLATE_CONNECTIONS; i++)
+	{
+		ws_destroy(&conns[i]);
+	}
+
+	ws_template_free(&tmpl);
+	if (srv) libws_test_server_free(srv);
+
+	if (t.base)
+	{
+		ws_global_destroy(&t.base);
+	}
+
+	return ret;
+}
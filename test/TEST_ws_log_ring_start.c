@@ -0,0 +1,341 @@
+#include "libws_test_helpers.h"
+#include "libws.h"
+#include "libws_log.h"
+#include "libws_private.h"
+#include "libws_log_ring.h"
+#include <stdio.h>
+#include <string.h>
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+
+#ifdef LIBWS_WITH_LOG
+
+// The records below must reach the ring even when the
+// library is built with a higher LIBWS_LOG_MIN_LEVEL.
+#undef LIBWS_LOG_MIN_LEVEL
+#define LIBWS_LOG_MIN_LEVEL LIBWS_TRACE
+
+#define RESTARTS 200
+
+///
+/// Packs the arguments into a record, and compares the
+/// formatted record to what vsnprintf gives.
+///
+static int check_format(const char *fmt, ...)
+{
+	va_list args;
+	va_list copy;
+	char expected[512];
+	char got[512];
+	ws_log_record_t rec;
+
+	va_start(args, fmt);
+	va_copy(copy, args);
+	vsnprintf(expected, sizeof(expected), fmt, args);
+
+	memset(&rec, 0, sizeof(rec));
+	rec.fmt = fmt;
+	_ws_log_record_pack(&rec, fmt, copy);
+	_ws_log_record_format(&rec, got, sizeof(got));
+
+	va_end(copy);
+	va_end(args);
+
+	if (strcmp(got, expected))
+	{
+		libws_test_FAILURE("  \"%s\" formatted to \"%s\", expected \"%s\"",
+							fmt, got, expected);
+		return -1;
+	}
+
+	libws_test_SUCCESS("  \"%s\"", got);
+	return 0;
+}
+
+static void pack(ws_log_record_t *rec, const char *fmt, ...)
+{
+	va_list args;
+
+	memset(rec, 0, sizeof(*rec));
+	rec->fmt = fmt;
+
+	va_start(args, fmt);
+	_ws_log_record_pack(rec, fmt, args);
+	va_end(args);
+}
+
+///
+/// Counts the lines in a file that contain a string.
+///
+static int count_lines(FILE *f, const char *needle)
+{
+	int count = 0;
+	char line[1024];
+
+	rewind(f);
+
+	while (fgets(line, sizeof(line), f))
+	{
+		if (strstr(line, needle))
+			count++;
+	}
+
+	return count;
+}
+
+#if defined(LIBWS_HAVE_THREAD_LOCAL) && !defined(_WIN32)
+static volatile int logging;
+
+static void *log_thread(void *arg)
+{
+	while (logging)
+	{
+		LIBWS_LOG(LIBWS_DEBUG, "racing record %d", 1);
+	}
+
+	return NULL;
+}
+
+///
+/// Starts and stops the log ring while another thread keeps logging.
+///
+static int check_restarts(FILE *out)
+{
+	int i;
+	int ret = 0;
+	pthread_t thread;
+
+	logging = 1;
+
+	if (pthread_create(&thread, NULL, log_thread, NULL))
+	{
+		libws_test_FAILURE("  Failed to start thread");
+		return -1;
+	}
+
+	for (i = 0; (i < RESTARTS) && !ret; i++)
+	{
+		// Every other start retires the rings.
+		if (ws_log_ring_start((i & 2) ? 32 : 16, 0, out))
+		{
+			libws_test_FAILURE("  Failed to start the log ring");
+			ret = -1;
+		}
+
+		ws_log_ring_flush();
+		ws_log_ring_stop();
+	}
+
+	logging = 0;
+	pthread_join(thread, NULL);
+
+	if (!ret)
+	{
+		libws_test_SUCCESS("  Restarted %d times", RESTARTS);
+	}
+
+	return ret;
+}
+#endif
+
+#endif // LIBWS_WITH_LOG
+
+int TEST_ws_log_ring_start(int argc, char *argv[])
+{
+	int ret = 0;
+	#ifdef LIBWS_WITH_LOG
+	int i;
+	int level;
+	size_t flushed;
+	uint64_t dropped;
+	char long_str[400];
+	char conn_str[64];
+	char got[512];
+	ws_log_record_t rec;
+	ws_t prev;
+	FILE *out = NULL;
+	#endif
+
+	libws_test_HEADLINE("TEST_ws_log_ring_start");
+	if (libws_test_init(argc, argv)) return -1;
+
+	#ifndef LIBWS_WITH_LOG
+	libws_test_SKIPPED("Not compiled with logging");
+	#else
+
+	libws_test_STATUS("Deferred formatting:");
+	{
+		ret |= check_format("No arguments");
+		ret |= check_format("%d %i %u %x %X %o", -42, 7, 42u, 0xbeefu, 0xcafeu, 8u);
+		ret |= check_format("%ld %lu %lld %llu", -1L, 2UL, -3LL, 4ULL);
+		ret |= check_format("%zu %hhd %hu %c%c", (size_t)123, 300, 70000, 'o', 'k');
+		ret |= check_format("%5.2f|%-8.3e|%g", 3.14159, 1234.5, 0.25);
+		ret |= check_format("[%s] [%-6s] [%.3s] [%*d] [%-*.*s]",
+							"hello", "ab", "truncated", 6, 42, 8, 2, "xyz");
+		ret |= check_format("%p %% %s", (void *)&rec, "end");
+	}
+
+	libws_test_STATUS("Arguments that don't fit:");
+	{
+		memset(long_str, 'a', sizeof(long_str) - 1);
+		long_str[sizeof(long_str) - 1] = '\0';
+
+		pack(&rec, "%d %s %d", 1, long_str, 2);
+		_ws_log_record_format(&rec, got, sizeof(got));
+
+		if (!rec.truncated
+			|| strncmp(got, "1 aaaa", 6)
+			|| !strstr(got, "[truncated]"))
+		{
+			libws_test_FAILURE("  Got \"%s\"", got);
+			ret = -1;
+		}
+		else
+		{
+			libws_test_SUCCESS("  Long string truncated");
+		}
+	}
+
+	level = ws_get_log_level();
+	ws_set_log_level(LIBWS_LOG_UPTO(LIBWS_DEBUG));
+
+	if (!(out = tmpfile()))
+	{
+		libws_test_FAILURE("Failed to create a temporary file");
+		return -1;
+	}
+
+	libws_test_STATUS("Records are dropped when the ring is full:");
+	{
+		if (ws_log_ring_start(16, 0, out))
+		{
+			libws_test_FAILURE("Failed to start the log ring");
+			ret = -1;
+			goto fail;
+		}
+
+		prev = _ws_log_enter((ws_t)&rec);
+
+		for (i = 0; i < 20; i++)
+		{
+			LIBWS_LOG(LIBWS_DEBUG, "ring record %d %s", i, "queued");
+		}
+
+		_ws_log_leave(prev);
+
+		dropped = ws_log_ring_get_dropped();
+		flushed = ws_log_ring_flush();
+
+		if ((flushed != 16) || (dropped != 4))
+		{
+			libws_test_FAILURE("  Flushed %u and dropped %u, expected 16 and 4",
+								(unsigned)flushed, (unsigned)dropped);
+			ret = -1;
+		}
+		else
+		{
+			libws_test_SUCCESS("  Flushed %u and dropped %u",
+								(unsigned)flushed, (unsigned)dropped);
+		}
+
+		snprintf(conn_str, sizeof(conn_str), ": %p: ring record", (void *)&rec);
+
+		if ((count_lines(out, "ring record 15 queued") != 1)
+			|| (count_lines(out, conn_str) != 16))
+		{
+			libws_test_FAILURE("  Records missing, or without the connection");
+			ret = -1;
+		}
+		else
+		{
+			libws_test_SUCCESS("  Records written with the connection");
+		}
+
+		if (ws_log_ring_start(16, 0, out) == 0)
+		{
+			libws_test_FAILURE("  Started the log ring twice");
+			ret = -1;
+		}
+
+		ws_log_ring_stop();
+	}
+
+	libws_test_STATUS("Flushed from a background thread:");
+	{
+		if (ws_log_ring_start(256, 1, out))
+		{
+			libws_test_FAILURE("Failed to start the log ring");
+			ret = -1;
+			goto fail;
+		}
+
+		for (i = 0; i < 200; i++)
+		{
+			LIBWS_LOG(LIBWS_DEBUG, "threaded record %d", i);
+		}
+
+		ws_log_ring_stop();
+
+		if (count_lines(out, "threaded record") != 200)
+		{
+			libws_test_FAILURE("  Got %d of 200 records",
+								count_lines(out, "threaded record"));
+			ret = -1;
+		}
+		else
+		{
+			libws_test_SUCCESS("  Got all records");
+		}
+	}
+
+	libws_test_STATUS("Restarted with the same size:");
+	{
+		if (ws_log_ring_start(256, 0, out))
+		{
+			libws_test_FAILURE("Failed to start the log ring");
+			ret = -1;
+			goto fail;
+		}
+
+		for (i = 0; i < 10; i++)
+		{
+			LIBWS_LOG(LIBWS_DEBUG, "reused record %d", i);
+		}
+
+		dropped = ws_log_ring_get_dropped();
+		flushed = ws_log_ring_flush();
+		ws_log_ring_stop();
+
+		if ((flushed != 10) || dropped
+			|| (count_lines(out, "reused record") != 10))
+		{
+			libws_test_FAILURE("  Flushed %u and dropped %u, expected 10 and 0",
+								(unsigned)flushed, (unsigned)dropped);
+			ret = -1;
+		}
+		else
+		{
+			libws_test_SUCCESS("  Flushed %u", (unsigned)flushed);
+		}
+
+		if (ws_log_ring_flush())
+		{
+			libws_test_FAILURE("  Flushed after being stopped");
+			ret = -1;
+		}
+	}
+
+	#if defined(LIBWS_HAVE_THREAD_LOCAL) && !defined(_WIN32)
+	libws_test_STATUS("Started and stopped while logging:");
+	ret |= check_restarts(out);
+	#endif
+
+fail:
+	ws_log_ring_stop();
+	ws_set_log_level(level);
+	if (out) fclose(out);
+	#endif // LIBWS_WITH_LOG
+
+	return ret;
+}
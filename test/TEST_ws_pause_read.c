@@ -0,0 +1,194 @@
+#include "libws_test_helpers.h"
+#include "libws.h"
+#include "libws_private.h"
+#include "libws_header.h"
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <string.h>
+#ifdef _WIN32
+#include <WinSock2.h>
+#define PAUSE_TEST_FAMILY AF_INET
+#else
+#include <sys/socket.h>
+#define PAUSE_TEST_FAMILY AF_UNIX
+#endif
+
+#define PAUSE_TEST_MSG "hello"
+
+typedef struct pause_test_s
+{
+	int msgs;
+	int pause_at;
+} pause_test_t;
+
+static void onmsg(ws_t ws, char *msg, uint64_t len, int binary, void *arg)
+{
+	pause_test_t *t = (pause_test_t *)arg;
+
+	t->msgs++;
+
+	if (t->msgs == t->pause_at)
+	{
+		ws_pause_read(ws);
+	}
+}
+
+///
+/// Writes a small unfragmented text message as the server would.
+///
+static void write_msg(evutil_socket_t fd, int count)
+{
+	int i;
+	ws_header_t h;
+	uint8_t header[WS_HDR_MAX_SIZE];
+	size_t header_len;
+
+	memset(&h, 0, sizeof(h));
+	h.fin = 1;
+	h.opcode = WS_OPCODE_TEXT_0X1;
+	h.payload_len = sizeof(PAUSE_TEST_MSG) - 1;
+	ws_pack_header(&h, header, sizeof(header), &header_len);
+
+	for (i = 0; i < count; i++)
+	{
+		send(fd, (const char *)header, header_len, 0);
+		send(fd, PAUSE_TEST_MSG, sizeof(PAUSE_TEST_MSG) - 1, 0);
+	}
+}
+
+static void run_loop(ws_base_t base)
+{
+	int i;
+
+	for (i = 0; i < 10; i++)
+	{
+		event_base_loop(base->ev_base, EVLOOP_NONBLOCK);
+	}
+}
+
+int TEST_ws_pause_read(int argc, char *argv[])
+{
+	int ret = 0;
+	size_t buffered;
+	size_t high;
+	evutil_socket_t fds[2] = { -1, -1 };
+	ws_base_t base = NULL;
+	ws_t ws = NULL;
+	pause_test_t t;
+
+	libws_test_HEADLINE("TEST_ws_pause_read");
+	if (libws_test_init(argc, argv)) return -1;
+
+	memset(&t, 0, sizeof(t));
+	t.pause_at = 1;
+
+	if (ws_global_init(&base))
+	{
+		libws_test_FAILURE("Failed to init global state");
+		return -1;
+	}
+
+	if (ws_init(&ws, base)
+		|| evutil_socketpair(PAUSE_TEST_FAMILY, SOCK_STREAM, 0, fds)
+		|| evutil_make_socket_nonblocking(fds[0])
+		|| _ws_create_bufferevent_socket(ws)
+		|| bufferevent_setfd(ws->bev, fds[0]))
+	{
+		libws_test_FAILURE("Failed to init websocket state");
+		ret = -1;
+		goto fail;
+	}
+
+	// Pretend the handshake is done.
+	ws->state = WS_STATE_CONNECTED;
+	ws->connect_state = WS_CONNECT_STATE_HANDSHAKE_COMPLETE;
+	ws_set_onmsg_cb(ws, onmsg, &t);
+	ws_set_read_watermark(ws, 4096);
+	bufferevent_enable(ws->bev, EV_READ | EV_WRITE);
+
+	libws_test_STATUS("Read watermark:");
+
+	bufferevent_getwatermark(ws->bev, EV_READ, NULL, &high);
+
+	if (high != 4096)
+	{
+		libws_test_FAILURE("  High watermark %u, expected 4096", (unsigned)high);
+		ret = -1;
+	}
+	else
+	{
+		libws_test_SUCCESS("  Set on the bufferevent");
+	}
+
+	libws_test_STATUS("Pause from the message callback:");
+
+	write_msg(fds[1], 3);
+	run_loop(base);
+	buffered = evbuffer_get_length(bufferevent_get_input(ws->bev));
+
+	if ((t.msgs != 1) || !ws_is_read_paused(ws) || !buffered)
+	{
+		libws_test_FAILURE("  Got %d messages, paused = %d, %u bytes left",
+							t.msgs, ws_is_read_paused(ws), (unsigned)buffered);
+		ret = -1;
+	}
+	else
+	{
+		libws_test_SUCCESS("  Stopped parsing with %u bytes left",
+							(unsigned)buffered);
+	}
+
+	libws_test_STATUS("Don't read while paused:");
+
+	write_msg(fds[1], 1);
+	run_loop(base);
+
+	if ((t.msgs != 1)
+		|| (evbuffer_get_length(bufferevent_get_input(ws->bev)) != buffered))
+	{
+		libws_test_FAILURE("  Read from the socket while paused");
+		ret = -1;
+	}
+	else
+	{
+		libws_test_SUCCESS("  Left the data in the socket");
+	}
+
+	libws_test_STATUS("Resume:");
+
+	ws_resume_read(ws);
+
+	if (t.msgs != 1)
+	{
+		libws_test_FAILURE("  Parsed from within ws_resume_read");
+		ret = -1;
+	}
+
+	run_loop(base);
+
+	if ((t.msgs != 4) || ws_is_read_paused(ws)
+		|| evbuffer_get_length(bufferevent_get_input(ws->bev)))
+	{
+		libws_test_FAILURE("  Got %d messages after resuming, expected 4",
+							t.msgs);
+		ret = -1;
+	}
+	else
+	{
+		libws_test_SUCCESS("  Got the buffered and the new messages");
+	}
+
+fail:
+	if (ws) ws->state = WS_STATE_CLOSED_CLEANLY;
+	ws_destroy(&ws);
+
+	if (fds[1] >= 0)
+	{
+		evutil_closesocket(fds[1]);
+	}
+
+	ws_global_destroy(&base);
+
+	return ret;
+}
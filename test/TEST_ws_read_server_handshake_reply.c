@@ -4,6 +4,7 @@
 #include "libws_handshake.h"
 #include "libws_log.h"
 #include <event2/buffer.h>
+#include <string.h>
 
 static int show_result_status(const char *msg,
 						ws_parse_state_t state, ws_parse_state_t expected)
@@ -37,26 +38,63 @@ static int run_header_test(const char *msg, ws_t ws, struct evbuffer *in,
 	return show_result_status(msg, state, expected);
 }
 
+typedef struct header_test_s
+{
+	struct evbuffer *in;
+	int count;
+	int copied;
+	int custom;
+} header_test_t;
+
+static int header_cb(ws_t ws, const char *header_name,
+					const char *header_val, void *arg)
+{
+	header_test_t *t = (header_test_t *)arg;
+	struct evbuffer_iovec vec;
+	const char *start;
+
+	// The headers should point into the received data.
+	evbuffer_peek(t->in, -1, NULL, &vec, 1);
+	start = (const char *)vec.iov_base;
+
+	if ((header_name < start) || (header_val >= (start + vec.iov_len)))
+	{
+		t->copied++;
+	}
+
+	if (!strcmp(header_name, "X-Custom") && !strcmp(header_val, "some value"))
+	{
+		t->custom++;
+	}
+
+	t->count++;
+
+	return 0;
+}
+
 int TEST_ws_read_server_handshake_reply(int argc, char *argv[])
 {
 	int ret = 0;
 	ws_base_t base = NULL;
 	ws_t ws = NULL;
 	char key_hash[256];
-	struct evbuffer *in = evbuffer_new();
+	struct evbuffer *in = NULL;
+	header_test_t ht;
 
 	libws_test_HEADLINE("TEST_ws_read_server_handshake_reply");
 	if (libws_test_init(argc, argv)) return -1;
 
-	if (!in)
+	// Before using libevent, since libws hooks its allocations.
+	if (ws_global_init(&base))
 	{
-		libws_test_FAILURE("Failed to init evbuffer");
+		libws_test_FAILURE("Failed to init global state");
 		return -1;
 	}
 
-	if (ws_global_init(&base))
+	if (!(in = evbuffer_new()))
 	{
-		libws_test_FAILURE("Failed to init global state");
+		libws_test_FAILURE("Failed to init evbuffer");
+		ws_global_destroy(&base);
 		return -1;
 	}
 
@@ -196,6 +234,77 @@ int TEST_ws_read_server_handshake_reply(int argc, char *argv[])
 						WS_PARSE_STATE_NEED_MORE);
 	}
 
+	libws_test_STATUS("Test header callback:");
+	{
+		memset(&ht, 0, sizeof(ht));
+		ht.in = in;
+		ws_set_header_cb(ws, header_cb, &ht);
+
+		ws->connect_state = WS_CONNECT_STATE_SENT_REQ;
+		evbuffer_drain(in, evbuffer_get_length(in));
+
+		evbuffer_add_printf(in, 
+							"HTTP/1.1 101\r\n"
+							"Upgrade: websocket\r\n"
+							"X-Custom:   some value  \r\n"
+							"Connection: upgrade\r\n"
+							"Sec-WebSocket-Accept: %s\r\n"
+							"\r\n", key_hash);
+
+		ret |= run_header_test("  Response with custom header", ws, in, 
+							WS_PARSE_STATE_SUCCESS);
+
+		if ((ht.count != 4) || (ht.custom != 1))
+		{
+			libws_test_FAILURE("Header callback called %d times, "
+								"expected 4", ht.count);
+			ret |= -1;
+		}
+		else if (ht.copied)
+		{
+			libws_test_FAILURE("%d headers were copied", ht.copied);
+			ret |= -1;
+		}
+		else
+		{
+			libws_test_SUCCESS("Got all headers without copies");
+		}
+
+		ws_set_header_cb(ws, NULL, NULL);
+	}
+
+	libws_test_STATUS("Test max response size:");
+	{
+		ws_set_max_handshake_size(ws, 64);
+
+		ws->connect_state = WS_CONNECT_STATE_SENT_REQ;
+		evbuffer_drain(in, evbuffer_get_length(in));
+
+		evbuffer_add_printf(in, 
+							"HTTP/1.1 101\r\n"
+							"Upgrade: websocket\r\n"
+							"Connection: upgrade\r\n"
+							"Sec-WebSocket-Accept: %s\r\n"
+							"\r\n", key_hash);
+
+		ret |= run_header_test("  Response too large", ws, in, 
+							WS_PARSE_STATE_ERROR);
+
+		ws->connect_state = WS_CONNECT_STATE_SENT_REQ;
+		evbuffer_drain(in, evbuffer_get_length(in));
+
+		evbuffer_add_printf(in, 
+							"HTTP/1.1 101\r\n"
+							"Upgrade: websocket\r\n"
+							"Connection: upgrade\r\n"
+							"Sec-WebSocket-Accept: ");
+
+		ret |= run_header_test("  Partial response too large", ws, in, 
+							WS_PARSE_STATE_ERROR);
+
+		ws_set_max_handshake_size(ws, WS_DEFAULT_MAX_HANDSHAKE_SIZE);
+	}
+
 fail:
 	evbuffer_free(in);
 	ws_destroy(&ws);
@@ -0,0 +1,240 @@
+#include "libws_test_helpers.h"
+#include "libws.h"
+#include "libws_private.h"
+#include "libws_header.h"
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <string.h>
+#include <stdlib.h>
+
+#define READ_TEST_TEXT "Gr\xc3\xbc\xc3\x9f" "e, \xe6\x97\xa5\xe6\x9c\xac\xe8\xaa\x9e " \
+						"\xe2\x80\x94 libws! "
+#define READ_TEST_MASK 0x1a2b3c4d
+
+typedef struct read_test_s
+{
+	char msg[4096];
+	size_t len;
+	int msgs;
+	int frames;
+} read_test_t;
+
+static void onmsg(ws_t ws, char *msg, uint64_t len, int binary, void *arg)
+{
+	read_test_t *t = (read_test_t *)arg;
+
+	t->msgs++;
+	t->len = (size_t)len;
+
+	if (len <= sizeof(t->msg))
+		memcpy(t->msg, msg, (size_t)len);
+}
+
+static void onframe_begin(ws_t ws, void *arg)
+{
+	((read_test_t *)arg)->frames++;
+}
+
+///
+/// Adds a masked frame, as a client would send it.
+///
+static void add_frame(struct evbuffer *frames, ws_opcode_t opcode, int fin,
+						const char *payload, size_t len)
+{
+	ws_header_t h;
+	uint8_t header[WS_HDR_MAX_SIZE];
+	size_t header_len;
+	char *masked = (char *)malloc(len + 1);
+
+	memset(&h, 0, sizeof(h));
+	h.fin = fin;
+	h.opcode = opcode;
+	h.mask_bit = 1;
+	h.mask = READ_TEST_MASK;
+	h.payload_len = len;
+	ws_pack_header(&h, header, sizeof(header), &header_len);
+
+	memcpy(masked, payload, len);
+	ws_mask_payload(READ_TEST_MASK, masked, len);
+
+	evbuffer_add(frames, header, header_len);
+	evbuffer_add(frames, masked, len);
+	free(masked);
+}
+
+///
+/// Feeds the frames to the parser a few bytes at a time.
+///
+static void feed(ws_t ws, struct evbuffer *frames, size_t chunk)
+{
+	size_t i;
+	size_t len = evbuffer_get_length(frames);
+	char *data = (char *)evbuffer_pullup(frames, -1);
+	struct evbuffer *in = evbuffer_new();
+
+	for (i = 0; i < len; i += chunk)
+	{
+		evbuffer_add(in, &data[i], ((len - i) < chunk) ? (len - i) : chunk);
+		_ws_read_websocket(ws, in);
+	}
+
+	evbuffer_free(in);
+}
+
+static int run(ws_base_t base, int direct, size_t chunk,
+				const char *text, size_t text_len)
+{
+	int ret = 0;
+	int is_direct = 0;
+	ws_t ws = NULL;
+	read_test_t t;
+	struct evbuffer *frames = evbuffer_new();
+
+	memset(&t, 0, sizeof(t));
+
+	if (ws_init(&ws, base)
+		|| !(ws->bev = bufferevent_socket_new(base->ev_base, -1, 0)))
+	{
+		libws_test_FAILURE("Failed to init websocket state");
+		ret = -1;
+		goto fail;
+	}
+
+	// So the ping can be answered.
+	ws->state = WS_STATE_CONNECTED;
+
+	ws_set_onmsg_cb(ws, onmsg, &t);
+
+	if (!direct)
+	{
+		ws_set_onmsg_frame_begin_cb(ws, onframe_begin, &t);
+	}
+
+	// Split in 3 frames that cut through code points,
+	// with a ping in the middle.
+	add_frame(frames, WS_OPCODE_TEXT_0X1, 0, text, 1000);
+	add_frame(frames, WS_OPCODE_PING_0X9, 1, "ping", 4);
+	add_frame(frames, WS_OPCODE_CONTINUATION_0X0, 0, &text[1000], 1001);
+	add_frame(frames, WS_OPCODE_CONTINUATION_0X0, 1, &text[2001],
+				text_len - 2001);
+
+	feed(ws, frames, chunk);
+	is_direct = ws->msg_direct;
+
+	if ((t.msgs != 1) || (t.len != text_len) || memcmp(t.msg, text, text_len))
+	{
+		libws_test_FAILURE("  %s, %u byte chunks: got %d messages of %u bytes",
+							direct ? "Direct" : "Callbacks", (unsigned)chunk,
+							t.msgs, (unsigned)t.len);
+		ret = -1;
+	}
+	else if ((is_direct != direct) || (t.frames != (direct ? 0 : 3)))
+	{
+		libws_test_FAILURE("  %s, %u byte chunks: direct = %d, %d frames",
+							direct ? "Direct" : "Callbacks", (unsigned)chunk,
+							is_direct, t.frames);
+		ret = -1;
+	}
+	else if (ws->state != WS_STATE_CONNECTED)
+	{
+		libws_test_FAILURE("  %s, %u byte chunks: closed the connection",
+							direct ? "Direct" : "Callbacks", (unsigned)chunk);
+		ret = -1;
+	}
+	else
+	{
+		libws_test_SUCCESS("  %s, %u byte chunks",
+							direct ? "Direct" : "Callbacks", (unsigned)chunk);
+	}
+
+fail:
+	if (ws) ws->state = WS_STATE_CLOSED_CLEANLY;
+	ws_destroy(&ws);
+	evbuffer_free(frames);
+
+	return ret;
+}
+
+static int run_invalid_utf8(ws_base_t base, size_t chunk)
+{
+	int ret = 0;
+	ws_t ws = NULL;
+	read_test_t t;
+	struct evbuffer *frames = evbuffer_new();
+
+	memset(&t, 0, sizeof(t));
+
+	if (ws_init(&ws, base)
+		|| !(ws->bev = bufferevent_socket_new(base->ev_base, -1, 0)))
+	{
+		libws_test_FAILURE("Failed to init websocket state");
+		ret = -1;
+		goto fail;
+	}
+
+	ws->state = WS_STATE_CONNECTED;
+	ws_set_onmsg_cb(ws, onmsg, &t);
+
+	// Ends in the middle of a code point.
+	add_frame(frames, WS_OPCODE_TEXT_0X1, 1, "abc\xe6\x97", 5);
+	feed(ws, frames, chunk);
+
+	if (ws->state == WS_STATE_CONNECTED)
+	{
+		libws_test_FAILURE("  %u byte chunks: not closed", (unsigned)chunk);
+		ret = -1;
+	}
+	else
+	{
+		libws_test_SUCCESS("  %u byte chunks: closed", (unsigned)chunk);
+	}
+
+fail:
+	if (ws) ws->state = WS_STATE_CLOSED_CLEANLY;
+	ws_destroy(&ws);
+	evbuffer_free(frames);
+
+	return ret;
+}
+
+int TEST_ws_read_websocket(int argc, char *argv[])
+{
+	int ret = 0;
+	size_t i;
+	size_t len;
+	size_t chunks[] = { 1, 3, 7, 1000, 4096 };
+	char text[3000];
+	ws_base_t base = NULL;
+
+	libws_test_HEADLINE("TEST_ws_read_websocket");
+	if (libws_test_init(argc, argv)) return -1;
+
+	if (ws_global_init(&base))
+	{
+		libws_test_FAILURE("Failed to init global state");
+		return -1;
+	}
+
+	for (len = 0; (len + sizeof(READ_TEST_TEXT) - 1) <= sizeof(text);
+		len += sizeof(READ_TEST_TEXT) - 1)
+	{
+		memcpy(&text[len], READ_TEST_TEXT, sizeof(READ_TEST_TEXT) - 1);
+	}
+
+	libws_test_STATUS("Fragmented masked text message:");
+
+	for (i = 0; i < sizeof(chunks) / sizeof(chunks[0]); i++)
+	{
+		ret |= run(base, 1, chunks[i], text, len);
+		ret |= run(base, 0, chunks[i], text, len);
+	}
+
+	libws_test_STATUS("Invalid UTF8 in a direct message:");
+
+	ret |= run_invalid_utf8(base, 1);
+	ret |= run_invalid_utf8(base, 4096);
+
+	ws_global_destroy(&base);
+
+	return ret;
+}
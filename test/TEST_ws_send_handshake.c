@@ -8,7 +8,6 @@
 
 static int do_test(ws_t ws, struct evbuffer *out, int success_expected)
 {
-	int ret = 0;
 	evbuffer_drain(out, evbuffer_get_length(out));
 
 	if (_ws_send_handshake(ws, out))
@@ -72,10 +71,10 @@ int TEST_ws_send_handshake(int argc, char *argv[])
 			goto fail;
 		}
 
-		ws->server = strdup("example.com");
+		ws->server = _ws_strdup("example.com");
 		ws->port = 123;
-		ws->uri = strdup("some_uri/path");
-		ws->origin = strdup("example.com");
+		ws->uri = _ws_strdup("some_uri/path");
+		ws_set_origin(ws, "example.com");
 
 		ws_add_subprotocol(ws, "echo");
 		ws_add_subprotocol(ws, "tut");
@@ -94,9 +93,9 @@ int TEST_ws_send_handshake(int argc, char *argv[])
 			goto fail;
 		}
 
-		ws->server = strdup("example.com");
+		ws->server = _ws_strdup("example.com");
 		ws->port = 123;
-		ws->uri = strdup("some_uri/path");
+		ws->uri = _ws_strdup("some_uri/path");
 
 		ret |= do_test(ws, out, 1);
 
@@ -126,9 +125,9 @@ int TEST_ws_send_handshake(int argc, char *argv[])
 			goto fail;
 		}
 
-		ws->server = strdup("example.com");
+		ws->server = _ws_strdup("example.com");
 		ws->port = 123;
-		ws->uri = strdup("some_uri/path");
+		ws->uri = _ws_strdup("some_uri/path");
 
 		ws_set_memory_functions(libws_test_malloc,
 							 free,
@@ -0,0 +1,297 @@
+#include "libws.h"
+#include "libws_private.h"
+#include "libws_test_helpers.h"
+#include "libws_test_server.h"
+#include <string.h>
+
+#define KEEPALIVE_CONNECTIONS 2
+#define KEEPALIVE_SAMPLES 3
+
+typedef struct keepalive_test_s
+{
+	ws_base_t base;
+	ws_t ws[KEEPALIVE_CONNECTIONS];
+	int count;
+	int connected;
+	int closed;
+	int pongs;
+	int staggered;
+	ws_close_status_t status;
+	char reason[64];
+} keepalive_test_t;
+
+static void keepalive_onpong(ws_t ws, char *msg, uint64_t len,
+						int binary, void *arg)
+{
+	keepalive_test_t *t = (keepalive_test_t *)ws_get_user_state(ws);
+	t->pongs++;
+}
+
+static void keepalive_onconnect(ws_t ws, void *arg)
+{
+	keepalive_test_t *t = (keepalive_test_t *)arg;
+	struct timeval first;
+	struct timeval second;
+	struct timeval diff;
+
+	if (++t->connected < t->count)
+		return;
+
+	if (t->count < 2)
+		return;
+
+	// The first pings of the two connections should not be due together.
+	_ws_timer_remaining(&t->base->timers, &t->ws[0]->keepalive_timer, &first);
+	_ws_timer_remaining(&t->base->timers, &t->ws[1]->keepalive_timer, &second);
+
+	if (evutil_timercmp(&first, &second, <))
+		evutil_timersub(&second, &first, &diff);
+	else
+		evutil_timersub(&first, &second, &diff);
+
+	t->staggered = (diff.tv_sec > 0) || (diff.tv_usec >= 10000);
+}
+
+static void keepalive_onclose(ws_t ws, ws_close_status_t status,
+						const char *reason, size_t reason_len, void *arg)
+{
+	keepalive_test_t *t = (keepalive_test_t *)arg;
+
+	t->status = status;
+
+	if (reason)
+	{
+		strncpy(t->reason, reason, sizeof(t->reason) - 1);
+	}
+
+	if (++t->closed == t->count)
+	{
+		ws_base_quit(t->base, 1);
+	}
+}
+
+static void keepalive_poll(evutil_socket_t fd, short what, void *arg)
+{
+	keepalive_test_t *t = (keepalive_test_t *)arg;
+	ws_rtt_stats_t rtt;
+	int i;
+
+	for (i = 0; i < t->count; i++)
+	{
+		if (ws_get_rtt_stats(t->ws[i], &rtt)
+			|| (rtt.count < KEEPALIVE_SAMPLES))
+		{
+			return;
+		}
+	}
+
+	for (i = 0; i < t->count; i++)
+	{
+		ws_close(t->ws[i]);
+	}
+}
+
+static void keepalive_give_up(evutil_socket_t fd, short what, void *arg)
+{
+	keepalive_test_t *t = (keepalive_test_t *)arg;
+	libws_test_FAILURE("Timed out");
+	ws_base_quit(t->base, 0);
+}
+
+static int keepalive_run(keepalive_test_t *t, libws_test_server_t *srv,
+						struct timeval interval, struct timeval timeout)
+{
+	int i;
+	int ret = 0;
+	struct event *poll = NULL;
+	struct event *give_up = NULL;
+	struct timeval poll_tv = {0, 10000};
+	struct timeval give_up_tv = {5, 0};
+
+	t->connected = 0;
+	t->closed = 0;
+
+	for (i = 0; i < t->count; i++)
+	{
+		ws_set_user_state(t->ws[i], t);
+		ws_set_onconnect_cb(t->ws[i], keepalive_onconnect, t);
+		ws_set_onpong_cb(t->ws[i], keepalive_onpong, t);
+		ws_set_onclose_cb(t->ws[i], keepalive_onclose, t);
+
+		if (ws_set_keepalive(t->ws[i], interval, timeout, 0))
+		{
+			libws_test_FAILURE("Failed to set keepalive");
+			return -1;
+		}
+
+		if (ws_connect(t->ws[i], "127.0.0.1",
+						libws_test_server_get_port(srv), ""))
+		{
+			libws_test_FAILURE("Failed to connect to test server");
+			return -1;
+		}
+	}
+
+	poll = event_new(t->base->ev_base, -1, EV_PERSIST, keepalive_poll, t);
+	give_up = evtimer_new(t->base->ev_base, keepalive_give_up, t);
+	event_add(poll, &poll_tv);
+	evtimer_add(give_up, &give_up_tv);
+
+	ws_base_service_blocking(t->base);
+
+	if (t->closed != t->count)
+	{
+		libws_test_FAILURE("Only %d of %d connections closed",
+							t->closed, t->count);
+		ret = -1;
+	}
+
+	event_free(poll);
+	event_free(give_up);
+
+	return ret;
+}
+
+int TEST_ws_set_keepalive(int argc, char **argv)
+{
+	int i;
+	int ret = 0;
+	ws_base_t base = NULL;
+	ws_rtt_stats_t rtt;
+	keepalive_test_t t;
+	libws_test_server_t *srv = NULL;
+	struct timeval interval = {0, 50000};
+	struct timeval timeout = {0, 500000};
+
+	libws_test_HEADLINE("TEST_ws_set_keepalive");
+
+	memset(&t, 0, sizeof(t));
+
+	if (ws_global_init(&base))
+	{
+		libws_test_FAILURE("Failed to init global state");
+		return -1;
+	}
+
+	t.base = base;
+
+	for (i = 0; i < KEEPALIVE_CONNECTIONS; i++)
+	{
+		if (ws_init(&t.ws[i], base))
+		{
+			libws_test_FAILURE("Failed to init websocket state");
+			ret = -1;
+			goto fail;
+		}
+	}
+
+	if (!(srv = libws_test_server_new(base->ev_base, 0)))
+	{
+		libws_test_FAILURE("Failed to start test server");
+		ret = -1;
+		goto fail;
+	}
+
+	if (!ws_get_rtt_stats(t.ws[0], &rtt))
+	{
+		libws_test_FAILURE("Got round trip times before any ping");
+		ret = -1;
+	}
+
+	libws_test_STATUS("Measure round trip times on %d connections",
+						KEEPALIVE_CONNECTIONS);
+
+	t.count = KEEPALIVE_CONNECTIONS;
+
+	if (keepalive_run(&t, srv, interval, timeout))
+	{
+		ret = -1;
+		goto fail;
+	}
+
+	if (t.staggered)
+	{
+		libws_test_SUCCESS("First pings are staggered");
+	}
+	else
+	{
+		libws_test_FAILURE("First pings are due at the same time");
+		ret = -1;
+	}
+
+	if (t.pongs)
+	{
+		libws_test_FAILURE("Keepalive pong passed to the pong callback");
+		ret = -1;
+	}
+
+	if (libws_test_server_get_ping_count(srv)
+		< (KEEPALIVE_CONNECTIONS * KEEPALIVE_SAMPLES))
+	{
+		libws_test_FAILURE("Server only got %llu pings",
+			(unsigned long long)libws_test_server_get_ping_count(srv));
+		ret = -1;
+	}
+
+	for (i = 0; i < KEEPALIVE_CONNECTIONS; i++)
+	{
+		ws_get_rtt_stats(t.ws[i], &rtt);
+
+		if ((rtt.count < KEEPALIVE_SAMPLES)
+			|| (rtt.min > rtt.p50) || (rtt.p50 > rtt.p99)
+			|| (rtt.p99 > rtt.max) || (rtt.max > 500000))
+		{
+			libws_test_FAILURE("Bad round trip times: count %llu min %llu "
+				"p50 %llu p99 %llu max %llu",
+				(unsigned long long)rtt.count, (unsigned long long)rtt.min,
+				(unsigned long long)rtt.p50, (unsigned long long)rtt.p99,
+				(unsigned long long)rtt.max);
+			ret = -1;
+		}
+		else
+		{
+			libws_test_SUCCESS("%llu round trips, p50 %llu us, max %llu us",
+				(unsigned long long)rtt.count, (unsigned long long)rtt.p50,
+				(unsigned long long)rtt.max);
+		}
+	}
+
+	libws_test_STATUS("Close when pongs stop arriving");
+
+	libws_test_server_set_ignore_pings(srv, 1);
+	interval.tv_usec = 20000;
+	timeout.tv_usec = 100000;
+	t.count = 1;
+
+	if (keepalive_run(&t, srv, interval, timeout))
+	{
+		ret = -1;
+		goto fail;
+	}
+
+	if ((t.status != WS_CLOSE_STATUS_ABNORMAL_1006)
+		|| strcmp(t.reason, "Keepalive timeout"))
+	{
+		libws_test_FAILURE("Closed with %d \"%s\"", t.status, t.reason);
+		ret = -1;
+	}
+	else
+	{
+		libws_test_SUCCESS("Closed with %d \"%s\"", t.status, t.reason);
+	}
+
+fail:
+	for (i = 0; i < KEEPALIVE_CONNECTIONS; i++)
+	{
+		ws_destroy(&t.ws[i]);
+	}
+
+	if (srv)
+	{
+		libws_test_server_free(srv);
+	}
+
+	ws_global_destroy(&base);
+
+	return ret;
+}
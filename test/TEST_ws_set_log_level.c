@@ -0,0 +1,95 @@
+#include "libws_test_helpers.h"
+#include "libws.h"
+#include "libws_log.h"
+#include <string.h>
+
+static int evaluated;
+static int logged;
+
+static int count_eval()
+{
+	return ++evaluated;
+}
+
+static void count_log_cb(int prio, const char *file,
+				const char *func, int line, const char *fmt, va_list args)
+{
+	logged++;
+}
+
+static int check_counts(const char *msg, int expect_evaluated, int expect_logged)
+{
+	if ((evaluated != expect_evaluated) || (logged != expect_logged))
+	{
+		libws_test_FAILURE("  %s: %d evaluated, %d logged, expected %d and %d",
+							msg, evaluated, logged,
+							expect_evaluated, expect_logged);
+		return -1;
+	}
+
+	libws_test_SUCCESS("  %s", msg);
+	return 0;
+}
+
+//
+// Emulates building with LIBWS_LOG_MIN_LEVEL=INFO, the
+// macro is only expanded where LIBWS_LOG is used.
+//
+static void log_with_floor()
+{
+	#undef LIBWS_LOG_MIN_LEVEL
+	#define LIBWS_LOG_MIN_LEVEL LIBWS_INFO
+	LIBWS_LOG(LIBWS_DEBUG, "Compiled out %d", count_eval());
+	LIBWS_LOG(LIBWS_INFO, "Kept %d", count_eval());
+
+	// The rest of the test expects nothing to be compiled out.
+	#undef LIBWS_LOG_MIN_LEVEL
+	#define LIBWS_LOG_MIN_LEVEL LIBWS_TRACE
+}
+
+int TEST_ws_set_log_level(int argc, char *argv[])
+{
+	int ret = 0;
+	int level;
+
+	libws_test_HEADLINE("TEST_ws_set_log_level");
+	if (libws_test_init(argc, argv)) return -1;
+
+	#ifndef LIBWS_WITH_LOG
+	libws_test_SKIPPED("Not compiled with logging");
+	return 0;
+	#endif
+
+	level = ws_get_log_level();
+	ws_set_log_cb(count_log_cb);
+
+	libws_test_STATUS("Disabled priorities:");
+	{
+		ws_set_log_level(LIBWS_ERR);
+		LIBWS_LOG(LIBWS_DEBUG, "Not logged %d", count_eval());
+		ret |= check_counts("Arguments not evaluated", 0, 0);
+	}
+
+	libws_test_STATUS("Enabled priorities:");
+	{
+		LIBWS_LOG(LIBWS_ERR, "Logged %d", count_eval());
+		ret |= check_counts("Logged once", 1, 1);
+
+		ws_set_log_level(LIBWS_LOG_UPTO(LIBWS_DEBUG));
+		LIBWS_LOG(LIBWS_DEBUG, "Logged %d", count_eval());
+		LIBWS_LOG(LIBWS_TRACE, "Not logged %d", count_eval());
+		ret |= check_counts("Logged up to DEBUG", 2, 2);
+	}
+
+	libws_test_STATUS("Priorities below the compile time minimum:");
+	{
+		ws_set_log_level(-1);
+		log_with_floor();
+		ret |= check_counts("Only INFO logged", 3, 3);
+	}
+
+	ws_set_log_level(level);
+	ws_set_log_cb(libws_test_log_on() ? ws_default_log_cb : NULL);
+
+	return ret;
+}
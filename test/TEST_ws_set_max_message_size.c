@@ -0,0 +1,360 @@
+#include "libws_test_helpers.h"
+#include "libws.h"
+#include "libws_private.h"
+#include "libws_header.h"
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <string.h>
+#include <stdlib.h>
+
+typedef struct limit_test_s
+{
+	int msgs;
+	uint64_t len;
+	int aborts;
+	int aborted_after_close;	///< The close was sent before the abort.
+	char buf[4096];				///< For the buffer provider.
+	size_t used;
+} limit_test_t;
+
+static int get_close_status(ws_t ws);
+
+static void onmsg(ws_t ws, char *msg, uint64_t len, int binary, void *arg)
+{
+	limit_test_t *t = (limit_test_t *)arg;
+	t->msgs++;
+	t->len = len;
+}
+
+static void onabort(ws_t ws, ws_close_status_t status, void *arg)
+{
+	limit_test_t *t = (limit_test_t *)arg;
+
+	if (status == WS_CLOSE_STATUS_MESSAGE_TOO_BIG_1009)
+		t->aborts++;
+
+	t->aborted_after_close |= (get_close_status(ws) != 0);
+}
+
+static char *onalloc(ws_t ws, uint64_t *len, int binary, void *arg)
+{
+	limit_test_t *t = (limit_test_t *)arg;
+	char *dst = &t->buf[t->used];
+
+	if (*len > (sizeof(t->buf) - t->used))
+		*len = sizeof(t->buf) - t->used;
+
+	t->used += (size_t)*len;
+
+	return dst;
+}
+
+static void oncommit(ws_t ws, char *buf, uint64_t len, int binary,
+					int msg_end, void *arg)
+{
+	limit_test_t *t = (limit_test_t *)arg;
+
+	if (msg_end == WS_RECV_MSG_ABORTED)
+	{
+		t->aborts++;
+		t->aborted_after_close |= (get_close_status(ws) != 0);
+	}
+	else if (msg_end)
+	{
+		t->msgs++;
+		t->len = t->used;
+	}
+}
+
+///
+/// Adds a frame header followed by up to len bytes of payload.
+///
+static void add_frame(struct evbuffer *in, ws_opcode_t opcode, int fin,
+						uint64_t len, size_t payload_len)
+{
+	ws_header_t h;
+	uint8_t header[WS_HDR_MAX_SIZE];
+	size_t header_len;
+	char *payload = (char *)calloc(1, payload_len + 1);
+
+	memset(&h, 0, sizeof(h));
+	h.fin = fin;
+	h.opcode = opcode;
+	h.payload_len = len;
+	ws_pack_header(&h, header, sizeof(header), &header_len);
+
+	evbuffer_add(in, header, header_len);
+	evbuffer_add(in, payload, payload_len);
+	free(payload);
+}
+
+///
+/// Gets the status of the close frame sent, 0 if there is none.
+///
+static int get_close_status(ws_t ws)
+{
+	ws_header_t h;
+	size_t header_len;
+	uint8_t buf[WS_HDR_MAX_SIZE + 2];
+	struct evbuffer *out = bufferevent_get_output(ws->bev);
+	ev_ssize_t len;
+
+	// Without a socket libevent keeps the start of the output frozen.
+	evbuffer_unfreeze(out, 1);
+	len = evbuffer_copyout(out, buf, sizeof(buf));
+	evbuffer_freeze(out, 1);
+
+	if ((len < 0)
+		|| (ws_unpack_header(&h, &header_len, buf, (size_t)len)
+			!= WS_PARSE_STATE_SUCCESS)
+		|| (h.opcode != WS_OPCODE_CLOSE_0X8)
+		|| ((size_t)len < (header_len + 2)))
+	{
+		return 0;
+	}
+
+	ws_unmask_payload(h.mask, (char *)&buf[header_len], 2);
+
+	return (buf[header_len] << 8) | buf[header_len + 1];
+}
+
+static int run(ws_base_t base, const char *name, uint64_t max_msg,
+				uint64_t max_frame, uint64_t len2, int expect_msgs,
+				int provided)
+{
+	int ret = 0;
+	int status;
+	ws_t ws = NULL;
+	limit_test_t t;
+	struct evbuffer *in = evbuffer_new();
+	#ifdef LIBWS_WITH_STATS
+	ws_stats_t stats;
+	#endif
+
+	memset(&t, 0, sizeof(t));
+
+	if (ws_init(&ws, base)
+		|| !(ws->bev = bufferevent_socket_new(base->ev_base, -1, 0)))
+	{
+		libws_test_FAILURE("Failed to init websocket state");
+		ret = -1;
+		goto fail;
+	}
+
+	ws->state = WS_STATE_CONNECTED;
+	ws_set_onmsg_cb(ws, onmsg, &t);
+	ws_set_onmsg_abort_cb(ws, onabort, &t);
+
+	if (provided)
+	{
+		ws_set_recv_buffer_provider(ws, onalloc, oncommit, &t);
+	}
+
+	if (ws_set_max_message_size(ws, max_msg)
+		|| ws_set_max_frame_size_recv(ws, max_frame)
+		|| (ws_get_max_message_size(ws) != max_msg)
+		|| (ws_get_max_frame_size_recv(ws) != max_frame))
+	{
+		libws_test_FAILURE("%s: failed to set limits", name);
+		ret = -1;
+		goto fail;
+	}
+
+	// The second frame only has the header, the payload
+	// must not be waited for if it goes over the limit.
+	add_frame(in, WS_OPCODE_BINARY_0X2, 0, 1000, 1000);
+	add_frame(in, WS_OPCODE_CONTINUATION_0X0, 1, len2,
+				expect_msgs ? (size_t)len2 : 0);
+	_ws_read_websocket(ws, in);
+
+	status = get_close_status(ws);
+
+	if (t.msgs != expect_msgs)
+	{
+		libws_test_FAILURE("%s: got %d messages, expected %d",
+							name, t.msgs, expect_msgs);
+		ret = -1;
+	}
+	else if (expect_msgs && (t.len != (1000 + len2)))
+	{
+		libws_test_FAILURE("%s: got %llu bytes", name,
+							(unsigned long long)t.len);
+		ret = -1;
+	}
+	else if (status != (expect_msgs ? 0 : WS_CLOSE_STATUS_MESSAGE_TOO_BIG_1009))
+	{
+		libws_test_FAILURE("%s: close status %d", name, status);
+		ret = -1;
+	}
+	else if ((t.aborts != !expect_msgs) || t.aborted_after_close)
+	{
+		libws_test_FAILURE("%s: %d abort notifications%s", name, t.aborts,
+							t.aborted_after_close ? " after the close" : "");
+		ret = -1;
+	}
+	else if (!expect_msgs && ws->msg_cap)
+	{
+		libws_test_FAILURE("%s: %u bytes still buffered", name,
+							(unsigned)ws->msg_cap);
+		ret = -1;
+	}
+	else
+	{
+		libws_test_SUCCESS("%s", name);
+	}
+
+	#ifdef LIBWS_WITH_STATS
+	ws_get_stats(ws, &stats);
+
+	if (stats.msgs_too_big_in != (uint64_t)!expect_msgs)
+	{
+		libws_test_FAILURE("%s: msgs_too_big_in = %llu", name,
+							(unsigned long long)stats.msgs_too_big_in);
+		ret = -1;
+	}
+	#endif
+
+fail:
+	if (ws) ws->state = WS_STATE_CLOSED_CLEANLY;
+	ws_destroy(&ws);
+	evbuffer_free(in);
+
+	return ret;
+}
+
+///
+/// Rejects a message and then checks the next one gets through, either
+/// after the rejected message ended or after reconnecting mid message.
+///
+static int run_after_reject(ws_base_t base, const char *name, int reconnect)
+{
+	int ret = 0;
+	ws_t ws = NULL;
+	limit_test_t t;
+	struct evbuffer *in = evbuffer_new();
+
+	memset(&t, 0, sizeof(t));
+
+	if (ws_init(&ws, base)
+		|| !(ws->bev = bufferevent_socket_new(base->ev_base, -1, 0)))
+	{
+		libws_test_FAILURE("Failed to init websocket state");
+		ret = -1;
+		goto fail;
+	}
+
+	ws->state = WS_STATE_CONNECTED;
+	ws_set_onmsg_cb(ws, onmsg, &t);
+	ws_set_onmsg_abort_cb(ws, onabort, &t);
+	ws_set_max_message_size(ws, 2000);
+
+	// When reconnecting the rest of the message never arrives.
+	add_frame(in, WS_OPCODE_BINARY_0X2, 0, 1000, 1000);
+	add_frame(in, WS_OPCODE_CONTINUATION_0X0, 1, 1001,
+				reconnect ? 0 : 1001);
+	_ws_read_websocket(ws, in);
+
+	if (reconnect)
+	{
+		_ws_shutdown(ws);
+		ws->state = WS_STATE_CLOSED_UNCLEANLY;
+
+		// The connect is never serviced, the frames are fed directly.
+		if (ws_connect(ws, "127.0.0.1", 1, "/"))
+		{
+			libws_test_FAILURE("%s: failed to reconnect", name);
+			ret = -1;
+			goto fail;
+		}
+
+		ws->state = WS_STATE_CONNECTED;
+	}
+
+	if (ws->recv_too_big || ws->recv_msg_len)
+	{
+		libws_test_FAILURE("%s: the rejected message was not forgotten", name);
+		ret = -1;
+		goto fail;
+	}
+
+	add_frame(in, WS_OPCODE_BINARY_0X2, 1, 1000, 1000);
+	_ws_read_websocket(ws, in);
+
+	if ((t.msgs != 1) || (t.len != 1000) || (t.aborts != 1))
+	{
+		libws_test_FAILURE("%s: got %d messages of %llu bytes, %d aborts",
+							name, t.msgs, (unsigned long long)t.len, t.aborts);
+		ret = -1;
+	}
+	else
+	{
+		libws_test_SUCCESS("%s", name);
+	}
+
+fail:
+	if (ws) ws->state = WS_STATE_CLOSED_CLEANLY;
+	ws_destroy(&ws);
+	evbuffer_free(in);
+
+	return ret;
+}
+
+int TEST_ws_set_max_message_size(int argc, char *argv[])
+{
+	int ret = 0;
+	ws_base_t base = NULL;
+
+	libws_test_HEADLINE("TEST_ws_set_max_message_size");
+	if (libws_test_init(argc, argv)) return -1;
+
+	if (ws_global_init(&base))
+	{
+		libws_test_FAILURE("Failed to init global state");
+		return -1;
+	}
+
+	libws_test_STATUS("Fragmented message of 1000 + n bytes:");
+
+	ret |= run(base, "  No limits", 0, 0, 1000, 1, 0);
+	ret |= run(base, "  At the message limit", 2000, 0, 1000, 1, 0);
+	ret |= run(base, "  At the frame limit", 0, 1000, 1000, 1, 0);
+	ret |= run(base, "  Over the message limit", 2000, 0, 1001, 0, 0);
+	ret |= run(base, "  Over the frame limit", 0, 1000, 1001, 0, 0);
+	ret |= run(base, "  Declares a huge frame", 1 << 20, 0,
+				WS_MAX_PAYLOAD_LEN, 0, 0);
+
+	libws_test_STATUS("Into provided buffers:");
+
+	ret |= run(base, "  At the message limit", 2000, 0, 1000, 1, 1);
+	ret |= run(base, "  Over the message limit", 2000, 0, 1001, 0, 1);
+	ret |= run(base, "  Over the frame limit", 0, 1000, 1001, 0, 1);
+
+	libws_test_STATUS("After a rejected message:");
+
+	ret |= run_after_reject(base, "  Once it ended", 0);
+	ret |= run_after_reject(base, "  After reconnecting", 1);
+
+	libws_test_STATUS("Invalid limits:");
+
+	{
+		ws_t ws = NULL;
+
+		if (ws_init(&ws, base)
+			|| !ws_set_max_message_size(ws, (uint64_t)WS_MAX_PAYLOAD_LEN + 1)
+			|| !ws_set_max_frame_size_recv(ws, (uint64_t)WS_MAX_PAYLOAD_LEN + 1))
+		{
+			libws_test_FAILURE("  Allowed a limit over the max payload length");
+			ret = -1;
+		}
+		else
+		{
+			libws_test_SUCCESS("  Refused a limit over the max payload length");
+		}
+
+		ws_destroy(&ws);
+	}
+
+	ws_global_destroy(&base);
+
+	return ret;
+}
@@ -0,0 +1,282 @@
+#include "libws.h"
+#include "libws_private.h"
+#include "libws_test_helpers.h"
+#include "libws_test_server.h"
+#include <string.h>
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+
+#define STEADY_MESSAGES 1000000
+#define STEADY_WARMUP 1000
+#define STEADY_IN_FLIGHT 16
+#define STEADY_MAX_MSG_SIZE 4096
+
+static const size_t steady_sizes[] =
+{
+	0, 1, 17, 125, 126, 300, 1000, 2048, 65, 4096, 3000, 7
+};
+
+#define STEADY_SIZE_COUNT (sizeof(steady_sizes) / sizeof(steady_sizes[0]))
+
+typedef struct steady_test_s
+{
+	ws_base_t base;
+	char pattern[STEADY_MAX_MSG_SIZE];
+	char buf[STEADY_MAX_MSG_SIZE];
+	int sent;
+	int received;
+	int bad;
+	int closed;
+	int warm_allocs;
+} steady_test_t;
+
+static int frees;
+
+static void counting_free(void *ptr)
+{
+	if (ptr) frees++;
+	free(ptr);
+}
+
+#ifndef _WIN32
+static void *cache_thread(void *arg)
+{
+	int *frees_before_exit = (int *)arg;
+
+	_ws_free(_ws_malloc(100));
+	*frees_before_exit = frees;
+
+	return NULL;
+}
+
+///
+/// Checks that a thread gives its cached blocks back when it exits.
+///
+static int check_thread_exit()
+{
+	pthread_t thread;
+	int frees_before = frees;
+	int frees_before_exit = 0;
+
+	if (pthread_create(&thread, NULL, cache_thread, &frees_before_exit))
+	{
+		libws_test_FAILURE("Failed to create a thread");
+		return -1;
+	}
+
+	pthread_join(thread, NULL);
+
+	if ((frees_before_exit != frees_before)
+		|| (frees != (frees_before + 1)))
+	{
+		libws_test_FAILURE("%d blocks freed before the thread exited, "
+							"%d after", frees_before_exit - frees_before,
+							frees - frees_before_exit);
+		return -1;
+	}
+
+	libws_test_SUCCESS("Cached blocks freed when the thread exited");
+	return 0;
+}
+#endif // !_WIN32
+
+static int steady_alloc_count()
+{
+	return libws_test_get_malloc_count() + libws_test_get_realloc_count();
+}
+
+static void steady_send(steady_test_t *t, ws_t ws)
+{
+	size_t len = steady_sizes[t->sent % STEADY_SIZE_COUNT];
+
+	// Sending masks the data in place.
+	memcpy(t->buf, t->pattern, len);
+	ws_send_msg_ex(ws, t->buf, len, 1);
+	t->sent++;
+}
+
+static void steady_onconnect(ws_t ws, void *arg)
+{
+	int i;
+	steady_test_t *t = (steady_test_t *)arg;
+
+	for (i = 0; i < STEADY_IN_FLIGHT; i++)
+	{
+		steady_send(t, ws);
+	}
+}
+
+static void steady_onmsg(ws_t ws, char *msg, uint64_t len,
+						int binary, void *arg)
+{
+	steady_test_t *t = (steady_test_t *)arg;
+	size_t expected_len = steady_sizes[t->received % STEADY_SIZE_COUNT];
+
+	if ((len != expected_len) || memcmp(msg, t->pattern, (size_t)len))
+	{
+		t->bad++;
+	}
+
+	t->received++;
+
+	if (t->received == STEADY_WARMUP)
+	{
+		t->warm_allocs = steady_alloc_count();
+	}
+
+	if (t->sent < STEADY_MESSAGES)
+	{
+		steady_send(t, ws);
+	}
+	else if (t->received == STEADY_MESSAGES)
+	{
+		ws_base_quit(t->base, 0);
+	}
+}
+
+static void steady_onclose(ws_t ws, ws_close_status_t status,
+						const char *reason, size_t reason_len, void *arg)
+{
+	steady_test_t *t = (steady_test_t *)arg;
+	t->closed++;
+	ws_base_quit(t->base, 0);
+}
+
+static void steady_give_up(evutil_socket_t fd, short what, void *arg)
+{
+	steady_test_t *t = (steady_test_t *)arg;
+	libws_test_FAILURE("Timed out");
+	ws_base_quit(t->base, 0);
+}
+
+int TEST_ws_set_memory_functions(int argc, char **argv)
+{
+	int i;
+	int ret = 0;
+	int steady_allocs;
+	ws_t ws = NULL;
+	steady_test_t *t = NULL;
+	libws_test_server_t *srv = NULL;
+	struct event *give_up = NULL;
+	struct timeval give_up_tv = {120, 0};
+
+	libws_test_HEADLINE("TEST_ws_set_memory_functions");
+
+	#ifndef LIBWS_WITH_MEMORY_ACCOUNTING
+	libws_test_SKIPPED("Freed blocks are only reused with memory accounting");
+	return 0;
+	#endif
+
+	#ifndef LIBWS_HAVE_THREAD_LOCAL
+	libws_test_SKIPPED("Freed blocks are only reused with thread local storage");
+	return 0;
+	#endif
+
+	if (!(t = (steady_test_t *)calloc(1, sizeof(steady_test_t))))
+	{
+		libws_test_FAILURE("Out of memory");
+		return -1;
+	}
+
+	for (i = 0; i < STEADY_MAX_MSG_SIZE; i++)
+	{
+		t->pattern[i] = 'a' + (i % 26);
+	}
+
+	// Count everything libws, libevent and OpenSSL allocate.
+	ws_set_memory_functions(libws_test_malloc, counting_free,
+							libws_test_realloc);
+
+	if (ws_global_init(&t->base))
+	{
+		libws_test_FAILURE("Failed to init global state");
+		ret = -1;
+		goto fail;
+	}
+
+	if (!(srv = libws_test_server_new(t->base->ev_base, 0)))
+	{
+		libws_test_FAILURE("Failed to start test server");
+		ret = -1;
+		goto fail;
+	}
+
+	if (ws_init(&ws, t->base))
+	{
+		libws_test_FAILURE("Failed to init websocket state");
+		ret = -1;
+		goto fail;
+	}
+
+	ws_set_onconnect_cb(ws, steady_onconnect, t);
+	ws_set_onmsg_cb(ws, steady_onmsg, t);
+	ws_set_onclose_cb(ws, steady_onclose, t);
+
+	if (ws_connect(ws, "127.0.0.1", libws_test_server_get_port(srv), ""))
+	{
+		libws_test_FAILURE("Failed to connect to test server");
+		ret = -1;
+		goto fail;
+	}
+
+	libws_test_STATUS("Echo %d messages of up to %d bytes, %d at a time",
+						STEADY_MESSAGES, STEADY_MAX_MSG_SIZE, STEADY_IN_FLIGHT);
+
+	give_up = evtimer_new(t->base->ev_base, steady_give_up, t);
+	evtimer_add(give_up, &give_up_tv);
+
+	ws_base_service_blocking(t->base);
+
+	steady_allocs = steady_alloc_count();
+
+	if ((t->received != STEADY_MESSAGES) || t->closed)
+	{
+		libws_test_FAILURE("Received %d of %d messages, %d closed",
+							t->received, STEADY_MESSAGES, t->closed);
+		ret = -1;
+		goto fail;
+	}
+
+	if (t->bad)
+	{
+		libws_test_FAILURE("%d messages were corrupted", t->bad);
+		ret = -1;
+	}
+	else
+	{
+		libws_test_SUCCESS("All messages were intact");
+	}
+
+	libws_test_STATUS("%d allocations during the first %d messages, "
+						"%d after that", t->warm_allocs, STEADY_WARMUP,
+						steady_allocs - t->warm_allocs);
+
+	if (steady_allocs != t->warm_allocs)
+	{
+		libws_test_FAILURE("Messages allocated memory after warmup");
+		ret = -1;
+	}
+	else
+	{
+		libws_test_SUCCESS("No allocations per message after warmup");
+	}
+
+fail:
+	if (give_up) event_free(give_up);
+	ws_destroy(&ws);
+	if (srv) libws_test_server_free(srv);
+
+	if (t->base)
+	{
+		ws_global_destroy(&t->base);
+	}
+
+	free(t);
+
+	#ifndef _WIN32
+	ret |= check_thread_exit();
+	#endif
+
+	return ret;
+}
@@ -0,0 +1,305 @@
+#include "libws.h"
+#include "libws_private.h"
+#include "libws_test_helpers.h"
+#include "libws_test_server.h"
+#include <string.h>
+
+#define MEMLIMIT_SMALL_MSG_SIZE 1024
+#define MEMLIMIT_MSG_SIZE (64 * 1024)
+#define MEMLIMIT_HEADROOM (32 * 1024)
+#define MEMLIMIT_SLACK 1024
+
+typedef struct memlimit_test_s
+{
+	ws_base_t base;
+	char msg[MEMLIMIT_MSG_SIZE];
+	char expect[MEMLIMIT_MSG_SIZE];
+	size_t msg_len;
+	size_t limit;
+	int received;
+	int bad;
+	int closed;
+	ws_close_status_t status;
+	size_t connected_bytes;
+} memlimit_test_t;
+
+static void memlimit_no_copy_cleanup(ws_t ws, const void *data,
+									uint64_t datalen, void *extra)
+{
+	// The test owns the buffer.
+}
+
+static void memlimit_send(memlimit_test_t *t, ws_t ws, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+	{
+		t->expect[i] = 'a' + ((t->received + i) % 26);
+	}
+
+	// Sent by reference, so only the incoming
+	// message counts towards the limit.
+	memcpy(t->msg, t->expect, len);
+	t->msg_len = len;
+	ws_send_msg_ex(ws, t->msg, len, 1);
+}
+
+static void memlimit_onconnect(ws_t ws, void *arg)
+{
+	memlimit_test_t *t = (memlimit_test_t *)arg;
+
+	ws_get_memory_usage(ws, &t->connected_bytes, NULL);
+	t->limit = t->connected_bytes + MEMLIMIT_HEADROOM;
+	ws_set_memory_limit(ws, t->limit);
+
+	memlimit_send(t, ws, MEMLIMIT_SMALL_MSG_SIZE);
+}
+
+static void memlimit_onmsg(ws_t ws, char *msg, uint64_t len,
+						int binary, void *arg)
+{
+	memlimit_test_t *t = (memlimit_test_t *)arg;
+
+	if ((len != t->msg_len) || memcmp(msg, t->expect, len))
+	{
+		t->bad++;
+	}
+
+	t->received++;
+
+	if (t->received == 1)
+	{
+		// This one won't fit.
+		memlimit_send(t, ws, MEMLIMIT_MSG_SIZE);
+	}
+	else
+	{
+		ws_base_quit(t->base, 0);
+	}
+}
+
+static void memlimit_onclose(ws_t ws, ws_close_status_t status,
+						const char *reason, size_t reason_len, void *arg)
+{
+	memlimit_test_t *t = (memlimit_test_t *)arg;
+	t->closed++;
+	t->status = status;
+	ws_base_quit(t->base, 0);
+}
+
+static void memlimit_give_up(evutil_socket_t fd, short what, void *arg)
+{
+	memlimit_test_t *t = (memlimit_test_t *)arg;
+	libws_test_FAILURE("Timed out");
+	ws_base_quit(t->base, 0);
+}
+
+int TEST_ws_set_memory_limit(int argc, char **argv)
+{
+	int ret = 0;
+	size_t bytes = 0;
+	size_t base_bytes = 0;
+	size_t base_idle = 0;
+	size_t base_after = 0;
+	size_t peak = 0;
+	ws_t ws = NULL;
+	memlimit_test_t *t = NULL;
+	libws_test_server_t *srv = NULL;
+	struct event *give_up = NULL;
+	struct timeval give_up_tv = {10, 0};
+
+	libws_test_HEADLINE("TEST_ws_set_memory_limit");
+
+	if (!(t = (memlimit_test_t *)calloc(1, sizeof(memlimit_test_t))))
+	{
+		libws_test_FAILURE("Out of memory");
+		return -1;
+	}
+
+	#ifdef LIBWS_WITH_MEMORY_ACCOUNTING
+	// Account for the libevent and OpenSSL memory of the connection too.
+	if (ws_install_memory_hooks())
+	{
+		libws_test_FAILURE("Failed to install the memory hooks");
+		ret = -1;
+		goto fail;
+	}
+	#endif
+
+	if (ws_global_init(&t->base))
+	{
+		libws_test_FAILURE("Failed to init global state");
+		ret = -1;
+		goto fail;
+	}
+
+	if (ws_init(&ws, t->base))
+	{
+		libws_test_FAILURE("Failed to init websocket state");
+		ret = -1;
+		goto fail;
+	}
+
+	#ifndef LIBWS_WITH_MEMORY_ACCOUNTING
+	if (!ws_get_memory_usage(ws, &bytes, NULL)
+		|| !ws_set_memory_limit(ws, MEMLIMIT_HEADROOM))
+	{
+		libws_test_FAILURE("Got memory usage without accounting support");
+		ret = -1;
+	}
+	else
+	{
+		libws_test_SKIPPED("Compiled without memory accounting support");
+	}
+
+	goto fail;
+	#endif
+
+	ws_base_get_memory_usage(t->base, &base_idle, NULL);
+	ws_get_memory_usage(ws, &bytes, NULL);
+
+	if (bytes != 0)
+	{
+		libws_test_FAILURE("%u bytes used by a new connection", (unsigned)bytes);
+		ret = -1;
+	}
+
+	if (!(srv = libws_test_server_new(t->base->ev_base, 0)))
+	{
+		libws_test_FAILURE("Failed to start test server");
+		ret = -1;
+		goto fail;
+	}
+
+	ws_set_onconnect_cb(ws, memlimit_onconnect, t);
+	ws_set_onmsg_cb(ws, memlimit_onmsg, t);
+	ws_set_onclose_cb(ws, memlimit_onclose, t);
+	ws_set_no_copy_cb(ws, memlimit_no_copy_cleanup, t);
+
+	if (ws_connect(ws, "127.0.0.1", libws_test_server_get_port(srv), ""))
+	{
+		libws_test_FAILURE("Failed to connect to test server");
+		ret = -1;
+		goto fail;
+	}
+
+	give_up = evtimer_new(t->base->ev_base, memlimit_give_up, t);
+	evtimer_add(give_up, &give_up_tv);
+
+	ws_base_service_blocking(t->base);
+
+	ws_get_memory_usage(ws, &bytes, &peak);
+
+	libws_test_STATUS("Connected connection used %u bytes, %u at most "
+					"with a limit of %u", (unsigned)t->connected_bytes,
+					(unsigned)peak, (unsigned)t->limit);
+
+	if (t->connected_bytes == 0)
+	{
+		libws_test_FAILURE("The socket was not accounted for");
+		ret = -1;
+	}
+
+	if (t->bad || (t->received != 1))
+	{
+		libws_test_FAILURE("Received %d messages (%d corrupt), "
+							"expected 1", t->received, t->bad);
+		ret = -1;
+	}
+	else
+	{
+		libws_test_SUCCESS("Messages below the limit got through");
+	}
+
+	if (peak <= t->limit)
+	{
+		libws_test_FAILURE("The incoming message was not accounted for");
+		ret = -1;
+	}
+
+	if (!t->closed || (t->status != WS_CLOSE_STATUS_MESSAGE_TOO_BIG_1009))
+	{
+		libws_test_FAILURE("Expected a close with status 1009 after going "
+							"over the limit, got %d closes, status %d",
+							t->closed, (int)t->status);
+		ret = -1;
+	}
+	else
+	{
+		libws_test_SUCCESS("Closed with status 1009 after going over "
+							"the limit");
+	}
+
+	// The limit close must not carry over to the next connection.
+	t->closed = 0;
+
+	if (ws_connect(ws, "127.0.0.1", libws_test_server_get_port(srv), ""))
+	{
+		libws_test_FAILURE("Failed to reconnect to test server");
+		ret = -1;
+		goto fail;
+	}
+
+	ws_base_service_blocking(t->base);
+
+	if (t->closed || t->bad || (t->received != 2))
+	{
+		libws_test_FAILURE("Received %d messages (%d corrupt) after "
+							"reconnecting, expected 2, %d closes",
+							t->received, t->bad, t->closed);
+		ret = -1;
+	}
+	else
+	{
+		libws_test_SUCCESS("Messages got through after reconnecting");
+	}
+
+	ws_get_memory_usage(ws, &bytes, NULL);
+	ws_base_get_memory_usage(t->base, &base_bytes, NULL);
+
+	if (base_bytes < (base_idle + bytes))
+	{
+		libws_test_FAILURE("Base uses %u bytes, less than its connection (%u)",
+							(unsigned)base_bytes, (unsigned)bytes);
+		ret = -1;
+	}
+
+	ws_destroy(&ws);
+
+	// Let libevent finish freeing the connection.
+	libws_test_server_free(srv);
+	srv = NULL;
+	ws_base_service(t->base);
+
+	ws_base_get_memory_usage(t->base, &base_after, NULL);
+
+	// A few libevent structures owned by the event base might have been
+	// allocated on behalf of the connection, those are freed with the base.
+	if ((base_bytes - base_after + MEMLIMIT_SLACK) < bytes)
+	{
+		libws_test_FAILURE("Only %u of %u bytes were given back when the "
+							"connection was destroyed",
+							(unsigned)(base_bytes - base_after),
+							(unsigned)bytes);
+		ret = -1;
+	}
+	else
+	{
+		libws_test_SUCCESS("The connection memory was given back");
+	}
+
+fail:
+	if (give_up) event_free(give_up);
+	ws_destroy(&ws);
+	if (srv) libws_test_server_free(srv);
+
+	if (t->base)
+	{
+		ws_global_destroy(&t->base);
+	}
+
+	free(t);
+
+	return ret;
+}
@@ -0,0 +1,207 @@
+#include "libws_test_helpers.h"
+#include "libws.h"
+#include "libws_private.h"
+#include "libws_header.h"
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/event.h>
+#include <string.h>
+#include <stdio.h>
+
+#define PONG_TEST_PINGS 5
+
+typedef struct pong_test_s
+{
+	int pongs;					///< Pongs sent.
+	char last[32];				///< Payload of the last pong.
+} pong_test_t;
+
+static void add_pings(struct evbuffer *in, int first, int count)
+{
+	int i;
+	ws_header_t h;
+	uint8_t header[WS_HDR_MAX_SIZE];
+	size_t header_len;
+	char payload[32];
+
+	for (i = first; i < (first + count); i++)
+	{
+		snprintf(payload, sizeof(payload), "ping%d", i);
+
+		memset(&h, 0, sizeof(h));
+		h.fin = 1;
+		h.opcode = WS_OPCODE_PING_0X9;
+		h.payload_len = strlen(payload);
+		ws_pack_header(&h, header, sizeof(header), &header_len);
+
+		evbuffer_add(in, header, header_len);
+		evbuffer_add(in, payload, strlen(payload));
+	}
+}
+
+///
+/// Takes the pongs sent so far from the output.
+///
+static void get_pongs(ws_t ws, pong_test_t *t)
+{
+	ws_header_t h;
+	size_t header_len;
+	size_t len;
+	uint8_t *buf;
+	struct evbuffer *out = bufferevent_get_output(ws->bev);
+
+	memset(t, 0, sizeof(*t));
+
+	// Without a socket libevent keeps the start of the output frozen.
+	evbuffer_unfreeze(out, 1);
+
+	while ((len = evbuffer_get_length(out)) > 0)
+	{
+		buf = evbuffer_pullup(out, -1);
+
+		if ((ws_unpack_header(&h, &header_len, buf, len)
+				!= WS_PARSE_STATE_SUCCESS)
+			|| (len < (header_len + h.payload_len))
+			|| (h.payload_len >= sizeof(t->last)))
+		{
+			t->pongs = -1;
+			break;
+		}
+
+		if (h.opcode == WS_OPCODE_PONG_0XA)
+		{
+			t->pongs++;
+			memcpy(t->last, &buf[header_len], (size_t)h.payload_len);
+			t->last[h.payload_len] = '\0';
+			ws_unmask_payload(h.mask, t->last, (size_t)h.payload_len);
+		}
+
+		evbuffer_drain(out, header_len + (size_t)h.payload_len);
+	}
+
+	evbuffer_freeze(out, 1);
+}
+
+static int check(ws_t ws, const char *name, int pongs, const char *last,
+				int suppressed)
+{
+	pong_test_t t;
+	#ifdef LIBWS_WITH_STATS
+	ws_stats_t stats;
+	#endif
+
+	get_pongs(ws, &t);
+
+	if ((t.pongs != pongs) || (pongs && strcmp(t.last, last)))
+	{
+		libws_test_FAILURE("%s: %d pongs, last \"%s\"", name, t.pongs, t.last);
+		return -1;
+	}
+
+	#ifdef LIBWS_WITH_STATS
+	ws_get_stats(ws, &stats);
+
+	if (stats.pongs_suppressed != (uint64_t)suppressed)
+	{
+		libws_test_FAILURE("%s: pongs_suppressed = %llu", name,
+							(unsigned long long)stats.pongs_suppressed);
+		return -1;
+	}
+	#endif
+
+	libws_test_SUCCESS("%s", name);
+
+	return 0;
+}
+
+int TEST_ws_set_pong_coalescing(int argc, char *argv[])
+{
+	int ret = 0;
+	ws_base_t base = NULL;
+	ws_t ws = NULL;
+	struct evbuffer *in = NULL;
+	struct timeval no_limit = { 0, 0 };
+	struct timeval interval = { 0, 100000 };
+	struct timeval wait = { 0, 400000 };
+
+	libws_test_HEADLINE("TEST_ws_set_pong_coalescing");
+	if (libws_test_init(argc, argv)) return -1;
+
+	if (ws_global_init(&base))
+	{
+		libws_test_FAILURE("Failed to init global state");
+		return -1;
+	}
+
+	if (!(in = evbuffer_new())
+		|| ws_init(&ws, base)
+		|| !(ws->bev = bufferevent_socket_new(base->ev_base, -1, 0)))
+	{
+		libws_test_FAILURE("Failed to init websocket state");
+		ret = -1;
+		goto fail;
+	}
+
+	ws->state = WS_STATE_CONNECTED;
+
+	libws_test_STATUS("%d pings in one read:", PONG_TEST_PINGS);
+
+	add_pings(in, 0, PONG_TEST_PINGS);
+	_ws_read_websocket(ws, in);
+	ret |= check(ws, "  A pong for every ping", PONG_TEST_PINGS, "ping4", 0);
+
+	ws_set_pong_coalescing(ws, 1, no_limit);
+
+	add_pings(in, 0, PONG_TEST_PINGS);
+	_ws_read_websocket(ws, in);
+	ret |= check(ws, "  Coalesced", 1, "ping4", PONG_TEST_PINGS - 1);
+
+	add_pings(in, 5, 1);
+	_ws_read_websocket(ws, in);
+	ret |= check(ws, "  Next read answered", 1, "ping5", PONG_TEST_PINGS - 1);
+
+	{
+		// The first byte of the next frame header.
+		unsigned char partial = 0x82;
+
+		add_pings(in, 6, 2);
+		evbuffer_add(in, &partial, 1);
+		_ws_read_websocket(ws, in);
+		ret |= check(ws, "  Ends with a partial header", 1, "ping7",
+					PONG_TEST_PINGS);
+		evbuffer_drain(in, evbuffer_get_length(in));
+	}
+
+	libws_test_STATUS("Rate limited:");
+
+	ws_set_pong_coalescing(ws, 1, interval);
+
+	add_pings(in, 10, 2);
+	_ws_read_websocket(ws, in);
+	ret |= check(ws, "  First read answered", 1, "ping11", PONG_TEST_PINGS + 1);
+
+	add_pings(in, 20, 2);
+	_ws_read_websocket(ws, in);
+	add_pings(in, 30, 2);
+	_ws_read_websocket(ws, in);
+	ret |= check(ws, "  Within the interval", 0, "", PONG_TEST_PINGS + 4);
+
+	event_base_loopexit(base->ev_base, &wait);
+	event_base_dispatch(base->ev_base);
+	ret |= check(ws, "  Answered when the interval is up", 1, "ping31",
+				PONG_TEST_PINGS + 4);
+
+	add_pings(in, 40, 1);
+	_ws_read_websocket(ws, in);
+	ws_set_pong_coalescing(ws, 0, no_limit);
+	ret |= check(ws, "  Answered when disabled", 1, "ping40",
+				PONG_TEST_PINGS + 4);
+
+fail:
+	if (ws) ws->state = WS_STATE_CLOSED_CLEANLY;
+	ws_destroy(&ws);
+	if (in) evbuffer_free(in);
+	ws_global_destroy(&base);
+
+	return ret;
+}
@@ -0,0 +1,223 @@
+#include "libws_test_helpers.h"
+#include "libws.h"
+#include "libws_private.h"
+#include "libws_header.h"
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <string.h>
+#include <stdlib.h>
+
+#define PROVIDER_TEST_TEXT "Gr\xc3\xbc\xc3\x9f" "e, \xe6\x97\xa5\xe6\x9c\xac\xe8\xaa\x9e " \
+							"\xe2\x80\x94 libws! "
+#define PROVIDER_TEST_MASK 0x1a2b3c4d
+
+///
+/// Hands out chunks of a single big buffer, like a ring buffer would.
+///
+typedef struct provider_test_s
+{
+	char buf[4096];
+	size_t used;			///< Handed out so far.
+	size_t committed;		///< Committed so far.
+	size_t chunk;			///< Max to hand out at a time, 0 to fail.
+	int msgs;
+	int msg_cbs;
+	int out_of_order;
+} provider_test_t;
+
+static char *onalloc(ws_t ws, uint64_t *len, int binary, void *arg)
+{
+	provider_test_t *t = (provider_test_t *)arg;
+	char *dst = &t->buf[t->used];
+
+	if (!t->chunk || (t->used + *len > sizeof(t->buf)))
+		return NULL;
+
+	if (*len > t->chunk)
+		*len = t->chunk;
+
+	t->used += (size_t)*len;
+
+	return dst;
+}
+
+static void oncommit(ws_t ws, char *buf, uint64_t len, int binary,
+					int msg_end, void *arg)
+{
+	provider_test_t *t = (provider_test_t *)arg;
+
+	// Buffers must come back in the order they were handed out.
+	if (len && (buf != &t->buf[t->committed]))
+		t->out_of_order = 1;
+
+	t->committed += (size_t)len;
+
+	if (msg_end)
+		t->msgs++;
+}
+
+static void onmsg(ws_t ws, char *msg, uint64_t len, int binary, void *arg)
+{
+	((provider_test_t *)arg)->msg_cbs++;
+}
+
+static void add_frame(struct evbuffer *frames, ws_opcode_t opcode, int fin,
+						const char *payload, size_t len)
+{
+	ws_header_t h;
+	uint8_t header[WS_HDR_MAX_SIZE];
+	size_t header_len;
+	char *masked = (char *)malloc(len + 1);
+
+	memset(&h, 0, sizeof(h));
+	h.fin = fin;
+	h.opcode = opcode;
+	h.mask_bit = 1;
+	h.mask = PROVIDER_TEST_MASK;
+	h.payload_len = len;
+	ws_pack_header(&h, header, sizeof(header), &header_len);
+
+	memcpy(masked, payload, len);
+	ws_mask_payload(PROVIDER_TEST_MASK, masked, len);
+
+	evbuffer_add(frames, header, header_len);
+	evbuffer_add(frames, masked, len);
+	free(masked);
+}
+
+static void feed(ws_t ws, struct evbuffer *frames, size_t chunk)
+{
+	size_t i;
+	size_t len = evbuffer_get_length(frames);
+	char *data = (char *)evbuffer_pullup(frames, -1);
+	struct evbuffer *in = evbuffer_new();
+
+	for (i = 0; i < len; i += chunk)
+	{
+		evbuffer_add(in, &data[i], ((len - i) < chunk) ? (len - i) : chunk);
+		_ws_read_websocket(ws, in);
+	}
+
+	evbuffer_free(in);
+}
+
+static int run(ws_base_t base, const char *name, size_t chunk,
+				size_t provider_chunk, const char *text, size_t text_len)
+{
+	int ret = 0;
+	ws_t ws = NULL;
+	provider_test_t t;
+	struct evbuffer *frames = evbuffer_new();
+
+	memset(&t, 0, sizeof(t));
+	t.chunk = provider_chunk;
+
+	if (ws_init(&ws, base)
+		|| !(ws->bev = bufferevent_socket_new(base->ev_base, -1, 0)))
+	{
+		libws_test_FAILURE("Failed to init websocket state");
+		ret = -1;
+		goto fail;
+	}
+
+	ws->state = WS_STATE_CONNECTED;
+	ws_set_onmsg_cb(ws, onmsg, &t);
+	ws_set_recv_buffer_provider(ws, onalloc, oncommit, &t);
+
+	// Fragmented with a ping in the middle and an empty last frame,
+	// followed by an empty message.
+	add_frame(frames, WS_OPCODE_TEXT_0X1, 0, text, 1000);
+	add_frame(frames, WS_OPCODE_PING_0X9, 1, "ping", 4);
+	add_frame(frames, WS_OPCODE_CONTINUATION_0X0, 0, &text[1000],
+				text_len - 1000);
+	add_frame(frames, WS_OPCODE_CONTINUATION_0X0, 1, "", 0);
+	add_frame(frames, WS_OPCODE_BINARY_0X2, 1, "", 0);
+
+	feed(ws, frames, chunk);
+
+	if (!provider_chunk)
+	{
+		if (ws->state == WS_STATE_CONNECTED)
+		{
+			libws_test_FAILURE("%s: not closed", name);
+			ret = -1;
+		}
+		else
+		{
+			libws_test_SUCCESS("%s: closed", name);
+		}
+	}
+	else if ((t.msgs != 2) || t.msg_cbs || t.out_of_order
+		|| (t.committed != text_len) || memcmp(t.buf, text, text_len))
+	{
+		libws_test_FAILURE("%s: %d messages, %d msg callbacks, "
+							"%u of %u bytes committed%s", name,
+							t.msgs, t.msg_cbs, (unsigned)t.committed,
+							(unsigned)text_len,
+							t.out_of_order ? " out of order" : "");
+		ret = -1;
+	}
+	else if (ws->state != WS_STATE_CONNECTED)
+	{
+		libws_test_FAILURE("%s: closed the connection", name);
+		ret = -1;
+	}
+	else
+	{
+		libws_test_SUCCESS("%s", name);
+	}
+
+fail:
+	if (ws) ws->state = WS_STATE_CLOSED_CLEANLY;
+	ws_destroy(&ws);
+	evbuffer_free(frames);
+
+	return ret;
+}
+
+int TEST_ws_set_recv_buffer_provider(int argc, char *argv[])
+{
+	int ret = 0;
+	size_t i;
+	size_t len;
+	size_t chunks[] = { 1, 7, 1000, 4096 };
+	char text[3000];
+	char name[64];
+	ws_base_t base = NULL;
+
+	libws_test_HEADLINE("TEST_ws_set_recv_buffer_provider");
+	if (libws_test_init(argc, argv)) return -1;
+
+	if (ws_global_init(&base))
+	{
+		libws_test_FAILURE("Failed to init global state");
+		return -1;
+	}
+
+	for (len = 0; (len + sizeof(PROVIDER_TEST_TEXT) - 1) <= sizeof(text);
+		len += sizeof(PROVIDER_TEST_TEXT) - 1)
+	{
+		memcpy(&text[len], PROVIDER_TEST_TEXT, sizeof(PROVIDER_TEST_TEXT) - 1);
+	}
+
+	libws_test_STATUS("Fragmented masked text message:");
+
+	for (i = 0; i < sizeof(chunks) / sizeof(chunks[0]); i++)
+	{
+		snprintf(name, sizeof(name), "  %u byte reads, whole frames",
+				(unsigned)chunks[i]);
+		ret |= run(base, name, chunks[i], sizeof(text), text, len);
+
+		snprintf(name, sizeof(name), "  %u byte reads, 300 byte buffers",
+				(unsigned)chunks[i]);
+		ret |= run(base, name, chunks[i], 300, text, len);
+	}
+
+	libws_test_STATUS("No buffer provided:");
+
+	ret |= run(base, "  Whole message", 4096, 0, text, len);
+
+	ws_global_destroy(&base);
+
+	return ret;
+}
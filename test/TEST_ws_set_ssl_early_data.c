@@ -0,0 +1,369 @@
+#include "libws_test_helpers.h"
+#include "libws_test_server.h"
+#include "libws.h"
+#include "libws_private.h"
+#include "libws_handshake.h"
+#include <string.h>
+
+#ifdef LIBWS_WITH_OPENSSL
+#include <openssl/ssl.h>
+
+// Needs OpenSSL 1.1.1 for early data, and the server runs on a thread.
+#if defined(SSL_EARLY_DATA_ACCEPTED) && !defined(_WIN32)
+#define EARLY_DATA_TEST
+#endif
+#endif // LIBWS_WITH_OPENSSL
+
+#ifdef EARLY_DATA_TEST
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+///
+/// A blocking stand-in for "openssl s_server -early_data", the same as
+/// in bench_tls_early_data. It replies to the websocket upgrade, sends
+/// one message followed by a close frame, and waits for the close reply.
+///
+typedef struct early_data_server_s
+{
+	SSL_CTX *ctx;
+	int listen_fd;
+	int port;
+	int count;				///< Number of connections to serve.
+	int reject;				///< Never read early data, rejecting it.
+	int early_data_count;	///< Number of handshakes received as early data.
+} early_data_server_t;
+
+typedef struct early_data_client_s
+{
+	ws_base_t base;
+	int msgs;
+	int closed;
+} early_data_client_t;
+
+static int server_write(SSL *ssl, const void *buf, size_t len, int early)
+{
+	size_t written;
+
+	if (early)
+		return SSL_write_early_data(ssl, buf, len, &written) ? 0 : -1;
+
+	return (SSL_write(ssl, buf, len) > 0) ? 0 : -1;
+}
+
+static int server_reply_upgrade(SSL *ssl, const char *request, int early)
+{
+	char key[64];
+	char accept_key[64];
+	char reply[256];
+	const char *k;
+	size_t i = 0;
+	static const unsigned char msg_and_close[] =
+		"\x81\x05hello"
+		"\x88\x02\x03\xe8";
+
+	if (!(k = strstr(request, "Sec-WebSocket-Key:")))
+		return -1;
+
+	k += strlen("Sec-WebSocket-Key:");
+	while (*k == ' ') k++;
+
+	while ((*k != '\r') && *k && (i < (sizeof(key) - 1)))
+		key[i++] = *k++;
+
+	key[i] = '\0';
+
+	if (_ws_calculate_key_hash(key, accept_key, sizeof(accept_key)))
+		return -1;
+
+	snprintf(reply, sizeof(reply),
+		"HTTP/1.1 101 Switching Protocols\r\n"
+		"Upgrade: websocket\r\n"
+		"Connection: Upgrade\r\n"
+		"Sec-WebSocket-Accept: %s\r\n"
+		"\r\n", accept_key);
+
+	if (server_write(ssl, reply, strlen(reply), early)
+	 || server_write(ssl, msg_and_close, sizeof(msg_and_close) - 1, early))
+		return -1;
+
+	return 0;
+}
+
+static void server_serve_one(early_data_server_t *srv, int fd)
+{
+	SSL *ssl;
+	char request[4096];
+	size_t len = 0;
+	size_t n = 0;
+	int replied = 0;
+	int r;
+
+	if (!(ssl = SSL_new(srv->ctx)))
+		return;
+
+	SSL_set_fd(ssl, fd);
+
+	if (!srv->reject)
+	{
+		// Reply to the upgrade request sent as early data right
+		// away, before the handshake is complete (0.5-RTT data).
+		do
+		{
+			r = SSL_read_early_data(ssl, request + len,
+								sizeof(request) - 1 - len, &n);
+			len += n;
+			request[len] = '\0';
+
+			if (!replied && strstr(request, "\r\n\r\n"))
+			{
+				if (server_reply_upgrade(ssl, request, 1))
+					goto done;
+
+				srv->early_data_count++;
+				replied = 1;
+			}
+		}
+		while (r == SSL_READ_EARLY_DATA_SUCCESS);
+
+		if (r == SSL_READ_EARLY_DATA_ERROR)
+			goto done;
+	}
+
+	if (SSL_accept(ssl) <= 0)
+		goto done;
+
+	request[len] = '\0';
+
+	// Otherwise read it the normal way.
+	if (!replied)
+	{
+		while (!strstr(request, "\r\n\r\n"))
+		{
+			if ((r = SSL_read(ssl, request + len, sizeof(request) - 1 - len)) <= 0)
+				goto done;
+
+			len += r;
+			request[len] = '\0';
+		}
+
+		if (server_reply_upgrade(ssl, request, 0))
+			goto done;
+	}
+
+	// Wait for the client to echo the close frame, and then close.
+	SSL_read(ssl, request, sizeof(request));
+	SSL_shutdown(ssl);
+	shutdown(fd, SHUT_WR);
+	while (read(fd, request, sizeof(request)) > 0);
+
+done:
+	SSL_free(ssl);
+	close(fd);
+}
+
+static void *server_thread(void *arg)
+{
+	early_data_server_t *srv = (early_data_server_t *)arg;
+	int fd;
+	int i;
+
+	for (i = 0; i < srv->count; i++)
+	{
+		if ((fd = accept(srv->listen_fd, NULL, NULL)) < 0)
+			break;
+
+		server_serve_one(srv, fd);
+	}
+
+	return NULL;
+}
+
+static int server_start(early_data_server_t *srv, pthread_t *thread,
+						uint32_t max_early_data)
+{
+	struct sockaddr_in sin;
+	socklen_t len = sizeof(sin);
+	int one = 1;
+
+	if (!(srv->ctx = libws_test_server_new_ssl_ctx()))
+		return -1;
+
+	SSL_CTX_set_min_proto_version(srv->ctx, TLS1_3_VERSION);
+	SSL_CTX_set_max_early_data(srv->ctx, max_early_data);
+
+	if ((srv->listen_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+		return -1;
+
+	setsockopt(srv->listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	sin.sin_port = 0;
+
+	if (bind(srv->listen_fd, (struct sockaddr *)&sin, sizeof(sin))
+	 || listen(srv->listen_fd, 16)
+	 || getsockname(srv->listen_fd, (struct sockaddr *)&sin, &len))
+		return -1;
+
+	srv->port = ntohs(sin.sin_port);
+
+	return pthread_create(thread, NULL, server_thread, srv) ? -1 : 0;
+}
+
+static void onmsg(ws_t ws, char *msg, uint64_t len, int binary, void *arg)
+{
+	early_data_client_t *client = (early_data_client_t *)arg;
+	client->msgs++;
+}
+
+static void onclose(ws_t ws, ws_close_status_t status,
+			const char *reason, size_t reason_len, void *arg)
+{
+	early_data_client_t *client = (early_data_client_t *)arg;
+	client->closed++;
+	ws_base_quit(client->base, 1);
+}
+
+static void give_up(evutil_socket_t fd, short what, void *arg)
+{
+	early_data_client_t *client = (early_data_client_t *)arg;
+	libws_test_FAILURE("  Timed out");
+	ws_base_quit(client->base, 1);
+}
+
+///
+/// Connects once to get a session ticket, and then reconnects
+/// resuming it with the handshake sent as early data.
+///
+static int run(const char *name, uint32_t max_early_data, int reject,
+				int expect_accepted)
+{
+	int ret = 0;
+	int i;
+	ws_t ws = NULL;
+	early_data_server_t srv;
+	early_data_client_t client;
+	pthread_t thread;
+	int started = 0;
+	struct event *timeout = NULL;
+	struct timeval tv = {5, 0};
+
+	memset(&srv, 0, sizeof(srv));
+	memset(&client, 0, sizeof(client));
+	srv.count = 2;
+	srv.reject = reject;
+	srv.listen_fd = -1;
+
+	if (server_start(&srv, &thread, max_early_data))
+	{
+		libws_test_FAILURE("%s: failed to start the server", name);
+		ret = -1;
+		goto fail;
+	}
+
+	started = 1;
+
+	if (ws_global_init(&client.base)
+		|| ws_init(&ws, client.base))
+	{
+		libws_test_FAILURE("%s: failed to init websocket state", name);
+		ret = -1;
+		goto fail;
+	}
+
+	ws_set_onmsg_cb(ws, onmsg, &client);
+	ws_set_onclose_cb(ws, onclose, &client);
+	ws_set_ssl_state(ws, LIBWS_SSL_SELFSIGNED);
+	ws_set_ssl_early_data(ws, 1);
+
+	timeout = evtimer_new(client.base->ev_base, give_up, &client);
+
+	for (i = 0; i < srv.count; i++)
+	{
+		client.msgs = 0;
+		client.closed = 0;
+		evtimer_add(timeout, &tv);
+
+		if (ws_connect(ws, "127.0.0.1", srv.port, ""))
+		{
+			libws_test_FAILURE("%s: failed to connect", name);
+			ret = -1;
+			goto fail;
+		}
+
+		ws_base_service_blocking(client.base);
+
+		if ((client.msgs != 1) || !client.closed)
+		{
+			libws_test_FAILURE("%s: connection %d got %d messages", name,
+								i, client.msgs);
+			ret = -1;
+			goto fail;
+		}
+	}
+
+	if (!ws_is_ssl_session_reused(ws)
+	 || (ws_is_ssl_early_data_accepted(ws) != expect_accepted)
+	 || (srv.early_data_count != expect_accepted))
+	{
+		libws_test_FAILURE("%s: resumed %d, early data accepted %d "
+							"(server got %d)", name,
+							ws_is_ssl_session_reused(ws),
+							ws_is_ssl_early_data_accepted(ws),
+							srv.early_data_count);
+		ret = -1;
+	}
+	else
+	{
+		libws_test_SUCCESS("%s", name);
+	}
+
+fail:
+	if (timeout) event_free(timeout);
+	ws_destroy(&ws);
+
+	if (client.base)
+		ws_global_destroy(&client.base);
+
+	if (started)
+	{
+		// Wakes up the server if it's still waiting for a connection.
+		shutdown(srv.listen_fd, SHUT_RDWR);
+		pthread_join(thread, NULL);
+	}
+
+	if (srv.listen_fd >= 0) close(srv.listen_fd);
+	if (srv.ctx) SSL_CTX_free(srv.ctx);
+
+	return ret;
+}
+
+#endif // EARLY_DATA_TEST
+
+int TEST_ws_set_ssl_early_data(int argc, char *argv[])
+{
+	int ret = 0;
+
+	libws_test_HEADLINE("TEST_ws_set_ssl_early_data");
+	if (libws_test_init(argc, argv)) return -1;
+
+	#ifndef EARLY_DATA_TEST
+	libws_test_SKIPPED("Not compiled with OpenSSL 1.1.1 or later");
+	#else
+
+	libws_test_STATUS("Reconnecting with the handshake as early data:");
+
+	ret |= run("  Accepted", 16384, 0, 1);
+	ret |= run("  Rejected", 16384, 1, 0);
+
+	// The handshake is never written as early data.
+	ret |= run("  Over the max early data", 16, 0, 0);
+
+	#endif // EARLY_DATA_TEST
+
+	return ret;
+}
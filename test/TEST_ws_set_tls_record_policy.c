@@ -0,0 +1,143 @@
+#include "libws_test_helpers.h"
+#include "libws.h"
+#include "libws_private.h"
+#ifdef LIBWS_WITH_OPENSSL
+#include <openssl/ssl.h>
+#include "libws_openssl.h"
+#endif
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <string.h>
+
+#ifdef LIBWS_WITH_OPENSSL
+
+#define RECORD_SMALL 1024
+#define RECORD_LARGE 16384
+#define RECORD_RAMP 4096
+
+static char record_data[RECORD_RAMP * 2];
+
+///
+/// Queues data like a send does, or drains it like OpenSSL
+/// does after writing it, and checks the record size after.
+///
+static int check(ws_t ws, const char *name, size_t add, size_t written,
+				size_t size)
+{
+	struct evbuffer *out = bufferevent_get_output(ws->bev);
+
+	if (add)
+	{
+		_ws_openssl_start_record_policy(ws);
+		evbuffer_add(out, record_data, add);
+	}
+
+	if (written)
+	{
+		// Without a socket libevent keeps the start of the output frozen.
+		evbuffer_unfreeze(out, 1);
+		evbuffer_drain(out, written);
+		evbuffer_freeze(out, 1);
+	}
+
+	if (ws->tls_record_size != size)
+	{
+		libws_test_FAILURE("%s: record size %u, expected %u", name,
+							(unsigned)ws->tls_record_size, (unsigned)size);
+		return -1;
+	}
+
+	libws_test_SUCCESS("%s", name);
+	return 0;
+}
+
+#endif // LIBWS_WITH_OPENSSL
+
+int TEST_ws_set_tls_record_policy(int argc, char *argv[])
+{
+	int ret = 0;
+	ws_base_t base = NULL;
+	#ifdef LIBWS_WITH_OPENSSL
+	ws_t ws = NULL;
+	struct timeval idle = { 1, 0 };
+	#endif
+
+	libws_test_HEADLINE("TEST_ws_set_tls_record_policy");
+	if (libws_test_init(argc, argv)) return -1;
+
+	#ifndef LIBWS_WITH_OPENSSL
+	libws_test_SKIPPED("Not compiled with OpenSSL");
+	#else
+
+	if (ws_global_init(&base))
+	{
+		libws_test_FAILURE("Failed to init global state");
+		return -1;
+	}
+
+	if (ws_init(&ws, base)
+		|| !(ws->ssl = SSL_new(base->ssl_ctx))
+		|| !(ws->bev = bufferevent_socket_new(base->ev_base, -1, 0)))
+	{
+		libws_test_FAILURE("Failed to init websocket state");
+		ret = -1;
+		goto fail;
+	}
+
+	if (!ws_set_tls_record_policy(ws, 100, RECORD_LARGE, RECORD_RAMP, idle))
+	{
+		libws_test_FAILURE("Accepted a record size below 512 bytes");
+		ret = -1;
+	}
+
+	ws_set_tls_record_policy(ws, RECORD_SMALL, RECORD_LARGE, RECORD_RAMP, idle);
+
+	libws_test_STATUS("Ramp up:");
+
+	ret |= check(ws, "  Small records when starting out",
+				RECORD_RAMP + 1, 0, RECORD_SMALL);
+	ret |= check(ws, "  Queued data doesn't count",
+				RECORD_RAMP, 0, RECORD_SMALL);
+	ret |= check(ws, "  Small records until the ramp is written",
+				0, RECORD_RAMP - 1, RECORD_SMALL);
+	ret |= check(ws, "  Large records once it is written",
+				0, 1, RECORD_LARGE);
+
+	libws_test_STATUS("Idle:");
+
+	ret |= check(ws, "  All written", 0, RECORD_RAMP + 1, RECORD_LARGE);
+	ret |= check(ws, "  Large records when sending again right away",
+				1, 1, RECORD_LARGE);
+
+	// Everything was written longer ago than the idle time.
+	ws->tls_record_last.tv_sec -= 2;
+	ret |= check(ws, "  Small records after being idle", 1, 0, RECORD_SMALL);
+
+	ws_set_tls_record_policy(ws, 0, 0, 0, idle);
+	ret |= check(ws, "  Disabled", 1, 2, 0);
+
+fail:
+	if (ws)
+	{
+		// Not owned by the bufferevent without a connection.
+		if (ws->bev)
+		{
+			bufferevent_free(ws->bev);
+			ws->bev = NULL;
+		}
+
+		if (ws->ssl)
+		{
+			SSL_free(ws->ssl);
+			ws->ssl = NULL;
+		}
+
+		ws->state = WS_STATE_CLOSED_CLEANLY;
+	}
+
+	ws_destroy(&ws);
+	ws_global_destroy(&base);
+	#endif // LIBWS_WITH_OPENSSL
+
+	return ret;
+}
@@ -0,0 +1,176 @@
+#include "libws_test_helpers.h"
+#include "libws.h"
+#include "libws_private.h"
+#include "libws_handshake.h"
+#include "libws_crypto.h"
+#include "libws_log.h"
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct sha1_vector_s
+{
+	const char *name;
+	const char *data;
+	size_t repeat;
+	const char *digest;
+} sha1_vector_t;
+
+// FIPS 180-2 examples.
+static const sha1_vector_t vectors[] =
+{
+	{ "empty", "", 1,
+		"da39a3ee5e6b4b0d3255bfef95601890afd80709" },
+	{ "\"abc\"", "abc", 1,
+		"a9993e364706816aba3e25717850c26c9cd0d89d" },
+	{ "two blocks",
+		"abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq", 1,
+		"84983e441c3bd26ebaae4aa1f95129e5e54670f1" },
+	{ "a million 'a'", "a", 1000000,
+		"34aa973cd4c4daa4f61eeb2bdbad27316534016f" }
+};
+
+static void to_hex(const unsigned char *md, char *hex)
+{
+	size_t i;
+
+	for (i = 0; i < WS_SHA1_DIGEST_LEN; i++)
+	{
+		sprintf(&hex[i * 2], "%02x", md[i]);
+	}
+}
+
+static int check_vectors(const ws_sha1_backend_t *b, char *buf)
+{
+	int ret = 0;
+	size_t i;
+	size_t len;
+	unsigned char md[WS_SHA1_DIGEST_LEN];
+	char hex[WS_SHA1_DIGEST_LEN * 2 + 1];
+
+	for (i = 0; i < sizeof(vectors) / sizeof(vectors[0]); i++)
+	{
+		len = strlen(vectors[i].data);
+
+		if (vectors[i].repeat > 1)
+		{
+			memset(buf, vectors[i].data[0], vectors[i].repeat);
+			len = vectors[i].repeat;
+		}
+		else
+		{
+			memcpy(buf, vectors[i].data, len);
+		}
+
+		b->sha1(buf, len, md);
+		to_hex(md, hex);
+
+		if (strcmp(hex, vectors[i].digest))
+		{
+			libws_test_FAILURE("  %s: %s, got %s expected %s",
+								b->name, vectors[i].name,
+								hex, vectors[i].digest);
+			ret = -1;
+		}
+		else
+		{
+			libws_test_SUCCESS("  %s: %s", b->name, vectors[i].name);
+		}
+	}
+
+	return ret;
+}
+
+int TEST_ws_sha1(int argc, char *argv[])
+{
+	int ret = 0;
+	size_t i;
+	size_t len;
+	size_t count;
+	const ws_sha1_backend_t *backends;
+	char *buf = NULL;
+	char key_hash[64];
+	unsigned char expect[WS_SHA1_DIGEST_LEN];
+	unsigned char md[WS_SHA1_DIGEST_LEN];
+
+	libws_test_HEADLINE("TEST_ws_sha1");
+	if (libws_test_init(argc, argv)) return -1;
+
+	if (!(buf = malloc(1000000)))
+	{
+		libws_test_FAILURE("Out of memory");
+		return -1;
+	}
+
+	backends = _ws_sha1_backends(&count);
+
+	libws_test_STATUS("Test vectors for %u backends, %s is selected",
+						(unsigned)count, _ws_sha1_backend_name());
+
+	for (i = 0; i < count; i++)
+	{
+		ret |= check_vectors(&backends[i], buf);
+	}
+
+	libws_test_STATUS("Backends agree on all padding lengths:");
+	{
+		for (len = 0; len < 1000; len++)
+		{
+			buf[len] = (char)(len * 31 + 7);
+		}
+
+		for (len = 0; len <= 300; len++)
+		{
+			backends[count - 1].sha1(buf, len, expect);
+
+			for (i = 0; i < count - 1; i++)
+			{
+				backends[i].sha1(buf, len, md);
+
+				if (memcmp(md, expect, sizeof(md)))
+				{
+					libws_test_FAILURE("  %s differs from %s for length %u",
+										backends[i].name,
+										backends[count - 1].name,
+										(unsigned)len);
+					ret = -1;
+					break;
+				}
+			}
+		}
+
+		libws_test_SUCCESS("  Compared lengths 0 to 300");
+	}
+
+	libws_test_STATUS("Accept key from RFC 6455 with each backend:");
+	{
+		for (i = 0; i < count; i++)
+		{
+			_ws_sha1_set_backend(backends[i].name);
+
+			if (_ws_calculate_key_hash("dGhlIHNhbXBsZSBub25jZQ==",
+										key_hash, sizeof(key_hash))
+				|| strcmp(key_hash, "s3pPLMBiTxaQ9kYGzzhZRbK+xOo="))
+			{
+				libws_test_FAILURE("  %s: Unexpected accept key",
+									backends[i].name);
+				ret = -1;
+			}
+			else
+			{
+				libws_test_SUCCESS("  %s: %s", backends[i].name, key_hash);
+			}
+		}
+
+		_ws_sha1_set_backend(backends[0].name);
+	}
+
+	if (_ws_sha1_set_backend("no-such-backend") == 0)
+	{
+		libws_test_FAILURE("Selected a backend that does not exist");
+		ret = -1;
+	}
+
+	free(buf);
+
+	return ret;
+}
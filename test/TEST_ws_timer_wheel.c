@@ -0,0 +1,250 @@
+#include "libws.h"
+#include "libws_private.h"
+#include "libws_test_helpers.h"
+#include <string.h>
+#include <stdlib.h>
+
+#define WHEEL_TIMERS 6
+#define WHEEL_LEVEL_TIMERS 5
+
+typedef struct wheel_test_s wheel_test_t;
+
+typedef struct wheel_timer_s
+{
+	wheel_test_t *t;
+	ws_timer_t timer;
+	struct timeval tv;
+	struct timeval armed;
+	int fired;
+	int early;
+} wheel_timer_t;
+
+struct wheel_test_s
+{
+	ws_base_t base;
+	wheel_timer_t timers[WHEEL_TIMERS];
+	int order[WHEEL_TIMERS];
+	int fired;
+	int expected;
+};
+
+static void wheel_arm(wheel_timer_t *w)
+{
+	evutil_gettimeofday(&w->armed, NULL);
+	_ws_timer_add(&w->t->base->timers, &w->timer, &w->tv);
+}
+
+static void wheel_timer_cb(void *arg)
+{
+	wheel_timer_t *w = (wheel_timer_t *)arg;
+	wheel_test_t *t = w->t;
+	struct timeval now;
+	struct timeval elapsed;
+
+	evutil_gettimeofday(&now, NULL);
+	evutil_timersub(&now, &w->armed, &elapsed);
+
+	if (evutil_timercmp(&elapsed, &w->tv, <))
+	{
+		w->early = 1;
+	}
+
+	t->order[t->fired++] = (int)(w - t->timers);
+	w->fired++;
+
+	// Timer 0 re-arms itself once.
+	if ((w == &t->timers[0]) && (w->fired == 1))
+	{
+		wheel_arm(w);
+	}
+
+	// Timer 1 cancels timer 2, which is due right after it.
+	if (w == &t->timers[1])
+	{
+		_ws_timer_del(&t->base->timers, &t->timers[2].timer);
+	}
+
+	if (t->fired == t->expected)
+	{
+		ws_base_quit(t->base, 1);
+	}
+}
+
+static void wheel_level_cb(void *arg)
+{
+	(*(int *)arg)++;
+}
+
+///
+/// Moves a wheel forward without waiting, and checks that a timer
+/// on each level, and one beyond the last, fires on its exact tick.
+///
+static int check_levels(ws_base_t base)
+{
+	int i;
+	int ret = 0;
+	int fired[WHEEL_LEVEL_TIMERS];
+	ws_timer_t timers[WHEEL_LEVEL_TIMERS];
+	ws_timer_wheel_t *wheel;
+	// 30ms, 1s, 100s, 2h and 6h.
+	long delays_s[WHEEL_LEVEL_TIMERS] = {0, 1, 100, 7200, 21600};
+	struct timeval tv;
+
+	if (!(wheel = (ws_timer_wheel_t *)malloc(sizeof(ws_timer_wheel_t)))
+		|| _ws_timer_wheel_init(wheel, base->ev_base))
+	{
+		libws_test_FAILURE("Failed to init timer wheel");
+		free(wheel);
+		return -1;
+	}
+
+	memset(fired, 0, sizeof(fired));
+	memset(timers, 0, sizeof(timers));
+
+	for (i = 0; i < WHEEL_LEVEL_TIMERS; i++)
+	{
+		tv.tv_sec = delays_s[i];
+		tv.tv_usec = delays_s[i] ? 0 : 30000;
+		_ws_timer_init(&timers[i], wheel_level_cb, &fired[i]);
+		_ws_timer_add(wheel, &timers[i], &tv);
+	}
+
+	for (i = 0; i < WHEEL_LEVEL_TIMERS; i++)
+	{
+		_ws_timer_wheel_run(wheel, timers[i].expires - 1);
+
+		if (fired[i])
+		{
+			libws_test_FAILURE("Timer due in %lds fired early", delays_s[i]);
+			ret = -1;
+			continue;
+		}
+
+		_ws_timer_wheel_run(wheel, timers[i].expires);
+
+		if ((fired[i] != 1) || (wheel->count != (size_t)(WHEEL_LEVEL_TIMERS - 1 - i)))
+		{
+			libws_test_FAILURE("Timer due in %lds didn't fire on time",
+								delays_s[i]);
+			ret = -1;
+		}
+	}
+
+	if (!ret)
+	{
+		libws_test_SUCCESS("Timers on all levels fired on their tick");
+	}
+
+	for (i = 0; i < WHEEL_LEVEL_TIMERS; i++)
+	{
+		_ws_timer_del(wheel, &timers[i]);
+	}
+
+	_ws_timer_wheel_destroy(wheel);
+	free(wheel);
+
+	return ret;
+}
+
+int TEST_ws_timer_wheel(int argc, char **argv)
+{
+	int i;
+	int ret = 0;
+	ws_base_t base = NULL;
+	wheel_test_t t;
+	struct timeval left;
+	// Timer 2 is cancelled by timer 1, timer 4 before the loop runs,
+	// timer 5 is on a higher level of the wheel.
+	long delays_ms[WHEEL_TIMERS] = {5, 100, 101, 8, 15, 1200};
+	int expected_order[] = {0, 3, 0, 1, 5};
+
+	libws_test_HEADLINE("TEST_ws_timer_wheel");
+
+	memset(&t, 0, sizeof(t));
+
+	if (ws_global_init(&base))
+	{
+		libws_test_FAILURE("Failed to init global state");
+		return -1;
+	}
+
+	t.base = base;
+	t.expected = sizeof(expected_order) / sizeof(expected_order[0]);
+
+	for (i = 0; i < WHEEL_TIMERS; i++)
+	{
+		t.timers[i].t = &t;
+		t.timers[i].tv.tv_sec = delays_ms[i] / 1000;
+		t.timers[i].tv.tv_usec = (delays_ms[i] % 1000) * 1000;
+		_ws_timer_init(&t.timers[i].timer, wheel_timer_cb, &t.timers[i]);
+		wheel_arm(&t.timers[i]);
+	}
+
+	_ws_timer_del(&base->timers, &t.timers[4].timer);
+
+	if (_ws_timer_pending(&t.timers[4].timer)
+		|| !_ws_timer_remaining(&base->timers, &t.timers[4].timer, &left))
+	{
+		libws_test_FAILURE("Cancelled timer is still pending");
+		ret = -1;
+	}
+
+	_ws_timer_remaining(&base->timers, &t.timers[5].timer, &left);
+
+	if (left.tv_sec != 1)
+	{
+		libws_test_FAILURE("Timer due in %ld.%06ld seconds, expected 1.2",
+							(long)left.tv_sec, (long)left.tv_usec);
+		ret = -1;
+	}
+
+	libws_test_STATUS("Run the timers");
+
+	ws_base_service_blocking(base);
+
+	if (t.fired != t.expected)
+	{
+		libws_test_FAILURE("%d timers fired, expected %d", t.fired, t.expected);
+		ret = -1;
+		goto fail;
+	}
+
+	for (i = 0; i < t.expected; i++)
+	{
+		if (t.order[i] != expected_order[i])
+		{
+			libws_test_FAILURE("Timer %d fired as number %d, expected timer %d",
+								t.order[i], i, expected_order[i]);
+			ret = -1;
+		}
+	}
+
+	for (i = 0; i < WHEEL_TIMERS; i++)
+	{
+		if (t.timers[i].early)
+		{
+			libws_test_FAILURE("Timer %d fired early", i);
+			ret = -1;
+		}
+	}
+
+	if (base->timers.count != 0)
+	{
+		libws_test_FAILURE("%d timers left on the wheel",
+							(int)base->timers.count);
+		ret = -1;
+	}
+
+	if (!ret)
+	{
+		libws_test_SUCCESS("Timers fired in order, none early");
+	}
+
+	libws_test_STATUS("Move the wheel forward");
+	ret |= check_levels(base);
+
+fail:
+	ws_global_destroy(&base);
+
+	return ret;
+}
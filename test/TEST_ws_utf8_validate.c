@@ -29,7 +29,7 @@ static const char *utf8_overlong[] =
 static int test_utf8_overlong()
 {
 	int ret = 0;
-	int i;
+	size_t i;
 	ws_utf8_state_t s;
 
 	libws_test_STATUS("Test overlong strings:");
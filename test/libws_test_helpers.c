@@ -272,4 +272,13 @@ void *libws_test_realloc(void *ptr, size_t sz)
 	return realloc(ptr, sz);
 }
 
+int libws_test_get_malloc_count()
+{
+	return malloc_current;
+}
+
+int libws_test_get_realloc_count()
+{
+	return realloc_current;
+}
 
@@ -43,5 +43,7 @@ void libws_test_set_malloc_fail_count(int count);
 void *libws_test_malloc(size_t sz);
 void libws_test_set_realloc_fail_count(int count);
 void *libws_test_realloc(void *ptr, size_t sz);
+int libws_test_get_malloc_count();
+int libws_test_get_realloc_count();
 
 #endif // __LIBWS_TEST_HELPERS_H__
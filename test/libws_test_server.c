@@ -0,0 +1,477 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+#include <winsock2.h>
+#else
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#endif
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/listener.h>
+#include "libws_test_server.h"
+#include "libws.h"
+#include "libws_private.h"
+#include "libws_handshake.h"
+
+#ifdef LIBWS_WITH_OPENSSL
+#include <openssl/evp.h>
+#include <openssl/rsa.h>
+#include <openssl/x509.h>
+#include <event2/bufferevent_ssl.h>
+#endif
+
+struct libws_test_server_s
+{
+	struct event_base *base;
+	struct evconnlistener *listener;
+	int port;
+	int open_count;
+	uint64_t echo_count;
+	uint64_t ping_count;
+	int ignore_pings;
+	struct libws_test_server_conn_s *conns;
+	char *scratch;
+	size_t scratch_size;
+	#ifdef LIBWS_WITH_OPENSSL
+	SSL_CTX *ssl_ctx;
+	#endif
+};
+
+typedef struct libws_test_server_conn_s
+{
+	libws_test_server_t *srv;
+	struct bufferevent *bev;
+	int upgraded;
+	int closing;
+	struct libws_test_server_conn_s *prev;
+	struct libws_test_server_conn_s *next;
+} libws_test_server_conn_t;
+
+static void _server_conn_free(libws_test_server_conn_t *conn)
+{
+	if (conn->prev)
+		conn->prev->next = conn->next;
+	else
+		conn->srv->conns = conn->next;
+
+	if (conn->next)
+		conn->next->prev = conn->prev;
+
+	conn->srv->open_count--;
+	bufferevent_free(conn->bev);
+	free(conn);
+}
+
+static int _server_handle_upgrade(libws_test_server_conn_t *conn,
+								struct evbuffer *in, struct evbuffer *out)
+{
+	struct evbuffer_ptr end;
+	char *req;
+	char *k;
+	char key[64];
+	char accept_key[64];
+	size_t i = 0;
+	size_t len;
+
+	end = evbuffer_search(in, "\r\n\r\n", 4, NULL);
+
+	if (end.pos < 0)
+		return 0;
+
+	len = end.pos + 4;
+	req = (char *)evbuffer_pullup(in, len);
+
+	// The request is not NUL terminated, but is ended by \r\n\r\n.
+	for (k = req; k < (req + len - 18); k++)
+	{
+		if (!evutil_ascii_strncasecmp(k, "Sec-WebSocket-Key:", 18))
+			break;
+	}
+
+	if (k >= (req + len - 18))
+		return -1;
+
+	k += 18;
+	while (*k == ' ') k++;
+
+	while ((*k != '\r') && (i < (sizeof(key) - 1)))
+		key[i++] = *k++;
+
+	key[i] = '\0';
+
+	if (_ws_calculate_key_hash(key, accept_key, sizeof(accept_key)))
+		return -1;
+
+	evbuffer_drain(in, len);
+
+	evbuffer_add_printf(out,
+		"HTTP/1.1 101 Switching Protocols\r\n"
+		"Upgrade: websocket\r\n"
+		"Connection: Upgrade\r\n"
+		"Sec-WebSocket-Accept: %s\r\n"
+		"\r\n", accept_key);
+
+	conn->upgraded = 1;
+
+	return 0;
+}
+
+static int _server_handle_frame(libws_test_server_conn_t *conn,
+								struct evbuffer *in, struct evbuffer *out)
+{
+	libws_test_server_t *srv = conn->srv;
+	unsigned char hdr[14];
+	unsigned char reply[10];
+	size_t hdr_len = 2;
+	size_t reply_len = 2;
+	uint64_t payload_len;
+	uint8_t mask[4];
+	uint8_t opcode;
+	size_t avail = evbuffer_get_length(in);
+	size_t i;
+
+	if (avail < 2)
+		return 0;
+
+	evbuffer_copyout(in, hdr, (avail < sizeof(hdr)) ? avail : sizeof(hdr));
+
+	opcode = hdr[0] & 0xF;
+	payload_len = hdr[1] & 0x7F;
+
+	if (payload_len == 126)
+	{
+		hdr_len += 2;
+		if (avail < hdr_len) return 0;
+		payload_len = ((uint64_t)hdr[2] << 8) | hdr[3];
+	}
+	else if (payload_len == 127)
+	{
+		hdr_len += 8;
+		if (avail < hdr_len) return 0;
+		payload_len = 0;
+		for (i = 0; i < 8; i++)
+			payload_len = (payload_len << 8) | hdr[2 + i];
+	}
+
+	if (hdr[1] & 0x80)
+	{
+		hdr_len += 4;
+		if (avail < hdr_len) return 0;
+		memcpy(mask, &hdr[hdr_len - 4], 4);
+	}
+	else
+	{
+		memset(mask, 0, sizeof(mask));
+	}
+
+	if (avail < (hdr_len + payload_len))
+		return 0;
+
+	evbuffer_drain(in, hdr_len);
+
+	if (payload_len > srv->scratch_size)
+	{
+		char *s;
+
+		if (!(s = (char *)realloc(srv->scratch, (size_t)payload_len)))
+			return -1;
+
+		srv->scratch = s;
+		srv->scratch_size = (size_t)payload_len;
+	}
+
+	evbuffer_remove(in, srv->scratch, (size_t)payload_len);
+
+	for (i = 0; i < payload_len; i++)
+		srv->scratch[i] ^= mask[i % 4];
+
+	// Echo everything, but answer pings with pongs.
+	reply[0] = hdr[0];
+
+	if (opcode == 0x9)
+	{
+		srv->ping_count++;
+
+		if (srv->ignore_pings)
+			return 1;
+
+		reply[0] = (hdr[0] & 0xF0) | 0xA;
+	}
+	else if (opcode == 0x8)
+	{
+		conn->closing = 1;
+	}
+	else if (opcode != 0xA)
+	{
+		srv->echo_count++;
+	}
+
+	if (opcode == 0xA)
+		return 1;
+
+	if (payload_len < 126)
+	{
+		reply[1] = (unsigned char)payload_len;
+	}
+	else if (payload_len <= 0xFFFF)
+	{
+		reply[1] = 126;
+		reply[2] = (unsigned char)(payload_len >> 8);
+		reply[3] = (unsigned char)payload_len;
+		reply_len = 4;
+	}
+	else
+	{
+		reply[1] = 127;
+		for (i = 0; i < 8; i++)
+			reply[2 + i] = (unsigned char)(payload_len >> (56 - (8 * i)));
+		reply_len = 10;
+	}
+
+	evbuffer_add(out, reply, reply_len);
+	evbuffer_add(out, srv->scratch, (size_t)payload_len);
+
+	return 1;
+}
+
+static void _server_write_cb(struct bufferevent *bev, void *arg)
+{
+	libws_test_server_conn_t *conn = (libws_test_server_conn_t *)arg;
+
+	// Close the TCP connection once the close frame is echoed.
+	if (conn->closing)
+	{
+		_server_conn_free(conn);
+	}
+}
+
+static void _server_read_cb(struct bufferevent *bev, void *arg)
+{
+	libws_test_server_conn_t *conn = (libws_test_server_conn_t *)arg;
+	struct evbuffer *in = bufferevent_get_input(bev);
+	struct evbuffer *out = bufferevent_get_output(bev);
+	int r = 0;
+
+	if (!conn->upgraded)
+	{
+		if (_server_handle_upgrade(conn, in, out))
+		{
+			_server_conn_free(conn);
+			return;
+		}
+
+		if (!conn->upgraded)
+			return;
+	}
+
+	while (!conn->closing && ((r = _server_handle_frame(conn, in, out)) > 0));
+
+	if (r < 0)
+	{
+		_server_conn_free(conn);
+	}
+}
+
+static void _server_event_cb(struct bufferevent *bev, short events, void *arg)
+{
+	libws_test_server_conn_t *conn = (libws_test_server_conn_t *)arg;
+
+	if (events & (BEV_EVENT_EOF | BEV_EVENT_ERROR))
+	{
+		_server_conn_free(conn);
+	}
+}
+
+static void _server_accept_cb(struct evconnlistener *listener,
+			evutil_socket_t fd, struct sockaddr *addr, int socklen, void *arg)
+{
+	libws_test_server_t *srv = (libws_test_server_t *)arg;
+	libws_test_server_conn_t *conn;
+	int one = 1;
+
+	if (!(conn = (libws_test_server_conn_t *)calloc(1, sizeof(*conn))))
+	{
+		evutil_closesocket(fd);
+		return;
+	}
+
+	conn->srv = srv;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (void *)&one, sizeof(one));
+
+	#ifdef LIBWS_WITH_OPENSSL
+	if (srv->ssl_ctx)
+	{
+		SSL *ssl = SSL_new(srv->ssl_ctx);
+
+		conn->bev = bufferevent_openssl_socket_new(srv->base, fd, ssl,
+					BUFFEREVENT_SSL_ACCEPTING, BEV_OPT_CLOSE_ON_FREE);
+	}
+	else
+	#endif
+	{
+		conn->bev = bufferevent_socket_new(srv->base, fd,
+											BEV_OPT_CLOSE_ON_FREE);
+	}
+
+	if (!conn->bev)
+	{
+		evutil_closesocket(fd);
+		free(conn);
+		return;
+	}
+
+	srv->open_count++;
+
+	conn->next = srv->conns;
+	if (srv->conns)
+		srv->conns->prev = conn;
+	srv->conns = conn;
+
+	bufferevent_setcb(conn->bev, _server_read_cb, _server_write_cb,
+					_server_event_cb, conn);
+	bufferevent_enable(conn->bev, EV_READ | EV_WRITE);
+}
+
+#ifdef LIBWS_WITH_OPENSSL
+SSL_CTX *libws_test_server_new_ssl_ctx()
+{
+	EVP_PKEY *pkey = NULL;
+	EVP_PKEY_CTX *pctx = NULL;
+	X509 *x509 = NULL;
+	SSL_CTX *ctx = NULL;
+
+	if (!(ctx = SSL_CTX_new(SSLv23_server_method())))
+		goto fail;
+
+	if (!(pctx = EVP_PKEY_CTX_new_id(EVP_PKEY_RSA, NULL))
+	 || (EVP_PKEY_keygen_init(pctx) <= 0)
+	 || (EVP_PKEY_CTX_set_rsa_keygen_bits(pctx, 2048) <= 0)
+	 || (EVP_PKEY_keygen(pctx, &pkey) <= 0))
+		goto fail;
+
+	if (!(x509 = X509_new()))
+		goto fail;
+
+	ASN1_INTEGER_set(X509_get_serialNumber(x509), 1);
+	X509_gmtime_adj(X509_get_notBefore(x509), 0);
+	X509_gmtime_adj(X509_get_notAfter(x509), 3600);
+	X509_set_pubkey(x509, pkey);
+	X509_NAME_add_entry_by_txt(X509_get_subject_name(x509), "CN",
+		MBSTRING_ASC, (const unsigned char *)"localhost", -1, -1, 0);
+	X509_set_issuer_name(x509, X509_get_subject_name(x509));
+
+	if (!X509_sign(x509, pkey, EVP_sha256())
+	 || !SSL_CTX_use_certificate(ctx, x509)
+	 || !SSL_CTX_use_PrivateKey(ctx, pkey))
+		goto fail;
+
+	EVP_PKEY_CTX_free(pctx);
+	EVP_PKEY_free(pkey);
+	X509_free(x509);
+
+	return ctx;
+fail:
+	if (pctx) EVP_PKEY_CTX_free(pctx);
+	if (pkey) EVP_PKEY_free(pkey);
+	if (x509) X509_free(x509);
+	if (ctx) SSL_CTX_free(ctx);
+	return NULL;
+}
+#endif // LIBWS_WITH_OPENSSL
+
+libws_test_server_t *libws_test_server_new(struct event_base *base,
+											int use_ssl)
+{
+	libws_test_server_t *srv;
+	struct sockaddr_in sin;
+	ev_socklen_t len = sizeof(sin);
+
+	if (!(srv = (libws_test_server_t *)calloc(1, sizeof(*srv))))
+		return NULL;
+
+	srv->base = base;
+
+	if (use_ssl)
+	{
+		#ifdef LIBWS_WITH_OPENSSL
+		if (!(srv->ssl_ctx = libws_test_server_new_ssl_ctx()))
+			goto fail;
+		#else
+		goto fail;
+		#endif
+	}
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(0x7f000001);
+	sin.sin_port = 0;
+
+	// Benchmarks connect many clients before accepting any,
+	// the kernel caps this to net.core.somaxconn.
+	if (!(srv->listener = evconnlistener_new_bind(base, _server_accept_cb,
+			srv, LEV_OPT_CLOSE_ON_FREE | LEV_OPT_REUSEABLE, 65535,
+			(struct sockaddr *)&sin, sizeof(sin))))
+		goto fail;
+
+	if (getsockname(evconnlistener_get_fd(srv->listener),
+					(struct sockaddr *)&sin, &len))
+		goto fail;
+
+	srv->port = ntohs(sin.sin_port);
+
+	return srv;
+fail:
+	libws_test_server_free(srv);
+	return NULL;
+}
+
+void libws_test_server_free(libws_test_server_t *srv)
+{
+	if (!srv)
+		return;
+
+	if (srv->listener)
+		evconnlistener_free(srv->listener);
+
+	// Connections the clients never closed.
+	while (srv->conns)
+		_server_conn_free(srv->conns);
+
+	#ifdef LIBWS_WITH_OPENSSL
+	if (srv->ssl_ctx)
+		SSL_CTX_free(srv->ssl_ctx);
+	#endif
+
+	free(srv->scratch);
+	free(srv);
+}
+
+int libws_test_server_get_port(libws_test_server_t *srv)
+{
+	return srv->port;
+}
+
+int libws_test_server_get_open_count(libws_test_server_t *srv)
+{
+	return srv->open_count;
+}
+
+uint64_t libws_test_server_get_echo_count(libws_test_server_t *srv)
+{
+	return srv->echo_count;
+}
+
+uint64_t libws_test_server_get_ping_count(libws_test_server_t *srv)
+{
+	return srv->ping_count;
+}
+
+void libws_test_server_set_ignore_pings(libws_test_server_t *srv, int ignore)
+{
+	srv->ignore_pings = ignore;
+}
@@ -0,0 +1,63 @@
+
+#ifndef __LIBWS_TEST_SERVER_H__
+#define __LIBWS_TEST_SERVER_H__
+
+#include "libws_config.h"
+#include <stdint.h>
+#include <event2/event.h>
+
+#ifdef LIBWS_WITH_OPENSSL
+#include <openssl/ssl.h>
+#endif
+
+///
+/// A minimal in-process websocket echo server, listening on
+/// a random port on 127.0.0.1. Echoes all messages back unmasked,
+/// replies to pings and echoes close frames.
+///
+typedef struct libws_test_server_s libws_test_server_t;
+
+///
+/// Creates a new echo server running on the given event base.
+///
+/// @param[in]	base 	The event base to run the server on.
+/// @param[in]	use_ssl Use TLS with a self-signed certificate.
+///
+/// @returns 			The server or NULL on failure.
+///
+libws_test_server_t *libws_test_server_new(struct event_base *base,
+											int use_ssl);
+
+void libws_test_server_free(libws_test_server_t *srv);
+
+int libws_test_server_get_port(libws_test_server_t *srv);
+
+///
+/// Number of connections currently open on the server.
+///
+int libws_test_server_get_open_count(libws_test_server_t *srv);
+
+///
+/// Number of messages (data frames) echoed by the server.
+///
+uint64_t libws_test_server_get_echo_count(libws_test_server_t *srv);
+
+///
+/// Number of pings received by the server.
+///
+uint64_t libws_test_server_get_ping_count(libws_test_server_t *srv);
+
+///
+/// Makes the server stop replying to pings, like a dead peer would.
+///
+void libws_test_server_set_ignore_pings(libws_test_server_t *srv, int ignore);
+
+#ifdef LIBWS_WITH_OPENSSL
+///
+/// Creates a server SSL context with a freshly generated
+/// self-signed certificate for "localhost".
+///
+SSL_CTX *libws_test_server_new_ssl_ctx();
+#endif
+
+#endif // __LIBWS_TEST_SERVER_H__